@@ -27,6 +27,7 @@
 #include <X11/XKBlib.h>
 #include <X11/extensions/XInput.h>
 #include <X11/extensions/XIproto.h>
+#include <X11/extensions/XKBproto.h>
 #include <X11/extensions/XKBstr.h>
 #include <errno.h>
 #include <gdk/gdk.h>
@@ -61,6 +62,7 @@
 #define NOTIFICATION_TIMEOUT 30
 
 struct MsdA11yKeyboardManagerPrivate {
+  int xkbOpcode;
   int xkbEventBase;
   gboolean stickykeys_shortcut_val;
   gboolean slowkeys_shortcut_val;
@@ -69,6 +71,20 @@ struct MsdA11yKeyboardManagerPrivate {
   GtkWidget *preferences_dialog;
   GtkStatusIcon *status_icon;
   XkbDescRec *original_xkb_desc;
+
+  /* Controls of the core keyboard as the server has them, without the
+   * keymap; kept up to date from XkbControlsNotify, see
+   * update_xkb_controls() */
+  XkbDescRec *xkb_desc;
+
+  /* Request serial and controls of our last XkbSetControls(), to
+   * recognize the XkbControlsNotify it causes */
+  unsigned long set_controls_serial;
+  unsigned int set_controls_mask;
+
+  /* Values we wrote to the settings from the server, by key, to
+   * recognize the change notifications they cause */
+  GHashTable *settings_echoes;
 #ifdef HAVE_LIBATSPI
   MsdA11yKeyboardAtspi *capslock_beep;
 #endif
@@ -91,6 +107,7 @@ static void msd_a11y_keyboard_manager_finalize(GObject *object);
 static void msd_a11y_keyboard_manager_ensure_status_icon(
     MsdA11yKeyboardManager *manager);
 static void set_server_from_settings(MsdA11yKeyboardManager *manager);
+static void invalidate_xkb_controls(MsdA11yKeyboardManager *manager);
 
 G_DEFINE_TYPE_WITH_PRIVATE(MsdA11yKeyboardManager, msd_a11y_keyboard_manager,
                            G_TYPE_OBJECT)
@@ -116,6 +133,9 @@ static GdkFilterReturn devicepresence_filter(GdkXEvent *xevent, GdkEvent *event,
   if (xev->type == xi_presence) {
     XDevicePresenceNotifyEvent *dpn = (XDevicePresenceNotifyEvent *)xev;
     if (dpn->devchange == DeviceEnabled) {
+      /* The new device may have reset the core keyboard's controls
+       * without telling us */
+      invalidate_xkb_controls(data);
       set_server_from_settings(data);
     }
   }
@@ -157,10 +177,11 @@ static void set_devicepresence_handler(MsdA11yKeyboardManager *manager) {
 
 static gboolean xkb_enabled(MsdA11yKeyboardManager *manager) {
   gboolean have_xkb;
-  int opcode, errorBase, major, minor;
+  int errorBase, major, minor;
 
   have_xkb = XkbQueryExtension(GDK_DISPLAY_XDISPLAY(gdk_display_get_default()),
-                               &opcode, &manager->priv->xkbEventBase,
+                               &manager->priv->xkbOpcode,
+                               &manager->priv->xkbEventBase,
                                &errorBase, &major, &minor) &&
              XkbUseExtension(GDK_DISPLAY_XDISPLAY(gdk_display_get_default()),
                              &major, &minor);
@@ -168,29 +189,155 @@ static gboolean xkb_enabled(MsdA11yKeyboardManager *manager) {
   return have_xkb;
 }
 
-static XkbDescRec *get_xkb_desc_rec(MsdA11yKeyboardManager *manager) {
+/* Fetches the controls of the core keyboard and nothing else; AccessX
+ * does not need the keymap */
+static XkbDescRec *get_xkb_desc_rec(void) {
   GdkDisplay *display;
   XkbDescRec *desc;
   Status status = Success;
 
   display = gdk_display_get_default();
 
+  desc = XkbAllocKeyboard();
+  g_return_val_if_fail(desc != NULL, NULL);
+
   gdk_x11_display_error_trap_push(display);
-  desc = XkbGetMap(GDK_DISPLAY_XDISPLAY(display), XkbAllMapComponentsMask,
-                   XkbUseCoreKbd);
-  if (desc != NULL) {
-    desc->ctrls = NULL;
-    status =
-        XkbGetControls(GDK_DISPLAY_XDISPLAY(display), XkbAllControlsMask, desc);
-  }
+  status =
+      XkbGetControls(GDK_DISPLAY_XDISPLAY(display), XkbAllControlsMask, desc);
   gdk_x11_display_error_trap_pop_ignored(display);
 
-  g_return_val_if_fail(desc != NULL && desc->ctrls != NULL, NULL);
-  g_return_val_if_fail(status == Success, NULL);
+  if (status != Success || desc->ctrls == NULL) {
+    g_warning("Could not get the keyboard controls");
+    XkbFreeKeyboard(desc, XkbAllComponentsMask, True);
+    return NULL;
+  }
 
   return desc;
 }
 
+static XkbDescRec *get_xkb_controls(MsdA11yKeyboardManager *manager) {
+  if (manager->priv->xkb_desc == NULL)
+    manager->priv->xkb_desc = get_xkb_desc_rec();
+
+  return manager->priv->xkb_desc;
+}
+
+static void invalidate_xkb_controls(MsdA11yKeyboardManager *manager) {
+  if (manager->priv->xkb_desc != NULL) {
+    XkbFreeKeyboard(manager->priv->xkb_desc, XkbAllComponentsMask, True);
+    manager->priv->xkb_desc = NULL;
+  }
+}
+
+/* Brings the cached controls up to date with @event.  The event carries
+ * the enabled controls itself; only the other controls it reports as
+ * changed are fetched. */
+static void update_xkb_controls(MsdA11yKeyboardManager *manager,
+                                XkbControlsNotifyEvent *event) {
+  XkbDescRec *desc = manager->priv->xkb_desc;
+  XkbControlsChangesRec changes;
+  GdkDisplay *display;
+  Status status;
+
+  if (desc == NULL) return;
+
+  desc->ctrls->enabled_ctrls = event->enabled_ctrls;
+
+  memset(&changes, 0, sizeof(changes));
+  changes.changed_ctrls = event->changed_ctrls & ~XkbControlsEnabledMask;
+  if (changes.changed_ctrls == 0) return;
+
+  display = gdk_display_get_default();
+
+  gdk_x11_display_error_trap_push(display);
+  status = XkbGetControlsChanges(GDK_DISPLAY_XDISPLAY(display), desc, &changes);
+  gdk_x11_display_error_trap_pop_ignored(display);
+
+  if (status != Success) invalidate_xkb_controls(manager);
+}
+
+/* The XkbSetControls() mask that carries the differences between @old
+ * and @new */
+static unsigned int get_changed_controls(const XkbControlsRec *old,
+                                         const XkbControlsRec *new) {
+  unsigned int changed = 0;
+
+  if (old->enabled_ctrls != new->enabled_ctrls)
+    changed |= XkbControlsEnabledMask;
+
+  if (old->ax_timeout != new->ax_timeout ||
+      old->axt_ctrls_mask != new->axt_ctrls_mask ||
+      old->axt_ctrls_values != new->axt_ctrls_values ||
+      old->axt_opts_mask != new->axt_opts_mask ||
+      old->axt_opts_values != new->axt_opts_values)
+    changed |= XkbAccessXTimeoutMask;
+
+  /* The server takes the sticky keys options and the feedback options
+   * of ax_options with different controls */
+  if ((old->ax_options ^ new->ax_options) & XkbAX_SKOptionsMask)
+    changed |= XkbStickyKeysMask;
+  if ((old->ax_options ^ new->ax_options) & XkbAX_FBOptionsMask)
+    changed |= XkbAccessXFeedbackMask;
+
+  if (old->debounce_delay != new->debounce_delay)
+    changed |= XkbBounceKeysMask;
+
+  if (old->slow_keys_delay != new->slow_keys_delay)
+    changed |= XkbSlowKeysMask;
+
+  if (old->mk_delay != new->mk_delay || old->mk_interval != new->mk_interval ||
+      old->mk_time_to_max != new->mk_time_to_max ||
+      old->mk_max_speed != new->mk_max_speed ||
+      old->mk_curve != new->mk_curve)
+    changed |= XkbMouseKeysAccelMask;
+
+  return changed;
+}
+
+/* Whether @event only reports what our last XkbSetControls() did */
+static gboolean is_own_controls_change(MsdA11yKeyboardManager *manager,
+                                       XkbControlsNotifyEvent *event) {
+  MsdA11yKeyboardManagerPrivate *priv = manager->priv;
+
+  if (priv->xkb_desc == NULL || priv->set_controls_mask == 0) return FALSE;
+
+  if (event->serial != priv->set_controls_serial ||
+      event->req_major != priv->xkbOpcode ||
+      event->req_minor != X_kbSetControls)
+    return FALSE;
+
+  /* Another client's request may have been handled in between */
+  if ((event->changed_ctrls & ~priv->set_controls_mask) != 0) return FALSE;
+
+  return event->enabled_ctrls == priv->xkb_desc->ctrls->enabled_ctrls;
+}
+
+static void note_settings_echo(MsdA11yKeyboardManager *manager,
+                               char const *key, GVariant *value) {
+  g_hash_table_insert(manager->priv->settings_echoes, g_strdup(key),
+                      g_variant_ref_sink(value));
+}
+
+/* Whether the change of @key only reports what set_settings_from_server()
+ * wrote.  Each write is matched once. */
+static gboolean is_settings_echo(MsdA11yKeyboardManager *manager,
+                                 GSettings *settings, char const *key) {
+  GVariant *expected;
+  GVariant *value;
+  gboolean echo;
+
+  expected = g_hash_table_lookup(manager->priv->settings_echoes, key);
+  if (expected == NULL) return FALSE;
+
+  value = g_settings_get_value(settings, key);
+  echo = g_variant_equal(value, expected);
+  g_variant_unref(value);
+
+  g_hash_table_remove(manager->priv->settings_echoes, key);
+
+  return echo;
+}
+
 static int get_int(GSettings *settings, char const *key) {
   int res = g_settings_get_int(settings, key);
   if (res <= 0) {
@@ -199,29 +346,33 @@ static int get_int(GSettings *settings, char const *key) {
   return res;
 }
 
-static gboolean set_int(GSettings *settings, char const *key, int val) {
+static gboolean set_int(MsdA11yKeyboardManager *manager, GSettings *settings,
+                        char const *key, int val) {
   int pre_val = g_settings_get_int(settings, key);
+
+  if (val == pre_val) return FALSE;
+
   g_settings_set_int(settings, key, val);
+  note_settings_echo(manager, key, g_variant_new_int32(val));
 #ifdef MATE_ENABLE_DEBUG
-  if (val != pre_val) {
-    g_warning("%s changed", key);
-  }
+  g_warning("%s changed", key);
 #endif /* MATE_ENABLE_DEBUG */
-  return val != pre_val;
+  return TRUE;
 }
 
-static gboolean set_bool(GSettings *settings, char const *key, int val) {
+static gboolean set_bool(MsdA11yKeyboardManager *manager, GSettings *settings,
+                         char const *key, int val) {
   gboolean bval = (val != 0);
   gboolean pre_val = g_settings_get_boolean(settings, key);
 
-  g_settings_set_boolean(settings, key, bval ? TRUE : FALSE);
+  if (bval == pre_val) return FALSE;
+
+  g_settings_set_boolean(settings, key, bval);
+  note_settings_echo(manager, key, g_variant_new_boolean(bval));
 #ifdef MATE_ENABLE_DEBUG
-  if (bval != pre_val) {
-    g_debug("%s changed", key);
-    return TRUE;
-  }
+  g_debug("%s changed", key);
 #endif /* MATE_ENABLE_DEBUG */
-  return (bval != pre_val);
+  return TRUE;
 }
 
 static unsigned long set_clear(gboolean flag, unsigned long value,
@@ -242,16 +393,21 @@ static gboolean set_ctrl_from_settings(XkbDescRec *desc, GSettings *settings,
 
 static void set_server_from_settings(MsdA11yKeyboardManager *manager) {
   XkbDescRec *desc;
+  XkbControlsRec old;
+  unsigned int changed;
   gboolean enable_accessX;
   GdkDisplay *display;
 
   mate_settings_profile_start(NULL);
 
-  desc = get_xkb_desc_rec(manager);
+  desc = get_xkb_controls(manager);
   if (!desc) {
+    mate_settings_profile_end(NULL);
     return;
   }
 
+  old = *desc->ctrls;
+
   /* general */
   enable_accessX = g_settings_get_boolean(manager->priv->settings, "enable");
 
@@ -357,20 +513,23 @@ static void set_server_from_settings(MsdA11yKeyboardManager *manager) {
   g_debug ("CHANGE to : 0x%x (2)", desc->ctrls->ax_options);
   */
 
+  changed = get_changed_controls(&old, desc->ctrls);
+  if (changed == 0) {
+    mate_settings_profile_end(NULL);
+    return;
+  }
+
   display = gdk_display_get_default();
 
   gdk_x11_display_error_trap_push(display);
-  XkbSetControls(GDK_DISPLAY_XDISPLAY(display),
-                 XkbSlowKeysMask | XkbBounceKeysMask | XkbStickyKeysMask |
-                     XkbMouseKeysMask | XkbMouseKeysAccelMask |
-                     XkbAccessXKeysMask | XkbAccessXTimeoutMask |
-                     XkbAccessXFeedbackMask | XkbControlsEnabledMask,
-                 desc);
-
-  XkbFreeKeyboard(desc, XkbAllComponentsMask, True);
+  manager->priv->set_controls_serial =
+      NextRequest(GDK_DISPLAY_XDISPLAY(display));
+  manager->priv->set_controls_mask = changed;
+  XkbSetControls(GDK_DISPLAY_XDISPLAY(display), changed, desc);
 
   XSync(GDK_DISPLAY_XDISPLAY(display), FALSE);
-  gdk_x11_display_error_trap_pop_ignored(display);
+  /* We no longer know what the server has */
+  if (gdk_x11_display_error_trap_pop(display)) invalidate_xkb_controls(manager);
 
   mate_settings_profile_end(NULL);
 }
@@ -754,7 +913,7 @@ static void set_settings_from_server(MsdA11yKeyboardManager *manager) {
   gboolean slowkeys_changed;
   gboolean stickykeys_changed;
 
-  desc = get_xkb_desc_rec(manager);
+  desc = get_xkb_controls(manager);
   if (!desc) {
     return;
   }
@@ -767,54 +926,59 @@ static void set_settings_from_server(MsdA11yKeyboardManager *manager) {
     fprintf (stderr, "changed to : 0x%x (2)\n", desc->ctrls->ax_options);
   */
 
-  changed |= set_bool(settings, "enable",
+  changed |= set_bool(manager, settings, "enable",
                       desc->ctrls->enabled_ctrls & XkbAccessXKeysMask);
 
   changed |= set_bool(
-      settings, "feature-state-change-beep",
+      manager, settings, "feature-state-change-beep",
       desc->ctrls->ax_options & (XkbAX_FeatureFBMask | XkbAX_SlowWarnFBMask));
-  changed |= set_bool(settings, "timeout-enable",
+  changed |= set_bool(manager, settings, "timeout-enable",
                       desc->ctrls->enabled_ctrls & XkbAccessXTimeoutMask);
-  changed |= set_int(settings, "timeout", desc->ctrls->ax_timeout);
+  changed |= set_int(manager, settings, "timeout", desc->ctrls->ax_timeout);
 
-  changed |= set_bool(settings, "bouncekeys-enable",
+  changed |= set_bool(manager, settings, "bouncekeys-enable",
                       desc->ctrls->enabled_ctrls & XkbBounceKeysMask);
-  changed |= set_int(settings, "bouncekeys-delay", desc->ctrls->debounce_delay);
-  changed |= set_bool(settings, "bouncekeys-beep-reject",
+  changed |= set_int(manager, settings, "bouncekeys-delay",
+                     desc->ctrls->debounce_delay);
+  changed |= set_bool(manager, settings, "bouncekeys-beep-reject",
                       desc->ctrls->ax_options & XkbAX_BKRejectFBMask);
 
-  changed |= set_bool(settings, "mousekeys-enable",
+  changed |= set_bool(manager, settings, "mousekeys-enable",
                       desc->ctrls->enabled_ctrls & XkbMouseKeysMask);
   changed |=
-      set_int(settings, "mousekeys-max-speed",
+      set_int(manager, settings, "mousekeys-max-speed",
               desc->ctrls->mk_max_speed * (1000 / desc->ctrls->mk_interval));
   /* NOTE : mk_time_to_max is measured in events not time */
-  changed |= set_int(settings, "mousekeys-accel-time",
+  changed |= set_int(manager, settings, "mousekeys-accel-time",
                      desc->ctrls->mk_time_to_max * desc->ctrls->mk_interval);
-  changed |= set_int(settings, "mousekeys-init-delay", desc->ctrls->mk_delay);
+  changed |= set_int(manager, settings, "mousekeys-init-delay",
+                     desc->ctrls->mk_delay);
 
-  slowkeys_changed = set_bool(settings, "slowkeys-enable",
-                              desc->ctrls->enabled_ctrls & XkbSlowKeysMask);
-  changed |= set_bool(settings, "slowkeys-beep-press",
+  slowkeys_changed =
+      set_bool(manager, settings, "slowkeys-enable",
+               desc->ctrls->enabled_ctrls & XkbSlowKeysMask);
+  changed |= set_bool(manager, settings, "slowkeys-beep-press",
                       desc->ctrls->ax_options & XkbAX_SKPressFBMask);
-  changed |= set_bool(settings, "slowkeys-beep-accept",
+  changed |= set_bool(manager, settings, "slowkeys-beep-accept",
                       desc->ctrls->ax_options & XkbAX_SKAcceptFBMask);
-  changed |= set_bool(settings, "slowkeys-beep-reject",
+  changed |= set_bool(manager, settings, "slowkeys-beep-reject",
                       desc->ctrls->ax_options & XkbAX_SKRejectFBMask);
-  changed |= set_int(settings, "slowkeys-delay", desc->ctrls->slow_keys_delay);
+  changed |= set_int(manager, settings, "slowkeys-delay",
+                     desc->ctrls->slow_keys_delay);
 
-  stickykeys_changed = set_bool(settings, "stickykeys-enable",
-                                desc->ctrls->enabled_ctrls & XkbStickyKeysMask);
-  changed |= set_bool(settings, "stickykeys-latch-to-lock",
+  stickykeys_changed =
+      set_bool(manager, settings, "stickykeys-enable",
+               desc->ctrls->enabled_ctrls & XkbStickyKeysMask);
+  changed |= set_bool(manager, settings, "stickykeys-latch-to-lock",
                       desc->ctrls->ax_options & XkbAX_LatchToLockMask);
-  changed |= set_bool(settings, "stickykeys-two-key-off",
+  changed |= set_bool(manager, settings, "stickykeys-two-key-off",
                       desc->ctrls->ax_options & XkbAX_TwoKeysMask);
-  changed |= set_bool(settings, "stickykeys-modifier-beep",
+  changed |= set_bool(manager, settings, "stickykeys-modifier-beep",
                       desc->ctrls->ax_options & XkbAX_StickyKeysFBMask);
 
   if (g_settings_get_enum(manager->priv->settings, "togglekeys-backend") ==
       TOGGLEKEYS_BACKEND_XKB) {
-    changed |= set_bool(settings, "togglekeys-enable",
+    changed |= set_bool(manager, settings, "togglekeys-enable",
                         desc->ctrls->ax_options & XkbAX_IndicatorFBMask);
   }
 
@@ -840,8 +1004,6 @@ static void set_settings_from_server(MsdA11yKeyboardManager *manager) {
     }
   }
 
-  XkbFreeKeyboard(desc, XkbAllComponentsMask, True);
-
   changed |= (stickykeys_changed | slowkeys_changed);
 
   if (changed) {
@@ -901,8 +1063,15 @@ static GdkFilterReturn cb_xkb_event_filter(GdkXEvent *xevent,
 
   if (xev->xany.type == (manager->priv->xkbEventBase + XkbEventCode) &&
       xkbEv->any.xkb_type == XkbControlsNotify) {
-    g_debug("XKB state changed");
-    set_settings_from_server(manager);
+    if (is_own_controls_change(manager, &xkbEv->ctrls)) {
+      /* The cache already holds what we sent, and the settings are
+       * where it came from */
+      g_debug("XKB state changed by us, ignoring");
+    } else {
+      g_debug("XKB state changed");
+      update_xkb_controls(manager, &xkbEv->ctrls);
+      set_settings_from_server(manager);
+    }
   } else if (xev->xany.type == (manager->priv->xkbEventBase + XkbEventCode) &&
              xkbEv->any.xkb_type == XkbAccessXNotify) {
     if (xkbEv->accessx.detail == XkbAXN_AXKWarning) {
@@ -939,7 +1108,9 @@ static GdkFilterReturn cb_xkb_event_filter(GdkXEvent *xevent,
 
 static void keyboard_callback(GSettings *settings, gchar *key,
                               MsdA11yKeyboardManager *manager) {
-  set_server_from_settings(manager);
+  /* Writing back what the server reported must not be sent again */
+  if (!is_settings_echo(manager, settings, key))
+    set_server_from_settings(manager);
   maybe_show_status_icon(manager);
 }
 
@@ -980,7 +1151,7 @@ static gboolean start_a11y_keyboard_idle_cb(MsdA11yKeyboardManager *manager) {
 
   /* Save current xkb state so we can restore it on exit
    */
-  manager->priv->original_xkb_desc = get_xkb_desc_rec(manager);
+  manager->priv->original_xkb_desc = get_xkb_desc_rec();
 
   event_mask = XkbControlsNotifyMask;
   event_mask |= XkbIndicatorStateNotifyMask;
@@ -1055,6 +1226,10 @@ void msd_a11y_keyboard_manager_stop(MsdA11yKeyboardManager *manager) {
 
   gdk_window_remove_filter(NULL, (GdkFilterFunc)cb_xkb_event_filter, manager);
 
+  invalidate_xkb_controls(manager);
+  p->set_controls_mask = 0;
+  g_hash_table_remove_all(p->settings_echoes);
+
   /* Disable all the AccessX bits
    */
   restore_server_xkb_config(manager);
@@ -1120,6 +1295,8 @@ static void msd_a11y_keyboard_manager_ensure_status_icon(
 
 static void msd_a11y_keyboard_manager_init(MsdA11yKeyboardManager *manager) {
   manager->priv = msd_a11y_keyboard_manager_get_instance_private(manager);
+  manager->priv->settings_echoes = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
 }
 
 static void msd_a11y_keyboard_manager_finalize(GObject *object) {
@@ -1132,6 +1309,8 @@ static void msd_a11y_keyboard_manager_finalize(GObject *object) {
 
   g_return_if_fail(a11y_keyboard_manager->priv != NULL);
 
+  g_hash_table_destroy(a11y_keyboard_manager->priv->settings_echoes);
+
   G_OBJECT_CLASS(msd_a11y_keyboard_manager_parent_class)->finalize(object);
 }
 
@@ -0,0 +1,243 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Runs the a11y-keyboard manager against the X server in $DISPLAY with
+ * in-memory settings, changes a few settings and XKB controls, and
+ * counts what each change costs: settings writes, XkbControlsNotify
+ * events, XkbSetControls requests and X requests.  A change made in the
+ * settings must be written once and sent to the server at most once; a
+ * change made on the server must be written back once and not be sent
+ * again.
+ *
+ * XkbSetControls requests are told apart by the XkbControlsNotify
+ * events they cause, which name the request and its serial.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <X11/XKBlib.h>
+#include <X11/extensions/XKBproto.h>
+#include <gdk/gdkx.h>
+#include <gio/gio.h>
+#include <gtk/gtk.h>
+#include <stdlib.h>
+
+#include "msd-a11y-keyboard-manager.h"
+
+#define CONFIG_SCHEMA "org.mate.accessibility-keyboard"
+
+/* How long nothing has to happen before a step counts as handled */
+#define SETTLE_TIMEOUT 250
+
+typedef struct {
+  const char *name;
+  /* Key and value to set, or NULL for toggling bounce keys on the server */
+  const char *key;
+  const char *value;
+} Step;
+
+static const Step steps[] = {
+    {"enable slow keys", "slowkeys-enable", "true"},
+    {"slow keys delay", "slowkeys-delay", "400"},
+    {"enable mouse keys", "mousekeys-enable", "true"},
+    /* Does not survive the round trip through mk_interval */
+    {"mouse keys speed", "mousekeys-max-speed", "755"},
+    {"timeout", "timeout", "150"},
+    {"disable slow keys", "slowkeys-enable", "false"},
+    {"bounce keys on server", NULL, NULL},
+    {"bounce keys on server", NULL, NULL},
+};
+
+static Display *xdisplay;
+static int xkb_opcode;
+static int xkb_event_base;
+static GSettings *settings;
+
+static GMainLoop *loop;
+static guint settle_id;
+static guint n_writes;
+static guint n_notifies;
+static guint n_set_controls;
+/* Serial of the XkbSetControls the test itself sent, or 0 */
+static unsigned long own_request;
+
+static gboolean on_settled(gpointer user_data) {
+  settle_id = 0;
+  g_main_loop_quit(loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void restart_settle_timeout(void) {
+  if (settle_id != 0) g_source_remove(settle_id);
+  settle_id = g_timeout_add(SETTLE_TIMEOUT, on_settled, NULL);
+}
+
+static void wait_for_settle(void) {
+  restart_settle_timeout();
+  g_main_loop_run(loop);
+}
+
+static void on_settings_changed(GSettings *gsettings, const char *key,
+                                gpointer user_data) {
+  n_writes++;
+  restart_settle_timeout();
+}
+
+static GdkFilterReturn count_notifies(GdkXEvent *gdk_xevent, GdkEvent *event,
+                                      gpointer user_data) {
+  XkbEvent *xkb_event = (XkbEvent *)gdk_xevent;
+
+  if (xkb_event->type == xkb_event_base + XkbEventCode &&
+      xkb_event->any.xkb_type == XkbControlsNotify) {
+    XkbControlsNotifyEvent *notify = &xkb_event->ctrls;
+
+    n_notifies++;
+    if (notify->req_major == xkb_opcode &&
+        notify->req_minor == X_kbSetControls && notify->serial != own_request)
+      n_set_controls++;
+    restart_settle_timeout();
+  }
+
+  return GDK_FILTER_CONTINUE;
+}
+
+static void toggle_server_bouncekeys(void) {
+  XkbDescRec *desc;
+
+  desc = XkbAllocKeyboard();
+  desc->device_spec = XkbUseCoreKbd;
+  XkbGetControls(xdisplay, XkbAllControlsMask, desc);
+  desc->ctrls->enabled_ctrls ^= XkbBounceKeysMask;
+  own_request = NextRequest(xdisplay);
+  XkbSetControls(xdisplay, XkbControlsEnabledMask, desc);
+  XkbFreeKeyboard(desc, XkbAllComponentsMask, True);
+  XFlush(xdisplay);
+}
+
+static gboolean run_step(const Step *step) {
+  unsigned long first_request;
+  unsigned long own_requests = 0;
+  guint n_requests;
+  gboolean ok = TRUE;
+
+  n_writes = 0;
+  n_notifies = 0;
+  n_set_controls = 0;
+  own_request = 0;
+
+  /* The memory backend emits "changed" from g_settings_set_value(), so
+   * the manager already reacts before it returns */
+  first_request = NextRequest(xdisplay);
+
+  if (step->key != NULL) {
+    GVariant *value;
+
+    value = g_variant_parse(NULL, step->value, NULL, NULL, NULL);
+    g_settings_set_value(settings, step->key, value);
+  } else {
+    /* What the step itself sends is not the manager's */
+    toggle_server_bouncekeys();
+    own_requests = NextRequest(xdisplay) - first_request;
+  }
+
+  wait_for_settle();
+
+  n_requests = NextRequest(xdisplay) - first_request - own_requests;
+
+  g_print("%-22s %u write(s), %u notify(s), %u XkbSetControls, "
+          "%u request(s)\n",
+          step->name, n_writes, n_notifies, n_set_controls, n_requests);
+
+  /* Only the change itself, or its single write back */
+  if (n_writes != 1) {
+    g_printerr("  expected one settings write\n");
+    ok = FALSE;
+  }
+  if (n_notifies > 1) {
+    g_printerr("  expected at most one XkbControlsNotify\n");
+    ok = FALSE;
+  }
+  if (step->key != NULL && n_set_controls > 1) {
+    g_printerr("  expected at most one XkbSetControls\n");
+    ok = FALSE;
+  }
+  if (step->key == NULL && n_set_controls > 0) {
+    g_printerr("  expected no XkbSetControls for a change on the server\n");
+    ok = FALSE;
+  }
+
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  MsdA11yKeyboardManager *manager;
+  GError *error = NULL;
+  int error_base, major, minor;
+  gboolean ok = TRUE;
+  guint i;
+
+  g_setenv("GSETTINGS_BACKEND", "memory", TRUE);
+
+  if (!gtk_init_with_args(&argc, &argv, NULL, NULL, NULL, &error)) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    exit(1);
+  }
+
+  xdisplay = gdk_x11_get_default_xdisplay();
+  major = XkbMajorVersion;
+  minor = XkbMinorVersion;
+  if (!XkbQueryExtension(xdisplay, &xkb_opcode, &xkb_event_base,
+                         &error_base, &major, &minor)) {
+    g_printerr("The X server has no XKB extension\n");
+    exit(1);
+  }
+
+  loop = g_main_loop_new(NULL, FALSE);
+  settings = g_settings_new(CONFIG_SCHEMA);
+  g_signal_connect(settings, "changed", G_CALLBACK(on_settings_changed), NULL);
+  gdk_window_add_filter(NULL, count_notifies, NULL);
+
+  manager = msd_a11y_keyboard_manager_new();
+  if (!msd_a11y_keyboard_manager_start(manager, &error)) {
+    g_printerr("Could not start the a11y-keyboard manager: %s\n",
+               error->message);
+    g_error_free(error);
+    exit(1);
+  }
+
+  /* The manager starts from an idle and syncs the server first */
+  wait_for_settle();
+
+  for (i = 0; i < G_N_ELEMENTS(steps); i++) {
+    if (!run_step(&steps[i])) ok = FALSE;
+  }
+
+  msd_a11y_keyboard_manager_stop(manager);
+  g_object_unref(manager);
+
+  gdk_window_remove_filter(NULL, count_notifies, NULL);
+  g_object_unref(settings);
+  g_main_loop_unref(loop);
+
+  return ok ? 0 : 1;
+}
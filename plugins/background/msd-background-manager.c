@@ -25,12 +25,14 @@
 #include <config.h>
 #endif
 
+#include <cairo-xlib.h>
 #include <errno.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <gio/gio.h>
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,6 +51,63 @@
 #define MATE_SESSION_MANAGER_DBUS_NAME "org.gnome.SessionManager"
 #define MATE_SESSION_MANAGER_DBUS_PATH "/org/gnome/SessionManager"
 
+/* Memory the rendered backgrounds kept for reuse may take up; enough
+ * for a couple of 4K screens or a handful of 1080p ones */
+#define SURFACE_CACHE_BUDGET (96 * 1024 * 1024)
+
+typedef struct {
+  char *key;
+  cairo_surface_t *surface;
+  gsize size;
+  GList *link;
+} CachedSurface;
+
+/* How long monitor changes have to settle before the background is
+ * drawn for the new layout; a hotplug emits several signals */
+#define LAYOUT_SETTLE_DELAY 250 /* ms */
+
+typedef struct {
+  GdkRectangle geometry;
+  gint scale;
+} MonitorLayout;
+
+/* The screen geometry a background was drawn for */
+typedef struct {
+  gint width;
+  gint height;
+  gint scale;
+  GArray *monitors;
+} ScreenLayout;
+
+/* Everything the worker thread needs to render one background. It is
+ * all gathered on the main thread, since neither MateBG nor GDK may be
+ * used from the worker, which only decodes with GdkPixbuf and scales
+ * and composites with cairo */
+typedef struct {
+  GdkScreen *screen;
+  gint width;
+  gint height;
+  gint scale;
+  gboolean do_fade;
+  char *key;
+
+  MateBGColorType color_type;
+  GdkRGBA primary;
+  GdkRGBA secondary;
+  MateBGPlacement placement;
+  /* The wallpaper to decode, or NULL for just the colours */
+  char *filename;
+  gint64 mtime;
+  /* The decoded wallpaper; set up front when it was decoded before,
+   * otherwise by the worker */
+  cairo_surface_t *image;
+
+  /* The rectangles, in pixels, the image is drawn in once each */
+  GArray *rects;
+  /* When set, only rects are rendered and the rest is copied from it */
+  cairo_surface_t *previous;
+} DrawJob;
+
 struct _MsdBackgroundManager {
   GObject parent;
 
@@ -56,7 +115,22 @@ struct _MsdBackgroundManager {
   MateBG *bg;
   cairo_surface_t *surface;
   MateBGCrossfade *fade;
-  GList *scr_sizes;
+  ScreenLayout *layout;
+  /* The image the current background was made from */
+  cairo_surface_t *image;
+  /* The last wallpaper decoded, and the file and mtime it came from */
+  cairo_surface_t *source;
+  char *source_filename;
+  gint64 source_mtime;
+  guint layout_timeout_id;
+
+  /* Rendered backgrounds by cache key, most recently used first in
+   * surface_lru */
+  GHashTable *surface_cache;
+  GQueue surface_lru;
+  gsize surface_cache_size;
+
+  GCancellable *draw_cancellable;
 
   gboolean msd_can_draw;
   gboolean caja_can_draw;
@@ -153,24 +227,529 @@ static void free_bg_surface(MsdBackgroundManager *manager) {
   }
 }
 
-static void free_scr_sizes(MsdBackgroundManager *manager) {
-  if (manager->scr_sizes != NULL) {
-    g_list_free_full(manager->scr_sizes, g_free);
-    manager->scr_sizes = NULL;
-  }
+static void screen_layout_free(ScreenLayout *layout) {
+  g_array_unref(layout->monitors);
+  g_free(layout);
 }
 
-static void real_draw_bg(MsdBackgroundManager *manager, GdkScreen *screen) {
+static ScreenLayout *screen_layout_new(GdkScreen *screen) {
+  GdkDisplay *display = gdk_screen_get_display(screen);
   GdkWindow *window = gdk_screen_get_root_window(screen);
-  gint scale = gdk_window_get_scale_factor(window);
-  gint width = WidthOfScreen(gdk_x11_screen_get_xscreen(screen)) / scale;
-  gint height = HeightOfScreen(gdk_x11_screen_get_xscreen(screen)) / scale;
+  ScreenLayout *layout;
+  MonitorLayout monitor;
+  int i;
+
+  layout = g_new0(ScreenLayout, 1);
+  layout->scale = gdk_window_get_scale_factor(window);
+  layout->width =
+      WidthOfScreen(gdk_x11_screen_get_xscreen(screen)) / layout->scale;
+  layout->height =
+      HeightOfScreen(gdk_x11_screen_get_xscreen(screen)) / layout->scale;
+  layout->monitors = g_array_new(FALSE, FALSE, sizeof(MonitorLayout));
+
+  for (i = 0; i < gdk_display_get_n_monitors(display); i++) {
+    GdkMonitor *gdk_monitor = gdk_display_get_monitor(display, i);
+
+    gdk_monitor_get_geometry(gdk_monitor, &monitor.geometry);
+    monitor.scale = gdk_monitor_get_scale_factor(gdk_monitor);
+    g_array_append_val(layout->monitors, monitor);
+  }
+
+  return layout;
+}
+
+static gboolean screen_layout_has_monitor(const ScreenLayout *layout,
+                                          const MonitorLayout *monitor) {
+  const MonitorLayout *other;
+  guint i;
+
+  for (i = 0; i < layout->monitors->len; i++) {
+    other = &g_array_index(layout->monitors, MonitorLayout, i);
+    if (other->scale == monitor->scale &&
+        gdk_rectangle_equal(&other->geometry, &monitor->geometry))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static gboolean screen_layout_equal(const ScreenLayout *a,
+                                    const ScreenLayout *b) {
+  guint i;
+
+  if (a == NULL || b == NULL) return a == b;
+
+  if (a->width != b->width || a->height != b->height || a->scale != b->scale ||
+      a->monitors->len != b->monitors->len)
+    return FALSE;
+
+  for (i = 0; i < a->monitors->len; i++) {
+    if (!screen_layout_has_monitor(
+            b, &g_array_index(a->monitors, MonitorLayout, i)))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* The rectangles, in pixels, of the monitors that are new or moved in
+ * new_layout, or NULL if the whole screen has to be drawn again */
+static GArray *screen_layout_diff(const ScreenLayout *old_layout,
+                                  const ScreenLayout *new_layout) {
+  const MonitorLayout *monitor;
+  GdkRectangle rect;
+  GArray *dirty;
+  guint i;
+
+  if (old_layout == NULL || old_layout->scale != new_layout->scale)
+    return NULL;
+
+  dirty = g_array_new(FALSE, FALSE, sizeof(GdkRectangle));
+
+  for (i = 0; i < new_layout->monitors->len; i++) {
+    monitor = &g_array_index(new_layout->monitors, MonitorLayout, i);
+    if (screen_layout_has_monitor(old_layout, monitor)) continue;
+
+    rect.x = monitor->geometry.x * new_layout->scale;
+    rect.y = monitor->geometry.y * new_layout->scale;
+    rect.width = monitor->geometry.width * new_layout->scale;
+    rect.height = monitor->geometry.height * new_layout->scale;
+    g_array_append_val(dirty, rect);
+  }
+
+  return dirty;
+}
+
+static void free_layout(MsdBackgroundManager *manager) {
+  g_clear_pointer(&manager->layout, screen_layout_free);
+  g_clear_pointer(&manager->image, cairo_surface_destroy);
+  g_clear_pointer(&manager->source, cairo_surface_destroy);
+  g_clear_pointer(&manager->source_filename, g_free);
+}
+
+static void cached_surface_free(CachedSurface *cached) {
+  g_free(cached->key);
+  cairo_surface_destroy(cached->surface);
+  g_free(cached);
+}
+
+static void surface_cache_remove(MsdBackgroundManager *manager,
+                                 CachedSurface *cached) {
+  g_queue_delete_link(&manager->surface_lru, cached->link);
+  manager->surface_cache_size -= cached->size;
+  /* Frees cached */
+  g_hash_table_remove(manager->surface_cache, cached->key);
+}
+
+static void surface_cache_clear(MsdBackgroundManager *manager) {
+  g_queue_clear(&manager->surface_lru);
+  g_hash_table_remove_all(manager->surface_cache);
+  manager->surface_cache_size = 0;
+}
+
+static cairo_surface_t *surface_cache_lookup(MsdBackgroundManager *manager,
+                                             const char *key) {
+  CachedSurface *cached;
+
+  cached = g_hash_table_lookup(manager->surface_cache, key);
+  if (cached == NULL) return NULL;
+
+  g_queue_unlink(&manager->surface_lru, cached->link);
+  g_queue_push_head_link(&manager->surface_lru, cached->link);
+
+  return cached->surface;
+}
+
+static void surface_cache_insert(MsdBackgroundManager *manager,
+                                 const char *key, cairo_surface_t *surface) {
+  CachedSurface *cached;
+
+  cached = g_hash_table_lookup(manager->surface_cache, key);
+  if (cached != NULL) surface_cache_remove(manager, cached);
+
+  cached = g_new0(CachedSurface, 1);
+  cached->key = g_strdup(key);
+  cached->surface = cairo_surface_reference(surface);
+  cached->size = (gsize)cairo_image_surface_get_stride(surface) *
+                 cairo_image_surface_get_height(surface);
+
+  g_queue_push_head(&manager->surface_lru, cached);
+  cached->link = manager->surface_lru.head;
+  g_hash_table_insert(manager->surface_cache, cached->key, cached);
+  manager->surface_cache_size += cached->size;
+
+  /* The surface just rendered always stays */
+  while (manager->surface_cache_size > SURFACE_CACHE_BUDGET &&
+         manager->surface_lru.tail != manager->surface_lru.head) {
+    surface_cache_remove(manager, manager->surface_lru.tail->data);
+  }
+}
+
+/* Identifies what the background renders to, or NULL if that can't
+ * be told without rendering it */
+static char *surface_cache_key(MateBG *bg, GdkScreen *screen, gint width,
+                               gint height, gint scale) {
+  GdkDisplay *display = gdk_screen_get_display(screen);
+  const char *filename;
+  GStatBuf buf;
+  gint64 mtime = 0;
+  MateBGColorType color_type;
+  GdkRGBA primary, secondary;
+  GdkRectangle geometry;
+  GString *key;
+  char *color;
+  int i;
+
+  /* Slideshows pick the image to show by the time of day */
+  if (mate_bg_changes_with_time(bg)) return NULL;
+
+  filename = mate_bg_get_filename(bg);
+  if (filename != NULL && g_stat(filename, &buf) == 0) mtime = buf.st_mtime;
+
+  key = g_string_new(NULL);
+  g_string_append_printf(key, "%s:%" G_GINT64_FORMAT ":%d:%dx%d@%d",
+                         filename != NULL ? filename : "", mtime,
+                         mate_bg_get_placement(bg), width, height, scale);
+
+  mate_bg_get_color(bg, &color_type, &primary, &secondary);
+  color = gdk_rgba_to_string(&primary);
+  g_string_append_printf(key, ":%d:%s", color_type, color);
+  g_free(color);
+  color = gdk_rgba_to_string(&secondary);
+  g_string_append_printf(key, ":%s", color);
+  g_free(color);
+
+  /* Images are drawn once per monitor */
+  for (i = 0; i < gdk_display_get_n_monitors(display); i++) {
+    gdk_monitor_get_geometry(gdk_display_get_monitor(display, i), &geometry);
+    g_string_append_printf(key, ":%d,%d,%dx%d", geometry.x, geometry.y,
+                           geometry.width, geometry.height);
+  }
+
+  return g_string_free(key, FALSE);
+}
+
+static void draw_job_free(DrawJob *job) {
+  g_object_unref(job->screen);
+  g_free(job->key);
+  g_free(job->filename);
+  g_clear_pointer(&job->image, cairo_surface_destroy);
+  g_clear_pointer(&job->rects, g_array_unref);
+  g_clear_pointer(&job->previous, cairo_surface_destroy);
+  g_free(job);
+}
+
+/* Like gdk_cairo_surface_create_from_pixbuf(), which is GDK and so
+ * can't be called from the worker */
+static cairo_surface_t *surface_from_pixbuf(GdkPixbuf *pixbuf) {
+  int width = gdk_pixbuf_get_width(pixbuf);
+  int height = gdk_pixbuf_get_height(pixbuf);
+  int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+  int src_stride = gdk_pixbuf_get_rowstride(pixbuf);
+  const guchar *src = gdk_pixbuf_get_pixels(pixbuf);
+  cairo_surface_t *surface;
+  const guchar *p;
+  guint32 *q;
+  guchar *dest;
+  int dest_stride;
+  guint a;
+  int x, y;
+
+  surface = cairo_image_surface_create(
+      n_channels == 3 ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32, width,
+      height);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+
+  cairo_surface_flush(surface);
+  dest = cairo_image_surface_get_data(surface);
+  dest_stride = cairo_image_surface_get_stride(surface);
+
+  for (y = 0; y < height; y++) {
+    p = src + y * src_stride;
+    q = (guint32 *)(dest + y * dest_stride);
+
+    /* cairo wants native endian pixels with premultiplied alpha */
+    for (x = 0; x < width; x++, p += n_channels) {
+      a = n_channels == 4 ? p[3] : 0xff;
+      q[x] = a << 24 | (p[0] * a + 127) / 255 << 16 |
+             (p[1] * a + 127) / 255 << 8 | (p[2] * a + 127) / 255;
+    }
+  }
+
+  cairo_surface_mark_dirty(surface);
+
+  return surface;
+}
+
+/* Decodes the wallpaper on the worker */
+static cairo_surface_t *load_image(const char *filename) {
+  GdkPixbuf *pixbuf, *rotated;
+  cairo_surface_t *surface;
+  GError *error = NULL;
+
+  pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+  if (pixbuf == NULL) {
+    g_warning("Unable to load background image %s: %s", filename,
+              error->message);
+    g_error_free(error);
+    return NULL;
+  }
+
+  rotated = gdk_pixbuf_apply_embedded_orientation(pixbuf);
+  g_object_unref(pixbuf);
+
+  surface = surface_from_pixbuf(rotated);
+  g_object_unref(rotated);
+
+  return surface;
+}
+
+/* Slideshows are XML files that only MateBG can read; it tells them
+ * from images the same way */
+static gboolean bg_is_slideshow(MateBG *bg) {
+  const char *filename = mate_bg_get_filename(bg);
+
+  return filename != NULL && g_str_has_suffix(filename, ".xml");
+}
+
+/* Where the image goes: once across the whole screen when spanned,
+ * otherwise once on each monitor, like mate_bg_draw() does */
+static GArray *layout_get_rects(const ScreenLayout *layout,
+                                MateBGPlacement placement) {
+  const MonitorLayout *monitor;
+  GdkRectangle rect;
+  GArray *rects;
+  guint i;
+
+  rects = g_array_new(FALSE, FALSE, sizeof(GdkRectangle));
+
+  if (placement == MATE_BG_PLACEMENT_SPANNED || layout->monitors->len == 0) {
+    rect.x = 0;
+    rect.y = 0;
+    rect.width = layout->width * layout->scale;
+    rect.height = layout->height * layout->scale;
+    g_array_append_val(rects, rect);
+
+    return rects;
+  }
+
+  for (i = 0; i < layout->monitors->len; i++) {
+    monitor = &g_array_index(layout->monitors, MonitorLayout, i);
+    rect.x = monitor->geometry.x * layout->scale;
+    rect.y = monitor->geometry.y * layout->scale;
+    rect.width = monitor->geometry.width * layout->scale;
+    rect.height = monitor->geometry.height * layout->scale;
+    g_array_append_val(rects, rect);
+  }
+
+  return rects;
+}
+
+static void draw_color(cairo_t *cr, DrawJob *job) {
+  cairo_pattern_t *pattern;
+
+  switch (job->color_type) {
+    case MATE_BG_COLOR_H_GRADIENT:
+      pattern = cairo_pattern_create_linear(0, 0, job->width * job->scale, 0);
+      break;
+    case MATE_BG_COLOR_V_GRADIENT:
+      pattern = cairo_pattern_create_linear(0, 0, 0, job->height * job->scale);
+      break;
+    default:
+      cairo_set_source_rgb(cr, job->primary.red, job->primary.green,
+                           job->primary.blue);
+      cairo_paint(cr);
+      return;
+  }
+
+  cairo_pattern_add_color_stop_rgb(pattern, 0.0, job->primary.red,
+                                   job->primary.green, job->primary.blue);
+  cairo_pattern_add_color_stop_rgb(pattern, 1.0, job->secondary.red,
+                                   job->secondary.green, job->secondary.blue);
+  cairo_set_source(cr, pattern);
+  cairo_paint(cr);
+  cairo_pattern_destroy(pattern);
+}
+
+/* Scales the image into rect the way mate_bg_draw() does for each
+ * placement: SCALED and SPANNED fit it, ZOOMED covers the rect,
+ * FILL_SCREEN stretches it, and CENTERED and TILED leave it unscaled.
+ * All but TILED are centred in the rect; TILED repeats the centre of
+ * the image, cropped to the rect, from the screen's origin. */
+static void draw_image(cairo_t *cr, DrawJob *job, const GdkRectangle *rect) {
+  int width = cairo_image_surface_get_width(job->image);
+  int height = cairo_image_surface_get_height(job->image);
+  cairo_surface_t *tile;
+  cairo_pattern_t *pattern;
+  double factor;
+  int w = width, h = height;
+  int tile_width, tile_height;
+
+  switch (job->placement) {
+    case MATE_BG_PLACEMENT_SCALED:
+    case MATE_BG_PLACEMENT_SPANNED:
+      factor = MIN((double)rect->width / width, (double)rect->height / height);
+      w = (int)(width * factor + 0.5);
+      h = (int)(height * factor + 0.5);
+      break;
+    case MATE_BG_PLACEMENT_ZOOMED:
+      factor = MAX((double)rect->width / width, (double)rect->height / height);
+      w = (int)(width * factor + 0.5);
+      h = (int)(height * factor + 0.5);
+      break;
+    case MATE_BG_PLACEMENT_FILL_SCREEN:
+      w = rect->width;
+      h = rect->height;
+      break;
+    default:
+      break;
+  }
+
+  /* Scaled down to nothing */
+  if (w <= 0 || h <= 0) return;
+
+  cairo_save(cr);
+
+  if (job->placement == MATE_BG_PLACEMENT_TILED) {
+    tile_width = MIN(width, rect->width);
+    tile_height = MIN(height, rect->height);
+    tile = cairo_surface_create_for_rectangle(
+        job->image, (width - tile_width) / 2, (height - tile_height) / 2,
+        tile_width, tile_height);
+    cairo_set_source_surface(cr, tile, 0, 0);
+    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_REPEAT);
+    cairo_surface_destroy(tile);
+  } else {
+    cairo_translate(cr, rect->x + (rect->width - w) / 2,
+                    rect->y + (rect->height - h) / 2);
+    cairo_scale(cr, (double)w / width, (double)h / height);
+    cairo_set_source_surface(cr, job->image, 0, 0);
+    pattern = cairo_get_source(cr);
+    cairo_pattern_set_filter(pattern, CAIRO_FILTER_BILINEAR);
+  }
+
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
+
+/* Decodes and scales the image into the background; this is what used
+ * to keep the main loop busy */
+static void render_bg_thread(GTask *task, MsdBackgroundManager *manager,
+                             DrawJob *job, GCancellable *cancellable) {
+  cairo_surface_t *surface;
+  GdkRectangle *rect;
+  cairo_t *cr;
+  guint i;
+
+  if (g_cancellable_is_cancelled(cancellable)) {
+    g_task_return_pointer(task, NULL, NULL);
+    return;
+  }
+
+  if (job->image == NULL && job->filename != NULL)
+    job->image = load_image(job->filename);
+
+  surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+                                       job->width * job->scale,
+                                       job->height * job->scale);
+  cr = cairo_create(surface);
+
+  /* Monitors that kept their place keep what was drawn on them */
+  if (job->previous != NULL) {
+    cairo_set_source_surface(cr, job->previous, 0, 0);
+    cairo_paint(cr);
+  } else {
+    draw_color(cr, job);
+  }
+
+  for (i = 0; i < job->rects->len; i++) {
+    rect = &g_array_index(job->rects, GdkRectangle, i);
+
+    cairo_save(cr);
+    cairo_rectangle(cr, rect->x, rect->y, rect->width, rect->height);
+    cairo_clip(cr);
+    if (job->previous != NULL) draw_color(cr, job);
+    if (job->image != NULL) draw_image(cr, job, rect);
+    cairo_restore(cr);
+  }
+
+  cairo_destroy(cr);
+
+  g_task_return_pointer(task, surface, (GDestroyNotify)cairo_surface_destroy);
+}
+
+/* Draws a slideshow with MateBG itself, on the main thread */
+static cairo_surface_t *render_bg_now(MateBG *bg, GdkScreen *screen,
+                                      gint width, gint height, gint scale) {
+  cairo_surface_t *surface;
+  GdkPixbuf *pixbuf;
+
+  pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width * scale,
+                          height * scale);
+  mate_bg_draw(bg, pixbuf, screen, TRUE);
+
+  surface = gdk_cairo_surface_create_from_pixbuf(pixbuf, 1, NULL);
+  g_object_unref(pixbuf);
+
+  return surface;
+}
+
+/* Like mate-bg, create the pixmap from a throwaway client that leaves
+ * it behind, since whoever sets the next background kills its owner */
+static cairo_surface_t *create_root_surface(GdkScreen *screen, gint width,
+                                            gint height) {
+  GdkWindow *root = gdk_screen_get_root_window(screen);
+  const char *display_name;
+  Display *display;
+  Pixmap pixmap;
+  int screen_num;
+
+  gdk_flush();
+
+  display_name = DisplayString(GDK_WINDOW_XDISPLAY(root));
+  display = XOpenDisplay(display_name);
+  if (display == NULL) {
+    g_warning("Unable to open display '%s' when setting background pixmap",
+              display_name != NULL ? display_name : "NULL");
+    return NULL;
+  }
+
+  XSetCloseDownMode(display, RetainPermanent);
+
+  screen_num = gdk_x11_screen_get_screen_number(screen);
+  pixmap = XCreatePixmap(display, GDK_WINDOW_XID(root), width, height,
+                         DefaultDepth(display, screen_num));
+
+  XCloseDisplay(display);
+
+  return cairo_xlib_surface_create(
+      GDK_SCREEN_XDISPLAY(screen), pixmap,
+      GDK_VISUAL_XVISUAL(gdk_screen_get_system_visual(screen)), width, height);
+}
+
+static void set_bg_surface(MsdBackgroundManager *manager, GdkScreen *screen,
+                           cairo_surface_t *image, gint scale,
+                           gboolean do_fade) {
+  cairo_t *cr;
 
   free_bg_surface(manager);
-  manager->surface = mate_bg_create_surface_scale(manager->bg, window, width,
-                                                  height, scale, TRUE);
+  manager->surface = create_root_surface(
+      screen, cairo_image_surface_get_width(image),
+      cairo_image_surface_get_height(image));
+  if (manager->surface == NULL) return;
+
+  cr = cairo_create(manager->surface);
+  cairo_set_source_surface(cr, image, 0, 0);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint(cr);
+  cairo_destroy(cr);
 
-  if (manager->do_fade) {
+  cairo_surface_set_device_scale(manager->surface, scale, scale);
+
+  if (do_fade) {
     free_fade(manager);
     manager->fade =
         mate_bg_set_surface_as_root_with_crossfade(screen, manager->surface);
@@ -179,11 +758,132 @@ static void real_draw_bg(MsdBackgroundManager *manager, GdkScreen *screen) {
   } else {
     mate_bg_set_surface_as_root(screen, manager->surface);
   }
-  manager->scr_sizes = g_list_prepend(manager->scr_sizes,
-                                      g_strdup_printf("%dx%d", width, height));
 }
 
-static void draw_background(MsdBackgroundManager *manager, gboolean may_fade) {
+static void on_bg_rendered(MsdBackgroundManager *manager, GAsyncResult *result,
+                           gpointer user_data) {
+  DrawJob *job = g_task_get_task_data(G_TASK(result));
+  cairo_surface_t *image;
+
+  image = g_task_propagate_pointer(G_TASK(result), NULL);
+  if (image == NULL) return;
+
+  /* Superseded by a newer draw, or the manager was stopped */
+  if (g_task_get_cancellable(G_TASK(result)) != manager->draw_cancellable) {
+    cairo_surface_destroy(image);
+    return;
+  }
+
+  g_clear_object(&manager->draw_cancellable);
+
+  /* Keep the decoded wallpaper, so that a new screen layout only has
+   * to scale it again */
+  if (job->image != NULL && job->image != manager->source) {
+    g_clear_pointer(&manager->source, cairo_surface_destroy);
+    g_free(manager->source_filename);
+    manager->source = cairo_surface_reference(job->image);
+    manager->source_filename = g_strdup(job->filename);
+    manager->source_mtime = job->mtime;
+  }
+
+  if (job->key != NULL) surface_cache_insert(manager, job->key, image);
+  set_bg_surface(manager, job->screen, image, job->scale, job->do_fade);
+
+  g_clear_pointer(&manager->image, cairo_surface_destroy);
+  manager->image = image;
+}
+
+static void cancel_draw(MsdBackgroundManager *manager) {
+  if (manager->draw_cancellable != NULL) {
+    g_cancellable_cancel(manager->draw_cancellable);
+    g_clear_object(&manager->draw_cancellable);
+  }
+}
+
+/* Draws the background for the screen's current layout. With
+ * only_changed, monitors that are laid out as for the last draw keep
+ * their part of the last image. */
+static void real_draw_bg(MsdBackgroundManager *manager, GdkScreen *screen,
+                         gboolean only_changed) {
+  ScreenLayout *layout = screen_layout_new(screen);
+  gint scale = layout->scale;
+  gint width = layout->width;
+  gint height = layout->height;
+  cairo_surface_t *image;
+  GArray *dirty = NULL;
+  GStatBuf buf;
+  DrawJob *job;
+  GTask *task;
+  char *key;
+
+  /* A draw still in flight means the last image is out of date */
+  if (only_changed && manager->image != NULL &&
+      manager->draw_cancellable == NULL &&
+      mate_bg_get_placement(manager->bg) != MATE_BG_PLACEMENT_SPANNED)
+    dirty = screen_layout_diff(manager->layout, layout);
+
+  cancel_draw(manager);
+
+  key = surface_cache_key(manager->bg, screen, width, height, scale);
+  image = key != NULL ? surface_cache_lookup(manager, key) : NULL;
+
+  if (image != NULL) {
+    g_debug("Reusing the background rendered for %s", key);
+    set_bg_surface(manager, screen, image, scale, manager->do_fade);
+    g_clear_pointer(&manager->image, cairo_surface_destroy);
+    manager->image = cairo_surface_reference(image);
+    g_free(key);
+    if (dirty != NULL) g_array_unref(dirty);
+  } else if (bg_is_slideshow(manager->bg)) {
+    /* Only MateBG knows which slide and which size to show, and it may
+     * not be used off the main thread */
+    image = render_bg_now(manager->bg, screen, width, height, scale);
+    if (key != NULL) surface_cache_insert(manager, key, image);
+    set_bg_surface(manager, screen, image, scale, manager->do_fade);
+    g_clear_pointer(&manager->image, cairo_surface_destroy);
+    manager->image = image;
+    g_free(key);
+    if (dirty != NULL) g_array_unref(dirty);
+  } else {
+    job = g_new0(DrawJob, 1);
+    job->screen = g_object_ref(screen);
+    job->width = width;
+    job->height = height;
+    job->scale = scale;
+    job->do_fade = manager->do_fade;
+    job->key = key;
+    mate_bg_get_color(manager->bg, &job->color_type, &job->primary,
+                      &job->secondary);
+    job->placement = mate_bg_get_placement(manager->bg);
+    job->filename = g_strdup(mate_bg_get_filename(manager->bg));
+    if (job->filename != NULL && g_stat(job->filename, &buf) == 0)
+      job->mtime = buf.st_mtime;
+    if (manager->source != NULL &&
+        g_strcmp0(manager->source_filename, job->filename) == 0 &&
+        manager->source_mtime == job->mtime)
+      job->image = cairo_surface_reference(manager->source);
+    if (dirty != NULL) {
+      g_debug("Drawing the background on %u changed monitor(s)", dirty->len);
+      job->previous = cairo_surface_reference(manager->image);
+      job->rects = dirty;
+    } else {
+      job->rects = layout_get_rects(layout, job->placement);
+    }
+
+    manager->draw_cancellable = g_cancellable_new();
+    task = g_task_new(manager, manager->draw_cancellable,
+                      (GAsyncReadyCallback)on_bg_rendered, NULL);
+    g_task_set_task_data(task, job, (GDestroyNotify)draw_job_free);
+    g_task_run_in_thread(task, (GTaskThreadFunc)render_bg_thread);
+    g_object_unref(task);
+  }
+
+  g_clear_pointer(&manager->layout, screen_layout_free);
+  manager->layout = layout;
+}
+
+static void draw_background(MsdBackgroundManager *manager, gboolean may_fade,
+                            gboolean only_changed) {
   if (!manager->msd_can_draw || manager->draw_in_progress ||
       caja_is_drawing_bg(manager))
     return;
@@ -194,12 +894,9 @@ static void draw_background(MsdBackgroundManager *manager, gboolean may_fade) {
 
   manager->draw_in_progress = TRUE;
   manager->do_fade = may_fade && can_fade_bg(manager);
-  free_scr_sizes(manager);
 
   g_debug("Drawing background on Screen");
-  real_draw_bg(manager, gdk_display_get_default_screen(display));
-
-  manager->scr_sizes = g_list_reverse(manager->scr_sizes);
+  real_draw_bg(manager, gdk_display_get_default_screen(display), only_changed);
 
   manager->draw_in_progress = FALSE;
   mate_settings_profile_end(NULL);
@@ -207,39 +904,57 @@ static void draw_background(MsdBackgroundManager *manager, gboolean may_fade) {
 
 static void on_bg_changed(MateBG *bg, MsdBackgroundManager *manager) {
   g_debug("Background changed");
-  draw_background(manager, TRUE);
+  draw_background(manager, TRUE, FALSE);
 }
 
 static void on_bg_transitioned(MateBG *bg, MsdBackgroundManager *manager) {
   g_debug("Background transitioned");
-  draw_background(manager, FALSE);
+  draw_background(manager, FALSE, FALSE);
 }
 
-static void on_screen_size_changed(GdkScreen *screen,
-                                   MsdBackgroundManager *manager) {
+static gboolean on_layout_settled(MsdBackgroundManager *manager) {
+  GdkDisplay *display = gdk_display_get_default();
+  ScreenLayout *layout;
+
+  manager->layout_timeout_id = 0;
+
   if (!manager->msd_can_draw || manager->draw_in_progress ||
       caja_is_drawing_bg(manager))
-    return;
+    return G_SOURCE_REMOVE;
 
-  GdkWindow *window = gdk_screen_get_root_window(screen);
-  gint scale = gdk_window_get_scale_factor(window);
-  gint scr_num = gdk_x11_screen_get_screen_number(screen);
-  gchar *old_size = g_list_nth_data(manager->scr_sizes, (guint)scr_num);
-  gchar *new_size = g_strdup_printf(
-      "%dx%d", WidthOfScreen(gdk_x11_screen_get_xscreen(screen)) / scale,
-      HeightOfScreen(gdk_x11_screen_get_xscreen(screen)) / scale);
-  if (g_strcmp0(old_size, new_size) != 0) {
-    g_debug("Screen%d size changed: %s -> %s", scr_num, old_size, new_size);
-    draw_background(manager, FALSE);
+  layout = screen_layout_new(gdk_display_get_default_screen(display));
+
+  if (screen_layout_equal(manager->layout, layout)) {
+    g_debug("Screen layout unchanged (%dx%d, %u monitor(s)). Ignoring.",
+            layout->width, layout->height, layout->monitors->len);
   } else {
-    g_debug("Screen%d size unchanged (%s). Ignoring.", scr_num, old_size);
+    g_debug("Screen layout changed: %dx%d, %u monitor(s)", layout->width,
+            layout->height, layout->monitors->len);
+    draw_background(manager, FALSE, TRUE);
   }
-  g_free(new_size);
+
+  screen_layout_free(layout);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void on_screen_size_changed(GdkScreen *screen,
+                                   MsdBackgroundManager *manager) {
+  if (manager->layout_timeout_id != 0)
+    g_source_remove(manager->layout_timeout_id);
+
+  manager->layout_timeout_id = g_timeout_add(
+      LAYOUT_SETTLE_DELAY, (GSourceFunc)on_layout_settled, manager);
 }
 
 static void disconnect_screen_signals(MsdBackgroundManager *manager) {
   GdkDisplay *display = gdk_display_get_default();
 
+  if (manager->layout_timeout_id != 0) {
+    g_source_remove(manager->layout_timeout_id);
+    manager->layout_timeout_id = 0;
+  }
+
   g_signal_handlers_disconnect_by_func(gdk_display_get_default_screen(display),
                                        G_CALLBACK(on_screen_size_changed),
                                        manager);
@@ -318,7 +1033,9 @@ static void remove_background(MsdBackgroundManager *manager) {
     manager->bg = NULL;
   }
 
-  free_scr_sizes(manager);
+  cancel_draw(manager);
+  surface_cache_clear(manager);
+  free_layout(manager);
   free_bg_surface(manager);
   free_fade(manager);
 }
@@ -457,13 +1174,24 @@ static GObject *msd_background_manager_constructor(
 }
 
 static void msd_background_manager_finalize(GObject *object) {
+  MsdBackgroundManager *manager;
+
   g_return_if_fail(object != NULL);
   g_return_if_fail(MSD_IS_BACKGROUND_MANAGER(object));
 
+  manager = MSD_BACKGROUND_MANAGER(object);
+
+  surface_cache_clear(manager);
+  g_hash_table_destroy(manager->surface_cache);
+
   G_OBJECT_CLASS(msd_background_manager_parent_class)->finalize(object);
 }
 
-static void msd_background_manager_init(MsdBackgroundManager *manager) {}
+static void msd_background_manager_init(MsdBackgroundManager *manager) {
+  manager->surface_cache = g_hash_table_new_full(
+      g_str_hash, g_str_equal, NULL, (GDestroyNotify)cached_surface_free);
+  g_queue_init(&manager->surface_lru);
+}
 
 static void msd_background_manager_class_init(
     MsdBackgroundManagerClass *klass) {
@@ -44,16 +44,22 @@
 
 #define DIALOG_TIMEOUT 2000      /* dialog timeout in ms */
 #define DIALOG_FADE_TIMEOUT 1500 /* timeout before fade starts */
-#define FADE_TIMEOUT 10 /* timeout in ms between each frame of the fade */
+#define FADE_DURATION 100 /* length of the fade in ms */
 
 #define BG_ALPHA 0.75
 
 struct MsdOsdWindowPrivate {
   guint is_composited : 1;
   guint hide_timeout_id;
-  guint fade_timeout_id;
-  double fade_out_alpha;
+  guint fade_tick_id;
+  gint64 fade_start_time;
   gint scale_factor;
+
+  /* Offscreen copy of the window contents, reused from frame to frame
+   * for as long as the window keeps its size */
+  cairo_surface_t *backing;
+  int backing_width;
+  int backing_height;
 };
 
 enum { DRAW_WHEN_COMPOSITED, LAST_SIGNAL };
@@ -62,40 +68,44 @@ static guint signals[LAST_SIGNAL] = {0};
 
 G_DEFINE_TYPE_WITH_PRIVATE(MsdOsdWindow, msd_osd_window, GTK_TYPE_WINDOW)
 
-static gboolean fade_timeout(MsdOsdWindow *window) {
-  if (window->priv->fade_out_alpha <= 0.0) {
-    gtk_widget_hide(GTK_WIDGET(window));
+/* The fade only changes the _NET_WM_WINDOW_OPACITY of the GdkWindow, which
+ * the compositor applies; gtk_widget_set_opacity() would instead repaint the
+ * whole RGBA window on every frame.  The frame clock only wakes us up once
+ * per frame while the fade lasts */
+static gboolean fade_tick(GtkWidget *widget, GdkFrameClock *frame_clock,
+                          gpointer user_data) {
+  MsdOsdWindow *window = MSD_OSD_WINDOW(widget);
+  gint64 now;
+  double opacity;
 
-    /* Reset it for the next time */
-    window->priv->fade_out_alpha = 1.0;
-    window->priv->fade_timeout_id = 0;
+  now = gdk_frame_clock_get_frame_time(frame_clock);
 
-    return FALSE;
-  } else {
-    GdkRectangle rect;
-    GtkWidget *win = GTK_WIDGET(window);
-    GtkAllocation allocation;
+  if (window->priv->fade_start_time == 0) window->priv->fade_start_time = now;
 
-    window->priv->fade_out_alpha -= 0.10;
+  opacity = 1.0 - (now - window->priv->fade_start_time) /
+                      (FADE_DURATION * 1000.0);
 
-    rect.x = 0;
-    rect.y = 0;
-    gtk_widget_get_allocation(win, &allocation);
-    rect.width = allocation.width;
-    rect.height = allocation.height;
+  if (opacity <= 0.0) {
+    window->priv->fade_tick_id = 0;
+    gtk_widget_hide(widget);
 
-    gtk_widget_realize(win);
-    gdk_window_invalidate_rect(gtk_widget_get_window(win), &rect, FALSE);
+    /* Reset it for the next time */
+    gdk_window_set_opacity(gtk_widget_get_window(widget), 1.0);
+
+    return G_SOURCE_REMOVE;
   }
 
-  return TRUE;
+  gdk_window_set_opacity(gtk_widget_get_window(widget), opacity);
+
+  return G_SOURCE_CONTINUE;
 }
 
 static gboolean hide_timeout(MsdOsdWindow *window) {
   if (window->priv->is_composited) {
     window->priv->hide_timeout_id = 0;
-    window->priv->fade_timeout_id =
-        g_timeout_add(FADE_TIMEOUT, (GSourceFunc)fade_timeout, window);
+    window->priv->fade_start_time = 0;
+    window->priv->fade_tick_id =
+        gtk_widget_add_tick_callback(GTK_WIDGET(window), fade_tick, NULL, NULL);
   } else {
     gtk_widget_hide(GTK_WIDGET(window));
   }
@@ -109,10 +119,11 @@ static void remove_hide_timeout(MsdOsdWindow *window) {
     window->priv->hide_timeout_id = 0;
   }
 
-  if (window->priv->fade_timeout_id != 0) {
-    g_source_remove(window->priv->fade_timeout_id);
-    window->priv->fade_timeout_id = 0;
-    window->priv->fade_out_alpha = 1.0;
+  if (window->priv->fade_tick_id != 0) {
+    gtk_widget_remove_tick_callback(GTK_WIDGET(window),
+                                    window->priv->fade_tick_id);
+    window->priv->fade_tick_id = 0;
+    gdk_window_set_opacity(gtk_widget_get_window(GTK_WIDGET(window)), 1.0);
   }
 }
 
@@ -128,6 +139,32 @@ static void add_hide_timeout(MsdOsdWindow *window) {
       g_timeout_add(timeout, (GSourceFunc)hide_timeout, window);
 }
 
+static cairo_surface_t *get_backing_surface(MsdOsdWindow *window,
+                                            cairo_t *orig_cr, int width,
+                                            int height) {
+  MsdOsdWindowPrivate *priv = window->priv;
+
+  if (priv->backing != NULL &&
+      (priv->backing_width != width || priv->backing_height != height)) {
+    cairo_surface_destroy(priv->backing);
+    priv->backing = NULL;
+  }
+
+  if (priv->backing == NULL) {
+    priv->backing = cairo_surface_create_similar(
+        cairo_get_target(orig_cr), CAIRO_CONTENT_COLOR_ALPHA, width, height);
+    priv->backing_width = width;
+    priv->backing_height = height;
+  }
+
+  if (cairo_surface_status(priv->backing) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(priv->backing);
+    priv->backing = NULL;
+  }
+
+  return priv->backing;
+}
+
 /* This is our draw-event handler when the window is in a compositing manager.
  * We draw everything by hand, using Cairo, so that we can have a nice
  * transparent/rounded look.
@@ -146,18 +183,23 @@ static void draw_when_composited(GtkWidget *widget, cairo_t *orig_cr) {
   cairo_set_operator(orig_cr, CAIRO_OPERATOR_SOURCE);
   gtk_window_get_size(GTK_WINDOW(widget), &width, &height);
 
-  surface = cairo_surface_create_similar(
-      cairo_get_target(orig_cr), CAIRO_CONTENT_COLOR_ALPHA, width, height);
+  surface = get_backing_surface(window, orig_cr, width, height);
 
-  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-    goto done;
+  if (surface == NULL) {
+    return;
   }
 
   cr = cairo_create(surface);
   if (cairo_status(cr) != CAIRO_STATUS_SUCCESS) {
-    goto done;
+    cairo_destroy(cr);
+    return;
   }
 
+  /* The previous frame is still there */
+  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+  cairo_paint(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
   gtk_render_background(context, cr, 0, 0, width, height);
   gtk_render_frame(context, cr, 0, 0, width, height);
 
@@ -171,12 +213,7 @@ static void draw_when_composited(GtkWidget *widget, cairo_t *orig_cr) {
   cairo_fill(orig_cr);
 
   cairo_set_source_surface(orig_cr, surface, 0, 0);
-  cairo_paint_with_alpha(orig_cr, window->priv->fade_out_alpha);
-
-done:
-  if (surface != NULL) {
-    cairo_surface_destroy(surface);
-  }
+  cairo_paint(orig_cr);
 }
 
 /* This is our draw-event handler when the window is *not* in a compositing
@@ -263,6 +300,17 @@ static void msd_osd_window_real_realize(GtkWidget *widget) {
   cairo_region_destroy(region);
 }
 
+static void msd_osd_window_real_unrealize(GtkWidget *widget) {
+  MsdOsdWindow *window = MSD_OSD_WINDOW(widget);
+
+  if (window->priv->backing != NULL) {
+    cairo_surface_destroy(window->priv->backing);
+    window->priv->backing = NULL;
+  }
+
+  GTK_WIDGET_CLASS(msd_osd_window_parent_class)->unrealize(widget);
+}
+
 static void msd_osd_window_style_updated(GtkWidget *widget) {
   GtkStyleContext *context;
   GtkBorder padding;
@@ -344,6 +392,7 @@ static void msd_osd_window_class_init(MsdOsdWindowClass *klass) {
   widget_class->show = msd_osd_window_real_show;
   widget_class->hide = msd_osd_window_real_hide;
   widget_class->realize = msd_osd_window_real_realize;
+  widget_class->unrealize = msd_osd_window_real_unrealize;
   widget_class->style_updated = msd_osd_window_style_updated;
   widget_class->get_preferred_width = msd_osd_window_get_preferred_width;
   widget_class->get_preferred_height = msd_osd_window_get_preferred_height;
@@ -412,8 +461,6 @@ static void msd_osd_window_init(MsdOsdWindow *window) {
     size = 110 * MAX(1, scale);
 
     gtk_window_set_default_size(GTK_WINDOW(window), size, size);
-
-    window->priv->fade_out_alpha = 1.0;
   } else {
     gtk_container_set_border_width(GTK_CONTAINER(window), 12);
   }
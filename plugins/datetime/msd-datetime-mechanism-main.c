@@ -23,10 +23,9 @@
 #include <config.h>
 #endif
 
-#include <dbus/dbus-glib-lowlevel.h>
-#include <dbus/dbus-glib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 #include <signal.h>
@@ -39,112 +38,52 @@
 
 #include "msd-datetime-mechanism.h"
 
-static DBusGProxy *get_bus_proxy(DBusGConnection *connection) {
-  DBusGProxy *bus_proxy;
-
-  bus_proxy = dbus_g_proxy_new_for_name(connection, DBUS_SERVICE_DBUS,
-                                        DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS);
-  return bus_proxy;
-}
-
 #define BUS_NAME "org.mate.SettingsDaemon.DateTimeMechanism"
 
-static gboolean acquire_name_on_proxy(DBusGProxy *bus_proxy) {
-  GError *error;
-  guint result;
-  gboolean res;
-  gboolean ret;
-
-  ret = FALSE;
-
-  if (bus_proxy == NULL) {
-    goto out;
-  }
-
-  error = NULL;
-  res = dbus_g_proxy_call(bus_proxy, "RequestName", &error, G_TYPE_STRING,
-                          BUS_NAME, G_TYPE_UINT, 0, G_TYPE_INVALID, G_TYPE_UINT,
-                          &result, G_TYPE_INVALID);
-  if (!res) {
-    if (error != NULL) {
-      g_warning("Failed to acquire %s: %s", BUS_NAME, error->message);
-      g_error_free(error);
-    } else {
-      g_warning("Failed to acquire %s", BUS_NAME);
-    }
-    goto out;
-  }
+static GMainLoop *loop = NULL;
+static MsdDatetimeMechanism *mechanism = NULL;
+static int ret = 1;
 
-  if (result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
-    if (error != NULL) {
-      g_warning("Failed to acquire %s: %s", BUS_NAME, error->message);
-      g_error_free(error);
-    } else {
-      g_warning("Failed to acquire %s", BUS_NAME);
-    }
-    goto out;
+static void on_bus_acquired(GDBusConnection *connection, const gchar *name,
+                            gpointer user_data) {
+  /* Register before the name is owned so no call can arrive unhandled */
+  mechanism = msd_datetime_mechanism_new(connection);
+  if (mechanism == NULL) {
+    g_main_loop_quit(loop);
   }
-
-  ret = TRUE;
-
-out:
-  return ret;
 }
 
-static DBusGConnection *get_system_bus(void) {
-  GError *error;
-  DBusGConnection *bus;
-
-  error = NULL;
-  bus = dbus_g_bus_get(DBUS_BUS_SYSTEM, &error);
-  if (bus == NULL) {
-    g_warning("Couldn't connect to system bus: %s", error->message);
-    g_error_free(error);
-  }
-  return bus;
+static void on_name_acquired(GDBusConnection *connection, const gchar *name,
+                             gpointer user_data) {
+  g_debug("Acquired %s", name);
+  ret = 0;
 }
 
-int main(int argc, char **argv) {
-  GMainLoop *loop;
-  MsdDatetimeMechanism *mechanism;
-  DBusGProxy *bus_proxy;
-  DBusGConnection *connection;
-  int ret;
-
-  ret = 1;
-
-  dbus_g_thread_init();
-
-  connection = get_system_bus();
+static void on_name_lost(GDBusConnection *connection, const gchar *name,
+                         gpointer user_data) {
   if (connection == NULL) {
-    goto out;
-  }
-
-  bus_proxy = get_bus_proxy(connection);
-  if (bus_proxy == NULL) {
-    g_warning("Could not construct bus_proxy object; bailing out");
-    goto out;
-  }
-
-  if (!acquire_name_on_proxy(bus_proxy)) {
-    g_warning("Could not acquire name; bailing out");
-    goto out;
+    g_warning("Couldn't connect to system bus");
+  } else {
+    g_warning("Failed to acquire %s", name);
   }
+  ret = 1;
+  g_main_loop_quit(loop);
+}
 
-  mechanism = msd_datetime_mechanism_new();
-
-  if (mechanism == NULL) {
-    goto out;
-  }
+int main(int argc, char **argv) {
+  guint owner_id;
 
   loop = g_main_loop_new(NULL, FALSE);
 
+  owner_id = g_bus_own_name(G_BUS_TYPE_SYSTEM, BUS_NAME,
+                            G_BUS_NAME_OWNER_FLAGS_NONE, on_bus_acquired,
+                            on_name_acquired, on_name_lost, NULL, NULL);
+
   g_main_loop_run(loop);
 
-  g_object_unref(mechanism);
+  g_bus_unown_name(owner_id);
+  g_clear_object(&mechanism);
   g_main_loop_unref(loop);
-  ret = 0;
 
-out:
   return ret;
 }
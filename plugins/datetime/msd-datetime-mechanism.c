@@ -25,10 +25,9 @@
 
 #include "msd-datetime-mechanism.h"
 
-#include <dbus/dbus-glib-lowlevel.h>
-#include <dbus/dbus-glib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 #include <polkit/polkit.h>
@@ -39,10 +38,51 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include "msd-datetime-mechanism-glue.h"
 #include "system-timezone.h"
 
+#define MSD_DATETIME_DBUS_PATH "/"
+#define MSD_DATETIME_DBUS_INTERFACE "org.mate.SettingsDaemon.DateTimeMechanism"
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='org.mate.SettingsDaemon.DateTimeMechanism'>"
+    "    <method name='SetTimezone'>"
+    "      <arg name='zonefile' direction='in' type='s'/>"
+    "    </method>"
+    "    <method name='GetTimezone'>"
+    "      <arg name='timezone' direction='out' type='s'/>"
+    "    </method>"
+    "    <method name='CanSetTimezone'>"
+    "      <arg name='value' direction='out' type='i'/>"
+    "    </method>"
+    "    <method name='SetTime'>"
+    "      <arg name='seconds_since_epoch' direction='in' type='x'/>"
+    "    </method>"
+    "    <method name='CanSetTime'>"
+    "      <arg name='value' direction='out' type='i'/>"
+    "    </method>"
+    "    <method name='AdjustTime'>"
+    "      <arg name='seconds_to_add' direction='in' type='x'/>"
+    "    </method>"
+    "    <method name='GetHardwareClockUsingUtc'>"
+    "      <arg name='is_using_utc' direction='out' type='b'/>"
+    "    </method>"
+    "    <method name='SetHardwareClockUsingUtc'>"
+    "      <arg name='is_using_utc' direction='in' type='b'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+/* Authorization checks that are still waiting on polkit, possibly on an
+ * authentication dialog; the mechanism must not exit under them */
+static guint pending_authorizations = 0;
+
 static gboolean do_exit(gpointer user_data) {
+  if (pending_authorizations > 0) {
+    g_debug("Not exiting, %u authorization(s) pending", pending_authorizations);
+    return TRUE;
+  }
+
   g_debug("Exiting due to inactivity");
   exit(1);
   return FALSE;
@@ -58,25 +98,55 @@ static void reset_killtimer(void) {
   timer_id = g_timeout_add_seconds(30, do_exit, NULL);
 }
 
+/* Actions a caller has been authorized for, forgotten as soon as the
+ * caller's bus name goes away */
+typedef struct {
+  guint watch_id;
+  GHashTable *actions;
+} MsdDatetimeCaller;
+
 struct MsdDatetimeMechanismPrivate {
-  DBusGConnection *system_bus_connection;
-  DBusGProxy *system_bus_proxy;
+  GDBusConnection *connection;
+  GDBusNodeInfo *introspection_data;
+  guint registration_id;
   PolkitAuthority *auth;
+
+  GHashTable *callers;
 };
 
+typedef void (*MsdDatetimeAuthorizedFunc)(MsdDatetimeMechanism *mechanism,
+                                          GDBusMethodInvocation *invocation);
+
+typedef struct {
+  MsdDatetimeMechanism *mechanism;
+  GDBusMethodInvocation *invocation;
+  char *action;
+  MsdDatetimeAuthorizedFunc func;
+} MsdDatetimeAuthData;
+
 static void msd_datetime_mechanism_finalize(GObject *object);
 
 G_DEFINE_TYPE_WITH_PRIVATE(MsdDatetimeMechanism, msd_datetime_mechanism,
                            G_TYPE_OBJECT)
 
+static const GDBusErrorEntry msd_datetime_mechanism_error_entries[] = {
+    {MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+     MSD_DATETIME_DBUS_INTERFACE ".GeneralError"},
+    {MSD_DATETIME_MECHANISM_ERROR_NOT_PRIVILEGED,
+     MSD_DATETIME_DBUS_INTERFACE ".NotPrivileged"},
+    {MSD_DATETIME_MECHANISM_ERROR_INVALID_TIMEZONE_FILE,
+     MSD_DATETIME_DBUS_INTERFACE ".InvalidTimezoneFile"},
+};
+
 GQuark msd_datetime_mechanism_error_quark(void) {
-  static GQuark ret = 0;
+  static gsize ret = 0;
 
-  if (ret == 0) {
-    ret = g_quark_from_static_string("msd_datetime_mechanism_error");
-  }
+  g_dbus_error_register_error_domain(
+      "msd_datetime_mechanism_error", &ret,
+      msd_datetime_mechanism_error_entries,
+      G_N_ELEMENTS(msd_datetime_mechanism_error_entries));
 
-  return ret;
+  return (GQuark)ret;
 }
 
 #define ENUM_ENTRY(NAME, DESC) \
@@ -102,35 +172,25 @@ GType msd_datetime_mechanism_error_get_type(void) {
   return etype;
 }
 
-static GObject *msd_datetime_mechanism_constructor(
-    GType type, guint n_construct_properties,
-    GObjectConstructParam *construct_properties) {
-  MsdDatetimeMechanism *mechanism;
-
-  mechanism = MSD_DATETIME_MECHANISM(
-      G_OBJECT_CLASS(msd_datetime_mechanism_parent_class)
-          ->constructor(type, n_construct_properties, construct_properties));
-
-  return G_OBJECT(mechanism);
+static void msd_datetime_caller_free(MsdDatetimeCaller *caller) {
+  g_bus_unwatch_name(caller->watch_id);
+  g_hash_table_destroy(caller->actions);
+  g_free(caller);
 }
 
 static void msd_datetime_mechanism_class_init(
     MsdDatetimeMechanismClass *klass) {
   GObjectClass *object_class = G_OBJECT_CLASS(klass);
 
-  object_class->constructor = msd_datetime_mechanism_constructor;
   object_class->finalize = msd_datetime_mechanism_finalize;
-
-  dbus_g_object_type_install_info(
-      MSD_DATETIME_TYPE_MECHANISM,
-      &dbus_glib_msd_datetime_mechanism_object_info);
-
-  dbus_g_error_domain_register(MSD_DATETIME_MECHANISM_ERROR, NULL,
-                               MSD_DATETIME_MECHANISM_TYPE_ERROR);
 }
 
 static void msd_datetime_mechanism_init(MsdDatetimeMechanism *mechanism) {
   mechanism->priv = msd_datetime_mechanism_get_instance_private(mechanism);
+
+  mechanism->priv->callers =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                            (GDestroyNotify)msd_datetime_caller_free);
 }
 
 static void msd_datetime_mechanism_finalize(GObject *object) {
@@ -143,124 +203,147 @@ static void msd_datetime_mechanism_finalize(GObject *object) {
 
   g_return_if_fail(mechanism->priv != NULL);
 
-  g_object_unref(mechanism->priv->system_bus_proxy);
+  if (mechanism->priv->registration_id != 0) {
+    g_dbus_connection_unregister_object(mechanism->priv->connection,
+                                        mechanism->priv->registration_id);
+  }
+
+  g_hash_table_destroy(mechanism->priv->callers);
+  g_clear_pointer(&mechanism->priv->introspection_data, g_dbus_node_info_unref);
+  g_clear_object(&mechanism->priv->connection);
+  g_clear_object(&mechanism->priv->auth);
 
   G_OBJECT_CLASS(msd_datetime_mechanism_parent_class)->finalize(object);
 }
 
-static gboolean register_mechanism(MsdDatetimeMechanism *mechanism) {
-  GError *error = NULL;
-
-  mechanism->priv->auth = polkit_authority_get_sync(NULL, &error);
-  if (mechanism->priv->auth == NULL) {
-    if (error != NULL) {
-      g_critical("error getting system bus: %s", error->message);
-      g_error_free(error);
-    }
-    goto error;
-  }
-
-  mechanism->priv->system_bus_connection =
-      dbus_g_bus_get(DBUS_BUS_SYSTEM, &error);
-  if (mechanism->priv->system_bus_connection == NULL) {
-    if (error != NULL) {
-      g_critical("error getting system bus: %s", error->message);
-      g_error_free(error);
-    }
-    goto error;
-  }
-
-  dbus_g_connection_register_g_object(mechanism->priv->system_bus_connection,
-                                      "/", G_OBJECT(mechanism));
+static void caller_vanished_cb(GDBusConnection *connection, const gchar *name,
+                               gpointer user_data) {
+  MsdDatetimeMechanism *mechanism = MSD_DATETIME_MECHANISM(user_data);
 
-  mechanism->priv->system_bus_proxy = dbus_g_proxy_new_for_name(
-      mechanism->priv->system_bus_connection, DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
-      DBUS_INTERFACE_DBUS);
+  g_debug("Forgetting authorizations of %s", name);
+  g_hash_table_remove(mechanism->priv->callers, name);
+}
 
-  reset_killtimer();
+static gboolean caller_is_authorized(MsdDatetimeMechanism *mechanism,
+                                     const char *sender, const char *action) {
+  MsdDatetimeCaller *caller;
 
-  return TRUE;
+  caller = g_hash_table_lookup(mechanism->priv->callers, sender);
 
-error:
-  return FALSE;
+  return caller != NULL && g_hash_table_contains(caller->actions, action);
 }
 
-MsdDatetimeMechanism *msd_datetime_mechanism_new(void) {
-  GObject *object;
-  gboolean res;
+static void caller_set_authorized(MsdDatetimeMechanism *mechanism,
+                                  const char *sender, const char *action) {
+  MsdDatetimeCaller *caller;
 
-  object = g_object_new(MSD_DATETIME_TYPE_MECHANISM, NULL);
+  caller = g_hash_table_lookup(mechanism->priv->callers, sender);
 
-  res = register_mechanism(MSD_DATETIME_MECHANISM(object));
-  if (!res) {
-    g_object_unref(object);
-    return NULL;
+  if (caller == NULL) {
+    caller = g_new0(MsdDatetimeCaller, 1);
+    caller->actions =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    caller->watch_id = g_bus_watch_name_on_connection(
+        mechanism->priv->connection, sender, G_BUS_NAME_WATCHER_FLAGS_NONE,
+        NULL, caller_vanished_cb, mechanism, NULL);
+
+    g_hash_table_insert(mechanism->priv->callers, g_strdup(sender), caller);
   }
 
-  return MSD_DATETIME_MECHANISM(object);
+  g_hash_table_add(caller->actions, g_strdup(action));
 }
 
-static gboolean _check_polkit_for_action(MsdDatetimeMechanism *mechanism,
-                                         DBusGMethodInvocation *context,
-                                         const char *action) {
-  char *sender;
-  GError *error;
-  PolkitSubject *subject;
-  PolkitAuthorizationResult *result;
+static void msd_datetime_auth_data_free(MsdDatetimeAuthData *data) {
+  g_object_unref(data->mechanism);
+  g_object_unref(data->invocation);
+  g_free(data->action);
+  g_free(data);
 
-  error = NULL;
+  pending_authorizations--;
+  reset_killtimer();
+}
 
-  /* Check that caller is privileged */
-  sender = dbus_g_method_get_sender(context);
-  subject = polkit_system_bus_name_new(sender);
-  g_free(sender);
+static void check_polkit_for_action_cb(GObject *source, GAsyncResult *res,
+                                       gpointer user_data) {
+  MsdDatetimeAuthData *data = user_data;
+  PolkitAuthorizationResult *result;
+  GError *error = NULL;
 
-  result = polkit_authority_check_authorization_sync(
-      mechanism->priv->auth, subject, action, NULL,
-      POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION, NULL, &error);
-  g_object_unref(subject);
+  result = polkit_authority_check_authorization_finish(
+      POLKIT_AUTHORITY(source), res, &error);
 
   if (error) {
-    dbus_g_method_return_error(context, error);
+    g_dbus_method_invocation_return_gerror(data->invocation, error);
     g_error_free(error);
-
-    return FALSE;
+    goto out;
   }
 
   if (!polkit_authorization_result_get_is_authorized(result)) {
-    error = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                        MSD_DATETIME_MECHANISM_ERROR_NOT_PRIVILEGED,
-                        "Not Authorized for action %s", action);
-    dbus_g_method_return_error(context, error);
-    g_error_free(error);
-    g_object_unref(result);
-
-    return FALSE;
+    g_dbus_method_invocation_return_error(
+        data->invocation, MSD_DATETIME_MECHANISM_ERROR,
+        MSD_DATETIME_MECHANISM_ERROR_NOT_PRIVILEGED,
+        "Not Authorized for action %s", data->action);
+    goto out;
   }
 
-  g_object_unref(result);
+  caller_set_authorized(
+      data->mechanism, g_dbus_method_invocation_get_sender(data->invocation),
+      data->action);
 
-  return TRUE;
+  data->func(data->mechanism, data->invocation);
+
+out:
+  g_clear_object(&result);
+  msd_datetime_auth_data_free(data);
 }
 
-static gboolean _set_time(MsdDatetimeMechanism *mechanism,
-                          const struct timeval *tv,
-                          DBusGMethodInvocation *context) {
-  GError *error;
+/* Runs @func once the caller of @invocation is known to be authorized for
+ * @action. Authorization may involve an authentication dialog, so the
+ * check never blocks the main loop; callers that were already authorized
+ * for the action over the same bus name are not asked again. */
+static void _check_polkit_for_action(MsdDatetimeMechanism *mechanism,
+                                     GDBusMethodInvocation *invocation,
+                                     const char *action,
+                                     MsdDatetimeAuthorizedFunc func) {
+  const char *sender;
+  PolkitSubject *subject;
+  MsdDatetimeAuthData *data;
+
+  sender = g_dbus_method_invocation_get_sender(invocation);
 
-  if (!_check_polkit_for_action(
-          mechanism, context,
-          "org.mate.settingsdaemon.datetimemechanism.settime"))
-    return FALSE;
+  if (caller_is_authorized(mechanism, sender, action)) {
+    func(mechanism, invocation);
+    return;
+  }
+
+  data = g_new0(MsdDatetimeAuthData, 1);
+  data->mechanism = g_object_ref(mechanism);
+  data->invocation = g_object_ref(invocation);
+  data->action = g_strdup(action);
+  data->func = func;
+  pending_authorizations++;
+
+  /* Check that caller is privileged */
+  subject = polkit_system_bus_name_new(sender);
+  polkit_authority_check_authorization(
+      mechanism->priv->auth, subject, action, NULL,
+      POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION, NULL,
+      check_polkit_for_action_cb, data);
+  g_object_unref(subject);
+}
+
+static void _set_time(MsdDatetimeMechanism *mechanism,
+                      GDBusMethodInvocation *invocation,
+                      const struct timeval *tv) {
+  GError *error = NULL;
 
   if (settimeofday(tv, NULL) != 0) {
-    error = g_error_new(
-        MSD_DATETIME_MECHANISM_ERROR, MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+    g_dbus_method_invocation_return_error(
+        invocation, MSD_DATETIME_MECHANISM_ERROR,
+        MSD_DATETIME_MECHANISM_ERROR_GENERAL,
         "Error calling settimeofday({%ld,%ld}): %s", (gint64)tv->tv_sec,
         (gint64)tv->tv_usec, strerror(errno));
-    dbus_g_method_return_error(context, error);
-    g_error_free(error);
-    return FALSE;
+    return;
   }
 
   if (g_file_test("/sbin/hwclock", G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR |
@@ -268,32 +351,27 @@ static gboolean _set_time(MsdDatetimeMechanism *mechanism,
     int exit_status;
     if (!g_spawn_command_line_sync("/sbin/hwclock --systohc", NULL, NULL,
                                    &exit_status, &error)) {
-      GError *error2;
-      error2 = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                           MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                           "Error spawning /sbin/hwclock: %s", error->message);
+      g_dbus_method_invocation_return_error(
+          invocation, MSD_DATETIME_MECHANISM_ERROR,
+          MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+          "Error spawning /sbin/hwclock: %s", error->message);
       g_error_free(error);
-      dbus_g_method_return_error(context, error2);
-      g_error_free(error2);
-      return FALSE;
+      return;
     }
     if (WEXITSTATUS(exit_status) != 0) {
-      error = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                          MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                          "/sbin/hwclock returned %d", exit_status);
-      dbus_g_method_return_error(context, error);
-      g_error_free(error);
-      return FALSE;
+      g_dbus_method_invocation_return_error(
+          invocation, MSD_DATETIME_MECHANISM_ERROR,
+          MSD_DATETIME_MECHANISM_ERROR_GENERAL, "/sbin/hwclock returned %d",
+          exit_status);
+      return;
     }
   }
 
-  dbus_g_method_return(context);
-  return TRUE;
+  g_dbus_method_invocation_return_value(invocation, NULL);
 }
 
-static gboolean _rh_update_etc_sysconfig_clock(DBusGMethodInvocation *context,
-                                               const char *key,
-                                               const char *value) {
+static gboolean _rh_update_etc_sysconfig_clock(
+    GDBusMethodInvocation *invocation, const char *key, const char *value) {
   /* On Red Hat / Fedora, the /etc/sysconfig/clock file needs to be kept in sync
    */
   if (g_file_test("/etc/sysconfig/clock",
@@ -313,7 +391,7 @@ static gboolean _rh_update_etc_sysconfig_clock(DBusGMethodInvocation *context,
           MSD_DATETIME_MECHANISM_ERROR, MSD_DATETIME_MECHANISM_ERROR_GENERAL,
           "Error reading /etc/sysconfig/clock file: %s", error->message);
       g_error_free(error);
-      dbus_g_method_return_error(context, error2);
+      g_dbus_method_invocation_return_gerror(invocation, error2);
       g_error_free(error2);
       return FALSE;
     }
@@ -344,7 +422,7 @@ static gboolean _rh_update_etc_sysconfig_clock(DBusGMethodInvocation *context,
             MSD_DATETIME_MECHANISM_ERROR, MSD_DATETIME_MECHANISM_ERROR_GENERAL,
             "Error updating /etc/sysconfig/clock: %s", error->message);
         g_error_free(error);
-        dbus_g_method_return_error(context, error2);
+        g_dbus_method_invocation_return_gerror(invocation, error2);
         g_error_free(error2);
         g_free(data);
         return FALSE;
@@ -359,58 +437,71 @@ static gboolean _rh_update_etc_sysconfig_clock(DBusGMethodInvocation *context,
 
 /* exported methods */
 
-gboolean msd_datetime_mechanism_set_time(MsdDatetimeMechanism *mechanism,
-                                         gint64 seconds_since_epoch,
-                                         DBusGMethodInvocation *context) {
+static void set_time_authorized(MsdDatetimeMechanism *mechanism,
+                                GDBusMethodInvocation *invocation) {
   struct timeval tv;
+  gint64 seconds_since_epoch;
 
-  reset_killtimer();
-  g_debug("SetTime(%ld) called", seconds_since_epoch);
+  g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(x)",
+                &seconds_since_epoch);
 
   tv.tv_sec = (time_t)seconds_since_epoch;
   tv.tv_usec = 0;
-  return _set_time(mechanism, &tv, context);
+  _set_time(mechanism, invocation, &tv);
+}
+
+static void msd_datetime_mechanism_set_time(MsdDatetimeMechanism *mechanism,
+                                            gint64 seconds_since_epoch,
+                                            GDBusMethodInvocation *invocation) {
+  g_debug("SetTime(%ld) called", seconds_since_epoch);
+
+  _check_polkit_for_action(mechanism, invocation,
+                           "org.mate.settingsdaemon.datetimemechanism.settime",
+                           set_time_authorized);
 }
 
-gboolean msd_datetime_mechanism_adjust_time(MsdDatetimeMechanism *mechanism,
-                                            gint64 seconds_to_add,
-                                            DBusGMethodInvocation *context) {
+static void adjust_time_authorized(MsdDatetimeMechanism *mechanism,
+                                   GDBusMethodInvocation *invocation) {
   struct timeval tv;
+  gint64 seconds_to_add;
 
-  reset_killtimer();
-  g_debug("AdjustTime(%ld) called", seconds_to_add);
+  g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(x)",
+                &seconds_to_add);
 
+  /* the time is read only now, after a possible authentication dialog */
   if (gettimeofday(&tv, NULL) != 0) {
-    GError *error;
-    error = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                        MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                        "Error calling gettimeofday(): %s", strerror(errno));
-    dbus_g_method_return_error(context, error);
-    g_error_free(error);
-    return FALSE;
+    g_dbus_method_invocation_return_error(
+        invocation, MSD_DATETIME_MECHANISM_ERROR,
+        MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+        "Error calling gettimeofday(): %s", strerror(errno));
+    return;
   }
 
   tv.tv_sec += (time_t)seconds_to_add;
-  return _set_time(mechanism, &tv, context);
+  _set_time(mechanism, invocation, &tv);
 }
 
-gboolean msd_datetime_mechanism_set_timezone(MsdDatetimeMechanism *mechanism,
-                                             const char *zone_file,
-                                             DBusGMethodInvocation *context) {
-  GError *error;
+static void msd_datetime_mechanism_adjust_time(
+    MsdDatetimeMechanism *mechanism, gint64 seconds_to_add,
+    GDBusMethodInvocation *invocation) {
+  g_debug("AdjustTime(%ld) called", seconds_to_add);
 
-  reset_killtimer();
-  g_debug("SetTimezone('%s') called", zone_file);
+  _check_polkit_for_action(mechanism, invocation,
+                           "org.mate.settingsdaemon.datetimemechanism.settime",
+                           adjust_time_authorized);
+}
+
+static void set_timezone_authorized(MsdDatetimeMechanism *mechanism,
+                                    GDBusMethodInvocation *invocation) {
+  const char *zone_file;
+  GError *error;
 
-  if (!_check_polkit_for_action(
-          mechanism, context,
-          "org.mate.settingsdaemon.datetimemechanism.settimezone"))
-    return FALSE;
+  g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(&s)",
+                &zone_file);
 
   error = NULL;
 
   if (!system_timezone_set_from_file(zone_file, &error)) {
-    GError *error2;
     int code;
 
     if (error->code == SYSTEM_TIMEZONE_ERROR_INVALID_TIMEZONE_FILE)
@@ -418,32 +509,38 @@ gboolean msd_datetime_mechanism_set_timezone(MsdDatetimeMechanism *mechanism,
     else
       code = MSD_DATETIME_MECHANISM_ERROR_GENERAL;
 
-    error2 =
-        g_error_new(MSD_DATETIME_MECHANISM_ERROR, code, "%s", error->message);
-
+    g_dbus_method_invocation_return_error(
+        invocation, MSD_DATETIME_MECHANISM_ERROR, code, "%s", error->message);
     g_error_free(error);
-
-    dbus_g_method_return_error(context, error2);
-    g_error_free(error2);
-
-    return FALSE;
+    return;
   }
 
-  dbus_g_method_return(context);
-  return TRUE;
+  g_dbus_method_invocation_return_value(invocation, NULL);
 }
 
-gboolean msd_datetime_mechanism_get_timezone(MsdDatetimeMechanism *mechism,
-                                             DBusGMethodInvocation *context) {
-  reset_killtimer();
+static void msd_datetime_mechanism_set_timezone(
+    MsdDatetimeMechanism *mechanism, const char *zone_file,
+    GDBusMethodInvocation *invocation) {
+  g_debug("SetTimezone('%s') called", zone_file);
 
-  dbus_g_method_return(context, system_timezone_find());
+  _check_polkit_for_action(
+      mechanism, invocation,
+      "org.mate.settingsdaemon.datetimemechanism.settimezone",
+      set_timezone_authorized);
+}
 
-  return TRUE;
+static void msd_datetime_mechanism_get_timezone(
+    MsdDatetimeMechanism *mechanism, GDBusMethodInvocation *invocation) {
+  char *timezone;
+
+  timezone = system_timezone_find();
+  g_dbus_method_invocation_return_value(invocation,
+                                        g_variant_new("(s)", timezone));
+  g_free(timezone);
 }
 
-gboolean msd_datetime_mechanism_get_hardware_clock_using_utc(
-    MsdDatetimeMechanism *mechanism, DBusGMethodInvocation *context) {
+static void msd_datetime_mechanism_get_hardware_clock_using_utc(
+    MsdDatetimeMechanism *mechanism, GDBusMethodInvocation *invocation) {
   char **lines;
   char *data;
   gsize len;
@@ -453,27 +550,23 @@ gboolean msd_datetime_mechanism_get_hardware_clock_using_utc(
   error = NULL;
 
   if (!g_file_get_contents("/etc/adjtime", &data, &len, &error)) {
-    GError *error2;
-    error2 = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                         MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                         "Error reading /etc/adjtime file: %s", error->message);
+    g_dbus_method_invocation_return_error(
+        invocation, MSD_DATETIME_MECHANISM_ERROR,
+        MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+        "Error reading /etc/adjtime file: %s", error->message);
     g_error_free(error);
-    dbus_g_method_return_error(context, error2);
-    g_error_free(error2);
-    return FALSE;
+    return;
   }
 
   lines = g_strsplit(data, "\n", 0);
   g_free(data);
 
   if (g_strv_length(lines) < 3) {
-    error = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                        MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                        "Cannot parse /etc/adjtime");
-    dbus_g_method_return_error(context, error);
-    g_error_free(error);
+    g_dbus_method_invocation_return_error(
+        invocation, MSD_DATETIME_MECHANISM_ERROR,
+        MSD_DATETIME_MECHANISM_ERROR_GENERAL, "Cannot parse /etc/adjtime");
     g_strfreev(lines);
-    return FALSE;
+    return;
   }
 
   if (strcmp(lines[2], "UTC") == 0) {
@@ -481,31 +574,28 @@ gboolean msd_datetime_mechanism_get_hardware_clock_using_utc(
   } else if (strcmp(lines[2], "LOCAL") == 0) {
     is_utc = FALSE;
   } else {
-    error = g_error_new(
-        MSD_DATETIME_MECHANISM_ERROR, MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+    g_dbus_method_invocation_return_error(
+        invocation, MSD_DATETIME_MECHANISM_ERROR,
+        MSD_DATETIME_MECHANISM_ERROR_GENERAL,
         "Expected UTC or LOCAL at line 3 of /etc/adjtime; found '%s'",
         lines[2]);
-    dbus_g_method_return_error(context, error);
-    g_error_free(error);
     g_strfreev(lines);
-    return FALSE;
+    return;
   }
   g_strfreev(lines);
-  dbus_g_method_return(context, is_utc);
-  return TRUE;
+  g_dbus_method_invocation_return_value(invocation,
+                                        g_variant_new("(b)", is_utc));
 }
 
-gboolean msd_datetime_mechanism_set_hardware_clock_using_utc(
-    MsdDatetimeMechanism *mechanism, gboolean using_utc,
-    DBusGMethodInvocation *context) {
+static void set_hardware_clock_using_utc_authorized(
+    MsdDatetimeMechanism *mechanism, GDBusMethodInvocation *invocation) {
   GError *error;
+  gboolean using_utc;
 
-  error = NULL;
+  g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(b)",
+                &using_utc);
 
-  if (!_check_polkit_for_action(
-          mechanism, context,
-          "org.mate.settingsdaemon.datetimemechanism.configurehwclock"))
-    return FALSE;
+  error = NULL;
 
   if (g_file_test("/sbin/hwclock", G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR |
                                        G_FILE_TEST_IS_EXECUTABLE)) {
@@ -514,81 +604,197 @@ gboolean msd_datetime_mechanism_set_hardware_clock_using_utc(
     cmd = g_strdup_printf("/sbin/hwclock %s --systohc",
                           using_utc ? "--utc" : "--localtime");
     if (!g_spawn_command_line_sync(cmd, NULL, NULL, &exit_status, &error)) {
-      GError *error2;
-      error2 = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                           MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                           "Error spawning /sbin/hwclock: %s", error->message);
+      g_dbus_method_invocation_return_error(
+          invocation, MSD_DATETIME_MECHANISM_ERROR,
+          MSD_DATETIME_MECHANISM_ERROR_GENERAL,
+          "Error spawning /sbin/hwclock: %s", error->message);
       g_error_free(error);
-      dbus_g_method_return_error(context, error2);
-      g_error_free(error2);
       g_free(cmd);
-      return FALSE;
+      return;
     }
     g_free(cmd);
     if (WEXITSTATUS(exit_status) != 0) {
-      error = g_error_new(MSD_DATETIME_MECHANISM_ERROR,
-                          MSD_DATETIME_MECHANISM_ERROR_GENERAL,
-                          "/sbin/hwclock returned %d", exit_status);
-      dbus_g_method_return_error(context, error);
-      g_error_free(error);
-      return FALSE;
+      g_dbus_method_invocation_return_error(
+          invocation, MSD_DATETIME_MECHANISM_ERROR,
+          MSD_DATETIME_MECHANISM_ERROR_GENERAL, "/sbin/hwclock returned %d",
+          exit_status);
+      return;
     }
 
-    if (!_rh_update_etc_sysconfig_clock(context,
-                                        "UTC=", using_utc ? "true" : "false"))
-      return FALSE;
+    if (!_rh_update_etc_sysconfig_clock(invocation, "UTC=",
+                                        using_utc ? "true" : "false"))
+      return;
   }
-  dbus_g_method_return(context);
-  return TRUE;
+  g_dbus_method_invocation_return_value(invocation, NULL);
 }
 
-static void check_can_do(MsdDatetimeMechanism *mechanism, const char *action,
-                         DBusGMethodInvocation *context) {
-  char *sender;
-  PolkitSubject *subject;
-  PolkitAuthorizationResult *result;
-  GError *error;
+static void msd_datetime_mechanism_set_hardware_clock_using_utc(
+    MsdDatetimeMechanism *mechanism, gboolean using_utc,
+    GDBusMethodInvocation *invocation) {
+  _check_polkit_for_action(
+      mechanism, invocation,
+      "org.mate.settingsdaemon.datetimemechanism.configurehwclock",
+      set_hardware_clock_using_utc_authorized);
+}
 
-  /* Check that caller is privileged */
-  sender = dbus_g_method_get_sender(context);
-  subject = polkit_system_bus_name_new(sender);
-  g_free(sender);
+static void check_can_do_cb(GObject *source, GAsyncResult *res,
+                            gpointer user_data) {
+  MsdDatetimeAuthData *data = user_data;
+  PolkitAuthorizationResult *result;
+  GError *error = NULL;
+  gint value;
 
-  error = NULL;
-  result = polkit_authority_check_authorization_sync(
-      mechanism->priv->auth, subject, action, NULL, 0, NULL, &error);
-  g_object_unref(subject);
+  result = polkit_authority_check_authorization_finish(
+      POLKIT_AUTHORITY(source), res, &error);
 
   if (error) {
-    dbus_g_method_return_error(context, error);
+    g_dbus_method_invocation_return_gerror(data->invocation, error);
     g_error_free(error);
-    return;
+    goto out;
   }
 
   if (polkit_authorization_result_get_is_authorized(result)) {
-    dbus_g_method_return(context, 2);
+    caller_set_authorized(
+        data->mechanism, g_dbus_method_invocation_get_sender(data->invocation),
+        data->action);
+    value = 2;
   } else if (polkit_authorization_result_get_is_challenge(result)) {
-    dbus_g_method_return(context, 1);
+    value = 1;
   } else {
-    dbus_g_method_return(context, 0);
+    value = 0;
+  }
+
+  g_dbus_method_invocation_return_value(data->invocation,
+                                        g_variant_new("(i)", value));
+
+out:
+  g_clear_object(&result);
+  msd_datetime_auth_data_free(data);
+}
+
+static void check_can_do(MsdDatetimeMechanism *mechanism, const char *action,
+                         GDBusMethodInvocation *invocation) {
+  const char *sender;
+  PolkitSubject *subject;
+  MsdDatetimeAuthData *data;
+
+  sender = g_dbus_method_invocation_get_sender(invocation);
+
+  if (caller_is_authorized(mechanism, sender, action)) {
+    g_dbus_method_invocation_return_value(invocation, g_variant_new("(i)", 2));
+    return;
   }
 
-  g_object_unref(result);
+  data = g_new0(MsdDatetimeAuthData, 1);
+  data->mechanism = g_object_ref(mechanism);
+  data->invocation = g_object_ref(invocation);
+  data->action = g_strdup(action);
+  pending_authorizations++;
+
+  /* Check that caller is privileged */
+  subject = polkit_system_bus_name_new(sender);
+  polkit_authority_check_authorization(mechanism->priv->auth, subject, action,
+                                       NULL, 0, NULL, check_can_do_cb, data);
+  g_object_unref(subject);
 }
 
-gboolean msd_datetime_mechanism_can_set_time(MsdDatetimeMechanism *mechanism,
-                                             DBusGMethodInvocation *context) {
-  check_can_do(mechanism, "org.mate.settingsdaemon.datetimemechanism.settime",
-               context);
+static void handle_method_call(GDBusConnection *connection, const gchar *sender,
+                               const gchar *object_path,
+                               const gchar *interface_name,
+                               const gchar *method_name, GVariant *parameters,
+                               GDBusMethodInvocation *invocation,
+                               gpointer user_data) {
+  MsdDatetimeMechanism *mechanism = MSD_DATETIME_MECHANISM(user_data);
 
-  return TRUE;
+  reset_killtimer();
+
+  if (g_strcmp0(method_name, "GetTimezone") == 0) {
+    msd_datetime_mechanism_get_timezone(mechanism, invocation);
+  } else if (g_strcmp0(method_name, "GetHardwareClockUsingUtc") == 0) {
+    msd_datetime_mechanism_get_hardware_clock_using_utc(mechanism, invocation);
+  } else if (g_strcmp0(method_name, "SetTimezone") == 0) {
+    const char *zone_file;
+
+    g_variant_get(parameters, "(&s)", &zone_file);
+    msd_datetime_mechanism_set_timezone(mechanism, zone_file, invocation);
+  } else if (g_strcmp0(method_name, "SetTime") == 0) {
+    gint64 seconds_since_epoch;
+
+    g_variant_get(parameters, "(x)", &seconds_since_epoch);
+    msd_datetime_mechanism_set_time(mechanism, seconds_since_epoch,
+                                    invocation);
+  } else if (g_strcmp0(method_name, "AdjustTime") == 0) {
+    gint64 seconds_to_add;
+
+    g_variant_get(parameters, "(x)", &seconds_to_add);
+    msd_datetime_mechanism_adjust_time(mechanism, seconds_to_add, invocation);
+  } else if (g_strcmp0(method_name, "SetHardwareClockUsingUtc") == 0) {
+    gboolean using_utc;
+
+    g_variant_get(parameters, "(b)", &using_utc);
+    msd_datetime_mechanism_set_hardware_clock_using_utc(mechanism, using_utc,
+                                                        invocation);
+  } else if (g_strcmp0(method_name, "CanSetTime") == 0) {
+    check_can_do(mechanism, "org.mate.settingsdaemon.datetimemechanism.settime",
+                 invocation);
+  } else if (g_strcmp0(method_name, "CanSetTimezone") == 0) {
+    check_can_do(mechanism,
+                 "org.mate.settingsdaemon.datetimemechanism.settimezone",
+                 invocation);
+  }
 }
 
-gboolean msd_datetime_mechanism_can_set_timezone(
-    MsdDatetimeMechanism *mechanism, DBusGMethodInvocation *context) {
-  check_can_do(mechanism,
-               "org.mate.settingsdaemon.datetimemechanism.settimezone",
-               context);
+static const GDBusInterfaceVTable interface_vtable = {
+    handle_method_call, NULL, NULL, {0}};
+
+static gboolean register_mechanism(MsdDatetimeMechanism *mechanism,
+                                   GDBusConnection *connection) {
+  GError *error = NULL;
+
+  mechanism->priv->auth = polkit_authority_get_sync(NULL, &error);
+  if (mechanism->priv->auth == NULL) {
+    if (error != NULL) {
+      g_critical("error getting polkit authority: %s", error->message);
+      g_error_free(error);
+    }
+    goto error;
+  }
+
+  mechanism->priv->connection = g_object_ref(connection);
+
+  mechanism->priv->introspection_data =
+      g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+  g_assert(mechanism->priv->introspection_data != NULL);
+
+  mechanism->priv->registration_id = g_dbus_connection_register_object(
+      connection, MSD_DATETIME_DBUS_PATH,
+      mechanism->priv->introspection_data->interfaces[0], &interface_vtable,
+      mechanism, NULL, &error);
+  if (mechanism->priv->registration_id == 0) {
+    g_critical("error registering object: %s", error->message);
+    g_error_free(error);
+    goto error;
+  }
+
+  reset_killtimer();
 
   return TRUE;
+
+error:
+  return FALSE;
+}
+
+MsdDatetimeMechanism *msd_datetime_mechanism_new(GDBusConnection *connection) {
+  GObject *object;
+  gboolean res;
+
+  object = g_object_new(MSD_DATETIME_TYPE_MECHANISM, NULL);
+
+  res = register_mechanism(MSD_DATETIME_MECHANISM(object), connection);
+  if (!res) {
+    g_object_unref(object);
+    return NULL;
+  }
+
+  return MSD_DATETIME_MECHANISM(object);
 }
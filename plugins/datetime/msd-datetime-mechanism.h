@@ -22,7 +22,7 @@
 #ifndef MSD_DATETIME_MECHANISM_H
 #define MSD_DATETIME_MECHANISM_H
 
-#include <dbus/dbus-glib.h>
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 
@@ -69,35 +69,7 @@ GType msd_datetime_mechanism_error_get_type(void);
 
 GQuark msd_datetime_mechanism_error_quark(void);
 GType msd_datetime_mechanism_get_type(void);
-MsdDatetimeMechanism *msd_datetime_mechanism_new(void);
-
-/* exported methods */
-gboolean msd_datetime_mechanism_get_timezone(MsdDatetimeMechanism *mechanism,
-                                             DBusGMethodInvocation *context);
-gboolean msd_datetime_mechanism_set_timezone(MsdDatetimeMechanism *mechanism,
-                                             const char *zone_file,
-                                             DBusGMethodInvocation *context);
-
-gboolean msd_datetime_mechanism_can_set_timezone(
-    MsdDatetimeMechanism *mechanism, DBusGMethodInvocation *context);
-
-gboolean msd_datetime_mechanism_set_time(MsdDatetimeMechanism *mechanism,
-                                         gint64 seconds_since_epoch,
-                                         DBusGMethodInvocation *context);
-
-gboolean msd_datetime_mechanism_can_set_time(MsdDatetimeMechanism *mechanism,
-                                             DBusGMethodInvocation *context);
-
-gboolean msd_datetime_mechanism_adjust_time(MsdDatetimeMechanism *mechanism,
-                                            gint64 seconds_to_add,
-                                            DBusGMethodInvocation *context);
-
-gboolean msd_datetime_mechanism_get_hardware_clock_using_utc(
-    MsdDatetimeMechanism *mechanism, DBusGMethodInvocation *context);
-
-gboolean msd_datetime_mechanism_set_hardware_clock_using_utc(
-    MsdDatetimeMechanism *mechanism, gboolean using_utc,
-    DBusGMethodInvocation *context);
+MsdDatetimeMechanism *msd_datetime_mechanism_new(GDBusConnection *connection);
 
 G_END_DECLS
 
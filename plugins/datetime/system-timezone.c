@@ -66,6 +66,12 @@
 /* The first 4 characters in a timezone file, from tzfile.h */
 #define TZ_MAGIC "TZif"
 
+/* Where the index of SYSTEM_ZONEINFODIR is kept between runs */
+#ifndef ZONEINFO_INDEX_FILE
+#define ZONEINFO_INDEX_FILE \
+  LOCALSTATEDIR "/cache/mate-settings-daemon/zoneinfo.index"
+#endif
+
 static char *files_to_check[CHECK_NB] = {ETC_TIMEZONE, ETC_TIMEZONE_MAJ,
                                          ETC_SYSCONFIG_CLOCK, ETC_CONF_D_CLOCK,
                                          ETC_LOCALTIME};
@@ -540,58 +546,288 @@ static char *system_timezone_read_etc_localtime_softlink(void) {
   return tz;
 }
 
-typedef gboolean (*CompareFiles)(struct stat *a_stat, struct stat *b_stat,
-                                 const char *a_content, gsize a_content_len,
-                                 const char *b_filename);
+/* Finding which zoneinfo file /etc/localtime is a hard link to or a copy
+ * of used to mean walking the whole zoneinfo tree. Instead, an index of
+ * the tree by inode and by content checksum is built once, kept on disk,
+ * and rebuilt when the mtime of any directory of the tree changes, which
+ * happens whenever tzdata adds, removes or replaces a file. Hits are
+ * still checked against the file they point to, and a mismatch triggers
+ * a rebuild too. */
+
+typedef struct {
+  GHashTable *dir_mtimes; /* directory -> its mtime when scanned */
+  GHashTable *by_inode;   /* "dev:ino" -> zoneinfo file */
+  GHashTable *by_hash;    /* SHA-256 of the content -> zoneinfo file */
+} ZoneinfoIndex;
+
+static ZoneinfoIndex *zoneinfo_index = NULL;
+
+static ZoneinfoIndex *zoneinfo_index_new(void) {
+  ZoneinfoIndex *index;
+
+  index = g_new0(ZoneinfoIndex, 1);
+  index->dir_mtimes =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  index->by_inode =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  index->by_hash =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  return index;
+}
+
+static void zoneinfo_index_free(ZoneinfoIndex *index) {
+  g_hash_table_destroy(index->dir_mtimes);
+  g_hash_table_destroy(index->by_inode);
+  g_hash_table_destroy(index->by_hash);
+  g_free(index);
+}
+
+static char *zoneinfo_index_inode_key(struct stat *file_stat) {
+  return g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                         (guint64)file_stat->st_dev,
+                         (guint64)file_stat->st_ino);
+}
+
+/* Like the old tree walk, the first file found wins when several zones
+ * share an inode or a content. */
+static void zoneinfo_index_add(GHashTable *table, char *key,
+                               const char *file) {
+  if (g_hash_table_contains(table, key)) {
+    g_free(key);
+    return;
+  }
+
+  g_hash_table_insert(table, key, g_strdup(file));
+}
+
+static void zoneinfo_index_set_dir_mtime(ZoneinfoIndex *index,
+                                         const char *dir, gint64 mtime) {
+  gint64 *value;
 
-static char *recursive_compare(struct stat *localtime_stat,
-                               const char *localtime_content,
-                               gsize localtime_content_len, char *file,
-                               CompareFiles compare_func) {
+  value = g_new(gint64, 1);
+  *value = mtime;
+  g_hash_table_insert(index->dir_mtimes, g_strdup(dir), value);
+}
+
+/* Whether no directory of the tree changed since the index was built */
+static gboolean zoneinfo_index_is_current(ZoneinfoIndex *index) {
+  GHashTableIter iter;
+  gpointer key, value;
+  struct stat dir_stat;
+
+  /* An index from before the directories were recorded */
+  if (g_hash_table_size(index->dir_mtimes) == 0) return FALSE;
+
+  g_hash_table_iter_init(&iter, index->dir_mtimes);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    if (g_stat(key, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode) ||
+        (gint64)dir_stat.st_mtime != *(gint64 *)value)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void zoneinfo_index_scan(ZoneinfoIndex *index, const char *file) {
   struct stat file_stat;
 
-  if (g_stat(file, &file_stat) != 0) return NULL;
+  if (g_stat(file, &file_stat) != 0) return;
 
   if (S_ISREG(file_stat.st_mode)) {
-    if (compare_func(localtime_stat, &file_stat, localtime_content,
-                     localtime_content_len, file))
-      return system_timezone_strip_path_if_valid(file);
-    else
-      return NULL;
+    char *content = NULL;
+    gsize content_len;
+
+    if (!g_file_get_contents(file, &content, &content_len, NULL)) return;
+
+    if (content_len >= strlen(TZ_MAGIC) &&
+        memcmp(content, TZ_MAGIC, strlen(TZ_MAGIC)) == 0) {
+      zoneinfo_index_add(index->by_inode, zoneinfo_index_inode_key(&file_stat),
+                         file);
+      zoneinfo_index_add(index->by_hash,
+                         g_compute_checksum_for_data(
+                             G_CHECKSUM_SHA256, (const guchar *)content,
+                             content_len),
+                         file);
+    }
+
+    g_free(content);
   } else if (S_ISDIR(file_stat.st_mode)) {
-    GDir *dir = NULL;
-    char *ret = NULL;
-    const char *subfile = NULL;
-    char *subpath = NULL;
+    GDir *dir;
+    const char *subfile;
 
     dir = g_dir_open(file, 0, NULL);
-    if (dir == NULL) return NULL;
+    if (dir == NULL) return;
+
+    zoneinfo_index_set_dir_mtime(index, file, file_stat.st_mtime);
 
     while ((subfile = g_dir_read_name(dir)) != NULL) {
+      char *subpath;
+
       subpath = g_build_filename(file, subfile, NULL);
+      zoneinfo_index_scan(index, subpath);
+      g_free(subpath);
+    }
 
-      ret = recursive_compare(localtime_stat, localtime_content,
-                              localtime_content_len, subpath, compare_func);
+    g_dir_close(dir);
+  }
+}
 
-      g_free(subpath);
+static void zoneinfo_index_load_group(GKeyFile *key_file, const char *group,
+                                      GHashTable *table) {
+  char **keys;
+  int i;
+
+  keys = g_key_file_get_keys(key_file, group, NULL, NULL);
+  if (keys == NULL) return;
+
+  for (i = 0; keys[i] != NULL; i++) {
+    char *file;
+
+    file = g_key_file_get_string(key_file, group, keys[i], NULL);
+    if (file == NULL) continue;
+
+    g_hash_table_insert(table, g_strdup(keys[i]), file);
+  }
+
+  g_strfreev(keys);
+}
 
-      if (ret != NULL) break;
+static void zoneinfo_index_load_dir_mtimes(GKeyFile *key_file,
+                                           ZoneinfoIndex *index) {
+  char **keys;
+  int i;
+
+  keys = g_key_file_get_keys(key_file, "Directories", NULL, NULL);
+  if (keys == NULL) return;
+
+  for (i = 0; keys[i] != NULL; i++) {
+    GError *error = NULL;
+    gint64 mtime;
+
+    mtime = g_key_file_get_int64(key_file, "Directories", keys[i], &error);
+    if (error != NULL) {
+      g_error_free(error);
+      continue;
     }
 
-    g_dir_close(dir);
+    zoneinfo_index_set_dir_mtime(index, keys[i], mtime);
+  }
+
+  g_strfreev(keys);
+}
+
+static ZoneinfoIndex *zoneinfo_index_load(void) {
+  GKeyFile *key_file;
+  ZoneinfoIndex *index = NULL;
+
+  key_file = g_key_file_new();
+
+  if (!g_key_file_load_from_file(key_file, ZONEINFO_INDEX_FILE,
+                                 G_KEY_FILE_NONE, NULL))
+    goto out;
+
+  index = zoneinfo_index_new();
+  zoneinfo_index_load_dir_mtimes(key_file, index);
+  zoneinfo_index_load_group(key_file, "Inodes", index->by_inode);
+  zoneinfo_index_load_group(key_file, "Checksums", index->by_hash);
 
-    return ret;
+out:
+  g_key_file_free(key_file);
+
+  return index;
+}
+
+static void zoneinfo_index_save_group(GKeyFile *key_file, const char *group,
+                                      GHashTable *table) {
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init(&iter, table);
+  while (g_hash_table_iter_next(&iter, &key, &value))
+    g_key_file_set_string(key_file, group, key, value);
+}
+
+/* Failing to save is not an error: we're then just not running as root,
+ * and the index will live as long as the process. */
+static void zoneinfo_index_save(ZoneinfoIndex *index) {
+  GKeyFile *key_file;
+  GHashTableIter iter;
+  gpointer key, value;
+  char *dirname;
+
+  dirname = g_path_get_dirname(ZONEINFO_INDEX_FILE);
+  g_mkdir_with_parents(dirname, 0755);
+  g_free(dirname);
+
+  key_file = g_key_file_new();
+  g_hash_table_iter_init(&iter, index->dir_mtimes);
+  while (g_hash_table_iter_next(&iter, &key, &value))
+    g_key_file_set_int64(key_file, "Directories", key, *(gint64 *)value);
+  zoneinfo_index_save_group(key_file, "Inodes", index->by_inode);
+  zoneinfo_index_save_group(key_file, "Checksums", index->by_hash);
+
+  if (!g_key_file_save_to_file(key_file, ZONEINFO_INDEX_FILE, NULL))
+    g_debug("Could not save zoneinfo index to " ZONEINFO_INDEX_FILE);
+
+  g_key_file_free(key_file);
+}
+
+static ZoneinfoIndex *zoneinfo_index_get(gboolean rebuild) {
+  if (!g_file_test(SYSTEM_ZONEINFODIR, G_FILE_TEST_IS_DIR)) return NULL;
+
+  if (!rebuild && zoneinfo_index != NULL &&
+      zoneinfo_index_is_current(zoneinfo_index))
+    return zoneinfo_index;
+
+  g_clear_pointer(&zoneinfo_index, zoneinfo_index_free);
+
+  if (!rebuild) {
+    zoneinfo_index = zoneinfo_index_load();
+    if (zoneinfo_index != NULL && !zoneinfo_index_is_current(zoneinfo_index))
+      g_clear_pointer(&zoneinfo_index, zoneinfo_index_free);
   }
 
-  return NULL;
+  if (zoneinfo_index == NULL) {
+    zoneinfo_index = zoneinfo_index_new();
+    zoneinfo_index_scan(zoneinfo_index, SYSTEM_ZONEINFODIR);
+    zoneinfo_index_save(zoneinfo_index);
+  }
+
+  return zoneinfo_index;
 }
 
 static gboolean files_are_identical_inode(struct stat *a_stat,
-                                          struct stat *b_stat,
-                                          const char *a_content,
-                                          gsize a_content_len,
                                           const char *b_filename) {
-  return (a_stat->st_ino == b_stat->st_ino);
+  struct stat b_stat;
+
+  if (g_stat(b_filename, &b_stat) != 0) return FALSE;
+
+  return (a_stat->st_dev == b_stat.st_dev && a_stat->st_ino == b_stat.st_ino);
+}
+
+static char *zoneinfo_index_lookup_inode(struct stat *localtime_stat,
+                                         gboolean rebuild) {
+  ZoneinfoIndex *index;
+  const char *file;
+  char *key;
+
+  index = zoneinfo_index_get(rebuild);
+  if (index == NULL) return NULL;
+
+  key = zoneinfo_index_inode_key(localtime_stat);
+  file = g_hash_table_lookup(index->by_inode, key);
+  g_free(key);
+
+  if (file == NULL) return NULL;
+
+  if (files_are_identical_inode(localtime_stat, file))
+    return system_timezone_strip_path_if_valid(file);
+
+  /* Stale index; try once more with a fresh one */
+  if (!rebuild) return zoneinfo_index_lookup_inode(localtime_stat, TRUE);
+
+  return NULL;
 }
 
 /* Determine if /etc/localtime is a hard link to some file, by looking at
@@ -603,21 +839,16 @@ static char *system_timezone_read_etc_localtime_hardlink(void) {
 
   if (!S_ISREG(stat_localtime.st_mode)) return NULL;
 
-  return recursive_compare(&stat_localtime, NULL, 0, SYSTEM_ZONEINFODIR,
-                           files_are_identical_inode);
+  return zoneinfo_index_lookup_inode(&stat_localtime, FALSE);
 }
 
-static gboolean files_are_identical_content(struct stat *a_stat,
-                                            struct stat *b_stat,
-                                            const char *a_content,
+static gboolean files_are_identical_content(const char *a_content,
                                             gsize a_content_len,
                                             const char *b_filename) {
   char *b_content = NULL;
   gsize b_content_len = -1;
   int cmp;
 
-  if (a_stat->st_size != b_stat->st_size) return FALSE;
-
   if (!g_file_get_contents(b_filename, &b_content, &b_content_len, NULL))
     return FALSE;
 
@@ -632,11 +863,37 @@ static gboolean files_are_identical_content(struct stat *a_stat,
   return (cmp == 0);
 }
 
+static char *zoneinfo_index_lookup_content(const char *localtime_content,
+                                           gsize localtime_content_len,
+                                           const char *checksum,
+                                           gboolean rebuild) {
+  ZoneinfoIndex *index;
+  const char *file;
+
+  index = zoneinfo_index_get(rebuild);
+  if (index == NULL) return NULL;
+
+  file = g_hash_table_lookup(index->by_hash, checksum);
+  if (file == NULL) return NULL;
+
+  if (files_are_identical_content(localtime_content, localtime_content_len,
+                                  file))
+    return system_timezone_strip_path_if_valid(file);
+
+  /* Stale index; try once more with a fresh one */
+  if (!rebuild)
+    return zoneinfo_index_lookup_content(
+        localtime_content, localtime_content_len, checksum, TRUE);
+
+  return NULL;
+}
+
 /* Determine if /etc/localtime is a copy of a timezone file */
 static char *system_timezone_read_etc_localtime_content(void) {
   struct stat stat_localtime;
   char *localtime_content = NULL;
   gsize localtime_content_len = -1;
+  char *checksum;
   char *retval;
 
   if (g_stat(ETC_LOCALTIME, &stat_localtime) != 0) return NULL;
@@ -647,10 +904,14 @@ static char *system_timezone_read_etc_localtime_content(void) {
                            &localtime_content_len, NULL))
     return NULL;
 
-  retval = recursive_compare(&stat_localtime, localtime_content,
-                             localtime_content_len, SYSTEM_ZONEINFODIR,
-                             files_are_identical_content);
+  checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+                                         (const guchar *)localtime_content,
+                                         localtime_content_len);
+
+  retval = zoneinfo_index_lookup_content(
+      localtime_content, localtime_content_len, checksum, FALSE);
 
+  g_free(checksum);
   g_free(localtime_content);
 
   return retval;
@@ -668,8 +929,8 @@ static GetSystemTimezone get_system_timezone_methods[] = {
     system_timezone_read_etc_TIMEZONE, system_timezone_read_etc_rc_conf,
     /* reading deprecated config files */
     system_timezone_read_etc_conf_d_clock,
-    /* reading /etc/timezone directly. Expensive since we have to stat
-     * many files */
+    /* reading /etc/localtime directly. Expensive the first time, since
+     * the zoneinfo index has to be built */
     system_timezone_read_etc_localtime_hardlink,
     system_timezone_read_etc_localtime_content, NULL};
 
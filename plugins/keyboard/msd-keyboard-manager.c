@@ -37,6 +37,9 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <X11/extensions/XInput.h>
+#include <X11/extensions/XInput2.h>
+
 #ifdef HAVE_X11_EXTENSIONS_XKB_H
 #include <X11/XKBlib.h>
 #include <X11/keysym.h>
@@ -64,6 +67,8 @@
 struct MsdKeyboardManagerPrivate {
   gboolean have_xkb;
   gint xkb_event_base;
+  gboolean have_xi2;
+  gint xi_opcode;
   GSettings *settings;
 };
 
@@ -75,15 +80,24 @@ G_DEFINE_TYPE_WITH_PRIVATE(MsdKeyboardManager, msd_keyboard_manager,
 static gpointer manager_object = NULL;
 
 #ifdef HAVE_X11_EXTENSIONS_XKB_H
-static gboolean xkb_set_keyboard_autorepeat_rate(int delay, int rate) {
+static gboolean xkb_set_keyboard_autorepeat_rate(unsigned int device_spec,
+                                                 int delay, int rate) {
+  Display *dpy = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+  unsigned int current_delay, current_interval;
   int interval = (rate <= 0) ? 1000000 : 1000 / rate;
 
   if (delay <= 0) {
     delay = 1;
   }
 
-  return XkbSetAutoRepeatRate(GDK_DISPLAY_XDISPLAY(gdk_display_get_default()),
-                              XkbUseCoreKbd, delay, interval);
+  /* Every XKB client is notified of a new rate, even an unchanged one */
+  if (XkbGetAutoRepeatRate(dpy, device_spec, &current_delay,
+                           &current_interval) &&
+      current_delay == (unsigned int)delay &&
+      current_interval == (unsigned int)interval)
+    return TRUE;
+
+  return XkbSetAutoRepeatRate(dpy, device_spec, delay, interval);
 }
 #endif
 
@@ -169,30 +183,41 @@ static void numlock_install_xkb_callback(MsdKeyboardManager *manager) {
 
 #endif /* HAVE_X11_EXTENSIONS_XKB_H */
 
+static void get_keyboard_control(GSettings *settings,
+                                 XKeyboardControl *kbdcontrol) {
+  gboolean click;
+  int click_volume;
+  char *volume_string;
+
+  click = g_settings_get_boolean(settings, KEY_CLICK);
+  click_volume = g_settings_get_int(settings, KEY_CLICK_VOLUME);
+
+  volume_string = g_settings_get_string(settings, KEY_BELL_MODE);
+  kbdcontrol->bell_percent =
+      (volume_string && !strcmp(volume_string, "on")) ? 50 : 0;
+  g_free(volume_string);
+
+  /* as percentage from 0..100 inclusive */
+  if (click_volume < 0) {
+    click_volume = 0;
+  } else if (click_volume > 100) {
+    click_volume = 100;
+  }
+  kbdcontrol->key_click_percent = click ? click_volume : 0;
+  kbdcontrol->bell_pitch = g_settings_get_int(settings, KEY_BELL_PITCH);
+  kbdcontrol->bell_duration = g_settings_get_int(settings, KEY_BELL_DURATION);
+}
+
 static void apply_settings(GSettings *settings, gchar *key,
                            MsdKeyboardManager *manager) {
   XKeyboardControl kbdcontrol;
   gboolean repeat;
-  gboolean click;
-  int click_volume;
-  int bell_volume;
-  int bell_pitch;
-  int bell_duration;
-  char *volume_string;
   GdkDisplay *display;
 #ifdef HAVE_X11_EXTENSIONS_XKB_H
   gboolean rnumlock;
 #endif /* HAVE_X11_EXTENSIONS_XKB_H */
 
   repeat = g_settings_get_boolean(settings, KEY_REPEAT);
-  click = g_settings_get_boolean(settings, KEY_CLICK);
-  click_volume = g_settings_get_int(settings, KEY_CLICK_VOLUME);
-  bell_pitch = g_settings_get_int(settings, KEY_BELL_PITCH);
-  bell_duration = g_settings_get_int(settings, KEY_BELL_DURATION);
-
-  volume_string = g_settings_get_string(settings, KEY_BELL_MODE);
-  bell_volume = (volume_string && !strcmp(volume_string, "on")) ? 50 : 0;
-  g_free(volume_string);
 
   display = gdk_display_get_default();
   gdk_x11_display_error_trap_push(display);
@@ -203,7 +228,7 @@ static void apply_settings(GSettings *settings, gchar *key,
     /* Use XKB in preference */
 #ifdef HAVE_X11_EXTENSIONS_XKB_H
     rate_set = xkb_set_keyboard_autorepeat_rate(
-        g_settings_get_int(settings, KEY_DELAY),
+        XkbUseCoreKbd, g_settings_get_int(settings, KEY_DELAY),
         g_settings_get_int(settings, KEY_RATE));
 #endif /* HAVE_X11_EXTENSIONS_XKB_H */
     if (!rate_set)
@@ -214,16 +239,7 @@ static void apply_settings(GSettings *settings, gchar *key,
     XAutoRepeatOff(GDK_DISPLAY_XDISPLAY(display));
   }
 
-  /* as percentage from 0..100 inclusive */
-  if (click_volume < 0) {
-    click_volume = 0;
-  } else if (click_volume > 100) {
-    click_volume = 100;
-  }
-  kbdcontrol.key_click_percent = click ? click_volume : 0;
-  kbdcontrol.bell_percent = bell_volume;
-  kbdcontrol.bell_pitch = bell_pitch;
-  kbdcontrol.bell_duration = bell_duration;
+  get_keyboard_control(settings, &kbdcontrol);
   XChangeKeyboardControl(
       GDK_DISPLAY_XDISPLAY(gdk_display_get_default()),
       KBKeyClickPercent | KBBellPercent | KBBellPitch | KBBellDuration,
@@ -247,6 +263,151 @@ void msd_keyboard_manager_apply_settings(MsdKeyboardManager *manager) {
   apply_settings(manager->priv->settings, NULL, manager);
 }
 
+/* Keyboard feedbacks are per device, and a new keyboard does not get
+ * what was set through the core keyboard */
+static void set_device_keyboard_control(Display *dpy, int deviceid,
+                                        XKeyboardControl *kbdcontrol) {
+  XDevice *device;
+  XFeedbackState *states, *state;
+  XKbdFeedbackControl feedback;
+  int n_feedbacks, i;
+
+  device = XOpenDevice(dpy, deviceid);
+  if (device == NULL) return;
+
+  states = XGetFeedbackControl(dpy, device, &n_feedbacks);
+  for (i = 0, state = states; i < n_feedbacks; i++) {
+    if (state->class == KbdFeedbackClass) {
+      memset(&feedback, 0, sizeof(feedback));
+      feedback.class = KbdFeedbackClass;
+      feedback.length = sizeof(feedback);
+      feedback.id = state->id;
+      feedback.click = kbdcontrol->key_click_percent;
+      feedback.percent = kbdcontrol->bell_percent;
+      feedback.pitch = kbdcontrol->bell_pitch;
+      feedback.duration = kbdcontrol->bell_duration;
+      XChangeFeedbackControl(dpy, device,
+                             DvKeyClickPercent | DvPercent | DvPitch |
+                                 DvDuration,
+                             (XFeedbackControl *)&feedback);
+      break;
+    }
+    state = (XFeedbackState *)((char *)state + state->length);
+  }
+
+  if (states != NULL) XFreeFeedbackList(states);
+  XCloseDevice(dpy, device);
+}
+
+/* Applies the settings to the keyboard @deviceid alone; the others
+ * already have them */
+static void apply_device_settings(MsdKeyboardManager *manager, int deviceid) {
+  GSettings *settings = manager->priv->settings;
+  XKeyboardControl kbdcontrol;
+  GdkDisplay *display;
+  Display *dpy;
+
+  display = gdk_display_get_default();
+  dpy = GDK_DISPLAY_XDISPLAY(display);
+
+  gdk_x11_display_error_trap_push(display);
+
+#ifdef HAVE_X11_EXTENSIONS_XKB_H
+  if (manager->priv->have_xkb) {
+    gboolean repeat = g_settings_get_boolean(settings, KEY_REPEAT);
+
+    XkbChangeEnabledControls(dpy, deviceid, XkbRepeatKeysMask,
+                             repeat ? XkbRepeatKeysMask : 0);
+    if (repeat)
+      xkb_set_keyboard_autorepeat_rate(deviceid,
+                                       g_settings_get_int(settings, KEY_DELAY),
+                                       g_settings_get_int(settings, KEY_RATE));
+  }
+#endif /* HAVE_X11_EXTENSIONS_XKB_H */
+
+  get_keyboard_control(settings, &kbdcontrol);
+  set_device_keyboard_control(dpy, deviceid, &kbdcontrol);
+
+  XSync(dpy, FALSE);
+  gdk_x11_display_error_trap_pop_ignored(display);
+}
+
+static GdkFilterReturn devicepresence_filter(GdkXEvent *xevent, GdkEvent *event,
+                                             gpointer data) {
+  MsdKeyboardManager *manager = MSD_KEYBOARD_MANAGER(data);
+  XGenericEventCookie *cookie = &((XEvent *)xevent)->xcookie;
+  XIHierarchyEvent *hev;
+  int i;
+
+  /* GDK has already fetched the data of XI2 events */
+  if (cookie->type != GenericEvent ||
+      cookie->extension != manager->priv->xi_opcode ||
+      cookie->evtype != XI_HierarchyChanged || cookie->data == NULL)
+    return GDK_FILTER_CONTINUE;
+
+  hev = cookie->data;
+  if (!(hev->flags & XIDeviceEnabled)) return GDK_FILTER_CONTINUE;
+
+  for (i = 0; i < hev->num_info; i++) {
+    if ((hev->info[i].flags & XIDeviceEnabled) &&
+        hev->info[i].use == XISlaveKeyboard) {
+      g_debug("Keyboard %d enabled", hev->info[i].deviceid);
+      apply_device_settings(manager, hev->info[i].deviceid);
+      msd_keyboard_xkb_new_keyboard(hev->info[i].deviceid);
+    }
+  }
+
+  return GDK_FILTER_CONTINUE;
+}
+
+static void set_devicepresence_handler(MsdKeyboardManager *manager) {
+  GdkDisplay *gdk_display;
+  Display *display;
+  Window root;
+  XIEventMask *masks;
+  XIEventMask mask;
+  unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {0};
+  int event_base, error_base, major = 2, minor = 0;
+  int n_masks, i;
+
+  gdk_display = gdk_display_get_default();
+  display = GDK_DISPLAY_XDISPLAY(gdk_display);
+  root = DefaultRootWindow(display);
+
+  if (!XQueryExtension(display, "XInputExtension", &manager->priv->xi_opcode,
+                       &event_base, &error_base))
+    return;
+
+  gdk_x11_display_error_trap_push(gdk_display);
+
+  if (XIQueryVersion(display, &major, &minor) != Success) {
+    gdk_x11_display_error_trap_pop_ignored(gdk_display);
+    g_debug("XInput 2 not available, new keyboards keep the server defaults");
+    return;
+  }
+
+  /* GDK may have selected events on the root window too, and a new
+   * selection would replace its own */
+  masks = XIGetSelectedEvents(display, root, &n_masks);
+  for (i = 0; i < n_masks; i++) {
+    if (masks[i].deviceid == XIAllDevices)
+      memcpy(bits, masks[i].mask, MIN(masks[i].mask_len, (int)sizeof(bits)));
+  }
+  if (masks != NULL) XFree(masks);
+
+  XISetMask(bits, XI_HierarchyChanged);
+  mask.deviceid = XIAllDevices;
+  mask.mask_len = sizeof(bits);
+  mask.mask = bits;
+  XISelectEvents(display, root, &mask, 1);
+
+  gdk_display_flush(gdk_display);
+  if (!gdk_x11_display_error_trap_pop(gdk_display)) {
+    gdk_window_add_filter(NULL, devicepresence_filter, manager);
+    manager->priv->have_xi2 = TRUE;
+  }
+}
+
 static gboolean start_keyboard_idle_cb(MsdKeyboardManager *manager) {
   mate_settings_profile_start(NULL);
 
@@ -268,6 +429,8 @@ static gboolean start_keyboard_idle_cb(MsdKeyboardManager *manager) {
   g_signal_connect(manager->priv->settings, "changed",
                    G_CALLBACK(apply_settings), manager);
 
+  set_devicepresence_handler(manager);
+
 #ifdef HAVE_X11_EXTENSIONS_XKB_H
   numlock_install_xkb_callback(manager);
 #endif /* HAVE_X11_EXTENSIONS_XKB_H */
@@ -293,6 +456,11 @@ void msd_keyboard_manager_stop(MsdKeyboardManager *manager) {
 
   g_debug("Stopping keyboard manager");
 
+  if (p->have_xi2) {
+    gdk_window_remove_filter(NULL, devicepresence_filter, manager);
+    p->have_xi2 = FALSE;
+  }
+
   if (p->settings != NULL) {
     g_object_unref(p->settings);
     p->settings = NULL;
@@ -27,6 +27,7 @@
 
 #include "msd-keyboard-xkb.h"
 
+#include <X11/XKBlib.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <gio/gio.h>
@@ -60,6 +61,17 @@ static GSettings *settings_kbd;
 static XklEngine *xkl_engine;
 static XklConfigRegistry *xkl_registry = NULL;
 
+/* What the registry said about each "layout\tvariant" item checked
+ * against it, so it is consulted once per item */
+static GHashTable *checked_layouts = NULL;
+
+/* The configuration last activated or found in effect, as built by
+ * get_config_key(), or NULL when the server may have changed since */
+static char *applied_config_key = NULL;
+
+/* Bursts of setting changes are applied once, from an idle */
+static guint apply_xkb_id = 0;
+
 static MatekbdDesktopConfig current_desktop_config;
 static MatekbdKeyboardConfig current_kbd_config;
 
@@ -321,86 +333,182 @@ static gboolean try_activating_xkb_config_if_new(
   return TRUE;
 }
 
-static gboolean filter_xkb_config(void) {
+static gboolean load_registry(void) {
+  if (xkl_registry) return TRUE;
+
+  xkl_registry = xkl_config_registry_get_instance(xkl_engine);
+  /* load all materials, unconditionally! */
+  if (!xkl_config_registry_load(xkl_registry, TRUE)) {
+    g_object_unref(xkl_registry);
+    xkl_registry = NULL;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean is_valid_layout(const gchar *layout_variant) {
   XklConfigItem *item;
   gchar *lname;
   gchar *vname;
+  gboolean valid = TRUE;
+
+  if (!matekbd_keyboard_config_split_items(layout_variant, &lname, &vname))
+    return TRUE;
+
+  item = xkl_config_item_new();
+  g_snprintf(item->name, sizeof(item->name), "%s", lname);
+  if (!xkl_config_registry_find_layout(xkl_registry, item)) {
+    xkl_debug(100, "Bad layout [%s]\n", lname);
+    valid = FALSE;
+  } else if (vname) {
+    g_snprintf(item->name, sizeof(item->name), "%s", vname);
+    if (!xkl_config_registry_find_variant(xkl_registry, lname, item)) {
+      xkl_debug(100, "Bad variant [%s(%s)]\n", lname, vname);
+      valid = FALSE;
+    }
+  }
+  g_object_unref(item);
+
+  return valid;
+}
+
+/* Drops the layouts the registry does not know.  Unless @use_registry,
+ * only those it already turned down are dropped, and the registry is
+ * not loaded. */
+static gboolean filter_xkb_config(gboolean use_registry) {
   gchar **lv;
+  gpointer valid;
   gboolean any_change = FALSE;
 
   xkl_debug(100, "Filtering configuration against the registry\n");
-  if (!xkl_registry) {
-    xkl_registry = xkl_config_registry_get_instance(xkl_engine);
-    /* load all materials, unconditionally! */
-    if (!xkl_config_registry_load(xkl_registry, TRUE)) {
-      g_object_unref(xkl_registry);
-      xkl_registry = NULL;
-      return FALSE;
-    }
-  }
+  if (use_registry && !load_registry()) return FALSE;
+
   lv = current_kbd_config.layouts_variants;
-  item = xkl_config_item_new();
   while (*lv) {
-    xkl_debug(100, "Checking [%s]\n", *lv);
-    if (matekbd_keyboard_config_split_items(*lv, &lname, &vname)) {
-      gboolean should_be_dropped = FALSE;
-      g_snprintf(item->name, sizeof(item->name), "%s", lname);
-      if (!xkl_config_registry_find_layout(xkl_registry, item)) {
-        xkl_debug(100, "Bad layout [%s]\n", lname);
-        should_be_dropped = TRUE;
-      } else if (vname) {
-        g_snprintf(item->name, sizeof(item->name), "%s", vname);
-        if (!xkl_config_registry_find_variant(xkl_registry, lname, item)) {
-          xkl_debug(100, "Bad variant [%s(%s)]\n", lname, vname);
-          should_be_dropped = TRUE;
-        }
-      }
-      if (should_be_dropped) {
-        g_strv_behead(lv);
-        any_change = TRUE;
+    if (!g_hash_table_lookup_extended(checked_layouts, *lv, NULL, &valid)) {
+      if (!use_registry) {
+        lv++;
         continue;
       }
+
+      xkl_debug(100, "Checking [%s]\n", *lv);
+      valid = GINT_TO_POINTER(is_valid_layout(*lv));
+      g_hash_table_insert(checked_layouts, g_strdup(*lv), valid);
+    }
+
+    if (!GPOINTER_TO_INT(valid)) {
+      g_strv_behead(lv);
+      any_change = TRUE;
+      continue;
     }
     lv++;
   }
-  g_object_unref(item);
   return any_change;
 }
 
+static char *get_config_key(MatekbdKeyboardConfig *kbd_config) {
+  GString *key = g_string_new(kbd_config->model);
+  gchar **p;
+
+  /* Items never contain newlines, so "\n\n" separates the lists */
+  g_string_append(key, "\n");
+  for (p = kbd_config->layouts_variants; p != NULL && *p != NULL; p++)
+    g_string_append_printf(key, "\n%s", *p);
+  g_string_append(key, "\n");
+  for (p = kbd_config->options; p != NULL && *p != NULL; p++)
+    g_string_append_printf(key, "\n%s", *p);
+
+  return g_string_free(key, FALSE);
+}
+
+/* get_config_key() of what the server has now */
+static char *get_server_config_key(void) {
+  MatekbdKeyboardConfig server_config;
+  char *key;
+
+  matekbd_keyboard_config_init(&server_config, xkl_engine);
+  matekbd_keyboard_config_load_from_x_current(&server_config, NULL);
+  key = get_config_key(&server_config);
+  matekbd_keyboard_config_term(&server_config);
+
+  return key;
+}
+
 static void apply_xkb_settings(void) {
   MatekbdKeyboardConfig current_sys_kbd_config;
+  char *config_key;
 
   if (!inited_ok) return;
 
-  matekbd_keyboard_config_init(&current_sys_kbd_config, xkl_engine);
-
   matekbd_keyboard_config_load_from_gsettings(&current_kbd_config,
                                               &initial_sys_kbd_config);
 
+  /* Leave out what failed before right away, and activate once */
+  filter_xkb_config(FALSE);
+
+  config_key = get_config_key(&current_kbd_config);
+  if (g_strcmp0(config_key, applied_config_key) == 0) {
+    xkl_debug(100, "KBD configuration is already in effect\n");
+    g_free(config_key);
+    show_hide_icon();
+    return;
+  }
+
+  matekbd_keyboard_config_init(&current_sys_kbd_config, xkl_engine);
   matekbd_keyboard_config_load_from_x_current(&current_sys_kbd_config, NULL);
 
   if (!try_activating_xkb_config_if_new(&current_sys_kbd_config)) {
-    if (filter_xkb_config()) {
+    if (filter_xkb_config(TRUE)) {
+      g_free(config_key);
+      config_key = get_config_key(&current_kbd_config);
       if (!try_activating_xkb_config_if_new(&current_sys_kbd_config)) {
         g_warning("Could not activate the filtered XKB configuration");
         activation_error();
+        g_clear_pointer(&config_key, g_free);
       }
     } else {
       g_warning("Could not activate the XKB configuration");
       activation_error();
+      g_clear_pointer(&config_key, g_free);
     }
   } else
     xkl_debug(
         100,
         "Actual KBD configuration was not changed: redundant notification\n");
 
+  g_free(applied_config_key);
+  applied_config_key = config_key;
+
   matekbd_keyboard_config_term(&current_sys_kbd_config);
   show_hide_icon();
 }
 
+static gboolean apply_xkb_settings_idle_cb(gpointer user_data) {
+  apply_xkb_id = 0;
+  apply_xkb_settings();
+
+  return G_SOURCE_REMOVE;
+}
+
 static void apply_xkb_settings_cb(GSettings *settings, gchar *key,
                                   gpointer user_data) {
-  apply_xkb_settings();
+  if (apply_xkb_id == 0)
+    apply_xkb_id = g_idle_add(apply_xkb_settings_idle_cb, NULL);
+}
+
+/* Someone else may have changed the keyboard configuration.  This is
+ * also emitted for our own activation, which must not make the next
+ * apply_xkb_settings() activate the same configuration again. */
+static void msd_keyboard_config_changed(XklEngine *engine) {
+  char *server_key;
+
+  if (applied_config_key == NULL) return;
+
+  server_key = get_server_config_key();
+  if (g_strcmp0(server_key, applied_config_key) != 0)
+    g_clear_pointer(&applied_config_key, g_free);
+  g_free(server_key);
 }
 
 static void msd_keyboard_xkb_analyze_sysconfig(void) {
@@ -425,12 +533,82 @@ static GdkFilterReturn msd_keyboard_xkb_evt_filter(GdkXEvent *xev,
   return GDK_FILTER_CONTINUE;
 }
 
-/* When new Keyboard is plugged in - reload the settings */
-static void msd_keyboard_new_device(XklEngine *engine) {
-  apply_desktop_settings();
+/* Whether the core keyboard still has the configuration we applied */
+static gboolean core_keyboard_is_current(void) {
+  char *server_key;
+  gboolean current;
+
+  if (applied_config_key == NULL) return FALSE;
+
+  server_key = get_server_config_key();
+  current = g_strcmp0(server_key, applied_config_key) == 0;
+  g_free(server_key);
+
+  return current;
+}
+
+/* Whether the keyboard @deviceid was compiled from the same components
+ * as the core keyboard */
+static gboolean device_has_core_keymap(int deviceid) {
+  GdkDisplay *display = gdk_display_get_default();
+  Display *dpy = GDK_DISPLAY_XDISPLAY(display);
+  unsigned int which = XkbKeycodesNameMask | XkbSymbolsNameMask |
+                       XkbTypesNameMask | XkbCompatNameMask;
+  XkbDescPtr core, device;
+  gboolean same = FALSE;
+
+  core = XkbAllocKeyboard();
+  device = XkbAllocKeyboard();
+  device->device_spec = deviceid;
+
+  gdk_x11_display_error_trap_push(display);
+  if (XkbGetNames(dpy, which, core) == Success &&
+      XkbGetNames(dpy, which, device) == Success && core->names != NULL &&
+      device->names != NULL)
+    same = core->names->keycodes == device->names->keycodes &&
+           core->names->symbols == device->names->symbols &&
+           core->names->types == device->names->types &&
+           core->names->compat == device->names->compat;
+  gdk_x11_display_error_trap_pop_ignored(display);
+
+  XkbFreeKeyboard(core, 0, True);
+  XkbFreeKeyboard(device, 0, True);
+
+  return same;
+}
+
+static void reload_layouts(void) {
+  g_clear_pointer(&applied_config_key, g_free);
   apply_xkb_settings();
 }
 
+/* libxklavier tells a keyboard was plugged in, but not which one; the
+ * layouts are only activated again if the core keyboard lost them */
+static void msd_keyboard_new_device(XklEngine *engine) {
+  if (core_keyboard_is_current()) {
+    xkl_debug(100, "New device, KBD configuration is still in effect\n");
+    return;
+  }
+
+  reload_layouts();
+}
+
+/* The keyboard manager calls this for each keyboard XInput 2 reports
+ * enabled.  It gets the layouts when it was set up with something other
+ * than what the core keyboard has; the other settings the manager
+ * applies to the device itself. */
+void msd_keyboard_xkb_new_keyboard(int deviceid) {
+  if (!inited_ok) return;
+
+  if (core_keyboard_is_current() && device_has_core_keymap(deviceid)) {
+    xkl_debug(100, "Keyboard %d already has the KBD configuration\n",
+              deviceid);
+    return;
+  }
+
+  reload_layouts();
+}
+
 static void msd_keyboard_update_indicator_icons(void) {
   Bool state;
   int new_state, i;
@@ -495,6 +673,9 @@ void msd_keyboard_xkb_init(MsdKeyboardManager *kbd_manager) {
     matekbd_desktop_config_init(&current_desktop_config, xkl_engine);
     matekbd_keyboard_config_init(&current_kbd_config, xkl_engine);
 
+    checked_layouts =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
     xkl_engine_backup_names_prop(xkl_engine);
     msd_keyboard_xkb_analyze_sysconfig();
 
@@ -516,6 +697,8 @@ void msd_keyboard_xkb_init(MsdKeyboardManager *kbd_manager) {
                        G_CALLBACK(msd_keyboard_new_device), NULL);
     g_signal_connect(xkl_engine, "X-state-changed",
                      G_CALLBACK(msd_keyboard_state_changed), NULL);
+    g_signal_connect(xkl_engine, "X-config-changed",
+                     G_CALLBACK(msd_keyboard_config_changed), NULL);
 
     mate_settings_profile_start("xkl_engine_start_listen");
     xkl_engine_start_listen(xkl_engine,
@@ -555,6 +738,14 @@ void msd_keyboard_xkb_shutdown(void) {
 
   gdk_window_remove_filter(NULL, msd_keyboard_xkb_evt_filter, NULL);
 
+  if (apply_xkb_id != 0) {
+    g_source_remove(apply_xkb_id);
+    apply_xkb_id = 0;
+  }
+
+  g_clear_pointer(&applied_config_key, g_free);
+  g_clear_pointer(&checked_layouts, g_hash_table_destroy);
+
   if (settings_desktop != NULL) {
     g_object_unref(settings_desktop);
   }
@@ -565,6 +756,7 @@ void msd_keyboard_xkb_shutdown(void) {
 
   if (xkl_registry) {
     g_object_unref(xkl_registry);
+    xkl_registry = NULL;
   }
 
   g_object_unref(xkl_engine);
@@ -31,6 +31,7 @@
 
 void msd_keyboard_xkb_init(MsdKeyboardManager* manager);
 void msd_keyboard_xkb_shutdown(void);
+void msd_keyboard_xkb_new_keyboard(int deviceid);
 
 typedef void (*PostActivationCallback)(void* userData);
 
@@ -0,0 +1,145 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Measures how long the volume OSD takes to render a frame while a
+ * volume key is held: the level changes on every frame and each frame
+ * is drawn the way the composited window draws it.  Then shows the OSD
+ * and counts how often it is repainted while it fades out, which should
+ * be never: the fade only changes the window opacity.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "msd-media-keys-window.h"
+
+/* Roughly three seconds of X key auto-repeat */
+#define N_FRAMES 100
+#define VOLUME_STEP 6
+
+static guint n_fade_draws;
+
+static gboolean count_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
+  n_fade_draws++;
+
+  return FALSE;
+}
+
+static gboolean start_counting(gpointer data) {
+  /* The first frame after mapping is not part of the fade */
+  n_fade_draws = 0;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void measure_fade(GtkWidget *window) {
+  GMainLoop *loop;
+  gint64 start;
+
+  loop = g_main_loop_new(NULL, FALSE);
+  g_signal_connect(window, "draw", G_CALLBACK(count_draw), NULL);
+  g_signal_connect_swapped(window, "hide", G_CALLBACK(g_main_loop_quit),
+                           loop);
+
+  gtk_widget_show(window);
+  msd_osd_window_update_and_hide(MSD_OSD_WINDOW(window));
+  g_timeout_add(500, start_counting, NULL);
+
+  start = g_get_monotonic_time();
+  g_main_loop_run(loop);
+
+  g_print("shown and faded out in %" G_GINT64_FORMAT " ms, %u repaint(s)\n",
+          (g_get_monotonic_time() - start) / 1000, n_fade_draws);
+
+  g_main_loop_unref(loop);
+}
+
+static void draw_frame(GtkWidget *window, cairo_surface_t *target) {
+  cairo_t *cr;
+
+  cr = cairo_create(target);
+
+  /* Exercise the backing surface too when we really are composited */
+  if (msd_osd_window_is_composited(MSD_OSD_WINDOW(window)))
+    gtk_widget_draw(window, cr);
+  else
+    g_signal_emit_by_name(window, "draw-when-composited", cr);
+
+  cairo_destroy(cr);
+}
+
+int main(int argc, char **argv) {
+  GError *error = NULL;
+  GtkWidget *window;
+  cairo_surface_t *target;
+  gint64 start, elapsed, first = 0, total = 0, worst = 0;
+  int width, height;
+  guint i, level = 0;
+
+  if (!gtk_init_with_args(&argc, &argv, NULL, NULL, NULL, &error)) {
+    fprintf(stderr, "%s", error->message);
+    g_error_free(error);
+    exit(1);
+  }
+
+  window = msd_media_keys_window_new();
+  msd_media_keys_window_set_action(MSD_MEDIA_KEYS_WINDOW(window),
+                                   MSD_MEDIA_KEYS_WINDOW_ACTION_VOLUME);
+  gtk_widget_realize(window);
+
+  gtk_window_get_size(GTK_WINDOW(window), &width, &height);
+  target = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+
+  for (i = 0; i < N_FRAMES; i++) {
+    level = (level + VOLUME_STEP) % 101;
+    msd_media_keys_window_set_volume_level(MSD_MEDIA_KEYS_WINDOW(window),
+                                           level);
+
+    start = g_get_monotonic_time();
+    draw_frame(window, target);
+    elapsed = g_get_monotonic_time() - start;
+
+    if (i == 0)
+      first = elapsed;
+    else
+      total += elapsed;
+    worst = MAX(worst, elapsed);
+  }
+
+  g_print("%dx%d %scomposited OSD, %d frames\n", width, height,
+          msd_osd_window_is_composited(MSD_OSD_WINDOW(window)) ? "" : "non-",
+          N_FRAMES);
+  g_print("first frame %" G_GINT64_FORMAT " us, then mean %" G_GINT64_FORMAT
+          " us, worst %" G_GINT64_FORMAT " us\n",
+          first, total / (N_FRAMES - 1), worst);
+
+  cairo_surface_destroy(target);
+
+  measure_fade(window);
+
+  gtk_widget_destroy(window);
+
+  return 0;
+}
@@ -57,12 +57,28 @@
 #define MSD_MEDIA_KEYS_DBUS_PATH MSD_DBUS_PATH "/MediaKeys"
 #define MSD_MEDIA_KEYS_DBUS_NAME MSD_DBUS_NAME ".MediaKeys"
 
+/* While a volume key is held, the mixer and the dialog are updated at
+ * most once per frame and the feedback sound plays at most once per
+ * VOLUME_FEEDBACK_INTERVAL */
+#define VOLUME_FRAME_INTERVAL 16     /* ms */
+#define VOLUME_FEEDBACK_INTERVAL 200 /* ms */
+
 #define TOUCHPAD_SCHEMA "org.mate.peripherals-touchpad"
 #define TOUCHPAD_ENABLED_KEY "touchpad-enabled"
 
 typedef struct {
+  MsdMediaKeysManager *manager;
   char *application;
   guint32 time;
+  /* Breaks ties between equal times in favour of the latest grab */
+  guint serial;
+
+  /* The bus name that grabbed the keys; they are released when it
+   * goes away */
+  char *owner;
+  guint watch_id;
+
+  guint heap_index;
 } MediaPlayer;
 
 struct _MsdMediaKeysManagerPrivate {
@@ -73,9 +89,23 @@ struct _MsdMediaKeysManagerPrivate {
   MateMixerStream *source_stream;
   MateMixerStreamControl *control;
   MateMixerStreamControl *source_control;
+
+  /* Key presses not yet written to pending_control */
+  MateMixerStreamControl *pending_control;
+  guint pending_volume;
+  gboolean pending_muted;
+  gboolean pending_quiet;
+  gboolean pending_is_mic;
+  gboolean pending_dirty;
+  guint volume_frame_id;
+  gint64 last_feedback_time;
 #endif
   GtkWidget *dialog;
   GSettings *settings;
+
+  /* Cached from settings */
+  gint volume_step;
+  gboolean enable_osd;
   GVolumeMonitor *volume_monitor;
 
   /* Multihead stuff */
@@ -87,7 +117,11 @@ struct _MsdMediaKeysManagerPrivate {
   GDBusProxy *rfkill_proxy;
   GCancellable *rfkill_cancellable;
 
-  GList *media_players;
+  /* Application name to MediaPlayer, and the same players in a heap
+   * with the one receiving the keys on top */
+  GHashTable *media_players;
+  GPtrArray *player_heap;
+  guint player_serial;
 
   DBusGConnection *connection;
   guint notify[HANDLED_KEYS];
@@ -284,6 +318,29 @@ static void update_kbd_cb(GSettings *settings, gchar *settings_key,
         "access the them.");
 }
 
+static void update_volume_step(MsdMediaKeysManager *manager) {
+  gint volume_step;
+
+  volume_step = g_settings_get_int(manager->priv->settings, "volume-step");
+  if (volume_step <= 0 || volume_step > 100) {
+    GVariant *variant =
+        g_settings_get_default_value(manager->priv->settings, "volume-step");
+    gint32 volume_step_default = g_variant_get_int32(variant);
+    volume_step = (gint)volume_step_default;
+    g_variant_unref(variant);
+  }
+
+  manager->priv->volume_step = volume_step;
+}
+
+static void settings_changed_cb(GSettings *settings, const gchar *settings_key,
+                                MsdMediaKeysManager *manager) {
+  if (g_strcmp0(settings_key, "volume-step") == 0)
+    update_volume_step(manager);
+  else if (g_strcmp0(settings_key, "enable-osd") == 0)
+    manager->priv->enable_osd = g_settings_get_boolean(settings, "enable-osd");
+}
+
 static void init_kbd(MsdMediaKeysManager *manager) {
   int i;
   GdkDisplay *dpy;
@@ -378,7 +435,7 @@ static void dialog_show(MsdMediaKeysManager *manager) {
                         manager->priv->current_screen);
 
   /* Return if OSD notifications are disabled */
-  if (!g_settings_get_boolean(manager->priv->settings, "enable-osd")) return;
+  if (!manager->priv->enable_osd) return;
 
   /*
    * get the window size
@@ -599,54 +656,132 @@ static void update_dialog(MsdMediaKeysManager *manager, guint volume,
 
 #ifdef HAVE_LIBCANBERRA
   if (quiet == FALSE && sound_changed != FALSE && muted == FALSE &&
-      is_mic == FALSE)
-    ca_gtk_play_for_widget(
-        manager->priv->dialog, 0, CA_PROP_EVENT_ID, "audio-volume-change",
-        CA_PROP_EVENT_DESCRIPTION, "Volume changed through key press",
-        CA_PROP_APPLICATION_NAME, PACKAGE_NAME, CA_PROP_APPLICATION_VERSION,
-        PACKAGE_VERSION, CA_PROP_APPLICATION_ID, "org.mate.SettingsDaemon",
-        NULL);
+      is_mic == FALSE) {
+    gint64 now = g_get_monotonic_time();
+
+    if (now - manager->priv->last_feedback_time >=
+        VOLUME_FEEDBACK_INTERVAL * 1000) {
+      manager->priv->last_feedback_time = now;
+      ca_gtk_play_for_widget(
+          manager->priv->dialog, 0, CA_PROP_EVENT_ID, "audio-volume-change",
+          CA_PROP_EVENT_DESCRIPTION, "Volume changed through key press",
+          CA_PROP_APPLICATION_NAME, PACKAGE_NAME, CA_PROP_APPLICATION_VERSION,
+          PACKAGE_VERSION, CA_PROP_APPLICATION_ID, "org.mate.SettingsDaemon",
+          NULL);
+    }
+  }
 #endif
 }
 
+/* Writes the accumulated key presses to the mixer in one go */
+static void flush_volume(MsdMediaKeysManager *manager) {
+  MsdMediaKeysManagerPrivate *priv = manager->priv;
+  MateMixerStreamControl *control = priv->pending_control;
+  gboolean muted, muted_last;
+  gboolean sound_changed = FALSE;
+  guint volume, volume_last;
+  guint volume_min, volume_max;
+
+  volume_min = mate_mixer_stream_control_get_min_volume(control);
+  volume_max = mate_mixer_stream_control_get_normal_volume(control);
+
+  volume = priv->pending_volume;
+  muted = priv->pending_muted;
+  volume_last = mate_mixer_stream_control_get_volume(control);
+  muted_last = mate_mixer_stream_control_get_mute(control);
+
+  if (muted != muted_last) {
+    if (mate_mixer_stream_control_set_mute(control, muted))
+      sound_changed = TRUE;
+    else
+      muted = muted_last;
+  }
+
+  if (volume != volume_last) {
+    if (mate_mixer_stream_control_set_volume(control, volume))
+      sound_changed = TRUE;
+    else
+      volume = volume_last;
+  }
+
+  /* Further presses build on what the mixer really took */
+  priv->pending_volume = volume;
+  priv->pending_muted = muted;
+  priv->pending_dirty = FALSE;
+
+  update_dialog(manager, MIN(100 * volume / (volume_max - volume_min), 100),
+                muted, sound_changed, priv->pending_quiet,
+                priv->pending_is_mic);
+
+  priv->pending_quiet = TRUE;
+}
+
+static gboolean volume_frame_cb(MsdMediaKeysManager *manager) {
+  MsdMediaKeysManagerPrivate *priv = manager->priv;
+
+  if (priv->pending_dirty) {
+    flush_volume(manager);
+    return G_SOURCE_CONTINUE;
+  }
+
+  /* The key was released; start from the mixer's state next time, it
+   * may be changed by others in the meantime */
+  priv->volume_frame_id = 0;
+  g_clear_object(&priv->pending_control);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void cancel_pending_volume(MsdMediaKeysManager *manager) {
+  if (manager->priv->volume_frame_id != 0) {
+    g_source_remove(manager->priv->volume_frame_id);
+    manager->priv->volume_frame_id = 0;
+  }
+
+  manager->priv->pending_dirty = FALSE;
+  g_clear_object(&manager->priv->pending_control);
+}
+
 static void do_sound_action(MsdMediaKeysManager *manager, int type,
                             gboolean quiet) {
+  MsdMediaKeysManagerPrivate *priv = manager->priv;
   gboolean muted;
-  gboolean muted_last;
-  gboolean sound_changed = FALSE;
   guint volume;
   guint volume_min, volume_max;
-  gint volume_step;
   guint volume_step_scaled;
-  guint volume_last;
   MateMixerStreamControl *control;
 
   gboolean is_input_control = type == MIC_MUTE_KEY ? TRUE : FALSE;
   if (is_input_control)
-    control = manager->priv->source_control;
+    control = priv->source_control;
   else
-    control = manager->priv->control;
+    control = priv->control;
   if (control == NULL) return;
 
+  /* Presses for another control are not merged with the pending ones */
+  if (priv->pending_control != NULL && priv->pending_control != control) {
+    if (priv->pending_dirty) flush_volume(manager);
+    cancel_pending_volume(manager);
+  }
+
   /* Theoretically the volume limits might be different for different
    * streams, also the minimum might not always start at 0 */
   volume_min = mate_mixer_stream_control_get_min_volume(control);
   volume_max = mate_mixer_stream_control_get_normal_volume(control);
 
-  volume_step = g_settings_get_int(manager->priv->settings, "volume-step");
-  if (volume_step <= 0 || volume_step > 100) {
-    GVariant *variant =
-        g_settings_get_default_value(manager->priv->settings, "volume-step");
-    gint32 volume_step_default = g_variant_get_int32(variant);
-    volume_step = (gint)volume_step_default;
-    g_variant_unref(variant);
-  }
-
   /* Scale the volume step size accordingly to the range used by the control */
-  volume_step_scaled = (volume_max - volume_min) * (guint)volume_step / 100;
+  volume_step_scaled =
+      (volume_max - volume_min) * (guint)priv->volume_step / 100;
+
+  if (priv->pending_control == NULL) {
+    priv->pending_control = g_object_ref(control);
+    priv->pending_volume = mate_mixer_stream_control_get_volume(control);
+    priv->pending_muted = mate_mixer_stream_control_get_mute(control);
+    priv->pending_quiet = TRUE;
+  }
 
-  volume = volume_last = mate_mixer_stream_control_get_volume(control);
-  muted = muted_last = mate_mixer_stream_control_get_mute(control);
+  volume = priv->pending_volume;
+  muted = priv->pending_muted;
 
   switch (type) {
     case MUTE_KEY:
@@ -671,22 +806,19 @@ static void do_sound_action(MsdMediaKeysManager *manager, int type,
       break;
   }
 
-  if (muted != muted_last) {
-    if (mate_mixer_stream_control_set_mute(control, muted))
-      sound_changed = TRUE;
-    else
-      muted = muted_last;
-  }
-
-  if (volume != mate_mixer_stream_control_get_volume(control)) {
-    if (mate_mixer_stream_control_set_volume(control, volume))
-      sound_changed = TRUE;
-    else
-      volume = volume_last;
+  priv->pending_volume = volume;
+  priv->pending_muted = muted;
+  priv->pending_quiet = priv->pending_quiet && quiet;
+  priv->pending_is_mic = is_input_control;
+  priv->pending_dirty = TRUE;
+
+  /* The first press goes out right away, repeats within the same frame
+   * wait for the frame to end */
+  if (priv->volume_frame_id == 0) {
+    flush_volume(manager);
+    priv->volume_frame_id = g_timeout_add(
+        VOLUME_FRAME_INTERVAL, (GSourceFunc)volume_frame_cb, manager);
   }
-
-  update_dialog(manager, MIN(100 * volume / (volume_max - volume_min), 100),
-                muted, sound_changed, quiet, is_input_control);
 }
 
 static void update_default_output(MsdMediaKeysManager *manager) {
@@ -916,12 +1048,81 @@ static void do_display_osd_action(MsdMediaKeysManager *manager) {
   dialog_show(manager);
 }
 
-static gint find_by_application(gconstpointer a, gconstpointer b) {
-  return strcmp(((MediaPlayer *)a)->application, b);
+static gboolean media_player_before(MediaPlayer *a, MediaPlayer *b) {
+  if (a->time != b->time) return a->time > b->time;
+
+  return a->serial > b->serial;
+}
+
+static void player_heap_swap(GPtrArray *heap, guint i, guint j) {
+  MediaPlayer *tmp = heap->pdata[i];
+
+  heap->pdata[i] = heap->pdata[j];
+  heap->pdata[j] = tmp;
+  ((MediaPlayer *)heap->pdata[i])->heap_index = i;
+  ((MediaPlayer *)heap->pdata[j])->heap_index = j;
+}
+
+static void player_heap_sift_up(GPtrArray *heap, guint i) {
+  while (i > 0 &&
+         media_player_before(heap->pdata[i], heap->pdata[(i - 1) / 2])) {
+    player_heap_swap(heap, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void player_heap_sift_down(GPtrArray *heap, guint i) {
+  guint first;
+
+  for (;;) {
+    first = i;
+
+    if (2 * i + 1 < heap->len &&
+        media_player_before(heap->pdata[2 * i + 1], heap->pdata[first]))
+      first = 2 * i + 1;
+    if (2 * i + 2 < heap->len &&
+        media_player_before(heap->pdata[2 * i + 2], heap->pdata[first]))
+      first = 2 * i + 2;
+
+    if (first == i) break;
+
+    player_heap_swap(heap, i, first);
+    i = first;
+  }
 }
 
-static gint find_by_time(gconstpointer a, gconstpointer b) {
-  return ((MediaPlayer *)a)->time < ((MediaPlayer *)b)->time;
+static void player_heap_remove(GPtrArray *heap, MediaPlayer *player) {
+  guint i = player->heap_index;
+
+  player_heap_swap(heap, i, heap->len - 1);
+  g_ptr_array_remove_index(heap, heap->len - 1);
+
+  if (i < heap->len) {
+    player_heap_sift_up(heap, i);
+    player_heap_sift_down(heap, i);
+  }
+}
+
+static void media_player_free(MediaPlayer *player) {
+  if (player->watch_id != 0) g_bus_unwatch_name(player->watch_id);
+  g_free(player->application);
+  g_free(player->owner);
+  g_free(player);
+}
+
+static void remove_media_player(MsdMediaKeysManager *manager,
+                                MediaPlayer *player) {
+  player_heap_remove(manager->priv->player_heap, player);
+  /* Frees the player */
+  g_hash_table_remove(manager->priv->media_players, player->application);
+}
+
+static void media_player_vanished_cb(GDBusConnection *connection,
+                                     const gchar *name, gpointer user_data) {
+  MediaPlayer *player = user_data;
+
+  g_debug("%s went away, deregistering %s", name, player->application);
+  remove_media_player(player->manager, player);
 }
 
 /*
@@ -931,73 +1132,106 @@ static gint find_by_time(gconstpointer a, gconstpointer b) {
  * may want to register with a lower priority (usually 1), to grab
  * events only nobody is interested.
  */
-gboolean msd_media_keys_manager_grab_media_player_keys(
+void msd_media_keys_manager_grab_media_player_keys(
     MsdMediaKeysManager *manager, const char *application, guint32 time,
-    GError **error) {
-  GList *iter;
+    DBusGMethodInvocation *context) {
   MediaPlayer *media_player;
+  char *owner;
 
   if (time == GDK_CURRENT_TIME) {
     time = (guint32)(g_get_monotonic_time() / 1000);
   }
 
-  iter = g_list_find_custom(manager->priv->media_players, application,
-                            find_by_application);
+  media_player = g_hash_table_lookup(manager->priv->media_players, application);
 
-  if (iter != NULL) {
-    if (((MediaPlayer *)iter->data)->time < time) {
-      g_free(((MediaPlayer *)iter->data)->application);
-      g_free(iter->data);
-      manager->priv->media_players =
-          g_list_delete_link(manager->priv->media_players, iter);
+  if (media_player != NULL) {
+    if (media_player->time < time) {
+      remove_media_player(manager, media_player);
     } else {
-      return TRUE;
+      dbus_g_method_return(context);
+      return;
     }
   }
 
+  owner = dbus_g_method_get_sender(context);
+
   g_debug("Registering %s at %u", application, time);
   media_player = g_new0(MediaPlayer, 1);
+  media_player->manager = manager;
   media_player->application = g_strdup(application);
   media_player->time = time;
+  media_player->serial = manager->priv->player_serial++;
+  media_player->owner = owner;
 
-  manager->priv->media_players = g_list_insert_sorted(
-      manager->priv->media_players, media_player, find_by_time);
+  g_hash_table_insert(manager->priv->media_players, media_player->application,
+                      media_player);
 
-  return TRUE;
+  media_player->heap_index = manager->priv->player_heap->len;
+  g_ptr_array_add(manager->priv->player_heap, media_player);
+  player_heap_sift_up(manager->priv->player_heap, media_player->heap_index);
+
+  /* Unique names are the same on every connection to the bus */
+  if (owner != NULL)
+    media_player->watch_id = g_bus_watch_name(
+        G_BUS_TYPE_SESSION, owner, G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
+        media_player_vanished_cb, media_player, NULL);
+
+  dbus_g_method_return(context);
 }
 
 gboolean msd_media_keys_manager_release_media_player_keys(
     MsdMediaKeysManager *manager, const char *application, GError **error) {
-  GList *iter;
+  MediaPlayer *media_player;
 
-  iter = g_list_find_custom(manager->priv->media_players, application,
-                            find_by_application);
+  media_player = g_hash_table_lookup(manager->priv->media_players, application);
 
-  if (iter != NULL) {
+  if (media_player != NULL) {
     g_debug("Deregistering %s", application);
-    g_free(((MediaPlayer *)iter->data)->application);
-    g_free(iter->data);
-    manager->priv->media_players =
-        g_list_delete_link(manager->priv->media_players, iter);
+    remove_media_player(manager, media_player);
   }
 
   return TRUE;
 }
 
+/* Only the player that grabbed the keys last gets the key press, so
+ * the D-Bus signal is addressed to its unique name rather than
+ * broadcast to every player on the bus.
+ */
+static void send_media_player_key_pressed(MsdMediaKeysManager *manager,
+                                          MediaPlayer *player,
+                                          const char *key) {
+  DBusMessage *message;
+
+  if (manager->priv->connection == NULL || player->owner == NULL) return;
+
+  message = dbus_message_new_signal(MSD_MEDIA_KEYS_DBUS_PATH,
+                                    MSD_MEDIA_KEYS_DBUS_NAME,
+                                    "MediaPlayerKeyPressed");
+  if (message == NULL) return;
+
+  dbus_message_set_destination(message, player->owner);
+  dbus_message_append_args(message, DBUS_TYPE_STRING, &player->application,
+                           DBUS_TYPE_STRING, &key, DBUS_TYPE_INVALID);
+  dbus_connection_send(
+      dbus_g_connection_get_connection(manager->priv->connection), message,
+      NULL);
+  dbus_message_unref(message);
+}
+
 static gboolean msd_media_player_key_pressed(MsdMediaKeysManager *manager,
                                              const char *key) {
-  const char *application = NULL;
+  MediaPlayer *player = NULL;
   gboolean have_listeners;
 
-  have_listeners = (manager->priv->media_players != NULL);
+  have_listeners = (manager->priv->player_heap->len > 0);
 
   if (have_listeners) {
-    application =
-        ((MediaPlayer *)manager->priv->media_players->data)->application;
+    player = manager->priv->player_heap->pdata[0];
+    send_media_player_key_pressed(manager, player, key);
   }
 
-  g_signal_emit(manager, signals[MEDIA_PLAYER_KEY_PRESSED], 0, application,
-                key);
+  g_signal_emit(manager, signals[MEDIA_PLAYER_KEY_PRESSED], 0,
+                player != NULL ? player->application : NULL, key);
 
   return !have_listeners;
 }
@@ -1255,6 +1489,15 @@ static gboolean start_media_keys_idle_cb(MsdMediaKeysManager *manager) {
   manager->priv->volume_monitor = g_volume_monitor_get();
   manager->priv->settings = g_settings_new(BINDING_SCHEMA);
 
+  /* Held volume keys consult these on every repeat */
+  g_signal_connect(manager->priv->settings, "changed::volume-step",
+                   G_CALLBACK(settings_changed_cb), manager);
+  g_signal_connect(manager->priv->settings, "changed::enable-osd",
+                   G_CALLBACK(settings_changed_cb), manager);
+  update_volume_step(manager);
+  manager->priv->enable_osd =
+      g_settings_get_boolean(manager->priv->settings, "enable-osd");
+
   ensure_cancellable(&manager->priv->rfkill_cancellable);
 
   init_screens(manager);
@@ -1329,7 +1572,6 @@ void msd_media_keys_manager_stop(MsdMediaKeysManager *manager) {
   MsdMediaKeysManagerPrivate *priv = manager->priv;
   GdkDisplay *dpy;
   GSList *ls;
-  GList *l;
   int i;
   gboolean need_flush;
 
@@ -1355,11 +1597,6 @@ void msd_media_keys_manager_stop(MsdMediaKeysManager *manager) {
     priv->volume_monitor = NULL;
   }
 
-  if (priv->connection != NULL) {
-    dbus_g_connection_unref(priv->connection);
-    priv->connection = NULL;
-  }
-
   need_flush = FALSE;
   dpy = gdk_display_get_default();
   gdk_x11_display_error_trap_push(dpy);
@@ -1388,6 +1625,7 @@ void msd_media_keys_manager_stop(MsdMediaKeysManager *manager) {
   }
 
 #ifdef HAVE_LIBMATEMIXER
+  cancel_pending_volume(manager);
   g_clear_object(&priv->stream);
   g_clear_object(&priv->source_stream);
   g_clear_object(&priv->control);
@@ -1400,22 +1638,23 @@ void msd_media_keys_manager_stop(MsdMediaKeysManager *manager) {
     priv->dialog = NULL;
   }
 
-  for (l = priv->media_players; l; l = l->next) {
-    MediaPlayer *mp = l->data;
-    g_free(mp->application);
-    g_free(mp);
-  }
-  g_list_free(priv->media_players);
-  priv->media_players = NULL;
+  g_ptr_array_set_size(priv->player_heap, 0);
+  g_hash_table_remove_all(priv->media_players);
 }
 
+static void msd_media_keys_manager_finalize(GObject *object);
+
 static void msd_media_keys_manager_class_init(MsdMediaKeysManagerClass *klass) {
+  GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
   signals[MEDIA_PLAYER_KEY_PRESSED] = g_signal_new(
       "media-player-key-pressed", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST,
       G_STRUCT_OFFSET(MsdMediaKeysManagerClass, media_player_key_pressed), NULL,
       NULL, msd_marshal_VOID__STRING_STRING, G_TYPE_NONE, 2, G_TYPE_STRING,
       G_TYPE_STRING);
 
+  object_class->finalize = msd_media_keys_manager_finalize;
+
   dbus_g_object_type_install_info(
       MSD_TYPE_MEDIA_KEYS_MANAGER,
       &dbus_glib_msd_media_keys_manager_object_info);
@@ -1423,6 +1662,25 @@ static void msd_media_keys_manager_class_init(MsdMediaKeysManagerClass *klass) {
 
 static void msd_media_keys_manager_init(MsdMediaKeysManager *manager) {
   manager->priv = msd_media_keys_manager_get_instance_private(manager);
+
+  manager->priv->media_players = g_hash_table_new_full(
+      g_str_hash, g_str_equal, NULL, (GDestroyNotify)media_player_free);
+  manager->priv->player_heap = g_ptr_array_new();
+}
+
+static void msd_media_keys_manager_finalize(GObject *object) {
+  MsdMediaKeysManagerPrivate *priv = MSD_MEDIA_KEYS_MANAGER(object)->priv;
+
+  g_ptr_array_unref(priv->player_heap);
+  g_hash_table_destroy(priv->media_players);
+
+  /* taken when the object was registered, not on start */
+  if (priv->connection != NULL) {
+    dbus_g_connection_unref(priv->connection);
+    priv->connection = NULL;
+  }
+
+  G_OBJECT_CLASS(msd_media_keys_manager_parent_class)->finalize(object);
 }
 
 static gboolean register_manager(MsdMediaKeysManager *manager) {
@@ -23,6 +23,7 @@
 #ifndef __MSD_MEDIA_KEYS_MANAGER_H
 #define __MSD_MEDIA_KEYS_MANAGER_H
 
+#include <dbus/dbus-glib.h>
 #include <glib-object.h>
 #include <glib.h>
 
@@ -65,9 +66,9 @@ gboolean msd_media_keys_manager_start(MsdMediaKeysManager *manager,
                                       GError **error);
 void msd_media_keys_manager_stop(MsdMediaKeysManager *manager);
 
-gboolean msd_media_keys_manager_grab_media_player_keys(
+void msd_media_keys_manager_grab_media_player_keys(
     MsdMediaKeysManager *manager, const char *application, guint32 time,
-    GError **error);
+    DBusGMethodInvocation *context);
 gboolean msd_media_keys_manager_release_media_player_keys(
     MsdMediaKeysManager *manager, const char *application, GError **error);
 
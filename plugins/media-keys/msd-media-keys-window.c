@@ -50,6 +50,12 @@ struct MsdMediaKeysWindowPrivate {
   GtkImage *image;
   GtkWidget *progress;
   GtkWidget *label;
+
+  /* "name:size:scale" to the rendered icon, or to NULL when the theme
+   * has no such icon. Emptied whenever icon_theme changes. */
+  GHashTable *icon_cache;
+  GtkIconTheme *icon_theme;
+  gulong icon_theme_changed_id;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(MsdMediaKeysWindow, msd_media_keys_window,
@@ -231,22 +237,65 @@ void msd_media_keys_window_set_volume_level(MsdMediaKeysWindow *window,
   }
 }
 
-static GdkPixbuf *load_pixbuf(MsdMediaKeysWindow *window, const char *name,
-                              int icon_size) {
+static void icon_theme_changed_cb(GtkIconTheme *theme,
+                                  MsdMediaKeysWindow *window) {
+  g_hash_table_remove_all(window->priv->icon_cache);
+}
+
+static void set_icon_theme(MsdMediaKeysWindow *window, GtkIconTheme *theme) {
+  if (window->priv->icon_theme == theme) return;
+
+  if (window->priv->icon_theme != NULL) {
+    g_signal_handler_disconnect(window->priv->icon_theme,
+                                window->priv->icon_theme_changed_id);
+    g_object_unref(window->priv->icon_theme);
+    window->priv->icon_theme_changed_id = 0;
+    window->priv->icon_theme = NULL;
+  }
+
+  g_hash_table_remove_all(window->priv->icon_cache);
+
+  if (theme != NULL) {
+    window->priv->icon_theme = g_object_ref(theme);
+    window->priv->icon_theme_changed_id = g_signal_connect(
+        theme, "changed", G_CALLBACK(icon_theme_changed_cb), window);
+  }
+}
+
+/* Returns the icon rendered at @icon_size for the window's scale factor,
+ * owned by the window's icon cache. Held keys redraw the window many
+ * times a second, so icons are only looked up and rasterized once. */
+static cairo_surface_t *load_icon_surface(MsdMediaKeysWindow *window,
+                                          const char *name, int icon_size) {
   GtkIconTheme *theme;
-  GdkPixbuf *pixbuf;
+  cairo_surface_t *surface;
+  int scale;
+  char *key;
 
-  if (window != NULL && gtk_widget_has_screen(GTK_WIDGET(window))) {
+  if (gtk_widget_has_screen(GTK_WIDGET(window))) {
     theme = gtk_icon_theme_get_for_screen(
         gtk_widget_get_screen(GTK_WIDGET(window)));
   } else {
     theme = gtk_icon_theme_get_default();
   }
 
-  pixbuf = gtk_icon_theme_load_icon(theme, name, icon_size,
-                                    GTK_ICON_LOOKUP_FORCE_SIZE, NULL);
+  set_icon_theme(window, theme);
+
+  scale = gtk_widget_get_scale_factor(GTK_WIDGET(window));
+  key = g_strdup_printf("%s:%d:%d", name, icon_size, scale);
 
-  return pixbuf;
+  if (g_hash_table_lookup_extended(window->priv->icon_cache, key, NULL,
+                                   (gpointer *)&surface)) {
+    g_free(key);
+    return surface;
+  }
+
+  surface = gtk_icon_theme_load_surface(theme, name, icon_size, scale, NULL,
+                                        GTK_ICON_LOOKUP_FORCE_SIZE, NULL);
+
+  g_hash_table_insert(window->priv->icon_cache, key, surface);
+
+  return surface;
 }
 
 static void draw_eject(cairo_t *cr, double _x0, double _y0, double width,
@@ -364,7 +413,7 @@ static void draw_speaker(cairo_t *cr, double cx, double cy, double width,
 static gboolean render_speaker(MsdMediaKeysWindow *window, cairo_t *cr,
                                double _x0, double _y0, double width,
                                double height) {
-  GdkPixbuf *pixbuf;
+  cairo_surface_t *surface;
   int icon_size;
   guint n;
   static const char *icon_names[] = {"audio-volume-muted",
@@ -404,17 +453,15 @@ static gboolean render_speaker(MsdMediaKeysWindow *window, cairo_t *cr,
 
   icon_size = (int)width;
 
-  pixbuf = load_pixbuf(window, icon_names[n], icon_size);
+  surface = load_icon_surface(window, icon_names[n], icon_size);
 
-  if (pixbuf == NULL) {
+  if (surface == NULL) {
     return FALSE;
   }
 
-  gdk_cairo_set_source_pixbuf(cr, pixbuf, _x0, _y0);
+  cairo_set_source_surface(cr, surface, _x0, _y0);
   cairo_paint_with_alpha(cr, MSD_OSD_WINDOW_FG_ALPHA);
 
-  g_object_unref(pixbuf);
-
   return TRUE;
 }
 
@@ -539,29 +586,27 @@ static void draw_action_volume(MsdMediaKeysWindow *window, cairo_t *cr) {
 static gboolean render_custom(MsdMediaKeysWindow *window, cairo_t *cr,
                               double _x0, double _y0, double width,
                               double height) {
-  GdkPixbuf *pixbuf;
+  cairo_surface_t *surface;
   int icon_size;
 
   icon_size = (int)width;
 
-  pixbuf = load_pixbuf(window, window->priv->icon_name, icon_size);
+  surface = load_icon_surface(window, window->priv->icon_name, icon_size);
 
-  if (pixbuf == NULL) {
+  if (surface == NULL) {
     char *name;
     if (gtk_widget_get_direction(GTK_WIDGET(window)) == GTK_TEXT_DIR_RTL)
       name = g_strdup_printf("%s-rtl", window->priv->icon_name);
     else
       name = g_strdup_printf("%s-ltr", window->priv->icon_name);
-    pixbuf = load_pixbuf(window, name, icon_size);
+    surface = load_icon_surface(window, name, icon_size);
     g_free(name);
-    if (pixbuf == NULL) return FALSE;
+    if (surface == NULL) return FALSE;
   }
 
-  gdk_cairo_set_source_pixbuf(cr, pixbuf, _x0, _y0);
+  cairo_set_source_surface(cr, surface, _x0, _y0);
   cairo_paint_with_alpha(cr, MSD_OSD_WINDOW_FG_ALPHA);
 
-  g_object_unref(pixbuf);
-
   return TRUE;
 }
 
@@ -617,9 +662,23 @@ static void msd_media_keys_window_draw_when_composited(MsdOsdWindow *osd_window,
   }
 }
 
+static void msd_media_keys_window_finalize(GObject *object) {
+  MsdMediaKeysWindow *window = MSD_MEDIA_KEYS_WINDOW(object);
+
+  set_icon_theme(window, NULL);
+  g_hash_table_destroy(window->priv->icon_cache);
+  g_free(window->priv->icon_name);
+  g_free(window->priv->description);
+
+  G_OBJECT_CLASS(msd_media_keys_window_parent_class)->finalize(object);
+}
+
 static void msd_media_keys_window_class_init(MsdMediaKeysWindowClass *klass) {
+  GObjectClass *object_class = G_OBJECT_CLASS(klass);
   MsdOsdWindowClass *osd_window_class = MSD_OSD_WINDOW_CLASS(klass);
 
+  object_class->finalize = msd_media_keys_window_finalize;
+
   osd_window_class->draw_when_composited =
       msd_media_keys_window_draw_when_composited;
 }
@@ -627,6 +686,10 @@ static void msd_media_keys_window_class_init(MsdMediaKeysWindowClass *klass) {
 static void msd_media_keys_window_init(MsdMediaKeysWindow *window) {
   window->priv = msd_media_keys_window_get_instance_private(window);
 
+  window->priv->icon_cache =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                            (GDestroyNotify)cairo_surface_destroy);
+
   if (!msd_osd_window_is_composited(MSD_OSD_WINDOW(window))) {
     GtkBuilder *builder;
     const gchar *objects[] = {"acme_box", NULL};
@@ -35,6 +35,43 @@
 #include "mate-settings-profile.h"
 #include "rfkill-glib.h"
 
+/* Upper bound on the number of killswitches tracked at once; rfkill
+ * indexes keep growing as devices come and go, so they are folded
+ * into this table rather than used directly */
+#define MAX_KILLSWITCHES 64
+
+typedef struct {
+  guint32 idx;
+  guint8 type;
+  guint8 state;
+  guint8 in_use;
+} MsdRfkillKillswitch;
+
+/* Running totals kept in sync with the killswitch table, so that
+ * none of the airplane mode queries has to walk it */
+typedef struct {
+  guint n_killswitches;
+  guint n_unblocked;
+  guint n_hard_blocked;
+} MsdRfkillCounters;
+
+typedef enum {
+  PROP_AIRPLANE_MODE = 0,
+  PROP_HARDWARE_AIRPLANE_MODE,
+  PROP_HAS_AIRPLANE_MODE,
+  PROP_SHOULD_SHOW_AIRPLANE_MODE,
+  PROP_BLUETOOTH_AIRPLANE_MODE,
+  PROP_BLUETOOTH_HARDWARE_AIRPLANE_MODE,
+  PROP_BLUETOOTH_HAS_AIRPLANE_MODE,
+  N_PROPS
+} MsdRfkillProperty;
+
+static const char *property_names[N_PROPS] = {
+    "AirplaneMode",          "HardwareAirplaneMode",
+    "HasAirplaneMode",       "ShouldShowAirplaneMode",
+    "BluetoothAirplaneMode", "BluetoothHardwareAirplaneMode",
+    "BluetoothHasAirplaneMode"};
+
 struct MsdRfkillManagerPrivate {
   GDBusNodeInfo *introspection_data;
   guint name_id;
@@ -42,8 +79,17 @@ struct MsdRfkillManagerPrivate {
   GCancellable *cancellable;
 
   CcRfkillGlib *rfkill;
-  GHashTable *killswitches;
-  GHashTable *bt_killswitches;
+  /* Set by test-rfkill only; NULL means /dev/rfkill */
+  char *rfkill_device;
+  MsdRfkillKillswitch killswitches[MAX_KILLSWITCHES];
+  MsdRfkillCounters counters;
+  MsdRfkillCounters bt_counters;
+
+  /* Property values last sent out in PropertiesChanged, one bit per
+     MsdRfkillProperty; nothing is cached until the first emission */
+  guint published_props;
+  gboolean props_published;
+  guint props_changed_id;
 
   /* In addition to using the rfkill kernel subsystem
      (which is exposed by wlan, wimax, bluetooth, nfc,
@@ -99,90 +145,49 @@ static void msd_rfkill_manager_init(MsdRfkillManager *manager) {
   manager->priv = msd_rfkill_manager_get_instance_private(manager);
 }
 
-static gboolean engine_get_airplane_mode_helper(GHashTable *killswitches) {
-  GHashTableIter iter;
-  gpointer key, value;
-
-  if (g_hash_table_size(killswitches) == 0) return FALSE;
-
-  g_hash_table_iter_init(&iter, killswitches);
-  while (g_hash_table_iter_next(&iter, &key, &value)) {
-    int state;
-
-    state = GPOINTER_TO_INT(value);
-
-    /* A single rfkill switch that's unblocked? Airplane mode is off */
-    if (state == RFKILL_STATE_UNBLOCKED) return FALSE;
-  }
+static gboolean engine_get_airplane_mode_helper(
+    const MsdRfkillCounters *counters) {
+  /* A single rfkill switch that's unblocked? Airplane mode is off */
+  return counters->n_killswitches > 0 && counters->n_unblocked == 0;
+}
 
-  return TRUE;
+static gboolean engine_get_hardware_airplane_mode_helper(
+    const MsdRfkillCounters *counters) {
+  /* If we have no killswitches, hw airplane mode is off. A single rfkill
+     switch that's not hw blocked? Hw airplane mode is off */
+  return counters->n_killswitches > 0 &&
+         counters->n_hard_blocked == counters->n_killswitches;
 }
 
 static gboolean engine_get_bluetooth_airplane_mode(MsdRfkillManager *manager) {
-  return engine_get_airplane_mode_helper(manager->priv->bt_killswitches);
+  return engine_get_airplane_mode_helper(&manager->priv->bt_counters);
 }
 
 static gboolean engine_get_bluetooth_hardware_airplane_mode(
     MsdRfkillManager *manager) {
-  GHashTableIter iter;
-  gpointer key, value;
-
-  /* If we have no killswitches, hw airplane mode is off. */
-  if (g_hash_table_size(manager->priv->bt_killswitches) == 0) return FALSE;
-
-  g_hash_table_iter_init(&iter, manager->priv->bt_killswitches);
-  while (g_hash_table_iter_next(&iter, &key, &value)) {
-    int state;
-
-    state = GPOINTER_TO_INT(value);
-
-    /* A single rfkill switch that's not hw blocked? Hw airplane mode is off */
-    if (state != RFKILL_STATE_HARD_BLOCKED) {
-      return FALSE;
-    }
-  }
-
-  return TRUE;
+  return engine_get_hardware_airplane_mode_helper(&manager->priv->bt_counters);
 }
 
 static gboolean engine_get_has_bluetooth_airplane_mode(
     MsdRfkillManager *manager) {
-  return (g_hash_table_size(manager->priv->bt_killswitches) > 0);
+  return (manager->priv->bt_counters.n_killswitches > 0);
 }
 
 static gboolean engine_get_airplane_mode(MsdRfkillManager *manager) {
   if (!manager->priv->wwan_interesting)
-    return engine_get_airplane_mode_helper(manager->priv->killswitches);
+    return engine_get_airplane_mode_helper(&manager->priv->counters);
   /* wwan enabled? then airplane mode is off (because an USB modem
      could be on in this state) */
-  return engine_get_airplane_mode_helper(manager->priv->killswitches) &&
+  return engine_get_airplane_mode_helper(&manager->priv->counters) &&
          !manager->priv->wwan_enabled;
 }
 
 static gboolean engine_get_hardware_airplane_mode(MsdRfkillManager *manager) {
-  GHashTableIter iter;
-  gpointer key, value;
-
-  /* If we have no killswitches, hw airplane mode is off. */
-  if (g_hash_table_size(manager->priv->killswitches) == 0) return FALSE;
-
-  g_hash_table_iter_init(&iter, manager->priv->killswitches);
-  while (g_hash_table_iter_next(&iter, &key, &value)) {
-    int state;
-
-    state = GPOINTER_TO_INT(value);
-
-    /* A single rfkill switch that's not hw blocked? Hw airplane mode is off */
-    if (state != RFKILL_STATE_HARD_BLOCKED) {
-      return FALSE;
-    }
-  }
-
-  return TRUE;
+  return engine_get_hardware_airplane_mode_helper(&manager->priv->counters);
 }
 
 static gboolean engine_get_has_airplane_mode(MsdRfkillManager *manager) {
-  return (g_hash_table_size(manager->priv->killswitches) > 0) ||
+  return (manager->priv->counters.n_killswitches > 0) ||
          manager->priv->wwan_interesting;
 }
 
@@ -194,37 +199,64 @@ static gboolean engine_get_should_show_airplane_mode(
          (g_strcmp0(manager->priv->chassis_type, "container") != 0);
 }
 
-static void engine_properties_changed(MsdRfkillManager *manager) {
+static gboolean engine_get_property(MsdRfkillManager *manager,
+                                    MsdRfkillProperty prop) {
+  switch (prop) {
+    case PROP_AIRPLANE_MODE:
+      return engine_get_airplane_mode(manager);
+    case PROP_HARDWARE_AIRPLANE_MODE:
+      return engine_get_hardware_airplane_mode(manager);
+    case PROP_HAS_AIRPLANE_MODE:
+      return engine_get_has_airplane_mode(manager);
+    case PROP_SHOULD_SHOW_AIRPLANE_MODE:
+      return engine_get_should_show_airplane_mode(manager);
+    case PROP_BLUETOOTH_AIRPLANE_MODE:
+      return engine_get_bluetooth_airplane_mode(manager);
+    case PROP_BLUETOOTH_HARDWARE_AIRPLANE_MODE:
+      return engine_get_bluetooth_hardware_airplane_mode(manager);
+    case PROP_BLUETOOTH_HAS_AIRPLANE_MODE:
+      return engine_get_has_bluetooth_airplane_mode(manager);
+    default:
+      g_assert_not_reached();
+  }
+
+  return FALSE;
+}
+
+static gboolean engine_emit_properties_changed(MsdRfkillManager *manager) {
   GVariantBuilder props_builder;
   GVariant *props_changed = NULL;
+  guint props, changed;
+  int i;
+
+  manager->priv->props_changed_id = 0;
 
   /* not yet connected to the session bus */
-  if (manager->priv->connection == NULL) return;
+  if (manager->priv->connection == NULL) return G_SOURCE_REMOVE;
+
+  props = 0;
+  for (i = 0; i < N_PROPS; i++) {
+    if (engine_get_property(manager, i)) props |= 1 << i;
+  }
+
+  if (manager->priv->props_published)
+    changed = props ^ manager->priv->published_props;
+  else
+    changed = (1 << N_PROPS) - 1;
+
+  if (changed == 0) return G_SOURCE_REMOVE;
 
   g_variant_builder_init(&props_builder, G_VARIANT_TYPE("a{sv}"));
 
-  g_variant_builder_add(
-      &props_builder, "{sv}", "AirplaneMode",
-      g_variant_new_boolean(engine_get_airplane_mode(manager)));
-  g_variant_builder_add(
-      &props_builder, "{sv}", "HardwareAirplaneMode",
-      g_variant_new_boolean(engine_get_hardware_airplane_mode(manager)));
-  g_variant_builder_add(
-      &props_builder, "{sv}", "HasAirplaneMode",
-      g_variant_new_boolean(engine_get_has_airplane_mode(manager)));
-  g_variant_builder_add(
-      &props_builder, "{sv}", "ShouldShowAirplaneMode",
-      g_variant_new_boolean(engine_get_should_show_airplane_mode(manager)));
-  g_variant_builder_add(
-      &props_builder, "{sv}", "BluetoothAirplaneMode",
-      g_variant_new_boolean(engine_get_bluetooth_airplane_mode(manager)));
-  g_variant_builder_add(
-      &props_builder, "{sv}", "BluetoothHardwareAirplaneMode",
-      g_variant_new_boolean(
-          engine_get_bluetooth_hardware_airplane_mode(manager)));
-  g_variant_builder_add(
-      &props_builder, "{sv}", "BluetoothHasAirplaneMode",
-      g_variant_new_boolean(engine_get_has_bluetooth_airplane_mode(manager)));
+  for (i = 0; i < N_PROPS; i++) {
+    if (!(changed & (1 << i))) continue;
+
+    g_variant_builder_add(&props_builder, "{sv}", property_names[i],
+                          g_variant_new_boolean((props & (1 << i)) != 0));
+  }
+
+  manager->priv->published_props = props;
+  manager->priv->props_published = TRUE;
 
   props_changed = g_variant_new("(s@a{sv}@as)", MSD_RFKILL_DBUS_NAME,
                                 g_variant_builder_end(&props_builder),
@@ -234,15 +266,86 @@ static void engine_properties_changed(MsdRfkillManager *manager) {
                                 MSD_RFKILL_DBUS_PATH,
                                 "org.freedesktop.DBus.Properties",
                                 "PropertiesChanged", props_changed, NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* rfkill events tend to come in bursts (one per radio on a CHANGE_ALL,
+ * plus NetworkManager following up on WwanEnabled), so the values are
+ * only compared and published once the burst has been processed. */
+static void engine_properties_changed(MsdRfkillManager *manager) {
+  if (manager->priv->props_changed_id != 0) return;
+
+  manager->priv->props_changed_id = g_idle_add(
+      (GSourceFunc)engine_emit_properties_changed, manager);
+}
+
+static void counters_add(MsdRfkillCounters *counters, guint8 state) {
+  counters->n_killswitches++;
+  if (state == RFKILL_STATE_UNBLOCKED) counters->n_unblocked++;
+  if (state == RFKILL_STATE_HARD_BLOCKED) counters->n_hard_blocked++;
+}
+
+static void counters_remove(MsdRfkillCounters *counters, guint8 state) {
+  counters->n_killswitches--;
+  if (state == RFKILL_STATE_UNBLOCKED) counters->n_unblocked--;
+  if (state == RFKILL_STATE_HARD_BLOCKED) counters->n_hard_blocked--;
 }
 
-static void rfkill_changed(CcRfkillGlib *rfkill, GList *events,
+/* Returns the slot tracking @idx, or if there is none and @create is
+ * set, a free slot for it. Probing starts at the slot @idx folds to,
+ * which in practice is the one it lives in. */
+static MsdRfkillKillswitch *find_killswitch(MsdRfkillManager *manager,
+                                            guint32 idx, gboolean create) {
+  MsdRfkillKillswitch *free_slot = NULL;
+  guint i;
+
+  for (i = 0; i < MAX_KILLSWITCHES; i++) {
+    MsdRfkillKillswitch *killswitch;
+
+    killswitch = &manager->priv->killswitches[(idx + i) % MAX_KILLSWITCHES];
+
+    if (killswitch->in_use && killswitch->idx == idx) return killswitch;
+
+    if (!killswitch->in_use && free_slot == NULL) free_slot = killswitch;
+  }
+
+  return create ? free_slot : NULL;
+}
+
+static void killswitch_remove(MsdRfkillManager *manager,
+                              MsdRfkillKillswitch *killswitch) {
+  counters_remove(&manager->priv->counters, killswitch->state);
+  if (killswitch->type == RFKILL_TYPE_BLUETOOTH)
+    counters_remove(&manager->priv->bt_counters, killswitch->state);
+
+  killswitch->in_use = FALSE;
+}
+
+static void killswitch_set(MsdRfkillManager *manager,
+                           MsdRfkillKillswitch *killswitch, guint32 idx,
+                           guint8 type, guint8 state) {
+  if (killswitch->in_use) killswitch_remove(manager, killswitch);
+
+  killswitch->idx = idx;
+  killswitch->type = type;
+  killswitch->state = state;
+  killswitch->in_use = TRUE;
+
+  counters_add(&manager->priv->counters, state);
+  if (type == RFKILL_TYPE_BLUETOOTH)
+    counters_add(&manager->priv->bt_counters, state);
+}
+
+static void rfkill_changed(CcRfkillGlib *rfkill,
+                           const struct rfkill_event *events, guint n_events,
                            MsdRfkillManager *manager) {
-  GList *l;
+  MsdRfkillKillswitch *killswitch;
+  guint i;
   int value;
 
-  for (l = events; l != NULL; l = l->next) {
-    struct rfkill_event *event = l->data;
+  for (i = 0; i < n_events; i++) {
+    const struct rfkill_event *event = &events[i];
 
     switch (event->op) {
       case RFKILL_OP_ADD:
@@ -254,24 +357,21 @@ static void rfkill_changed(CcRfkillGlib *rfkill, GList *events,
         else
           value = RFKILL_STATE_UNBLOCKED;
 
-        g_hash_table_insert(manager->priv->killswitches,
-                            GINT_TO_POINTER(event->idx),
-                            GINT_TO_POINTER(value));
-        if (event->type == RFKILL_TYPE_BLUETOOTH)
-          g_hash_table_insert(manager->priv->bt_killswitches,
-                              GINT_TO_POINTER(event->idx),
-                              GINT_TO_POINTER(value));
+        killswitch = find_killswitch(manager, event->idx, TRUE);
+        if (killswitch == NULL) {
+          g_warning("Too many rfkill switches, ignoring ID %d", event->idx);
+          break;
+        }
+
+        killswitch_set(manager, killswitch, event->idx, event->type, value);
         g_debug("%s %srfkill with ID %d",
                 event->op == RFKILL_OP_ADD ? "Added" : "Changed",
                 event->type == RFKILL_TYPE_BLUETOOTH ? "Bluetooth " : "",
                 event->idx);
         break;
       case RFKILL_OP_DEL:
-        g_hash_table_remove(manager->priv->killswitches,
-                            GINT_TO_POINTER(event->idx));
-        if (event->type == RFKILL_TYPE_BLUETOOTH)
-          g_hash_table_remove(manager->priv->bt_killswitches,
-                              GINT_TO_POINTER(event->idx));
+        killswitch = find_killswitch(manager, event->idx, FALSE);
+        if (killswitch != NULL) killswitch_remove(manager, killswitch);
         g_debug("Removed %srfkill with ID %d",
                 event->type == RFKILL_TYPE_BLUETOOTH ? "Bluetooth " : "",
                 event->idx);
@@ -567,10 +667,11 @@ gboolean msd_rfkill_manager_start(MsdRfkillManager *manager, GError **error) {
       g_dbus_node_info_new_for_xml(introspection_xml, NULL);
   g_assert(manager->priv->introspection_data != NULL);
 
-  manager->priv->killswitches = g_hash_table_new(g_direct_hash, g_direct_equal);
-  manager->priv->bt_killswitches =
-      g_hash_table_new(g_direct_hash, g_direct_equal);
-  manager->priv->rfkill = cc_rfkill_glib_new();
+  if (manager->priv->rfkill_device != NULL)
+    manager->priv->rfkill =
+        cc_rfkill_glib_new_for_device(manager->priv->rfkill_device);
+  else
+    manager->priv->rfkill = cc_rfkill_glib_new();
   g_signal_connect(manager->priv->rfkill, "changed",
                    G_CALLBACK(rfkill_changed), manager);
   cc_rfkill_glib_open(manager->priv->rfkill);
@@ -613,8 +714,16 @@ void msd_rfkill_manager_stop(MsdRfkillManager *manager) {
   g_clear_pointer(&p->introspection_data, g_dbus_node_info_unref);
   g_clear_object(&p->connection);
   g_clear_object(&p->rfkill);
-  g_clear_pointer(&p->killswitches, g_hash_table_destroy);
-  g_clear_pointer(&p->bt_killswitches, g_hash_table_destroy);
+  memset(p->killswitches, 0, sizeof(p->killswitches));
+  memset(&p->counters, 0, sizeof(p->counters));
+  memset(&p->bt_counters, 0, sizeof(p->bt_counters));
+  p->published_props = 0;
+  p->props_published = FALSE;
+
+  if (p->props_changed_id != 0) {
+    g_source_remove(p->props_changed_id);
+    p->props_changed_id = 0;
+  }
 
   if (p->cancellable) {
     g_cancellable_cancel(p->cancellable);
@@ -641,6 +750,8 @@ static void msd_rfkill_manager_finalize(GObject *object) {
 
   msd_rfkill_manager_stop(manager);
 
+  g_free(manager->priv->rfkill_device);
+
   G_OBJECT_CLASS(msd_rfkill_manager_parent_class)->finalize(object);
 }
 
@@ -654,3 +765,14 @@ MsdRfkillManager *msd_rfkill_manager_new(void) {
 
   return MSD_RFKILL_MANAGER(manager_object);
 }
+
+/* Only for test-rfkill, which feeds events through a FIFO */
+MsdRfkillManager *msd_rfkill_manager_new_for_device(const char *device) {
+  MsdRfkillManager *manager;
+
+  manager = msd_rfkill_manager_new();
+  g_free(manager->priv->rfkill_device);
+  manager->priv->rfkill_device = g_strdup(device);
+
+  return manager;
+}
@@ -54,6 +54,7 @@ typedef struct {
 GType msd_rfkill_manager_get_type(void);
 
 MsdRfkillManager *msd_rfkill_manager_new(void);
+MsdRfkillManager *msd_rfkill_manager_new_for_device(const char *device);
 gboolean msd_rfkill_manager_start(MsdRfkillManager *manager, GError **error);
 void msd_rfkill_manager_stop(MsdRfkillManager *manager);
 
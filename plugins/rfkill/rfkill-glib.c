@@ -43,6 +43,7 @@ enum { CHANGED, LAST_SIGNAL };
 static int signals[LAST_SIGNAL] = {0};
 
 struct CcRfkillGlibPrivate {
+  char *device;
   GOutputStream *stream;
   GIOChannel *channel;
   guint watch_id;
@@ -58,6 +59,11 @@ G_DEFINE_TYPE_WITH_PRIVATE(CcRfkillGlib, cc_rfkill_glib, G_TYPE_OBJECT)
 
 #define CHANGE_ALL_TIMEOUT 500
 
+/* Number of events read from the rfkill fd in one go */
+#define EVENT_BATCH_SIZE 32
+
+#define RFKILL_DEVICE "/dev/rfkill"
+
 static const char *type_to_string(unsigned int type);
 
 /* Note that this can return %FALSE without setting @error. */
@@ -257,26 +263,28 @@ static void print_event(struct rfkill_event *event) {
           op_to_string(event->op), event->soft, event->hard);
 }
 
-static gboolean got_change_event(GList *events) {
-  GList *l;
-
-  g_assert(events != NULL);
+static gboolean got_change_event(const struct rfkill_event *events,
+                                 guint n_events) {
+  guint i;
 
-  for (l = events; l != NULL; l = l->next) {
-    struct rfkill_event *event = l->data;
+  g_assert(n_events > 0);
 
-    if (event->op == RFKILL_OP_CHANGE) return TRUE;
+  for (i = 0; i < n_events; i++) {
+    if (events[i].op == RFKILL_OP_CHANGE) return TRUE;
   }
 
   return FALSE;
 }
 
-static void emit_changed_signal_and_free(CcRfkillGlib *rfkill, GList *events) {
-  if (events == NULL) return;
+static void emit_changed_signal(CcRfkillGlib *rfkill,
+                                const struct rfkill_event *events,
+                                guint n_events) {
+  if (n_events == 0) return;
 
-  g_signal_emit(G_OBJECT(rfkill), signals[CHANGED], 0, events);
+  g_signal_emit(G_OBJECT(rfkill), signals[CHANGED], 0, events, n_events);
 
-  if (rfkill->priv->change_all_timeout_id > 0 && got_change_event(events)) {
+  if (rfkill->priv->change_all_timeout_id > 0 &&
+      got_change_event(events, n_events)) {
     g_debug(
         "Received a change event after a RFKILL_OP_CHANGE_ALL event, "
         "re-sending RFKILL_OP_CHANGE_ALL");
@@ -289,46 +297,61 @@ static void emit_changed_signal_and_free(CcRfkillGlib *rfkill, GList *events) {
     g_source_remove(rfkill->priv->change_all_timeout_id);
     rfkill->priv->change_all_timeout_id = 0;
   }
-
-  g_list_free_full(events, g_free);
 }
 
-static gboolean event_cb(GIOChannel *source, GIOCondition condition,
-                         CcRfkillGlib *rfkill) {
-  GList *events;
+/* Reads as many pending events as fit in @events straight from @fd.
+ * /dev/rfkill hands out one event per read(), a pipe may hand out
+ * several; either way the events end up packed in the caller's buffer.
+ * Returns the number of events read, or -1 if the fd failed.
+ */
+static int read_events(int fd, struct rfkill_event *events, guint n_events) {
+  gsize buf_size = n_events * sizeof(struct rfkill_event);
+  gsize filled = 0;
 
-  events = NULL;
+  while (filled < buf_size) {
+    ssize_t len;
 
-  if (condition & G_IO_IN) {
-    GIOStatus status;
-    struct rfkill_event event;
-    gsize read;
+    len = read(fd, (char *)events + filled, buf_size - filled);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) break;
+      g_debug("Reading of RFKILL events failed");
+      return -1;
+    }
 
-    status = g_io_channel_read_chars(source, (char *)&event, sizeof(event),
-                                     &read, NULL);
+    if (len == 0) return -1;
 
-    while (status == G_IO_STATUS_NORMAL && read == sizeof(event)) {
-      struct rfkill_event *event_ptr;
+    filled += len;
+  }
 
-      print_event(&event);
+  if (filled % sizeof(struct rfkill_event) != 0)
+    g_warning("Wrong size of RFKILL event");
 
-#if GLIB_CHECK_VERSION(2, 68, 0)
-      event_ptr = g_memdup2(&event, sizeof(event));
-#else
-      event_ptr = g_memdup(&event, sizeof(event));
-#endif
-      events = g_list_prepend(events, event_ptr);
+  return filled / sizeof(struct rfkill_event);
+}
 
-      status = g_io_channel_read_chars(source, (char *)&event, sizeof(event),
-                                       &read, NULL);
-    }
-    events = g_list_reverse(events);
-  } else {
+static gboolean event_cb(GIOChannel *source, GIOCondition condition,
+                         CcRfkillGlib *rfkill) {
+  struct rfkill_event events[EVENT_BATCH_SIZE];
+  int n_events;
+  int fd;
+  int i;
+
+  if (!(condition & G_IO_IN)) {
     g_debug("Something unexpected happened on rfkill fd");
     return FALSE;
   }
 
-  emit_changed_signal_and_free(rfkill, events);
+  fd = g_io_channel_unix_get_fd(source);
+
+  do {
+    n_events = read_events(fd, events, EVENT_BATCH_SIZE);
+    if (n_events < 0) return FALSE;
+
+    for (i = 0; i < n_events; i++) print_event(&events[i]);
+
+    emit_changed_signal(rfkill, events, n_events);
+  } while (n_events == EVENT_BATCH_SIZE);
 
   return TRUE;
 }
@@ -342,16 +365,18 @@ static void cc_rfkill_glib_init(CcRfkillGlib *rfkill) {
 
 int cc_rfkill_glib_open(CcRfkillGlib *rfkill) {
   CcRfkillGlibPrivate *priv;
+  struct rfkill_event events[EVENT_BATCH_SIZE];
+  int n_events, n_added, n_read;
   int fd;
   int ret;
-  GList *events;
+  int i;
 
   g_return_val_if_fail(RFKILL_IS_GLIB(rfkill), -1);
   g_return_val_if_fail(rfkill->priv->stream == NULL, -1);
 
   priv = rfkill->priv;
 
-  fd = open("/dev/rfkill", O_RDWR);
+  fd = open(priv->device, O_RDWR);
   if (fd < 0) {
     if (errno == EACCES)
       g_warning(
@@ -367,46 +392,40 @@ int cc_rfkill_glib_open(CcRfkillGlib *rfkill) {
     return ret;
   }
 
-  events = NULL;
-
-  while (1) {
-    struct rfkill_event event;
-    struct rfkill_event *event_ptr;
-    ssize_t len;
+  n_added = 0;
 
-    len = read(fd, &event, sizeof(event));
-    if (len < 0) {
-      if (errno == EAGAIN) break;
-      g_debug("Reading of RFKILL events failed");
-      break;
-    }
+  /* Only the initial RFKILL_OP_ADD events matter here; they are
+   * compacted to the front of the buffer, which is flushed whenever
+   * it fills up */
+  do {
+    n_events = read_events(fd, events + n_added, EVENT_BATCH_SIZE - n_added);
+    if (n_events < 0) break;
 
-    if (len != RFKILL_EVENT_SIZE_V1) {
-      g_warning("Wrong size of RFKILL event\n");
-      continue;
-    }
+    n_read = n_added + n_events;
+    for (i = n_added; i < n_read; i++) {
+      if (events[i].op != RFKILL_OP_ADD) continue;
 
-    if (event.op != RFKILL_OP_ADD) continue;
+      g_debug("Read killswitch of type '%s' (idx=%d): soft %d hard %d",
+              type_to_string(events[i].type), events[i].idx, events[i].soft,
+              events[i].hard);
 
-    g_debug("Read killswitch of type '%s' (idx=%d): soft %d hard %d",
-            type_to_string(event.type), event.idx, event.soft, event.hard);
+      events[n_added++] = events[i];
+    }
 
-#if GLIB_CHECK_VERSION(2, 68, 0)
-    event_ptr = g_memdup2(&event, sizeof(event));
-#else
-    event_ptr = g_memdup(&event, sizeof(event));
-#endif
-    events = g_list_prepend(events, event_ptr);
-  }
+    if (n_added == EVENT_BATCH_SIZE) {
+      emit_changed_signal(rfkill, events, n_added);
+      n_added = 0;
+      n_events = EVENT_BATCH_SIZE;
+    }
+  } while (n_events > 0);
 
   /* Setup monitoring */
   priv->channel = g_io_channel_unix_new(fd);
   priv->watch_id = g_io_add_watch(priv->channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
                                   (GIOFunc)event_cb, rfkill);
 
-  if (events) {
-    events = g_list_reverse(events);
-    emit_changed_signal_and_free(rfkill, events);
+  if (n_added > 0) {
+    emit_changed_signal(rfkill, events, n_added);
   } else {
     g_debug("No rfkill device available on startup");
   }
@@ -434,6 +453,7 @@ static void cc_rfkill_glib_finalize(GObject *object) {
     g_io_channel_unref(priv->channel);
   }
   g_clear_object(&priv->stream);
+  g_free(priv->device);
 
   G_OBJECT_CLASS(cc_rfkill_glib_parent_class)->finalize(object);
 }
@@ -446,9 +466,19 @@ static void cc_rfkill_glib_class_init(CcRfkillGlibClass *klass) {
   signals[CHANGED] =
       g_signal_new("changed", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST,
                    G_STRUCT_OFFSET(CcRfkillGlibClass, changed), NULL, NULL,
-                   NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
+                   NULL, G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_UINT);
 }
 
 CcRfkillGlib *cc_rfkill_glib_new(void) {
-  return CC_RFKILL_GLIB(g_object_new(CC_RFKILL_TYPE_GLIB, NULL));
+  return cc_rfkill_glib_new_for_device(RFKILL_DEVICE);
+}
+
+/* Reads and writes @device instead of /dev/rfkill, for test-rfkill */
+CcRfkillGlib *cc_rfkill_glib_new_for_device(const char *device) {
+  CcRfkillGlib *rfkill;
+
+  rfkill = CC_RFKILL_GLIB(g_object_new(CC_RFKILL_TYPE_GLIB, NULL));
+  rfkill->priv->device = g_strdup(device);
+
+  return rfkill;
 }
@@ -54,11 +54,13 @@ typedef struct _CcRfkillGlib {
 typedef struct _CcRfkillGlibClass {
   GObjectClass parent_class;
 
-  void (*changed)(CcRfkillGlib *rfkill, GList *events);
+  void (*changed)(CcRfkillGlib *rfkill, const struct rfkill_event *events,
+                  guint n_events);
 } CcRfkillGlibClass;
 
 GType cc_rfkill_glib_get_type(void);
 CcRfkillGlib *cc_rfkill_glib_new(void);
+CcRfkillGlib *cc_rfkill_glib_new_for_device(const char *device);
 int cc_rfkill_glib_open(CcRfkillGlib *rfkill);
 
 void cc_rfkill_glib_send_event(CcRfkillGlib *rfkill, struct rfkill_event *event,
@@ -0,0 +1,250 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Feeds bursts of rfkill events through a FIFO standing in for
+ * /dev/rfkill and counts the PropertiesChanged signals the rfkill
+ * manager sends on a private session bus for each of them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "msd-rfkill-manager.h"
+#include "rfkill.h"
+
+#define RFKILL_DBUS_NAME "org.mate.SettingsDaemon.Rfkill"
+#define RFKILL_DBUS_PATH "/org/mate/SettingsDaemon/Rfkill"
+
+/* How long the bus has to stay quiet before a burst counts as handled */
+#define SETTLE_TIMEOUT 250
+
+typedef struct {
+  const char *name;
+  struct rfkill_event events[4];
+  guint n_events;
+  guint expected_signals;
+} Burst;
+
+static const Burst bursts[] = {
+    {"add",
+     {{0, RFKILL_TYPE_WLAN, RFKILL_OP_ADD, 0, 0},
+      {1, RFKILL_TYPE_BLUETOOTH, RFKILL_OP_ADD, 0, 0},
+      {2, RFKILL_TYPE_WWAN, RFKILL_OP_ADD, 0, 0},
+      {3, RFKILL_TYPE_WLAN, RFKILL_OP_ADD, 1, 0}},
+     4,
+     1},
+    {"soft block",
+     {{0, RFKILL_TYPE_WLAN, RFKILL_OP_CHANGE, 1, 0},
+      {1, RFKILL_TYPE_BLUETOOTH, RFKILL_OP_CHANGE, 1, 0},
+      {2, RFKILL_TYPE_WWAN, RFKILL_OP_CHANGE, 1, 0},
+      {3, RFKILL_TYPE_WLAN, RFKILL_OP_CHANGE, 1, 0}},
+     4,
+     1},
+    {"soft block again",
+     {{0, RFKILL_TYPE_WLAN, RFKILL_OP_CHANGE, 1, 0},
+      {1, RFKILL_TYPE_BLUETOOTH, RFKILL_OP_CHANGE, 1, 0},
+      {2, RFKILL_TYPE_WWAN, RFKILL_OP_CHANGE, 1, 0},
+      {3, RFKILL_TYPE_WLAN, RFKILL_OP_CHANGE, 1, 0}},
+     4,
+     0},
+    {"hard block",
+     {{0, RFKILL_TYPE_WLAN, RFKILL_OP_CHANGE, 1, 1},
+      {1, RFKILL_TYPE_BLUETOOTH, RFKILL_OP_CHANGE, 1, 1},
+      {2, RFKILL_TYPE_WWAN, RFKILL_OP_CHANGE, 1, 1},
+      {3, RFKILL_TYPE_WLAN, RFKILL_OP_CHANGE, 1, 1}},
+     4,
+     1},
+    {"remove bluetooth",
+     {{1, RFKILL_TYPE_BLUETOOTH, RFKILL_OP_DEL, 1, 1}},
+     1,
+     1},
+};
+
+static GMainLoop *loop = NULL;
+static guint settle_id = 0;
+static guint n_signals = 0;
+static guint n_properties = 0;
+
+static gboolean on_settled(gpointer user_data) {
+  settle_id = 0;
+  g_main_loop_quit(loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void restart_settle_timeout(void) {
+  if (settle_id != 0) g_source_remove(settle_id);
+  settle_id = g_timeout_add(SETTLE_TIMEOUT, on_settled, NULL);
+}
+
+static void on_properties_changed(GDBusConnection *connection,
+                                  const gchar *sender_name,
+                                  const gchar *object_path,
+                                  const gchar *interface_name,
+                                  const gchar *signal_name,
+                                  GVariant *parameters, gpointer user_data) {
+  GVariant *changed;
+
+  changed = g_variant_get_child_value(parameters, 1);
+  n_signals++;
+  n_properties += g_variant_n_children(changed);
+  g_variant_unref(changed);
+
+  restart_settle_timeout();
+}
+
+static void on_name_appeared(GDBusConnection *connection, const gchar *name,
+                             const gchar *name_owner, gpointer user_data) {
+  g_main_loop_quit(loop);
+}
+
+static gboolean run_burst(int fd, const Burst *burst) {
+  gsize size;
+
+  n_signals = 0;
+  n_properties = 0;
+
+  size = burst->n_events * sizeof(struct rfkill_event);
+  if (write(fd, burst->events, size) != (ssize_t)size) {
+    g_printerr("Could not write '%s' events: %s\n", burst->name,
+               g_strerror(errno));
+    return FALSE;
+  }
+
+  restart_settle_timeout();
+  g_main_loop_run(loop);
+
+  g_print("%-18s %u event(s) -> %u PropertiesChanged signal(s), %u "
+          "propert%s\n",
+          burst->name, burst->n_events, n_signals, n_properties,
+          n_properties == 1 ? "y" : "ies");
+
+  if (n_signals != burst->expected_signals) {
+    g_printerr("  expected %u signal(s)\n", burst->expected_signals);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+int main(int argc, char **argv) {
+  MsdRfkillManager *manager;
+  GTestDBus *bus;
+  GDBusConnection *connection;
+  GError *error = NULL;
+  char *tmpdir, *fifo;
+  guint watch_id;
+  gboolean ok;
+  guint i;
+  int fd;
+
+  tmpdir = g_dir_make_tmp("test-rfkill-XXXXXX", &error);
+  if (tmpdir == NULL) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  fifo = g_build_filename(tmpdir, "rfkill", NULL);
+  if (mkfifo(fifo, 0600) < 0) {
+    g_printerr("Could not create %s: %s\n", fifo, g_strerror(errno));
+    return 1;
+  }
+
+  /* Opening the FIFO read-write keeps it from ever reporting EOF */
+  fd = open(fifo, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    g_printerr("Could not open %s: %s\n", fifo, g_strerror(errno));
+    return 1;
+  }
+
+  bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+  g_test_dbus_up(bus);
+
+  /* GTestDBus only replaces the session bus; keep the manager's
+   * hostnamed, NetworkManager and ModemManager lookups off the real
+   * system bus too
+   */
+  g_setenv("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address(bus), TRUE);
+
+  connection = g_dbus_connection_new_for_address_sync(
+      g_test_dbus_get_bus_address(bus),
+      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+          G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+      NULL, NULL, &error);
+  if (connection == NULL) {
+    g_printerr("Could not connect to the test bus: %s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  g_dbus_connection_signal_subscribe(
+      connection, NULL, "org.freedesktop.DBus.Properties", "PropertiesChanged",
+      RFKILL_DBUS_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE, on_properties_changed,
+      NULL, NULL);
+
+  loop = g_main_loop_new(NULL, FALSE);
+
+  manager = msd_rfkill_manager_new_for_device(fifo);
+  if (!msd_rfkill_manager_start(manager, &error)) {
+    g_printerr("Could not start the rfkill manager: %s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  watch_id = g_bus_watch_name_on_connection(
+      connection, RFKILL_DBUS_NAME, G_BUS_NAME_WATCHER_FLAGS_NONE,
+      on_name_appeared, NULL, NULL, NULL);
+  g_main_loop_run(loop);
+  g_bus_unwatch_name(watch_id);
+
+  ok = TRUE;
+  for (i = 0; i < G_N_ELEMENTS(bursts); i++) {
+    if (!run_burst(fd, &bursts[i])) ok = FALSE;
+  }
+
+  msd_rfkill_manager_stop(manager);
+  g_object_unref(manager);
+
+  g_object_unref(connection);
+  g_test_dbus_down(bus);
+  g_object_unref(bus);
+  g_unsetenv("DBUS_SYSTEM_BUS_ADDRESS");
+
+  close(fd);
+  g_unlink(fifo);
+  g_rmdir(tmpdir);
+  g_free(fifo);
+  g_free(tmpdir);
+  g_main_loop_unref(loop);
+
+  return ok ? 0 : 1;
+}
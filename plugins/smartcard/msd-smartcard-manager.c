@@ -57,6 +57,8 @@
 
 typedef enum _MsdSmartcardManagerState MsdSmartcardManagerState;
 typedef struct _MsdSmartcardManagerWorker MsdSmartcardManagerWorker;
+typedef struct _MsdSmartcardManagerDriver MsdSmartcardManagerDriver;
+typedef struct _MsdSmartcardManagerEnumeration MsdSmartcardManagerEnumeration;
 
 enum _MsdSmartcardManagerState {
   MSD_SMARTCARD_MANAGER_STATE_STOPPED = 0,
@@ -67,14 +69,23 @@ enum _MsdSmartcardManagerState {
 
 struct _MsdSmartcardManagerPrivate {
   MsdSmartcardManagerState state;
-  SECMODModule *module;
   char *module_path;
+  char **module_paths;
 
-  GSource *smartcard_event_source;
-  GPid smartcard_event_watcher_pid;
+  GPtrArray *drivers;
   GHashTable *smartcards;
 
-  GThread *worker_thread;
+  GCancellable *enumeration_cancellable;
+  guint pending_enumerations;
+
+  /* enumeration threads still inside PK11 calls, and the results
+   * they have not handed to the main loop yet; the modules and NSS
+   * must outlive both
+   */
+  GMutex enumeration_lock;
+  GCond enumeration_cond;
+  guint running_enumerations;
+  GList *enumerations;
 
   guint poll_timeout_id;
 
@@ -82,6 +93,27 @@ struct _MsdSmartcardManagerPrivate {
   guint32 nss_is_loaded : 1;
 };
 
+/* One per loaded PKCS #11 module.  Each driver has its own event
+ * worker thread and pipe, but all of them feed the manager's single
+ * card table.
+ */
+struct _MsdSmartcardManagerDriver {
+  MsdSmartcardManager *manager;
+  SECMODModule *module;
+
+  GSource *smartcard_event_source;
+  GThread *worker_thread;
+};
+
+/* One per enumeration task.  The module ref and the cards found are
+ * only touched under enumeration_lock, so that stopping can drop them
+ * before NSS is shut down even if the task has not completed yet.
+ */
+struct _MsdSmartcardManagerEnumeration {
+  SECMODModule *module;
+  GPtrArray *cards;
+};
+
 struct _MsdSmartcardManagerWorker {
   SECMODModule *module;
   GHashTable *smartcards;
@@ -111,21 +143,37 @@ static gboolean msd_smartcard_manager_stop_now(MsdSmartcardManager *manager);
 static void msd_smartcard_manager_queue_stop(MsdSmartcardManager *manager);
 
 static gboolean msd_smartcard_manager_create_worker(
-    MsdSmartcardManager *manager, int *worker_fd, GThread **worker_thread);
+    MsdSmartcardManagerDriver *driver, int *worker_fd);
 
 static MsdSmartcardManagerWorker *msd_smartcard_manager_worker_new(
     int write_fd);
 static void msd_smartcard_manager_worker_free(
     MsdSmartcardManagerWorker *worker);
+static MsdSmartcardManagerDriver *msd_smartcard_manager_driver_new(
+    MsdSmartcardManager *manager, SECMODModule *module);
+static void msd_smartcard_manager_driver_free(
+    MsdSmartcardManagerDriver *driver);
 static gboolean open_pipe(int *write_fd, int *read_fd);
 static gboolean read_bytes(int fd, gpointer bytes, gsize num_bytes);
 static gboolean write_bytes(int fd, gconstpointer bytes, gsize num_bytes);
-static MsdSmartcard *read_smartcard(int fd, SECMODModule *module);
+static MsdSmartcard *read_smartcard(int fd, SECMODModule *module,
+                                    CK_SLOT_ID *slot_id, int *slot_series);
 static gboolean write_smartcard(int fd, MsdSmartcard *card);
 
-enum { PROP_0 = 0, PROP_MODULE_PATH, NUMBER_OF_PROPERTIES };
+enum {
+  PROP_0 = 0,
+  PROP_MODULE_PATH,
+  PROP_MODULE_PATHS,
+  NUMBER_OF_PROPERTIES
+};
 
-enum { SMARTCARD_INSERTED = 0, SMARTCARD_REMOVED, ERROR, NUMBER_OF_SIGNALS };
+enum {
+  SMARTCARD_INSERTED = 0,
+  SMARTCARD_REMOVED,
+  ERROR,
+  CARDS_ENUMERATED,
+  NUMBER_OF_SIGNALS
+};
 
 static guint msd_smartcard_manager_signals[NUMBER_OF_SIGNALS] = {0};
 
@@ -157,6 +205,12 @@ static void msd_smartcard_manager_class_install_properties(
                                    _("path to smartcard PKCS #11 driver"), NULL,
                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
   g_object_class_install_property(object_class, PROP_MODULE_PATH, param_spec);
+
+  param_spec = g_param_spec_boxed(
+      "module-paths", _("Module Paths"),
+      _("paths to the smartcard PKCS #11 drivers to watch"), G_TYPE_STRV,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+  g_object_class_install_property(object_class, PROP_MODULE_PATHS, param_spec);
 }
 
 static void msd_smartcard_manager_set_property(GObject *object, guint prop_id,
@@ -169,6 +223,11 @@ static void msd_smartcard_manager_set_property(GObject *object, guint prop_id,
       msd_smartcard_manager_set_module_path(manager, g_value_get_string(value));
       break;
 
+    case PROP_MODULE_PATHS:
+      g_strfreev(manager->priv->module_paths);
+      manager->priv->module_paths = g_value_dup_boxed(value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
       break;
@@ -188,6 +247,10 @@ static void msd_smartcard_manager_get_property(GObject *object, guint prop_id,
       g_free(module_path);
       break;
 
+    case PROP_MODULE_PATHS:
+      g_value_set_boxed(value, manager->priv->module_paths);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
       break;
@@ -253,6 +316,12 @@ static void msd_smartcard_manager_class_install_signals(
       G_STRUCT_OFFSET(MsdSmartcardManagerClass, error), NULL, NULL,
       g_cclosure_marshal_VOID__POINTER, G_TYPE_NONE, 1, G_TYPE_POINTER);
   manager_class->error = NULL;
+
+  msd_smartcard_manager_signals[CARDS_ENUMERATED] = g_signal_new(
+      "cards-enumerated", G_OBJECT_CLASS_TYPE(object_class), G_SIGNAL_RUN_LAST,
+      G_STRUCT_OFFSET(MsdSmartcardManagerClass, cards_enumerated), NULL, NULL,
+      g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+  manager_class->cards_enumerated = NULL;
 }
 
 static gboolean slot_id_equal(const CK_SLOT_ID *slot_id_1,
@@ -288,7 +357,10 @@ static void msd_smartcard_manager_init(MsdSmartcardManager *manager) {
   manager->priv = msd_smartcard_manager_get_instance_private(manager);
   manager->priv->poll_timeout_id = 0;
   manager->priv->is_unstoppable = FALSE;
-  manager->priv->module = NULL;
+  manager->priv->drivers = g_ptr_array_new_with_free_func(
+      (GDestroyNotify)msd_smartcard_manager_driver_free);
+  g_mutex_init(&manager->priv->enumeration_lock);
+  g_cond_init(&manager->priv->enumeration_cond);
 
   manager->priv->smartcards =
       g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_free,
@@ -307,6 +379,15 @@ static void msd_smartcard_manager_finalize(GObject *object) {
   g_hash_table_destroy(manager->priv->smartcards);
   manager->priv->smartcards = NULL;
 
+  g_ptr_array_free(manager->priv->drivers, TRUE);
+  manager->priv->drivers = NULL;
+
+  g_free(manager->priv->module_path);
+  g_strfreev(manager->priv->module_paths);
+
+  g_mutex_clear(&manager->priv->enumeration_lock);
+  g_cond_clear(&manager->priv->enumeration_cond);
+
   gobject_class->finalize(object);
 }
 
@@ -330,6 +411,16 @@ MsdSmartcardManager *msd_smartcard_manager_new(const char *module_path) {
   return instance;
 }
 
+MsdSmartcardManager *msd_smartcard_manager_new_for_modules(
+    const char *const *module_paths) {
+  MsdSmartcardManager *instance;
+
+  instance = MSD_SMARTCARD_MANAGER(g_object_new(
+      MSD_TYPE_SMARTCARD_MANAGER, "module-paths", module_paths, NULL));
+
+  return instance;
+}
+
 static void msd_smartcard_manager_emit_error(MsdSmartcardManager *manager,
                                              GError *error) {
   manager->priv->is_unstoppable = TRUE;
@@ -353,22 +444,44 @@ static void msd_smartcard_manager_emit_smartcard_removed(
   manager->priv->is_unstoppable = FALSE;
 }
 
+/* Cards are tracked by (module, slot, series) so that two drivers
+ * exposing the same slot id, or a card re-inserted into the same
+ * slot, never collide in the merged table.
+ */
+static char *msd_smartcard_manager_make_card_key(SECMODModule *module,
+                                                 CK_SLOT_ID slot_id,
+                                                 int slot_series) {
+  const char *module_name;
+
+  module_name = module->commonName;
+  if (module_name == NULL) {
+    module_name = module->dllName != NULL ? module->dllName : "";
+  }
+
+  return g_strdup_printf("%s:%lu:%d", module_name, (gulong)slot_id,
+                         slot_series);
+}
+
 static gboolean msd_smartcard_manager_check_for_and_process_events(
     GIOChannel *io_channel, GIOCondition condition,
-    MsdSmartcardManager *manager) {
+    MsdSmartcardManagerDriver *driver) {
+  MsdSmartcardManager *manager;
   MsdSmartcard *card;
   gboolean should_stop;
   gchar event_type;
-  char *card_name;
+  char *card_key;
+  CK_SLOT_ID slot_id;
+  int slot_series;
   int fd;
 
+  manager = driver->manager;
   card = NULL;
   should_stop = (condition & G_IO_HUP) || (condition & G_IO_ERR);
 
   if (should_stop) {
     g_debug(
         "received %s on event socket, stopping "
-        "manager...",
+        "driver...",
         (condition & G_IO_HUP) && (condition & G_IO_ERR) ? "error and hangup"
         : (condition & G_IO_HUP)                         ? "hangup"
                                                          : "error");
@@ -386,37 +499,49 @@ static gboolean msd_smartcard_manager_check_for_and_process_events(
     goto out;
   }
 
-  card = read_smartcard(fd, manager->priv->module);
+  card = read_smartcard(fd, driver->module, &slot_id, &slot_series);
 
   if (card == NULL) {
     should_stop = TRUE;
     goto out;
   }
 
-  card_name = msd_smartcard_get_name(card);
+  card_key =
+      msd_smartcard_manager_make_card_key(driver->module, slot_id, slot_series);
 
   switch (event_type) {
     case 'I':
-      g_hash_table_replace(manager->priv->smartcards, card_name, card);
-      card_name = NULL;
+      g_hash_table_replace(manager->priv->smartcards, card_key, card);
+      card_key = NULL;
 
       msd_smartcard_manager_emit_smartcard_inserted(manager, card);
       card = NULL;
       break;
 
-    case 'R':
-      msd_smartcard_manager_emit_smartcard_removed(manager, card);
-      if (!g_hash_table_remove(manager->priv->smartcards, card_name)) {
+    case 'R': {
+      MsdSmartcard *tracked_card;
+
+      tracked_card = g_hash_table_lookup(manager->priv->smartcards, card_key);
+
+      if (tracked_card != NULL) {
+        g_object_unref(card);
+        card = g_object_ref(tracked_card);
+      } else {
         g_debug("got removal event of unknown card!");
       }
-      g_free(card_name);
-      card_name = NULL;
+
+      msd_smartcard_manager_emit_smartcard_removed(manager, card);
+      g_hash_table_remove(manager->priv->smartcards, card_key);
+      g_free(card_key);
+      card_key = NULL;
+      g_object_unref(card);
       card = NULL;
       break;
+    }
 
     default:
-      g_free(card_name);
-      card_name = NULL;
+      g_free(card_key);
+      card_key = NULL;
       g_object_unref(card);
 
       should_stop = TRUE;
@@ -435,7 +560,6 @@ out:
 
     msd_smartcard_manager_emit_error(manager, error);
     g_error_free(error);
-    msd_smartcard_manager_stop_now(manager);
     return FALSE;
   }
 
@@ -443,8 +567,32 @@ out:
 }
 
 static void msd_smartcard_manager_event_processing_stopped_handler(
-    MsdSmartcardManager *manager) {
-  manager->priv->smartcard_event_source = NULL;
+    MsdSmartcardManagerDriver *driver) {
+  MsdSmartcardManager *manager;
+  guint i;
+
+  manager = driver->manager;
+  driver->smartcard_event_source = NULL;
+
+  if (driver->worker_thread != NULL) {
+    SECMOD_CancelWait(driver->module);
+    driver->worker_thread = NULL;
+  }
+
+  if (manager->priv->state != MSD_SMARTCARD_MANAGER_STATE_STARTED) {
+    return;
+  }
+
+  /* one driver going away shouldn't take the others down with it */
+  for (i = 0; i < manager->priv->drivers->len; i++) {
+    MsdSmartcardManagerDriver *other_driver;
+
+    other_driver = g_ptr_array_index(manager->priv->drivers, i);
+    if (other_driver->smartcard_event_source != NULL) {
+      return;
+    }
+  }
+
   msd_smartcard_manager_stop_now(manager);
 }
 
@@ -476,16 +624,56 @@ static gboolean open_pipe(int *write_fd, int *read_fd) {
   return TRUE;
 }
 
+static MsdSmartcardManagerDriver *msd_smartcard_manager_driver_new(
+    MsdSmartcardManager *manager, SECMODModule *module) {
+  MsdSmartcardManagerDriver *driver;
+
+  driver = g_slice_new0(MsdSmartcardManagerDriver);
+  driver->manager = manager;
+  driver->module = module;
+
+  return driver;
+}
+
+static void msd_smartcard_manager_driver_stop_watching_for_events(
+    MsdSmartcardManagerDriver *driver) {
+  if (driver->smartcard_event_source != NULL) {
+    g_source_destroy(driver->smartcard_event_source);
+    driver->smartcard_event_source = NULL;
+  }
+
+  if (driver->worker_thread != NULL) {
+    SECMOD_CancelWait(driver->module);
+    driver->worker_thread = NULL;
+  }
+}
+
+static void msd_smartcard_manager_driver_free(
+    MsdSmartcardManagerDriver *driver) {
+  msd_smartcard_manager_driver_stop_watching_for_events(driver);
+
+  if (driver->module != NULL) {
+    SECMOD_DestroyModule(driver->module);
+    driver->module = NULL;
+  }
+
+  g_slice_free(MsdSmartcardManagerDriver, driver);
+}
+
 static void msd_smartcard_manager_stop_watching_for_events(
     MsdSmartcardManager *manager) {
-  if (manager->priv->smartcard_event_source != NULL) {
-    g_source_destroy(manager->priv->smartcard_event_source);
-    manager->priv->smartcard_event_source = NULL;
+  guint i;
+
+  if (manager->priv->enumeration_cancellable != NULL) {
+    g_mutex_lock(&manager->priv->enumeration_lock);
+    g_cancellable_cancel(manager->priv->enumeration_cancellable);
+    g_mutex_unlock(&manager->priv->enumeration_lock);
+    g_clear_object(&manager->priv->enumeration_cancellable);
   }
 
-  if (manager->priv->worker_thread != NULL) {
-    SECMOD_CancelWait(manager->priv->module);
-    manager->priv->worker_thread = NULL;
+  for (i = 0; i < manager->priv->drivers->len; i++) {
+    msd_smartcard_manager_driver_stop_watching_for_events(
+        g_ptr_array_index(manager->priv->drivers, i));
   }
 }
 
@@ -535,43 +723,24 @@ out:
   return FALSE;
 }
 
-static SECMODModule *load_driver(char *module_path, GError **error) {
+/* Loads an explicitly configured driver; when none is configured
+ * load_drivers() picks up every loaded module with removable slots.
+ */
+static SECMODModule *load_driver(const char *module_path, GError **error) {
   SECMODModule *module;
   char *module_spec;
-  gboolean module_explicitly_specified;
 
   g_debug("attempting to load driver...");
 
-  module = NULL;
-  module_explicitly_specified = module_path != NULL;
-  if (module_explicitly_specified) {
-    module_spec = g_strdup_printf("library=\"%s\"", module_path);
-    g_debug("loading smartcard driver using spec '%s'", module_spec);
+  module_spec = g_strdup_printf("library=\"%s\"", module_path);
+  g_debug("loading smartcard driver using spec '%s'", module_spec);
 
-    module = SECMOD_LoadUserModule(module_spec, NULL /* parent */,
-                                   FALSE /* recurse */);
-    g_free(module_spec);
-    module_spec = NULL;
+  module = SECMOD_LoadUserModule(module_spec, NULL /* parent */,
+                                 FALSE /* recurse */);
+  g_free(module_spec);
+  module_spec = NULL;
 
-  } else {
-    SECMODModuleList *modules, *tmp;
-
-    modules = SECMOD_GetDefaultModuleList();
-
-    for (tmp = modules; tmp != NULL; tmp = tmp->next) {
-      if (!SECMOD_HasRemovableSlots(tmp->module) || !tmp->module->loaded)
-        continue;
-
-      module = SECMOD_ReferenceModule(tmp->module);
-      break;
-    }
-  }
-
-  if (!module_explicitly_specified && module == NULL) {
-    g_set_error(error, MSD_SMARTCARD_MANAGER_ERROR,
-                MSD_SMARTCARD_MANAGER_ERROR_LOADING_DRIVER,
-                _("no suitable smartcard driver could be found"));
-  } else if (module == NULL || !module->loaded) {
+  if (module == NULL || !module->loaded) {
     gsize error_message_size;
     char *error_message;
 
@@ -609,90 +778,319 @@ out:
   return module;
 }
 
-static void msd_smartcard_manager_get_all_cards(MsdSmartcardManager *manager) {
+static gboolean load_drivers(MsdSmartcardManager *manager, GError **error) {
+  GError *driver_error;
+
+  driver_error = NULL;
+
+  if (manager->priv->module_paths != NULL ||
+      manager->priv->module_path != NULL) {
+    const char *single_path[] = {manager->priv->module_path, NULL};
+    const char *const *paths;
+    int i;
+
+    paths = manager->priv->module_paths != NULL
+                ? (const char *const *)manager->priv->module_paths
+                : single_path;
+
+    for (i = 0; paths[i] != NULL; i++) {
+      SECMODModule *module;
+
+      g_clear_error(&driver_error);
+      module = load_driver(paths[i], &driver_error);
+
+      if (module == NULL) {
+        g_warning("could not load smartcard driver '%s' - %s", paths[i],
+                  driver_error->message);
+        continue;
+      }
+
+      g_ptr_array_add(manager->priv->drivers,
+                      msd_smartcard_manager_driver_new(manager, module));
+    }
+  } else {
+    SECMODModuleList *modules, *tmp;
+
+    modules = SECMOD_GetDefaultModuleList();
+
+    for (tmp = modules; tmp != NULL; tmp = tmp->next) {
+      if (!SECMOD_HasRemovableSlots(tmp->module) || !tmp->module->loaded)
+        continue;
+
+      g_ptr_array_add(manager->priv->drivers,
+                      msd_smartcard_manager_driver_new(
+                          manager, SECMOD_ReferenceModule(tmp->module)));
+    }
+
+    if (manager->priv->drivers->len == 0) {
+      g_set_error(&driver_error, MSD_SMARTCARD_MANAGER_ERROR,
+                  MSD_SMARTCARD_MANAGER_ERROR_LOADING_DRIVER,
+                  _("no suitable smartcard driver could be found"));
+    }
+  }
+
+  if (manager->priv->drivers->len == 0) {
+    g_propagate_error(error, driver_error);
+    return FALSE;
+  }
+
+  g_clear_error(&driver_error);
+  g_debug("loaded %u smartcard driver(s)", manager->priv->drivers->len);
+
+  return TRUE;
+}
+
+static void msd_smartcard_manager_enumeration_clear(
+    MsdSmartcardManagerEnumeration *enumeration) {
+  if (enumeration->cards != NULL) {
+    g_ptr_array_unref(enumeration->cards);
+    enumeration->cards = NULL;
+  }
+
+  if (enumeration->module != NULL) {
+    SECMOD_DestroyModule(enumeration->module);
+    enumeration->module = NULL;
+  }
+}
+
+static void msd_smartcard_manager_enumeration_free(
+    MsdSmartcardManagerEnumeration *enumeration) {
+  msd_smartcard_manager_enumeration_clear(enumeration);
+  g_slice_free(MsdSmartcardManagerEnumeration, enumeration);
+}
+
+static void msd_smartcard_manager_enumerate_driver_cards(
+    GTask *task, MsdSmartcardManager *manager,
+    MsdSmartcardManagerEnumeration *enumeration, GCancellable *cancellable) {
+  SECMODModule *module;
+  GPtrArray *cards;
   int i;
 
-  for (i = 0; i < manager->priv->module->slotCount; i++) {
-    MsdSmartcard *card;
+  /* stopping waits for this thread before it drops the module ref, so
+   * it is safe to use without the lock until the count goes down
+   */
+  module = enumeration->module;
+  cards = g_ptr_array_new_with_free_func(g_object_unref);
+
+  for (i = 0; i < module->slotCount; i++) {
     CK_SLOT_ID slot_id;
     int slot_series;
-    char *card_name;
 
-    slot_id = PK11_GetSlotID(manager->priv->module->slots[i]);
-    slot_series = PK11_GetSlotSeries(manager->priv->module->slots[i]);
+    if (g_cancellable_is_cancelled(cancellable)) {
+      break;
+    }
 
-    card = _msd_smartcard_new(manager->priv->module, slot_id, slot_series);
+    slot_id = PK11_GetSlotID(module->slots[i]);
+    slot_series = PK11_GetSlotSeries(module->slots[i]);
 
-    card_name = msd_smartcard_get_name(card);
+    g_ptr_array_add(cards, _msd_smartcard_new(module, slot_id, slot_series));
+  }
 
-    g_hash_table_replace(manager->priv->smartcards, card_name, card);
+  g_mutex_lock(&manager->priv->enumeration_lock);
+  /* nobody wants the cards any more, drop them while NSS is still up
+   */
+  if (g_cancellable_is_cancelled(cancellable)) {
+    g_ptr_array_unref(cards);
+    msd_smartcard_manager_enumeration_clear(enumeration);
+  } else {
+    enumeration->cards = cards;
   }
+  manager->priv->running_enumerations--;
+  g_cond_broadcast(&manager->priv->enumeration_cond);
+  g_mutex_unlock(&manager->priv->enumeration_lock);
+
+  g_task_return_boolean(task, TRUE);
 }
 
-gboolean msd_smartcard_manager_start(MsdSmartcardManager *manager,
-                                     GError **error) {
-  int worker_fd;
-  GIOChannel *io_channel;
-  GSource *source;
-  GError *nss_error;
+static void msd_smartcard_manager_on_driver_cards_enumerated(
+    MsdSmartcardManager *manager, GAsyncResult *result, gpointer user_data) {
+  MsdSmartcardManagerEnumeration *enumeration;
+  SECMODModule *module;
+  GPtrArray *cards;
+  guint i;
 
-  if (manager->priv->state == MSD_SMARTCARD_MANAGER_STATE_STARTED) {
-    g_debug("smartcard manager already started");
-    return TRUE;
+  enumeration = g_task_get_task_data(G_TASK(result));
+
+  /* take the results over; if the manager was stopped in the meantime
+   * they are already gone
+   */
+  g_mutex_lock(&manager->priv->enumeration_lock);
+  manager->priv->enumerations =
+      g_list_remove(manager->priv->enumerations, enumeration);
+  module = enumeration->module;
+  cards = enumeration->cards;
+  enumeration->module = NULL;
+  enumeration->cards = NULL;
+  g_mutex_unlock(&manager->priv->enumeration_lock);
+
+  /* the manager may have been stopped, and maybe restarted, while
+   * the slots were being walked
+   */
+  if (g_task_get_cancellable(G_TASK(result)) !=
+      manager->priv->enumeration_cancellable) {
+    if (cards != NULL) {
+      g_ptr_array_unref(cards);
+    }
+    if (module != NULL) {
+      SECMOD_DestroyModule(module);
+    }
+    return;
   }
 
-  manager->priv->state = MSD_SMARTCARD_MANAGER_STATE_STARTING;
+  for (i = 0; cards != NULL && i < cards->len; i++) {
+    MsdSmartcard *card;
+    char *card_key;
 
-  worker_fd = -1;
+    card = g_ptr_array_index(cards, i);
+    card_key = msd_smartcard_manager_make_card_key(
+        module, msd_smartcard_get_slot_id(card),
+        msd_smartcard_get_slot_series(card));
 
-  nss_error = NULL;
-  if (!manager->priv->nss_is_loaded && !load_nss(&nss_error)) {
-    g_propagate_error(error, nss_error);
-    goto out;
+    /* the event worker may already have reported this one */
+    if (g_hash_table_contains(manager->priv->smartcards, card_key)) {
+      g_free(card_key);
+      continue;
+    }
+
+    g_hash_table_replace(manager->priv->smartcards, card_key,
+                         g_object_ref(card));
   }
-  manager->priv->nss_is_loaded = TRUE;
 
-  if (manager->priv->module == NULL) {
-    manager->priv->module = load_driver(manager->priv->module_path, &nss_error);
+  if (cards != NULL) {
+    g_ptr_array_unref(cards);
+  }
+  if (module != NULL) {
+    SECMOD_DestroyModule(module);
   }
 
-  if (manager->priv->module == NULL) {
-    g_propagate_error(error, nss_error);
-    goto out;
+  manager->priv->pending_enumerations--;
+  if (manager->priv->pending_enumerations == 0) {
+    g_debug("all smartcard slots enumerated");
+    g_signal_emit(manager, msd_smartcard_manager_signals[CARDS_ENUMERATED], 0);
+  }
+}
+
+/* Walking the slots of a module can take a while for slow readers,
+ * so every driver is enumerated in its own thread off the main loop
+ * and the results are merged into the card table as they come in.
+ */
+static void msd_smartcard_manager_get_all_cards(MsdSmartcardManager *manager) {
+  guint i;
+
+  manager->priv->enumeration_cancellable = g_cancellable_new();
+  manager->priv->pending_enumerations = manager->priv->drivers->len;
+
+  if (manager->priv->pending_enumerations == 0) {
+    g_signal_emit(manager, msd_smartcard_manager_signals[CARDS_ENUMERATED], 0);
+    return;
   }
 
-  if (!msd_smartcard_manager_create_worker(manager, &worker_fd,
-                                           &manager->priv->worker_thread)) {
+  g_mutex_lock(&manager->priv->enumeration_lock);
+  manager->priv->running_enumerations += manager->priv->drivers->len;
+  g_mutex_unlock(&manager->priv->enumeration_lock);
+
+  for (i = 0; i < manager->priv->drivers->len; i++) {
+    MsdSmartcardManagerDriver *driver;
+    MsdSmartcardManagerEnumeration *enumeration;
+    GTask *task;
+
+    driver = g_ptr_array_index(manager->priv->drivers, i);
+
+    enumeration = g_slice_new0(MsdSmartcardManagerEnumeration);
+    enumeration->module = SECMOD_ReferenceModule(driver->module);
+
+    g_mutex_lock(&manager->priv->enumeration_lock);
+    manager->priv->enumerations =
+        g_list_prepend(manager->priv->enumerations, enumeration);
+    g_mutex_unlock(&manager->priv->enumeration_lock);
+
+    task = g_task_new(
+        manager, manager->priv->enumeration_cancellable,
+        (GAsyncReadyCallback)msd_smartcard_manager_on_driver_cards_enumerated,
+        NULL);
+    g_task_set_task_data(
+        task, enumeration,
+        (GDestroyNotify)msd_smartcard_manager_enumeration_free);
+    g_task_set_return_on_cancel(task, FALSE);
+    g_task_run_in_thread(
+        task, (GTaskThreadFunc)msd_smartcard_manager_enumerate_driver_cards);
+    g_object_unref(task);
+  }
+}
+
+static gboolean msd_smartcard_manager_driver_start(
+    MsdSmartcardManagerDriver *driver, GError **error) {
+  int worker_fd;
+  GIOChannel *io_channel;
+  GSource *source;
+
+  worker_fd = -1;
+
+  if (!msd_smartcard_manager_create_worker(driver, &worker_fd)) {
     g_set_error(error, MSD_SMARTCARD_MANAGER_ERROR,
                 MSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
                 _("could not watch for incoming card events - %s"),
                 g_strerror(errno));
-
-    goto out;
+    return FALSE;
   }
 
   io_channel = g_io_channel_unix_new(worker_fd);
+  g_io_channel_set_close_on_unref(io_channel, TRUE);
 
   source = g_io_create_watch(io_channel, G_IO_IN | G_IO_HUP);
   g_io_channel_unref(io_channel);
   io_channel = NULL;
 
-  manager->priv->smartcard_event_source = source;
+  driver->smartcard_event_source = source;
 
   g_source_set_callback(
-      manager->priv->smartcard_event_source,
+      driver->smartcard_event_source,
       (GSourceFunc)(GIOFunc)msd_smartcard_manager_check_for_and_process_events,
-      manager,
+      driver,
       (GDestroyNotify)msd_smartcard_manager_event_processing_stopped_handler);
-  g_source_attach(manager->priv->smartcard_event_source, NULL);
-  g_source_unref(manager->priv->smartcard_event_source);
+  g_source_attach(driver->smartcard_event_source, NULL);
+  g_source_unref(driver->smartcard_event_source);
+
+  return TRUE;
+}
+
+gboolean msd_smartcard_manager_start(MsdSmartcardManager *manager,
+                                     GError **error) {
+  GError *nss_error;
+  guint i;
+
+  if (manager->priv->state == MSD_SMARTCARD_MANAGER_STATE_STARTED) {
+    g_debug("smartcard manager already started");
+    return TRUE;
+  }
+
+  manager->priv->state = MSD_SMARTCARD_MANAGER_STATE_STARTING;
+
+  nss_error = NULL;
+  if (!manager->priv->nss_is_loaded && !load_nss(&nss_error)) {
+    g_propagate_error(error, nss_error);
+    goto out;
+  }
+  manager->priv->nss_is_loaded = TRUE;
+
+  if (manager->priv->drivers->len == 0 && !load_drivers(manager, &nss_error)) {
+    g_propagate_error(error, nss_error);
+    goto out;
+  }
+
+  for (i = 0; i < manager->priv->drivers->len; i++) {
+    if (!msd_smartcard_manager_driver_start(
+            g_ptr_array_index(manager->priv->drivers, i), error)) {
+      goto out;
+    }
+  }
+
+  manager->priv->state = MSD_SMARTCARD_MANAGER_STATE_STARTED;
 
   /* populate the hash with cards that are already inserted
    */
   msd_smartcard_manager_get_all_cards(manager);
 
-  manager->priv->state = MSD_SMARTCARD_MANAGER_STATE_STARTED;
-
 out:
   /* don't leave it in a half started state
    */
@@ -714,11 +1112,24 @@ static gboolean msd_smartcard_manager_stop_now(MsdSmartcardManager *manager) {
   manager->priv->state = MSD_SMARTCARD_MANAGER_STATE_STOPPED;
   msd_smartcard_manager_stop_watching_for_events(manager);
 
-  if (manager->priv->module != NULL) {
-    SECMOD_DestroyModule(manager->priv->module);
-    manager->priv->module = NULL;
+  /* cancellation is only noticed between slots, so a thread may still
+   * be talking to its module
+   */
+  g_mutex_lock(&manager->priv->enumeration_lock);
+  while (manager->priv->running_enumerations > 0) {
+    g_cond_wait(&manager->priv->enumeration_cond,
+                &manager->priv->enumeration_lock);
   }
 
+  /* tasks that finished but have not completed on the main loop yet
+   * still hold module and slot refs; those must go before NSS does
+   */
+  g_list_foreach(manager->priv->enumerations,
+                 (GFunc)msd_smartcard_manager_enumeration_clear, NULL);
+  g_mutex_unlock(&manager->priv->enumeration_lock);
+
+  g_ptr_array_set_size(manager->priv->drivers, 0);
+
   if (manager->priv->nss_is_loaded) {
     NSS_Shutdown();
     manager->priv->nss_is_loaded = FALSE;
@@ -850,11 +1261,20 @@ static gboolean write_bytes(int fd, gconstpointer bytes, gsize num_bytes) {
   return TRUE;
 }
 
-static MsdSmartcard *read_smartcard(int fd, SECMODModule *module) {
+static MsdSmartcard *read_smartcard(int fd, SECMODModule *module,
+                                    CK_SLOT_ID *slot_id, int *slot_series) {
   MsdSmartcard *card;
   char *card_name;
   gsize card_name_size;
 
+  if (!read_bytes(fd, slot_id, sizeof(*slot_id))) {
+    return NULL;
+  }
+
+  if (!read_bytes(fd, slot_series, sizeof(*slot_series))) {
+    return NULL;
+  }
+
   card_name_size = 0;
   if (!read_bytes(fd, &card_name_size, sizeof(card_name_size))) {
     return NULL;
@@ -874,6 +1294,18 @@ static MsdSmartcard *read_smartcard(int fd, SECMODModule *module) {
 static gboolean write_smartcard(int fd, MsdSmartcard *card) {
   gsize card_name_size;
   char *card_name;
+  CK_SLOT_ID slot_id;
+  int slot_series;
+
+  slot_id = msd_smartcard_get_slot_id(card);
+  if (!write_bytes(fd, &slot_id, sizeof(slot_id))) {
+    return FALSE;
+  }
+
+  slot_series = msd_smartcard_get_slot_series(card);
+  if (!write_bytes(fd, &slot_series, sizeof(slot_series))) {
+    return FALSE;
+  }
 
   card_name = msd_smartcard_get_name(card);
   card_name_size = strlen(card_name) + 1;
@@ -1084,7 +1516,7 @@ static void msd_smartcard_manager_worker_run(
 }
 
 static gboolean msd_smartcard_manager_create_worker(
-    MsdSmartcardManager *manager, int *worker_fd, GThread **worker_thread) {
+    MsdSmartcardManagerDriver *driver, int *worker_fd) {
   MsdSmartcardManagerWorker *worker;
   int write_fd, read_fd;
 
@@ -1095,13 +1527,13 @@ static gboolean msd_smartcard_manager_create_worker(
   }
 
   worker = msd_smartcard_manager_worker_new(write_fd);
-  worker->module = manager->priv->module;
+  worker->module = driver->module;
 
-  *worker_thread =
+  driver->worker_thread =
       g_thread_new("MsdSmartcardManagerWorker",
                    (GThreadFunc)msd_smartcard_manager_worker_run, worker);
 
-  if (*worker_thread == NULL) {
+  if (driver->worker_thread == NULL) {
     msd_smartcard_manager_worker_free(worker);
     return FALSE;
   }
@@ -66,6 +66,7 @@ struct _MsdSmartcardManagerClass {
   void (*smartcard_inserted)(MsdSmartcardManager *manager, MsdSmartcard *token);
   void (*smartcard_removed)(MsdSmartcardManager *manager, MsdSmartcard *token);
   void (*error)(MsdSmartcardManager *manager, GError *error);
+  void (*cards_enumerated)(MsdSmartcardManager *manager);
 };
 
 enum _MsdSmartcardManagerError {
@@ -80,6 +81,8 @@ GType msd_smartcard_manager_get_type(void) G_GNUC_CONST;
 GQuark msd_smartcard_manager_error_quark(void) G_GNUC_CONST;
 
 MsdSmartcardManager *msd_smartcard_manager_new(const char *module);
+MsdSmartcardManager *msd_smartcard_manager_new_for_modules(
+    const char *const *module_paths);
 
 gboolean msd_smartcard_manager_start(MsdSmartcardManager *manager,
                                      GError **error);
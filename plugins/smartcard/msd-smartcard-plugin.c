@@ -60,6 +60,9 @@ typedef enum {
 #define MSD_SMARTCARD_SCHEMA "org.mate.peripherals-smartcard"
 #define KEY_REMOVE_ACTION "removal-action"
 
+#define MSD_SMARTCARD_PLUGIN_SCHEMA "org.mate.SettingsDaemon.plugins.smartcard"
+#define KEY_DRIVERS "drivers"
+
 MATE_SETTINGS_PLUGIN_REGISTER_WITH_PRIVATE(MsdSmartcardPlugin,
                                            msd_smartcard_plugin);
 
@@ -114,11 +117,26 @@ static void force_logout(MsdSmartcardPlugin *plugin) {
 }
 
 static void msd_smartcard_plugin_init(MsdSmartcardPlugin *plugin) {
+  GSettings *settings;
+  char **drivers;
+
   plugin->priv = msd_smartcard_plugin_get_instance_private(plugin);
 
   g_debug("MsdSmartcardPlugin initializing");
 
-  plugin->priv->manager = msd_smartcard_manager_new(NULL);
+  settings = g_settings_new(MSD_SMARTCARD_PLUGIN_SCHEMA);
+  drivers = g_settings_get_strv(settings, KEY_DRIVERS);
+  g_object_unref(settings);
+
+  /* an empty list means every loaded module with removable slots */
+  if (drivers != NULL && drivers[0] != NULL) {
+    plugin->priv->manager =
+        msd_smartcard_manager_new_for_modules((const char *const *)drivers);
+  } else {
+    plugin->priv->manager = msd_smartcard_manager_new(NULL);
+  }
+
+  g_strfreev(drivers);
 }
 
 static void msd_smartcard_plugin_finalize(GObject *object) {
@@ -219,6 +237,17 @@ static void smartcard_removed_cb(MsdSmartcardManager *card_monitor,
   process_smartcard_removal(plugin);
 }
 
+static void cards_enumerated_cb(MsdSmartcardManager *card_monitor,
+                                MsdSmartcardPlugin *plugin) {
+  if (!msd_smartcard_manager_login_card_is_inserted(card_monitor)) {
+    g_debug(
+        "MsdSmartcardPlugin processing smartcard removal immediately user "
+        "logged in with smartcard "
+        "and it's not inserted");
+    process_smartcard_removal(plugin);
+  }
+}
+
 static void impl_activate(MateSettingsPlugin *plugin) {
   GError *error;
   MsdSmartcardPlugin *smartcard_plugin = MSD_SMARTCARD_PLUGIN(plugin);
@@ -251,25 +280,25 @@ static void impl_activate(MateSettingsPlugin *plugin) {
     return;
   }
 
-  if (!msd_smartcard_manager_start(smartcard_plugin->priv->manager, &error)) {
-    g_warning("MsdSmartcardPlugin Unable to start smartcard manager: %s",
-              error->message);
-    g_error_free(error);
-  }
-
   g_signal_connect(smartcard_plugin->priv->manager, "smartcard-removed",
                    G_CALLBACK(smartcard_removed_cb), smartcard_plugin);
 
   g_signal_connect(smartcard_plugin->priv->manager, "smartcard-inserted",
                    G_CALLBACK(smartcard_inserted_cb), smartcard_plugin);
 
-  if (!msd_smartcard_manager_login_card_is_inserted(
-          smartcard_plugin->priv->manager)) {
-    g_debug(
-        "MsdSmartcardPlugin processing smartcard removal immediately user "
-        "logged in with smartcard "
-        "and it's not inserted");
-    process_smartcard_removal(smartcard_plugin);
+  /* already inserted cards are enumerated in the background, so the
+   * login card check has to wait until that is done
+   */
+  g_signal_connect(smartcard_plugin->priv->manager, "cards-enumerated",
+                   G_CALLBACK(cards_enumerated_cb), smartcard_plugin);
+
+  if (!msd_smartcard_manager_start(smartcard_plugin->priv->manager, &error)) {
+    g_warning("MsdSmartcardPlugin Unable to start smartcard manager: %s",
+              error->message);
+    g_error_free(error);
+
+    /* nothing will be enumerated, so do the check now */
+    cards_enumerated_cb(smartcard_plugin->priv->manager, smartcard_plugin);
   }
 
   smartcard_plugin->priv->is_active = TRUE;
@@ -294,6 +323,9 @@ static void impl_deactivate(MateSettingsPlugin *plugin) {
 
   g_signal_handlers_disconnect_by_func(smartcard_plugin->priv->manager,
                                        smartcard_inserted_cb, smartcard_plugin);
+
+  g_signal_handlers_disconnect_by_func(smartcard_plugin->priv->manager,
+                                       cards_enumerated_cb, smartcard_plugin);
   smartcard_plugin->priv->bus_connection = NULL;
   smartcard_plugin->priv->is_active = FALSE;
 }
@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Builds a small tree of inheriting sound themes, fills a simulated
+ * sample cache with every event of every theme, and counts how many
+ * samples have to be uploaded again after tweaking single files, once
+ * with a full flush and once with the flush set the theme index derives
+ * from the change. Every event is also cached with a "-dialog" suffix
+ * that no theme provides, so that it plays through the name fallback.
+ * A sample the theme index fails to drop although the tweak changed the
+ * file it resolves to makes the run fail.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "msd-sound-theme-index.h"
+
+#define N_EVENTS 40
+#define N_OVERRIDES 10
+
+/* Cached event IDs without a sound of their own */
+#define FALLBACK_SUFFIX "-dialog"
+
+typedef struct {
+  const char *name;
+  const char *inherits;
+  guint first_event;
+  guint n_events;
+} Theme;
+
+/* "freedesktop" provides everything, "mate" overrides a few events and
+ * "mate-quiet" only changes its parent */
+static const Theme themes[] = {
+    {"freedesktop", NULL, 0, N_EVENTS},
+    {"mate", "freedesktop", 0, N_OVERRIDES},
+    {"mate-quiet", "mate", 0, 0},
+};
+
+typedef struct {
+  const char *description;
+  const char *theme;
+  const char *file;
+} Tweak;
+
+static const Tweak tweaks[] = {
+    {"override in mate", "mate", "stereo/event-03.oga"},
+    {"new override in mate", "mate", "stereo/event-25.oga"},
+    {"base sound", "freedesktop", "stereo/event-20.oga"},
+    {"leaf index.theme", "mate-quiet", "index.theme"},
+};
+
+static const Theme *find_theme(const char *name) {
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(themes); i++) {
+    if (g_strcmp0(themes[i].name, name) == 0) return &themes[i];
+  }
+
+  return NULL;
+}
+
+static gboolean write_file(const char *path, const char *contents) {
+  GError *error = NULL;
+  char *dir;
+
+  dir = g_path_get_dirname(path);
+  g_mkdir_with_parents(dir, 0700);
+  g_free(dir);
+
+  if (!g_file_set_contents(path, contents, -1, &error)) {
+    g_printerr("Could not write %s: %s\n", path, error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean create_themes(const char *sound_dir) {
+  char *path, *contents, *name;
+  guint i, j;
+
+  for (i = 0; i < G_N_ELEMENTS(themes); i++) {
+    path = g_build_filename(sound_dir, themes[i].name, "index.theme", NULL);
+    contents = g_strdup_printf("[Sound Theme]\nName=%s\n%s%s\n",
+                               themes[i].name,
+                               themes[i].inherits ? "Inherits=" : "",
+                               themes[i].inherits ? themes[i].inherits : "");
+    if (!write_file(path, contents)) return FALSE;
+    g_free(contents);
+    g_free(path);
+
+    for (j = themes[i].first_event; j < themes[i].n_events; j++) {
+      name = g_strdup_printf("event-%02u.oga", j);
+      path = g_build_filename(sound_dir, themes[i].name, "stereo", name, NULL);
+      if (!write_file(path, "OggS")) return FALSE;
+      g_free(path);
+      g_free(name);
+    }
+  }
+
+  return TRUE;
+}
+
+/* The file, relative to the sound directory, that plays for @event_id
+ * while @theme is selected.  Like libcanberra, the whole inheritance
+ * chain is searched for the name, and then for the name with its last
+ * "-suffix" stripped, and so on. */
+static char *resolve(const char *sound_dir, const char *theme,
+                     const char *event_id) {
+  const Theme *t;
+  char *name, *dash, *file, *path;
+  gboolean found;
+
+  name = g_strdup(event_id);
+  do {
+    for (t = find_theme(theme); t != NULL; t = find_theme(t->inherits)) {
+      file = g_strdup_printf("%s/stereo/%s.oga", t->name, name);
+      path = g_build_filename(sound_dir, file, NULL);
+      found = g_file_test(path, G_FILE_TEST_EXISTS);
+      g_free(path);
+
+      if (found) {
+        g_free(name);
+        return file;
+      }
+      g_free(file);
+    }
+
+    dash = strrchr(name, '-');
+    if (dash != NULL) *dash = '\0';
+  } while (dash != NULL);
+  g_free(name);
+
+  return NULL;
+}
+
+/* Whether @tweak can change what plays for @event_id under @theme */
+static gboolean is_stale(const char *sound_dir, const Tweak *tweak,
+                         const char *theme, const char *event_id) {
+  const Theme *t;
+  char *file, *resolved;
+  gboolean stale;
+
+  if (g_strcmp0(tweak->file, "index.theme") == 0) {
+    for (t = find_theme(theme); t != NULL; t = find_theme(t->inherits)) {
+      if (g_strcmp0(t->name, tweak->theme) == 0) return TRUE;
+    }
+    return FALSE;
+  }
+
+  /* The tweak is already made, so it is what resolves if it matters */
+  file = g_build_filename(tweak->theme, tweak->file, NULL);
+  resolved = resolve(sound_dir, theme, event_id);
+  stale = g_strcmp0(resolved, file) == 0;
+  g_free(resolved);
+  g_free(file);
+
+  return stale;
+}
+
+static gboolean run_tweak(const char *sound_dir, const Tweak *tweak) {
+  MsdSoundThemeIndex *index;
+  MsdSoundFlushSet *set;
+  const char *sound_dirs[] = {sound_dir, NULL};
+  GFile *file;
+  char *path, *event_id;
+  guint i, j, n_cached = 0, n_flushed = 0, n_required = 0, n_missed = 0;
+  gint64 start, elapsed;
+
+  index = msd_sound_theme_index_new_for_dirs(sound_dirs);
+  set = msd_sound_flush_set_new();
+
+  path = g_build_filename(sound_dir, tweak->theme, tweak->file, NULL);
+  if (!write_file(path, g_str_has_suffix(path, ".theme")
+                            ? "[Sound Theme]\nName=tweaked\nInherits=mate\n"
+                            : "OggS tweaked")) {
+    g_free(path);
+    return FALSE;
+  }
+
+  file = g_file_new_for_path(path);
+  start = g_get_monotonic_time();
+  msd_sound_theme_index_add_change(index, file, set);
+  elapsed = g_get_monotonic_time() - start;
+  g_object_unref(file);
+  g_free(path);
+
+  for (i = 0; i < G_N_ELEMENTS(themes); i++) {
+    for (j = 0; j < 2 * N_EVENTS; j++) {
+      event_id = g_strdup_printf("event-%02u%s", j % N_EVENTS,
+                                 j < N_EVENTS ? "" : FALLBACK_SUFFIX);
+      n_cached++;
+
+      if (msd_sound_flush_set_matches(set, themes[i].name, event_id)) {
+        n_flushed++;
+      }
+
+      if (is_stale(sound_dir, tweak, themes[i].name, event_id)) {
+        n_required++;
+        if (!msd_sound_flush_set_matches(set, themes[i].name, event_id)) {
+          g_printerr("  %s/%s was not dropped\n", themes[i].name, event_id);
+          n_missed++;
+        }
+      }
+
+      g_free(event_id);
+    }
+  }
+
+  g_print("%-22s uploads: full flush %3u, selective %3u, required %3u "
+          "(%" G_GINT64_FORMAT " us)\n",
+          tweak->description, n_cached, n_flushed, n_required, elapsed);
+
+  msd_sound_flush_set_free(set);
+  msd_sound_theme_index_free(index);
+
+  return n_missed == 0;
+}
+
+static void remove_tree(const char *path) {
+  GDir *dir;
+  const char *name;
+  char *child;
+
+  if ((dir = g_dir_open(path, 0, NULL)) != NULL) {
+    while ((name = g_dir_read_name(dir)) != NULL) {
+      child = g_build_filename(path, name, NULL);
+      remove_tree(child);
+      g_free(child);
+    }
+    g_dir_close(dir);
+  }
+
+  g_remove(path);
+}
+
+int main(int argc, char **argv) {
+  GError *error = NULL;
+  char *tmpdir, *sound_dir;
+  gboolean ok = TRUE;
+  guint i;
+
+  tmpdir = g_dir_make_tmp("bench-sound-cache-XXXXXX", &error);
+  if (tmpdir == NULL) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  sound_dir = g_build_filename(tmpdir, "sounds", NULL);
+
+  if (create_themes(sound_dir)) {
+    for (i = 0; i < G_N_ELEMENTS(tweaks); i++) {
+      if (!run_tweak(sound_dir, &tweaks[i])) ok = FALSE;
+    }
+  } else {
+    ok = FALSE;
+  }
+
+  remove_tree(tmpdir);
+  g_free(sound_dir);
+  g_free(tmpdir);
+
+  return ok ? 0 : 1;
+}
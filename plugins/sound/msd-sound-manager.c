@@ -38,11 +38,13 @@
 #include <unistd.h>
 
 #ifdef HAVE_PULSE
+#include <pulse/glib-mainloop.h>
 #include <pulse/pulseaudio.h>
 #endif
 
 #include "mate-settings-profile.h"
 #include "msd-sound-manager.h"
+#include "msd-sound-theme-index.h"
 
 struct _MsdSoundManager {
   GObject parent;
@@ -50,11 +52,36 @@ struct _MsdSoundManager {
 #ifdef HAVE_PULSE
   GSettings *settings;
   GList *monitors;
+
+  /* Monitors for the directories of theme_index, replaced whenever
+   * the index is rebuilt */
+  MsdSoundThemeIndex *theme_index;
+  GList *theme_monitors;
+  gboolean theme_index_stale;
+
+  pa_glib_mainloop *pa_mainloop;
+  pa_context *pa_context;
+  guint reconnect_id;
+
+  /* Samples due to be dropped, collected until the flush timeout
+   * fires */
+  MsdSoundFlushSet *pending;
+
+  /* The flush currently walking the server's sample list */
+  pa_operation *flush_op;
+  MsdSoundFlushSet *flushing;
 #endif /* HAVE_PULSE */
   guint timeout;
 };
 
 #define MATE_SOUND_SCHEMA "org.mate.sound"
+#define KEY_THEME_NAME "theme-name"
+#define KEY_INPUT_FEEDBACK_PREFIX "input-feedback"
+
+/* Set by libcanberra on the samples it uploads */
+#define SAMPLE_THEME_PROP "canberra.xdg-theme.name"
+
+#define RECONNECT_DELAY 5
 
 static void msd_sound_manager_finalize(GObject *object);
 
@@ -64,17 +91,54 @@ static gpointer manager_object = NULL;
 
 #ifdef HAVE_PULSE
 
+static void connect_context(MsdSoundManager *manager);
+static void flush_cache(MsdSoundManager *manager);
+
+static gboolean sample_is_flushed(MsdSoundManager *manager,
+                                  const pa_sample_info *i) {
+  const char *event_id;
+
+  /* We only flush those samples which have an XDG sound name
+   * attached, because only those originate from themeing  */
+  if (!(event_id = pa_proplist_gets(i->proplist, PA_PROP_EVENT_ID)))
+    return FALSE;
+
+  return msd_sound_flush_set_matches(
+      manager->flushing, pa_proplist_gets(i->proplist, SAMPLE_THEME_PROP),
+      event_id);
+}
+
+static void finish_flush(MsdSoundManager *manager) {
+  if (manager->flush_op) {
+    pa_operation_unref(manager->flush_op);
+    manager->flush_op = NULL;
+  }
+
+  g_clear_pointer(&manager->flushing, msd_sound_flush_set_free);
+}
+
 static void sample_info_cb(pa_context *c, const pa_sample_info *i, int eol,
                            void *userdata) {
+  MsdSoundManager *manager = MSD_SOUND_MANAGER(userdata);
   pa_operation *o;
 
-  if (!i) return;
+  if (eol) {
+    if (eol < 0)
+      g_debug("Sample enumeration failed: %s",
+              pa_strerror(pa_context_errno(c)));
+    else
+      g_debug("Sample cache flushed");
+
+    finish_flush(manager);
+
+    /* Pick up changes that came in while this flush was running */
+    flush_cache(manager);
+    return;
+  }
 
   g_debug("Found sample %s", i->name);
 
-  /* We only flush those samples which have an XDG sound name
-   * attached, because only those originate from themeing  */
-  if (!(pa_proplist_gets(i->proplist, PA_PROP_EVENT_ID))) return;
+  if (!sample_is_flushed(manager, i)) return;
 
   g_debug("Dropping sample %s from cache", i->name);
 
@@ -90,97 +154,195 @@ static void sample_info_cb(pa_context *c, const pa_sample_info *i, int eol,
    * speed things up a bit.*/
 }
 
-static void flush_cache(void) {
-  pa_mainloop *ml = NULL;
-  pa_context *c = NULL;
-  pa_proplist *pl = NULL;
-  pa_operation *o = NULL;
+static void flush_cache(MsdSoundManager *manager) {
+  /* Whatever is still running covers only the changes before it; the
+   * new request goes out as soon as it is done */
+  if (manager->flush_op != NULL) return;
+
+  if (msd_sound_flush_set_is_empty(manager->pending)) return;
+
+  /* Requests stay pending until the server is reachable again */
+  if (manager->pa_context == NULL ||
+      pa_context_get_state(manager->pa_context) != PA_CONTEXT_READY)
+    return;
 
   g_debug("Flushing sample cache");
 
-  if (!(ml = pa_mainloop_new())) {
-    g_debug("Failed to allocate pa_mainloop");
-    goto fail;
+  manager->flushing = manager->pending;
+  manager->pending = msd_sound_flush_set_new();
+
+  /* Enumerate all cached samples */
+  if (!(manager->flush_op = pa_context_get_sample_info_list(
+            manager->pa_context, sample_info_cb, manager))) {
+    g_debug("pa_context_get_sample_info_list(): %s",
+            pa_strerror(pa_context_errno(manager->pa_context)));
+    finish_flush(manager);
   }
+}
+
+static gboolean reconnect_cb(MsdSoundManager *manager) {
+  manager->reconnect_id = 0;
+  connect_context(manager);
+  return FALSE;
+}
+
+static void context_state_cb(pa_context *c, void *userdata) {
+  MsdSoundManager *manager = MSD_SOUND_MANAGER(userdata);
+
+  switch (pa_context_get_state(c)) {
+    case PA_CONTEXT_READY:
+      g_debug("Connected to the sound server");
+      flush_cache(manager);
+      break;
+
+    case PA_CONTEXT_FAILED:
+    case PA_CONTEXT_TERMINATED:
+      g_debug("Connection to the sound server lost: %s",
+              pa_strerror(pa_context_errno(c)));
+
+      /* Anything the failed flush had not reached yet is retried
+       * once we are back */
+      if (manager->flush_op) {
+        pa_operation_cancel(manager->flush_op);
+        msd_sound_flush_set_merge(manager->pending, manager->flushing);
+        finish_flush(manager);
+      }
+
+      pa_context_set_state_callback(c, NULL, NULL);
+      pa_context_unref(c);
+      manager->pa_context = NULL;
+
+      if (manager->reconnect_id == 0)
+        manager->reconnect_id = g_timeout_add_seconds(
+            RECONNECT_DELAY, (GSourceFunc)reconnect_cb, manager);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void connect_context(MsdSoundManager *manager) {
+  pa_proplist *pl;
 
   if (!(pl = pa_proplist_new())) {
     g_debug("Failed to allocate pa_proplist");
-    goto fail;
+    return;
   }
 
   pa_proplist_sets(pl, PA_PROP_APPLICATION_NAME, PACKAGE_NAME);
   pa_proplist_sets(pl, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
   pa_proplist_sets(pl, PA_PROP_APPLICATION_ID, "org.mate.SettingsDaemon");
 
-  if (!(c = pa_context_new_with_proplist(pa_mainloop_get_api(ml), PACKAGE_NAME,
-                                         pl))) {
+  manager->pa_context = pa_context_new_with_proplist(
+      pa_glib_mainloop_get_api(manager->pa_mainloop), PACKAGE_NAME, pl);
+  pa_proplist_free(pl);
+
+  if (manager->pa_context == NULL) {
     g_debug("Failed to allocate pa_context");
-    goto fail;
+    return;
   }
 
-  pa_proplist_free(pl);
-  pl = NULL;
-
-  if (pa_context_connect(c, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) < 0) {
-    g_debug("pa_context_connect(): %s", pa_strerror(pa_context_errno(c)));
-    goto fail;
+  pa_context_set_state_callback(manager->pa_context, context_state_cb,
+                                manager);
+
+  /* With NOFAIL the context waits for a server that is not up yet
+   * instead of failing straight away */
+  if (pa_context_connect(manager->pa_context, NULL,
+                         PA_CONTEXT_NOAUTOSPAWN | PA_CONTEXT_NOFAIL,
+                         NULL) < 0) {
+    g_debug("pa_context_connect(): %s",
+            pa_strerror(pa_context_errno(manager->pa_context)));
+    pa_context_set_state_callback(manager->pa_context, NULL, NULL);
+    pa_context_unref(manager->pa_context);
+    manager->pa_context = NULL;
+
+    manager->reconnect_id = g_timeout_add_seconds(
+        RECONNECT_DELAY, (GSourceFunc)reconnect_cb, manager);
   }
+}
 
-  /* Wait until the connection is established */
-  while (pa_context_get_state(c) != PA_CONTEXT_READY) {
-    if (!PA_CONTEXT_IS_GOOD(pa_context_get_state(c))) {
-      g_debug("Connection failed: %s", pa_strerror(pa_context_errno(c)));
-      goto fail;
-    }
-
-    if (pa_mainloop_iterate(ml, TRUE, NULL) < 0) {
-      g_debug("pa_mainloop_iterate() failed");
-      goto fail;
-    }
+static void disconnect_context(MsdSoundManager *manager) {
+  if (manager->reconnect_id) {
+    g_source_remove(manager->reconnect_id);
+    manager->reconnect_id = 0;
   }
 
-  /* Enumerate all cached samples */
-  if (!(o = pa_context_get_sample_info_list(c, sample_info_cb, NULL))) {
-    g_debug("pa_context_get_sample_info_list(): %s",
-            pa_strerror(pa_context_errno(c)));
-    goto fail;
+  if (manager->flush_op) {
+    pa_operation_cancel(manager->flush_op);
+    finish_flush(manager);
   }
 
-  /* Wait until our operation is finished and there's nothing
-   * more queued to send to the server */
-  while (pa_operation_get_state(o) == PA_OPERATION_RUNNING ||
-         pa_context_is_pending(c)) {
-    if (!PA_CONTEXT_IS_GOOD(pa_context_get_state(c))) {
-      g_debug("Connection failed: %s", pa_strerror(pa_context_errno(c)));
-      goto fail;
-    }
-
-    if (pa_mainloop_iterate(ml, TRUE, NULL) < 0) {
-      g_debug("pa_mainloop_iterate() failed");
-      goto fail;
-    }
+  if (manager->pa_context) {
+    pa_context_set_state_callback(manager->pa_context, NULL, NULL);
+    pa_context_disconnect(manager->pa_context);
+    pa_context_unref(manager->pa_context);
+    manager->pa_context = NULL;
   }
 
-  g_debug("Sample cache flushed");
+  g_clear_pointer(&manager->pa_mainloop, pa_glib_mainloop_free);
+}
+
+static void file_monitor_changed_cb(GFileMonitor *monitor, GFile *file,
+                                    GFile *other_file, GFileMonitorEvent event,
+                                    MsdSoundManager *manager);
+
+static gboolean register_directory_callback(MsdSoundManager *manager,
+                                            const char *path, GList **monitors,
+                                            GError **error) {
+  GFile *f;
+  GFileMonitor *m;
+  gboolean succ = FALSE;
 
-fail:
-  if (o) {
-    pa_operation_cancel(o);
-    pa_operation_unref(o);
+  g_debug("Registering directory monitor for %s", path);
+
+  f = g_file_new_for_path(path);
+
+  m = g_file_monitor_directory(f, 0, NULL, error);
+
+  if (m != NULL) {
+    g_signal_connect(m, "changed", G_CALLBACK(file_monitor_changed_cb),
+                     manager);
+
+    *monitors = g_list_prepend(*monitors, m);
+
+    succ = TRUE;
   }
 
-  if (c) {
-    pa_context_disconnect(c);
-    pa_context_unref(c);
+  g_object_unref(f);
+
+  return succ;
+}
+
+static void free_monitors(GList **monitors) {
+  while (*monitors) {
+    g_file_monitor_cancel(G_FILE_MONITOR((*monitors)->data));
+    g_object_unref((*monitors)->data);
+    *monitors = g_list_delete_link(*monitors, *monitors);
   }
+}
+
+static void load_theme_index(MsdSoundManager *manager) {
+  const char *const *dirs;
+  guint i;
 
-  if (pl) pa_proplist_free(pl);
+  free_monitors(&manager->theme_monitors);
+  msd_sound_theme_index_free(manager->theme_index);
 
-  if (ml) pa_mainloop_free(ml);
+  manager->theme_index = msd_sound_theme_index_new();
+  manager->theme_index_stale = FALSE;
+
+  /* The sound directories themselves are among the base monitors */
+  dirs = msd_sound_theme_index_get_directories(manager->theme_index);
+  for (i = 0; dirs[i] != NULL; i++)
+    register_directory_callback(manager, dirs[i], &manager->theme_monitors,
+                                NULL);
 }
 
 static gboolean flush_cb(MsdSoundManager *manager) {
-  flush_cache();
+  if (manager->theme_index_stale) load_theme_index(manager);
+
+  flush_cache(manager);
   manager->timeout = 0;
   return FALSE;
 }
@@ -195,40 +357,33 @@ static void trigger_flush(MsdSoundManager *manager) {
 
 static void gsettings_notify_cb(GSettings *client, gchar *key,
                                 MsdSoundManager *manager) {
+  /* Only these change which files the cached samples come from */
+  if (g_strcmp0(key, KEY_THEME_NAME) != 0 &&
+      !g_str_has_prefix(key, KEY_INPUT_FEEDBACK_PREFIX))
+    return;
+
+  msd_sound_flush_set_add_all(manager->pending);
   trigger_flush(manager);
 }
 
 static void file_monitor_changed_cb(GFileMonitor *monitor, GFile *file,
                                     GFile *other_file, GFileMonitorEvent event,
                                     MsdSoundManager *manager) {
-  g_debug("Theme dir changed");
-  trigger_flush(manager);
-}
-
-static gboolean register_directory_callback(MsdSoundManager *manager,
-                                            const char *path, GError **error) {
-  GFile *f;
-  GFileMonitor *m;
-  gboolean succ = FALSE;
-
-  g_debug("Registering directory monitor for %s", path);
-
-  f = g_file_new_for_path(path);
-
-  m = g_file_monitor_directory(f, 0, NULL, error);
-
-  if (m != NULL) {
-    g_signal_connect(m, "changed", G_CALLBACK(file_monitor_changed_cb),
-                     manager);
+  if (event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED ||
+      event == G_FILE_MONITOR_EVENT_PRE_UNMOUNT)
+    return;
 
-    manager->monitors = g_list_prepend(manager->monitors, m);
+  g_debug("Theme dir changed");
 
-    succ = TRUE;
-  }
+  /* Only the events served by the changed file are dropped, from its
+   * theme and from every theme inheriting from it */
+  if (msd_sound_theme_index_add_change(manager->theme_index, file,
+                                       manager->pending))
+    manager->theme_index_stale = TRUE;
 
-  g_object_unref(f);
+  if (msd_sound_flush_set_is_empty(manager->pending)) return;
 
-  return succ;
+  trigger_flush(manager);
 }
 
 #endif
@@ -244,6 +399,13 @@ gboolean msd_sound_manager_start(MsdSoundManager *manager, GError **error) {
 
 #ifdef HAVE_PULSE
 
+  manager->pending = msd_sound_flush_set_new();
+
+  /* One connection for the lifetime of the manager, driven by the
+   * GLib main loop so flushing never blocks the daemon */
+  manager->pa_mainloop = pa_glib_mainloop_new(NULL);
+  connect_context(manager);
+
   /* We listen for change of the selected theme ... */
   manager->settings = g_settings_new(MATE_SOUND_SCHEMA);
 
@@ -262,7 +424,7 @@ gboolean msd_sound_manager_start(MsdSoundManager *manager, GError **error) {
     p = NULL;
 
   if (p) {
-    register_directory_callback(manager, p, NULL);
+    register_directory_callback(manager, p, &manager->monitors, NULL);
     g_free(p);
   }
 
@@ -272,9 +434,18 @@ gboolean msd_sound_manager_start(MsdSoundManager *manager, GError **error) {
 
   ps = g_strsplit(dd, ":", 0);
 
-  for (k = ps; *k; ++k) register_directory_callback(manager, *k, NULL);
+  for (k = ps; *k; ++k) {
+    register_directory_callback(manager, *k, &manager->monitors, NULL);
+
+    p = g_build_filename(*k, "sounds", NULL);
+    register_directory_callback(manager, p, &manager->monitors, NULL);
+    g_free(p);
+  }
 
   g_strfreev(ps);
+
+  /* ... and to the themes in there */
+  load_theme_index(manager);
 #endif
 
   mate_settings_profile_end(NULL);
@@ -296,12 +467,13 @@ void msd_sound_manager_stop(MsdSoundManager *manager) {
     manager->timeout = 0;
   }
 
-  while (manager->monitors) {
-    g_file_monitor_cancel(G_FILE_MONITOR(manager->monitors->data));
-    g_object_unref(manager->monitors->data);
-    manager->monitors =
-        g_list_delete_link(manager->monitors, manager->monitors);
-  }
+  disconnect_context(manager);
+
+  g_clear_pointer(&manager->pending, msd_sound_flush_set_free);
+
+  free_monitors(&manager->monitors);
+  free_monitors(&manager->theme_monitors);
+  g_clear_pointer(&manager->theme_index, msd_sound_theme_index_free);
 #endif
 }
 
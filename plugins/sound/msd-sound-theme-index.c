@@ -0,0 +1,501 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "msd-sound-theme-index.h"
+
+#include <string.h>
+
+/* Every theme falls back to this one once its own inheritance chain is
+ * exhausted, see the XDG sound theme specification */
+#define FALLBACK_THEME "freedesktop"
+
+/* How deep below a theme directory sound files live: locale, then
+ * output profile */
+#define MAX_THEME_DEPTH 2
+
+static const char *const sound_suffixes[] = {".disabled", ".oga", ".ogg",
+                                             ".wav"};
+
+struct MsdSoundFlushSet {
+  gboolean all;
+
+  /* Events stale in every theme */
+  GHashTable *any_theme_events;
+
+  /* Theme name to its set of stale events, or to NULL when all of the
+   * theme is stale */
+  GHashTable *themes;
+};
+
+struct MsdSoundThemeIndex {
+  char **sound_dirs;
+
+  /* Theme name to the themes it inherits from, as found in the first
+   * index.theme for that name */
+  GHashTable *parents;
+
+  /* Theme name to a GPtrArray of the themes inheriting from it */
+  GHashTable *children;
+
+  /* Every theme directory and subdirectory of a theme, NULL-terminated */
+  GPtrArray *directories;
+};
+
+static void destroy_event_set(gpointer data) {
+  if (data != NULL) g_hash_table_destroy(data);
+}
+
+static GHashTable *event_set_new(void) {
+  return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+MsdSoundFlushSet *msd_sound_flush_set_new(void) {
+  MsdSoundFlushSet *set;
+
+  set = g_new0(MsdSoundFlushSet, 1);
+  set->any_theme_events = event_set_new();
+  set->themes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      destroy_event_set);
+
+  return set;
+}
+
+void msd_sound_flush_set_free(MsdSoundFlushSet *set) {
+  if (set == NULL) return;
+
+  g_hash_table_destroy(set->any_theme_events);
+  g_hash_table_destroy(set->themes);
+  g_free(set);
+}
+
+void msd_sound_flush_set_add_all(MsdSoundFlushSet *set) { set->all = TRUE; }
+
+void msd_sound_flush_set_add_theme(MsdSoundFlushSet *set, const char *theme) {
+  g_hash_table_replace(set->themes, g_strdup(theme), NULL);
+}
+
+void msd_sound_flush_set_add_event(MsdSoundFlushSet *set, const char *theme,
+                                   const char *event_id) {
+  GHashTable *events;
+
+  if (theme == NULL) {
+    g_hash_table_add(set->any_theme_events, g_strdup(event_id));
+    return;
+  }
+
+  if (g_hash_table_lookup_extended(set->themes, theme, NULL,
+                                   (gpointer *)&events)) {
+    /* The whole theme goes anyway */
+    if (events == NULL) return;
+  } else {
+    events = event_set_new();
+    g_hash_table_insert(set->themes, g_strdup(theme), events);
+  }
+
+  g_hash_table_add(events, g_strdup(event_id));
+}
+
+void msd_sound_flush_set_merge(MsdSoundFlushSet *set,
+                               const MsdSoundFlushSet *other) {
+  GHashTableIter iter, events_iter;
+  gpointer theme, events, event_id;
+
+  if (other->all) set->all = TRUE;
+
+  g_hash_table_iter_init(&iter, other->any_theme_events);
+  while (g_hash_table_iter_next(&iter, &event_id, NULL))
+    msd_sound_flush_set_add_event(set, NULL, event_id);
+
+  g_hash_table_iter_init(&iter, other->themes);
+  while (g_hash_table_iter_next(&iter, &theme, &events)) {
+    if (events == NULL) {
+      msd_sound_flush_set_add_theme(set, theme);
+      continue;
+    }
+
+    g_hash_table_iter_init(&events_iter, events);
+    while (g_hash_table_iter_next(&events_iter, &event_id, NULL))
+      msd_sound_flush_set_add_event(set, theme, event_id);
+  }
+}
+
+/* Whether @events has @event_id or a name it falls back to: like
+ * libcanberra, "bell-terminal" is looked up as "bell" when no theme has
+ * a sound for it, so a change to "bell" may make it stale as well */
+static gboolean event_set_matches(GHashTable *events, const char *event_id) {
+  char *name, *dash;
+  gboolean found = FALSE;
+
+  name = g_strdup(event_id);
+  do {
+    if (g_hash_table_contains(events, name)) {
+      found = TRUE;
+      break;
+    }
+
+    dash = strrchr(name, '-');
+    if (dash != NULL) *dash = '\0';
+  } while (dash != NULL);
+  g_free(name);
+
+  return found;
+}
+
+gboolean msd_sound_flush_set_is_empty(const MsdSoundFlushSet *set) {
+  return !set->all && g_hash_table_size(set->any_theme_events) == 0 &&
+         g_hash_table_size(set->themes) == 0;
+}
+
+/* Whether the sample cached for @event_id while @theme was selected is
+ * stale, @event_id or a name it falls back to having changed. Samples
+ * that do not say which theme they came from are dropped whenever any
+ * theme has the event, or all of its events, stale. */
+gboolean msd_sound_flush_set_matches(const MsdSoundFlushSet *set,
+                                     const char *theme, const char *event_id) {
+  GHashTableIter iter;
+  GHashTable *events;
+
+  if (set->all) return TRUE;
+
+  if (event_id == NULL) return !msd_sound_flush_set_is_empty(set);
+
+  if (event_set_matches(set->any_theme_events, event_id)) return TRUE;
+
+  if (theme == NULL) {
+    g_hash_table_iter_init(&iter, set->themes);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&events)) {
+      if (events == NULL || event_set_matches(events, event_id)) return TRUE;
+    }
+    return FALSE;
+  }
+
+  if (!g_hash_table_lookup_extended(set->themes, theme, NULL,
+                                    (gpointer *)&events))
+    return FALSE;
+
+  return events == NULL || event_set_matches(events, event_id);
+}
+
+static char **read_inherits(const char *theme_dir) {
+  GKeyFile *keyfile;
+  char *path, *inherits;
+  char **parents = NULL;
+  guint i;
+
+  path = g_build_filename(theme_dir, "index.theme", NULL);
+  keyfile = g_key_file_new();
+
+  if (g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, NULL)) {
+    inherits =
+        g_key_file_get_string(keyfile, "Sound Theme", "Inherits", NULL);
+    if (inherits != NULL) {
+      parents = g_strsplit(inherits, ",", 0);
+      for (i = 0; parents[i] != NULL; i++) g_strstrip(parents[i]);
+      g_free(inherits);
+    }
+  }
+
+  g_key_file_free(keyfile);
+  g_free(path);
+
+  return parents;
+}
+
+static void add_directories(MsdSoundThemeIndex *index, const char *path,
+                            int depth) {
+  GDir *dir;
+  const char *name;
+  char *child;
+
+  g_ptr_array_add(index->directories, g_strdup(path));
+
+  if (depth >= MAX_THEME_DEPTH) return;
+
+  if (!(dir = g_dir_open(path, 0, NULL))) return;
+
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    child = g_build_filename(path, name, NULL);
+    if (g_file_test(child, G_FILE_TEST_IS_DIR))
+      add_directories(index, child, depth + 1);
+    g_free(child);
+  }
+
+  g_dir_close(dir);
+}
+
+static void add_child(MsdSoundThemeIndex *index, const char *parent,
+                      const char *theme) {
+  GPtrArray *children;
+
+  children = g_hash_table_lookup(index->children, parent);
+  if (children == NULL) {
+    children = g_ptr_array_new_with_free_func(g_free);
+    g_hash_table_insert(index->children, g_strdup(parent), children);
+  }
+
+  g_ptr_array_add(children, g_strdup(theme));
+}
+
+static void scan_sound_dir(MsdSoundThemeIndex *index, const char *sound_dir) {
+  GDir *dir;
+  const char *theme;
+  char *theme_dir;
+
+  if (!(dir = g_dir_open(sound_dir, 0, NULL))) return;
+
+  while ((theme = g_dir_read_name(dir)) != NULL) {
+    theme_dir = g_build_filename(sound_dir, theme, NULL);
+
+    if (g_file_test(theme_dir, G_FILE_TEST_IS_DIR)) {
+      add_directories(index, theme_dir, 0);
+
+      /* Earlier directories shadow later ones */
+      if (!g_hash_table_contains(index->parents, theme))
+        g_hash_table_insert(index->parents, g_strdup(theme),
+                            read_inherits(theme_dir));
+    }
+
+    g_free(theme_dir);
+  }
+
+  g_dir_close(dir);
+}
+
+MsdSoundThemeIndex *msd_sound_theme_index_new_for_dirs(
+    const char *const *sound_dirs) {
+  MsdSoundThemeIndex *index;
+  GHashTableIter iter;
+  gpointer theme, parents;
+  guint i;
+
+  index = g_new0(MsdSoundThemeIndex, 1);
+  index->sound_dirs = g_strdupv((char **)sound_dirs);
+  index->parents =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                            (GDestroyNotify)g_strfreev);
+  index->children = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+  index->directories = g_ptr_array_new_with_free_func(g_free);
+
+  for (i = 0; sound_dirs[i] != NULL; i++)
+    scan_sound_dir(index, sound_dirs[i]);
+
+  g_ptr_array_add(index->directories, NULL);
+
+  g_hash_table_iter_init(&iter, index->parents);
+  while (g_hash_table_iter_next(&iter, &theme, &parents)) {
+    for (i = 0; parents != NULL && ((char **)parents)[i] != NULL; i++)
+      add_child(index, ((char **)parents)[i], theme);
+  }
+
+  g_debug("Indexed %u sound theme(s) in %u directories",
+          g_hash_table_size(index->parents), index->directories->len - 1);
+
+  return index;
+}
+
+MsdSoundThemeIndex *msd_sound_theme_index_new(void) {
+  MsdSoundThemeIndex *index;
+  const char *const *data_dirs;
+  GPtrArray *sound_dirs;
+  guint i;
+
+  sound_dirs = g_ptr_array_new_with_free_func(g_free);
+
+  g_ptr_array_add(sound_dirs,
+                  g_build_filename(g_get_user_data_dir(), "sounds", NULL));
+
+  data_dirs = g_get_system_data_dirs();
+  for (i = 0; data_dirs[i] != NULL; i++)
+    g_ptr_array_add(sound_dirs,
+                    g_build_filename(data_dirs[i], "sounds", NULL));
+
+  g_ptr_array_add(sound_dirs, NULL);
+
+  index = msd_sound_theme_index_new_for_dirs(
+      (const char *const *)sound_dirs->pdata);
+
+  g_ptr_array_unref(sound_dirs);
+
+  return index;
+}
+
+void msd_sound_theme_index_free(MsdSoundThemeIndex *index) {
+  if (index == NULL) return;
+
+  g_strfreev(index->sound_dirs);
+  g_hash_table_destroy(index->parents);
+  g_hash_table_destroy(index->children);
+  g_ptr_array_unref(index->directories);
+  g_free(index);
+}
+
+const char *const *msd_sound_theme_index_get_directories(
+    MsdSoundThemeIndex *index) {
+  return (const char *const *)index->directories->pdata;
+}
+
+/* @theme and every theme inheriting from it, directly or not */
+static GHashTable *get_dependents(MsdSoundThemeIndex *index,
+                                  const char *theme) {
+  GHashTable *dependents;
+  GQueue queue = G_QUEUE_INIT;
+  GPtrArray *children;
+  const char *current;
+  guint i;
+
+  dependents = g_hash_table_new(g_str_hash, g_str_equal);
+  g_hash_table_add(dependents, (gpointer)theme);
+  g_queue_push_tail(&queue, (gpointer)theme);
+
+  while ((current = g_queue_pop_head(&queue)) != NULL) {
+    children = g_hash_table_lookup(index->children, current);
+    if (children == NULL) continue;
+
+    for (i = 0; i < children->len; i++) {
+      if (g_hash_table_contains(dependents, children->pdata[i])) continue;
+
+      g_hash_table_add(dependents, children->pdata[i]);
+      g_queue_push_tail(&queue, children->pdata[i]);
+    }
+  }
+
+  return dependents;
+}
+
+/* Marks @event_id, or all events when it is NULL, stale in @theme and in
+ * every theme that may resolve sounds through it */
+static void add_theme_change(MsdSoundThemeIndex *index, const char *theme,
+                             const char *event_id, MsdSoundFlushSet *set) {
+  GHashTable *dependents;
+  GHashTableIter iter;
+  gpointer dependent;
+
+  if (g_strcmp0(theme, FALLBACK_THEME) == 0) {
+    if (event_id != NULL)
+      msd_sound_flush_set_add_event(set, NULL, event_id);
+    else
+      msd_sound_flush_set_add_all(set);
+    return;
+  }
+
+  dependents = get_dependents(index, theme);
+
+  g_hash_table_iter_init(&iter, dependents);
+  while (g_hash_table_iter_next(&iter, &dependent, NULL)) {
+    if (event_id != NULL)
+      msd_sound_flush_set_add_event(set, dependent, event_id);
+    else
+      msd_sound_flush_set_add_theme(set, dependent);
+  }
+
+  g_hash_table_destroy(dependents);
+}
+
+static char *get_event_id(const char *name) {
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(sound_suffixes); i++) {
+    if (g_str_has_suffix(name, sound_suffixes[i]))
+      return g_strndup(name, strlen(name) - strlen(sound_suffixes[i]));
+  }
+
+  return NULL;
+}
+
+static const char *find_relative_path(MsdSoundThemeIndex *index,
+                                      const char *path) {
+  gsize len;
+  guint i;
+
+  for (i = 0; index->sound_dirs[i] != NULL; i++) {
+    len = strlen(index->sound_dirs[i]);
+
+    if (strncmp(path, index->sound_dirs[i], len) != 0) continue;
+
+    if (path[len] == '\0') return path + len;
+    if (path[len] == G_DIR_SEPARATOR) return path + len + 1;
+  }
+
+  return NULL;
+}
+
+/* Adds the samples made stale by a change to @file to @set. Returns TRUE
+ * when the change may have added or removed themes or directories, or
+ * changed how themes inherit, so that the index needs to be rebuilt. */
+gboolean msd_sound_theme_index_add_change(MsdSoundThemeIndex *index,
+                                          GFile *file, MsdSoundFlushSet *set) {
+  char *path, *basename, *event_id;
+  const char *relative;
+  char **components;
+  guint n_components;
+  gboolean rebuild = TRUE;
+
+  path = g_file_get_path(file);
+  if (path == NULL) return FALSE;
+
+  relative = find_relative_path(index, path);
+
+  if (relative == NULL) {
+    /* A sounds directory may have appeared in a data directory; nothing
+     * else outside the sound directories matters */
+    basename = g_file_get_basename(file);
+    if (g_strcmp0(basename, "sounds") == 0)
+      msd_sound_flush_set_add_all(set);
+    else
+      rebuild = FALSE;
+    g_free(basename);
+    g_free(path);
+    return rebuild;
+  }
+
+  if (*relative == '\0') {
+    msd_sound_flush_set_add_all(set);
+    g_free(path);
+    return TRUE;
+  }
+
+  components = g_strsplit(relative, G_DIR_SEPARATOR_S, 0);
+  n_components = g_strv_length(components);
+
+  if (n_components == 2 &&
+      g_strcmp0(components[1], "index.theme") == 0) {
+    add_theme_change(index, components[0], NULL, set);
+  } else if (n_components > 1 &&
+             (event_id = get_event_id(components[n_components - 1]))) {
+    g_debug("Sound file for event %s of theme %s changed", event_id,
+            components[0]);
+    add_theme_change(index, components[0], event_id, set);
+    g_free(event_id);
+    rebuild = FALSE;
+  } else {
+    /* The theme directory itself or one of its subdirectories */
+    add_theme_change(index, components[0], NULL, set);
+  }
+
+  g_strfreev(components);
+  g_free(path);
+
+  return rebuild;
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef MSD_SOUND_THEME_INDEX_H
+#define MSD_SOUND_THEME_INDEX_H
+
+#include <gio/gio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The cached samples a set of theme changes makes stale: whole themes,
+ * single events of a theme, or single events of every theme */
+typedef struct MsdSoundFlushSet MsdSoundFlushSet;
+
+MsdSoundFlushSet *msd_sound_flush_set_new(void);
+void msd_sound_flush_set_free(MsdSoundFlushSet *set);
+
+void msd_sound_flush_set_add_all(MsdSoundFlushSet *set);
+void msd_sound_flush_set_add_theme(MsdSoundFlushSet *set, const char *theme);
+void msd_sound_flush_set_add_event(MsdSoundFlushSet *set, const char *theme,
+                                   const char *event_id);
+void msd_sound_flush_set_merge(MsdSoundFlushSet *set,
+                               const MsdSoundFlushSet *other);
+
+gboolean msd_sound_flush_set_is_empty(const MsdSoundFlushSet *set);
+gboolean msd_sound_flush_set_matches(const MsdSoundFlushSet *set,
+                                     const char *theme, const char *event_id);
+
+/* The sound themes installed in the XDG data directories and the way
+ * they inherit from each other */
+typedef struct MsdSoundThemeIndex MsdSoundThemeIndex;
+
+MsdSoundThemeIndex *msd_sound_theme_index_new(void);
+MsdSoundThemeIndex *msd_sound_theme_index_new_for_dirs(
+    const char *const *sound_dirs);
+void msd_sound_theme_index_free(MsdSoundThemeIndex *index);
+
+const char *const *msd_sound_theme_index_get_directories(
+    MsdSoundThemeIndex *index);
+
+gboolean msd_sound_theme_index_add_change(MsdSoundThemeIndex *index,
+                                          GFile *file, MsdSoundFlushSet *set);
+
+G_END_DECLS
+
+#endif /* MSD_SOUND_THEME_INDEX_H */
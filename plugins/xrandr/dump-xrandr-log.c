@@ -0,0 +1,192 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Prints the xrandr plugin's debug log, oldest record first, followed
+ * by how long the handled screen changes took.  The log is written
+ * while the plugin's debug-log setting is on.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <stdio.h>
+
+#include "msd-xrandr-log.h"
+
+typedef struct {
+  guint count;
+  gint64 total;
+  gint64 worst;
+} Latency;
+
+static char *only_event = NULL;
+static gboolean summary_only = FALSE;
+
+static GHashTable *latencies;
+
+static const GOptionEntry entries[] = {
+    {"event", 'e', 0, G_OPTION_ARG_STRING, &only_event,
+     "Only print records of this event", "EVENT"},
+    {"summary", 's', 0, G_OPTION_ARG_NONE, &summary_only,
+     "Only print the latency summary", NULL},
+    {NULL}};
+
+static void print_outputs(GVariant *outputs) {
+  GVariantIter iter;
+  GVariant *output;
+
+  g_variant_iter_init(&iter, outputs);
+  while ((output = g_variant_iter_next_value(&iter)) != NULL) {
+    const char *name = "?";
+    gboolean connected = FALSE, primary = FALSE;
+    gint32 x, y, width, height, rate;
+
+    g_variant_lookup(output, "name", "&s", &name);
+    g_variant_lookup(output, "connected", "b", &connected);
+
+    if (!connected) {
+      g_print("\n    %s: disconnected", name);
+    } else if (g_variant_lookup(output, "geometry", "(iiii)", &x, &y, &width,
+                                &height)) {
+      rate = 0;
+      g_variant_lookup(output, "rate", "i", &rate);
+      g_variant_lookup(output, "primary", "b", &primary);
+      g_print("\n    %s: %dx%d@%d +%d+%d%s", name, width, height, rate, x, y,
+              primary ? " (primary)" : "");
+    } else {
+      g_print("\n    %s: off", name);
+    }
+
+    g_variant_unref(output);
+  }
+}
+
+static void print_record(gint64 time, const char *event, GVariant *fields,
+                         gpointer user_data) {
+  GDateTime *date;
+  GVariantIter iter;
+  GVariant *value;
+  GVariant *outputs = NULL;
+  const char *key;
+  char *text;
+  gint64 latency;
+
+  if (g_variant_lookup(fields, "latency", "x", &latency)) {
+    Latency *l = g_hash_table_lookup(latencies, event);
+
+    if (l == NULL) {
+      l = g_new0(Latency, 1);
+      g_hash_table_insert(latencies, g_strdup(event), l);
+    }
+    l->count++;
+    l->total += latency;
+    l->worst = MAX(l->worst, latency);
+  }
+
+  if (summary_only) return;
+  if (only_event != NULL && g_strcmp0(only_event, event) != 0) return;
+
+  date = g_date_time_new_from_unix_local(time / G_USEC_PER_SEC);
+  text = g_date_time_format(date, "%F %T");
+  g_print("%s.%06d %s", text, (int)(time % G_USEC_PER_SEC), event);
+  g_free(text);
+  g_date_time_unref(date);
+
+  g_variant_iter_init(&iter, fields);
+  while (g_variant_iter_next(&iter, "{&sv}", &key, &value)) {
+    if (g_strcmp0(key, "outputs") == 0) {
+      outputs = value;
+      continue;
+    }
+
+    if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+      g_print(" %s=%s", key, g_variant_get_string(value, NULL));
+    else {
+      text = g_variant_print(value, FALSE);
+      g_print(" %s=%s", key, text);
+      g_free(text);
+    }
+    g_variant_unref(value);
+  }
+
+  if (outputs != NULL) {
+    print_outputs(outputs);
+    g_variant_unref(outputs);
+  }
+
+  g_print("\n");
+}
+
+static void print_latency(gpointer key, gpointer value, gpointer user_data) {
+  Latency *l = value;
+
+  g_print("%-12s %5u handled, mean %" G_GINT64_FORMAT
+          " us, worst %" G_GINT64_FORMAT " us\n",
+          (const char *)key, l->count, l->total / l->count, l->worst);
+}
+
+int main(int argc, char **argv) {
+  GOptionContext *context;
+  GError *error = NULL;
+  char *filename;
+  char *rotated;
+  gboolean ok = TRUE;
+
+  context = g_option_context_new("[LOGFILE]");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (argc > 1)
+    filename = g_strdup(argv[1]);
+  else
+    filename = msd_xrandr_log_get_default_filename();
+  rotated = g_strconcat(filename, ".1", NULL);
+
+  latencies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  /* The rotated file holds the older records, and need not exist */
+  if (g_file_test(rotated, G_FILE_TEST_EXISTS) &&
+      !msd_xrandr_log_read(rotated, print_record, NULL, &error)) {
+    g_printerr("%s\n", error->message);
+    g_clear_error(&error);
+  }
+
+  if (!msd_xrandr_log_read(filename, print_record, NULL, &error)) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    ok = FALSE;
+  }
+
+  if (g_hash_table_size(latencies) > 0) {
+    if (!summary_only) g_print("\n");
+    g_hash_table_foreach(latencies, print_latency, NULL);
+  }
+
+  g_hash_table_destroy(latencies);
+  g_free(rotated);
+  g_free(filename);
+
+  return ok ? 0 : 1;
+}
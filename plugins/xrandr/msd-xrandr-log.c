@@ -0,0 +1,233 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "msd-xrandr-log.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Every log file starts with this, so that a truncated or foreign file
+ * is not mistaken for records */
+#define LOG_MAGIC "MSDXRL01"
+#define LOG_MAGIC_LEN 8
+
+/* A record is a little-endian guint32 size followed by the serialized
+ * (time, event, fields) tuple */
+#define RECORD_TYPE "(xsa{sv})"
+
+struct MsdXrandrLog {
+  char *filename;
+  char *rotated_filename;
+  goffset max_size;
+
+  FILE *file;
+  goffset size;
+};
+
+char *msd_xrandr_log_get_default_filename(void) {
+  return g_build_filename(g_get_user_cache_dir(), "mate-settings-daemon",
+                          "xrandr-events.log", NULL);
+}
+
+static gboolean open_log_file(MsdXrandrLog *log, GError **error) {
+  char magic[LOG_MAGIC_LEN];
+
+  log->file = fopen(log->filename, "a+b");
+  if (log->file == NULL) goto fail;
+
+  fseek(log->file, 0, SEEK_END);
+  log->size = ftell(log->file);
+
+  if (log->size > 0) {
+    rewind(log->file);
+    if (fread(magic, 1, LOG_MAGIC_LEN, log->file) == LOG_MAGIC_LEN &&
+        memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) == 0) {
+      fseek(log->file, 0, SEEK_END);
+      return TRUE;
+    }
+
+    /* Not one of ours, or written by an older version; start over */
+    fclose(log->file);
+    log->file = fopen(log->filename, "w+b");
+    if (log->file == NULL) goto fail;
+  }
+
+  if (fwrite(LOG_MAGIC, 1, LOG_MAGIC_LEN, log->file) != LOG_MAGIC_LEN)
+    goto fail;
+  fflush(log->file);
+  log->size = LOG_MAGIC_LEN;
+
+  return TRUE;
+
+fail:
+  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+              "Could not open %s: %s", log->filename, g_strerror(errno));
+  if (log->file != NULL) {
+    fclose(log->file);
+    log->file = NULL;
+  }
+  return FALSE;
+}
+
+MsdXrandrLog *msd_xrandr_log_new(const char *filename, goffset max_size,
+                                 GError **error) {
+  MsdXrandrLog *log;
+  char *dir;
+
+  dir = g_path_get_dirname(filename);
+  g_mkdir_with_parents(dir, 0700);
+  g_free(dir);
+
+  log = g_new0(MsdXrandrLog, 1);
+  log->filename = g_strdup(filename);
+  log->rotated_filename = g_strconcat(filename, ".1", NULL);
+  log->max_size = max_size;
+
+  if (!open_log_file(log, error)) {
+    msd_xrandr_log_free(log);
+    return NULL;
+  }
+
+  return log;
+}
+
+void msd_xrandr_log_free(MsdXrandrLog *log) {
+  if (log == NULL) return;
+
+  if (log->file != NULL) fclose(log->file);
+  g_free(log->filename);
+  g_free(log->rotated_filename);
+  g_free(log);
+}
+
+static void rotate(MsdXrandrLog *log) {
+  GError *error = NULL;
+
+  fclose(log->file);
+  log->file = NULL;
+
+  if (g_rename(log->filename, log->rotated_filename) < 0)
+    g_unlink(log->filename);
+
+  if (!open_log_file(log, &error)) {
+    g_warning("%s", error->message);
+    g_error_free(error);
+  }
+}
+
+void msd_xrandr_log_append(MsdXrandrLog *log, const char *event,
+                           GVariant *fields) {
+  GVariant *record;
+  guint32 size;
+  guint32 header;
+
+  if (fields == NULL) fields = g_variant_new("a{sv}", NULL);
+
+  record = g_variant_ref_sink(
+      g_variant_new("(xs@a{sv})", g_get_real_time(), event, fields));
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN) {
+    GVariant *swapped = g_variant_byteswap(record);
+
+    g_variant_unref(record);
+    record = swapped;
+  }
+
+  if (log->file == NULL) goto out;
+
+  size = g_variant_get_size(record);
+  if (log->size > LOG_MAGIC_LEN &&
+      log->size + sizeof(header) + size > log->max_size) {
+    rotate(log);
+    if (log->file == NULL) goto out;
+  }
+
+  header = GUINT32_TO_LE(size);
+  fwrite(&header, sizeof(header), 1, log->file);
+  fwrite(g_variant_get_data(record), 1, size, log->file);
+  fflush(log->file);
+  log->size += sizeof(header) + size;
+
+out:
+  g_variant_unref(record);
+}
+
+gboolean msd_xrandr_log_read(const char *filename, MsdXrandrLogFunc func,
+                             gpointer user_data, GError **error) {
+  char *contents;
+  gsize length;
+  gsize offset;
+
+  if (!g_file_get_contents(filename, &contents, &length, error)) return FALSE;
+
+  if (length < LOG_MAGIC_LEN ||
+      memcmp(contents, LOG_MAGIC, LOG_MAGIC_LEN) != 0) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                "%s is not an xrandr event log", filename);
+    g_free(contents);
+    return FALSE;
+  }
+
+  offset = LOG_MAGIC_LEN;
+  while (offset + sizeof(guint32) <= length) {
+    GBytes *bytes;
+    GVariant *record;
+    GVariant *fields;
+    const char *event;
+    gint64 time;
+    guint32 size;
+
+    memcpy(&size, contents + offset, sizeof(size));
+    size = GUINT32_FROM_LE(size);
+    offset += sizeof(size);
+
+    /* A record cut short by a crash ends the log */
+    if (size > length - offset) break;
+
+    /* Copied, as GVariant wants its data aligned */
+    bytes = g_bytes_new(contents + offset, size);
+    record = g_variant_ref_sink(
+        g_variant_new_from_bytes(G_VARIANT_TYPE(RECORD_TYPE), bytes, FALSE));
+    g_bytes_unref(bytes);
+    if (G_BYTE_ORDER == G_BIG_ENDIAN) {
+      GVariant *swapped = g_variant_byteswap(record);
+
+      g_variant_unref(record);
+      record = swapped;
+    }
+
+    g_variant_get(record, "(x&s@a{sv})", &time, &event, &fields);
+    func(time, event, fields, user_data);
+    g_variant_unref(fields);
+    g_variant_unref(record);
+
+    offset += size;
+  }
+
+  g_free(contents);
+
+  return TRUE;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef MSD_XRANDR_LOG_H
+#define MSD_XRANDR_LOG_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Debug log of what the xrandr plugin did.  Each record is an event name
+ * with an a{sv} dictionary of fields, serialized as a GVariant.  When the
+ * file grows past its maximum size it is moved aside to "<filename>.1",
+ * so the log never takes more than twice that. */
+typedef struct MsdXrandrLog MsdXrandrLog;
+
+typedef void (*MsdXrandrLogFunc)(gint64 time, const char *event,
+                                 GVariant *fields, gpointer user_data);
+
+char *msd_xrandr_log_get_default_filename(void);
+
+MsdXrandrLog *msd_xrandr_log_new(const char *filename, goffset max_size,
+                                 GError **error);
+void msd_xrandr_log_free(MsdXrandrLog *log);
+
+void msd_xrandr_log_append(MsdXrandrLog *log, const char *event,
+                           GVariant *fields);
+
+gboolean msd_xrandr_log_read(const char *filename, MsdXrandrLogFunc func,
+                             gpointer user_data, GError **error);
+
+G_END_DECLS
+
+#endif /* MSD_XRANDR_LOG_H */
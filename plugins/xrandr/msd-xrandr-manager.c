@@ -31,6 +31,7 @@
 #include <gio/gio.h>
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <locale.h>
 #include <stdio.h>
@@ -52,6 +53,7 @@
 #endif
 
 #include "mate-settings-profile.h"
+#include "msd-xrandr-log.h"
 #include "msd-xrandr-manager.h"
 
 #define CONF_SCHEMA "org.mate.SettingsDaemon.plugins.xrandr"
@@ -62,6 +64,7 @@
 #define CONF_KEY_TURN_ON_LAPTOP_MONITOR_AT_STARTUP \
   "turn-on-laptop-monitor-at-startup"
 #define CONF_KEY_DEFAULT_CONFIGURATION_FILE "default-configuration-file"
+#define CONF_KEY_DEBUG_LOG "debug-log"
 
 #define VIDEO_KEYSYM "XF86Display"
 #define ROTATE_KEYSYM "XF86RotateWindows"
@@ -71,6 +74,13 @@
  */
 #define CONFIRMATION_DIALOG_SECONDS 30
 
+/* How long the screen has to stay unchanged before the fn-F7 cycle is
+ * worked out for it */
+#define FN_F7_SETTLE_DELAY 500 /* ms */
+
+/* Size at which the debug log is moved aside and a new one started */
+#define EVENT_LOG_MAX_SIZE (512 * 1024)
+
 /* name of the icon files (msd-xrandr.svg, etc.) */
 #define MSD_XRANDR_ICON_NAME "msd-xrandr"
 
@@ -82,6 +92,15 @@
 #define MSD_XRANDR_DBUS_PATH MSD_DBUS_PATH "/XRANDR"
 #define MSD_XRANDR_DBUS_NAME MSD_DBUS_NAME ".XRANDR"
 
+/* Where the user's decision about a configuration applied through D-Bus
+ * stands; see begin_confirmation() */
+typedef enum {
+  CONFIRMATION_NONE,
+  CONFIRMATION_PENDING,
+  CONFIRMATION_CONFIRMED,
+  CONFIRMATION_REVERTED
+} ConfirmationState;
+
 struct MsdXrandrManagerPrivate {
   DBusGConnection *dbus_connection;
 
@@ -105,10 +124,33 @@ struct MsdXrandrManagerPrivate {
   int current_fn_f7_config; /* -1 if no configs */
   MateRRConfig *
       *fn_f7_configs; /* NULL terminated, NULL if there are no configs */
+  char **fn_f7_keys;  /* get_config_key() of each of fn_f7_configs */
+  guint fn_f7_timeout_id;
 
   /* Last time at which we got a "screen got reconfigured" event; see
    * on_randr_event() */
   guint32 last_config_timestamp;
+
+  /* Configurations from the intended file by fingerprint of the outputs
+   * they were stored for, or NULL if none matches; see
+   * apply_intended_configuration_from_index() */
+  GHashTable *config_index;
+  char *config_index_stamp;
+  GFileMonitor *intended_monitor;
+  GFileMonitor *backup_monitor;
+
+  /* Rotations each output allows in its current mode and position,
+   * until the screen changes; see get_allowed_rotations_for_output() */
+  GHashTable *rotation_cache;
+
+  /* "Does the display look OK?" countdown.  Hotplug events that arrive
+   * while it is pending are handled once the user has decided. */
+  ConfirmationState confirmation_state;
+  GtkWidget *confirmation_dialog;
+  guint confirmation_timeout_id;
+  int confirmation_countdown;
+  guint32 confirmation_timestamp;
+  gboolean randr_event_queued;
 };
 
 static const MateRRRotation possible_rotations[] = {
@@ -126,8 +168,8 @@ static void error_message(MsdXrandrManager *mgr, const char *primary_text,
 static void status_icon_popup_menu(MsdXrandrManager *manager, guint button,
                                    guint32 timestamp);
 static void run_display_capplet(GtkWidget *widget);
-static void get_allowed_rotations_for_output(MateRRConfig *config,
-                                             MateRRScreen *rr_screen,
+static void on_randr_event(MateRRScreen *screen, gpointer data);
+static void get_allowed_rotations_for_output(MsdXrandrManager *manager,
                                              MateRROutputInfo *output,
                                              int *out_num_rotations,
                                              MateRRRotation *out_rotations);
@@ -136,48 +178,144 @@ G_DEFINE_TYPE_WITH_PRIVATE(MsdXrandrManager, msd_xrandr_manager, G_TYPE_OBJECT)
 
 static gpointer manager_object = NULL;
 
-static FILE *log_file;
+/* Debug log; NULL unless the debug-log setting is on, so that nothing
+ * is formatted while it is off */
+static MsdXrandrLog *event_log;
 
-static void log_open(void) {
-  char *toggle_filename;
-  char *log_filename;
-  struct stat st;
+/* Text given to log_msg() that does not end in a newline yet */
+static GString *log_line;
 
-  if (log_file) return;
+static void update_event_log(GSettings *settings) {
+  GError *error = NULL;
+  char *filename;
 
-  toggle_filename = g_build_filename(g_get_home_dir(), "msd-debug-randr", NULL);
-  log_filename =
-      g_build_filename(g_get_home_dir(), "msd-debug-randr.log", NULL);
+  if (!g_settings_get_boolean(settings, CONF_KEY_DEBUG_LOG)) {
+    g_clear_pointer(&event_log, msd_xrandr_log_free);
+    if (log_line != NULL) g_string_truncate(log_line, 0);
+    return;
+  }
 
-  if (stat(toggle_filename, &st) != 0) goto out;
+  if (event_log != NULL) return;
 
-  log_file = fopen(log_filename, "a");
+  filename = msd_xrandr_log_get_default_filename();
+  event_log = msd_xrandr_log_new(filename, EVENT_LOG_MAX_SIZE, &error);
+  if (event_log == NULL) {
+    g_warning("Could not create the xrandr debug log: %s", error->message);
+    g_error_free(error);
+  } else {
+    g_debug("Logging xrandr events to %s", filename);
+  }
+  g_free(filename);
+}
 
-  if (log_file && ftell(log_file) == 0)
-    fprintf(
-        log_file,
-        "To keep this log from being created, please rm ~/msd-debug-randr\n");
+static void log_event(const char *event, GVariant *fields) {
+  if (event_log != NULL)
+    msd_xrandr_log_append(event_log, event, fields);
+  else if (fields != NULL)
+    g_variant_unref(g_variant_ref_sink(fields));
+}
 
-out:
-  g_free(toggle_filename);
-  g_free(log_filename);
+/* Writes out any text that log_msg() was still waiting on a newline for */
+static void log_flush(void) {
+  if (event_log == NULL || log_line == NULL || log_line->len == 0) return;
+
+  log_event("message", g_variant_new_parsed("{'text': <%s>}", log_line->str));
+  g_string_truncate(log_line, 0);
 }
 
-static void log_close(void) {
-  if (log_file) {
-    fclose(log_file);
-    log_file = NULL;
+/* Free-form text; every line becomes a "message" record */
+static void log_msg(const char *format, ...) {
+  va_list args;
+  char *newline;
+
+  if (event_log == NULL) return;
+
+  if (log_line == NULL) log_line = g_string_new(NULL);
+
+  va_start(args, format);
+  g_string_append_vprintf(log_line, format, args);
+  va_end(args);
+
+  while ((newline = strchr(log_line->str, '\n')) != NULL) {
+    *newline = '\0';
+    if (newline != log_line->str)
+      log_event("message",
+                g_variant_new_parsed("{'text': <%s>}", log_line->str));
+    g_string_erase(log_line, 0, newline - log_line->str + 1);
   }
 }
 
-static void log_msg(const char *format, ...) {
-  if (log_file) {
-    va_list args;
+static GVariant *get_outputs_variant(MateRRConfig *config) {
+  MateRROutputInfo **outputs = mate_rr_config_get_outputs(config);
+  GVariantBuilder builder;
+  int x, y, width, height, rate;
+  int i;
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("aa{sv}"));
+
+  for (i = 0; outputs[i] != NULL; i++) {
+    const char *name = mate_rr_output_info_get_name(outputs[i]);
+
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&builder, "{sv}", "name",
+                          g_variant_new_string(name ? name : ""));
+    g_variant_builder_add(
+        &builder, "{sv}", "connected",
+        g_variant_new_boolean(mate_rr_output_info_is_connected(outputs[i])));
+
+    if (mate_rr_output_info_is_active(outputs[i])) {
+      mate_rr_output_info_get_geometry(outputs[i], &x, &y, &width, &height);
+      g_variant_builder_add(&builder, "{sv}", "geometry",
+                            g_variant_new("(iiii)", x, y, width, height));
+      rate = mate_rr_output_info_get_refresh_rate(outputs[i]);
+      g_variant_builder_add(&builder, "{sv}", "rate",
+                            g_variant_new_int32(rate));
+      g_variant_builder_add(
+          &builder, "{sv}", "rotation",
+          g_variant_new_uint32(mate_rr_output_info_get_rotation(outputs[i])));
+      g_variant_builder_add(
+          &builder, "{sv}", "primary",
+          g_variant_new_boolean(mate_rr_output_info_get_primary(outputs[i])));
+    }
 
-    va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
+    g_variant_builder_close(&builder);
   }
+
+  return g_variant_builder_end(&builder);
+}
+
+/* Records how a change of the screen was handled, how long that took
+ * since @start_time, and the outputs it left the screen with */
+static void log_screen_event(MateRRScreen *screen, const char *event,
+                             const char *action, gint64 start_time,
+                             guint32 change_timestamp,
+                             guint32 config_timestamp) {
+  GVariantBuilder builder;
+  MateRRConfig *current;
+
+  if (event_log == NULL) return;
+
+  log_flush();
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add(&builder, "{sv}", "action",
+                        g_variant_new_string(action));
+  g_variant_builder_add(
+      &builder, "{sv}", "latency",
+      g_variant_new_int64(g_get_monotonic_time() - start_time));
+  g_variant_builder_add(&builder, "{sv}", "change",
+                        g_variant_new_uint32(change_timestamp));
+  g_variant_builder_add(&builder, "{sv}", "config",
+                        g_variant_new_uint32(config_timestamp));
+
+  current = mate_rr_config_new_current(screen, NULL);
+  if (current != NULL) {
+    g_variant_builder_add(&builder, "{sv}", "outputs",
+                          get_outputs_variant(current));
+    g_object_unref(current);
+  }
+
+  log_event(event, g_variant_builder_end(&builder));
 }
 
 static void log_output(MateRROutputInfo *output) {
@@ -230,7 +368,7 @@ static void log_screen(MateRRScreen *screen) {
   int min_w, min_h, max_w, max_h;
   guint32 change_timestamp, config_timestamp;
 
-  if (!log_file) return;
+  if (!event_log) return;
 
   config = mate_rr_config_new_current(screen, NULL);
 
@@ -322,6 +460,157 @@ fail:
   return FALSE;
 }
 
+static void unref_config(gpointer config) {
+  if (config != NULL) g_object_unref(config);
+}
+
+static void invalidate_config_index(MsdXrandrManager *manager) {
+  g_hash_table_remove_all(manager->priv->config_index);
+  g_clear_pointer(&manager->priv->config_index_stamp, g_free);
+}
+
+static void config_file_changed_cb(GFileMonitor *monitor, GFile *file,
+                                   GFile *other_file, GFileMonitorEvent event,
+                                   MsdXrandrManager *manager) {
+  invalidate_config_index(manager);
+}
+
+/* Takes ownership of filename */
+static GFileMonitor *monitor_config_file(MsdXrandrManager *manager,
+                                         char *filename) {
+  GFileMonitor *monitor;
+  GFile *file;
+
+  file = g_file_new_for_path(filename);
+  monitor = g_file_monitor_file(file, G_FILE_MONITOR_WATCH_MOVES, NULL, NULL);
+  if (monitor != NULL)
+    g_signal_connect(monitor, "changed", G_CALLBACK(config_file_changed_cb),
+                     manager);
+
+  g_object_unref(file);
+  g_free(filename);
+
+  return monitor;
+}
+
+/* Identifies the file a stored configuration was parsed from; file
+ * monitor events lag behind our own renames of the backup file */
+static char *get_file_stamp(const char *filename) {
+  GStatBuf buf;
+
+  if (g_stat(filename, &buf) != 0) return NULL;
+
+  return g_strdup_printf("%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT
+                         ":%" G_GUINT64_FORMAT,
+                         (gint64)buf.st_mtime, (gint64)buf.st_size,
+                         (guint64)buf.st_ino);
+}
+
+/* What a stored configuration is matched on: the connector of each
+ * output and the monitor attached to it */
+static char *get_outputs_fingerprint(MateRRScreen *screen) {
+  MateRROutput **outputs;
+  GChecksum *checksum;
+  const guint8 *edid;
+  gsize edid_size;
+  const char *name;
+  char *fingerprint;
+  int i;
+
+  checksum = g_checksum_new(G_CHECKSUM_SHA1);
+  outputs = mate_rr_screen_list_outputs(screen);
+
+  for (i = 0; outputs[i] != NULL; i++) {
+    name = mate_rr_output_get_name(outputs[i]);
+    g_checksum_update(checksum, (const guchar *)name, strlen(name) + 1);
+
+    if (!mate_rr_output_is_connected(outputs[i])) continue;
+
+    edid = mate_rr_output_get_edid_data(outputs[i], &edid_size);
+    if (edid != NULL) g_checksum_update(checksum, edid, edid_size);
+    g_checksum_update(checksum, (const guchar *)"", 1);
+  }
+
+  fingerprint = g_strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+
+  return fingerprint;
+}
+
+/* Like apply_configuration_from_filename() on the intended file, but
+ * each set of outputs is only matched against the stored configurations
+ * once until the file changes.
+ */
+static gboolean apply_intended_configuration_from_index(
+    MsdXrandrManager *manager, guint32 timestamp, GError **error) {
+  MsdXrandrManagerPrivate *priv = manager->priv;
+  MateRRConfig *config;
+  GError *my_error = NULL;
+  char *intended_filename;
+  char *fingerprint;
+  char *stamp;
+  gboolean result = FALSE;
+
+  intended_filename = mate_rr_config_get_intended_filename();
+  fingerprint = NULL;
+
+  stamp = get_file_stamp(intended_filename);
+  if (g_strcmp0(stamp, priv->config_index_stamp) != 0) {
+    invalidate_config_index(manager);
+    priv->config_index_stamp = stamp;
+  } else {
+    g_free(stamp);
+  }
+
+  if (priv->config_index_stamp == NULL) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "%s does not exist",
+                intended_filename);
+    goto out;
+  }
+
+  fingerprint = get_outputs_fingerprint(priv->rw_screen);
+
+  if (!g_hash_table_lookup_extended(priv->config_index, fingerprint, NULL,
+                                    (gpointer *)&config)) {
+    log_msg("  Looking up the stored configuration for outputs %s\n",
+            fingerprint);
+
+    config = g_object_new(MATE_TYPE_RR_CONFIG, "screen", priv->rw_screen, NULL);
+    if (mate_rr_config_load_filename(config, intended_filename, &my_error)) {
+      mate_rr_config_ensure_primary(config);
+    } else {
+      g_clear_object(&config);
+
+      /* Only remember that nothing matches, not that the file is
+       * broken */
+      if (!g_error_matches(my_error, MATE_RR_ERROR,
+                           MATE_RR_ERROR_NO_MATCHING_CONFIG)) {
+        g_propagate_error(error, my_error);
+        goto out;
+      }
+      g_error_free(my_error);
+    }
+
+    g_hash_table_insert(priv->config_index, g_strdup(fingerprint), config);
+  }
+
+  if (config == NULL) {
+    g_set_error(error, MATE_RR_ERROR, MATE_RR_ERROR_NO_MATCHING_CONFIG,
+                "none of the saved display configurations matched the active "
+                "configuration");
+    goto out;
+  }
+
+  result =
+      mate_rr_config_apply_with_time(config, priv->rw_screen, timestamp, error);
+
+out:
+  g_free(fingerprint);
+  g_free(intended_filename);
+
+  return result;
+}
+
 /* This function centralizes the use of mate_rr_config_apply_with_time().
  *
  * Applies a configuration and displays an error message if an error happens.
@@ -401,139 +690,148 @@ static void restore_backup_configuration(MsdXrandrManager *manager,
   unlink(backup_filename);
 }
 
-typedef struct {
-  MsdXrandrManager *manager;
-  GtkWidget *dialog;
-
-  int countdown;
-  int response_id;
-} TimeoutDialog;
+static void print_countdown_text(MsdXrandrManager *manager) {
+  MsdXrandrManagerPrivate *priv = manager->priv;
 
-static void print_countdown_text(TimeoutDialog *timeout) {
   gtk_message_dialog_format_secondary_text(
-      GTK_MESSAGE_DIALOG(timeout->dialog),
+      GTK_MESSAGE_DIALOG(priv->confirmation_dialog),
       ngettext("The display will be reset to its previous configuration in %d "
                "second",
                "The display will be reset to its previous configuration in %d "
                "seconds",
-               timeout->countdown),
-      timeout->countdown);
+               priv->confirmation_countdown),
+      priv->confirmation_countdown);
 }
 
-static gboolean timeout_cb(gpointer data) {
-  TimeoutDialog *timeout = data;
-
-  timeout->countdown--;
+static void close_confirmation_dialog(MsdXrandrManager *manager) {
+  MsdXrandrManagerPrivate *priv = manager->priv;
 
-  if (timeout->countdown == 0) {
-    timeout->response_id = GTK_RESPONSE_CANCEL;
-    gtk_main_quit();
-  } else {
-    print_countdown_text(timeout);
+  if (priv->confirmation_timeout_id != 0) {
+    g_source_remove(priv->confirmation_timeout_id);
+    priv->confirmation_timeout_id = 0;
   }
 
-  return TRUE;
+  if (priv->confirmation_dialog != NULL) {
+    gtk_widget_destroy(priv->confirmation_dialog);
+    priv->confirmation_dialog = NULL;
+  }
 }
 
-static void timeout_response_cb(GtkDialog *dialog, int response_id,
-                                gpointer data) {
-  TimeoutDialog *timeout = data;
+/* Keeps or reverts the configuration being confirmed, then handles the
+ * hotplug events that were held back while the user was deciding */
+static void finish_confirmation(MsdXrandrManager *manager, gboolean keep) {
+  MsdXrandrManagerPrivate *priv = manager->priv;
+  char *backup_filename;
+  char *intended_filename;
 
-  if (response_id == GTK_RESPONSE_DELETE_EVENT) {
-    /* The user closed the dialog or pressed ESC, revert */
-    timeout->response_id = GTK_RESPONSE_CANCEL;
-  } else
-    timeout->response_id = response_id;
+  if (priv->confirmation_state != CONFIRMATION_PENDING) return;
 
-  gtk_main_quit();
-}
+  close_confirmation_dialog(manager);
 
-static gboolean user_says_things_are_ok(MsdXrandrManager *manager,
-                                        GdkWindow *parent_window) {
-  TimeoutDialog timeout;
-  guint timeout_id;
+  backup_filename = mate_rr_config_get_backup_filename();
+  intended_filename = mate_rr_config_get_intended_filename();
 
-  timeout.manager = manager;
+  if (keep) {
+    priv->confirmation_state = CONFIRMATION_CONFIRMED;
+    unlink(backup_filename);
+  } else {
+    priv->confirmation_state = CONFIRMATION_REVERTED;
+    restore_backup_configuration(manager, backup_filename, intended_filename,
+                                 priv->confirmation_timestamp);
+  }
 
-  timeout.dialog =
-      gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION,
-                             GTK_BUTTONS_NONE, _("Does the display look OK?"));
+  g_free(backup_filename);
+  g_free(intended_filename);
 
-  timeout.countdown = CONFIRMATION_DIALOG_SECONDS;
+  if (event_log != NULL)
+    log_event("confirmation",
+              g_variant_new_parsed("{'result': <%s>}",
+                                   keep ? "confirmed" : "reverted"));
 
-  print_countdown_text(&timeout);
+  if (priv->randr_event_queued) {
+    priv->randr_event_queued = FALSE;
+    on_randr_event(priv->rw_screen, manager);
+  }
 
-  gtk_window_set_icon_name(GTK_WINDOW(timeout.dialog),
-                           "preferences-desktop-display");
-  gtk_dialog_add_button(GTK_DIALOG(timeout.dialog),
-                        _("_Restore Previous Configuration"),
-                        GTK_RESPONSE_CANCEL);
-  gtk_dialog_add_button(GTK_DIALOG(timeout.dialog),
-                        _("_Keep This Configuration"), GTK_RESPONSE_ACCEPT);
-  gtk_dialog_set_default_response(GTK_DIALOG(timeout.dialog),
-                                  GTK_RESPONSE_ACCEPT); /* ah, the optimism */
+  priv->confirmation_state = CONFIRMATION_NONE;
+}
 
-  g_signal_connect(timeout.dialog, "response", G_CALLBACK(timeout_response_cb),
-                   &timeout);
+static gboolean confirmation_timeout_cb(gpointer data) {
+  MsdXrandrManager *manager = MSD_XRANDR_MANAGER(data);
+  MsdXrandrManagerPrivate *priv = manager->priv;
 
-  gtk_widget_realize(timeout.dialog);
+  priv->confirmation_countdown--;
 
-  if (parent_window)
-    gdk_window_set_transient_for(gtk_widget_get_window(timeout.dialog),
-                                 parent_window);
+  if (priv->confirmation_countdown == 0) {
+    priv->confirmation_timeout_id = 0;
+    finish_confirmation(manager, FALSE);
+    return FALSE;
+  }
 
-  gtk_widget_show_all(timeout.dialog);
-  /* We don't use g_timeout_add_seconds() since we actually care that the user
-   * sees "real" second ticks in the dialog */
-  timeout_id = g_timeout_add(1000, timeout_cb, &timeout);
-  gtk_main();
+  print_countdown_text(manager);
 
-  gtk_widget_destroy(timeout.dialog);
-  g_source_remove(timeout_id);
+  return TRUE;
+}
 
-  if (timeout.response_id == GTK_RESPONSE_ACCEPT)
-    return TRUE;
-  else
-    return FALSE;
+static void confirmation_response_cb(GtkDialog *dialog, int response_id,
+                                     gpointer data) {
+  MsdXrandrManager *manager = MSD_XRANDR_MANAGER(data);
+
+  /* Closing the dialog or pressing ESC reverts, too */
+  finish_confirmation(manager, response_id == GTK_RESPONSE_ACCEPT);
 }
 
-struct confirmation {
-  MsdXrandrManager *manager;
-  GdkWindow *parent_window;
-  guint32 timestamp;
-};
+/* Asks the user whether the configuration that was just applied can be
+ * kept.  This returns right away; the answer arrives on the main loop
+ * in finish_confirmation(). */
+static void begin_confirmation(MsdXrandrManager *manager,
+                               GdkWindow *parent_window, guint32 timestamp) {
+  MsdXrandrManagerPrivate *priv = manager->priv;
 
-static gboolean confirm_with_user_idle_cb(gpointer data) {
-  struct confirmation *confirmation = data;
-  char *backup_filename;
-  char *intended_filename;
+  priv->confirmation_timestamp = timestamp;
+  priv->confirmation_countdown = CONFIRMATION_DIALOG_SECONDS;
 
-  backup_filename = mate_rr_config_get_backup_filename();
-  intended_filename = mate_rr_config_get_intended_filename();
+  /* A second configuration while the first one is still being confirmed
+   * replaces it, and the countdown starts over */
+  if (priv->confirmation_state == CONFIRMATION_PENDING) {
+    g_source_remove(priv->confirmation_timeout_id);
+  } else {
+    priv->confirmation_state = CONFIRMATION_PENDING;
 
-  if (user_says_things_are_ok(confirmation->manager,
-                              confirmation->parent_window))
-    unlink(backup_filename);
-  else
-    restore_backup_configuration(confirmation->manager, backup_filename,
-                                 intended_filename, confirmation->timestamp);
+    priv->confirmation_dialog =
+        gtk_message_dialog_new(NULL, 0, GTK_MESSAGE_QUESTION, GTK_BUTTONS_NONE,
+                               _("Does the display look OK?"));
 
-  g_free(confirmation);
+    gtk_window_set_icon_name(GTK_WINDOW(priv->confirmation_dialog),
+                             "preferences-desktop-display");
+    gtk_window_set_keep_above(GTK_WINDOW(priv->confirmation_dialog), TRUE);
+    gtk_dialog_add_button(GTK_DIALOG(priv->confirmation_dialog),
+                          _("_Restore Previous Configuration"),
+                          GTK_RESPONSE_CANCEL);
+    gtk_dialog_add_button(GTK_DIALOG(priv->confirmation_dialog),
+                          _("_Keep This Configuration"), GTK_RESPONSE_ACCEPT);
+    gtk_dialog_set_default_response(GTK_DIALOG(priv->confirmation_dialog),
+                                    GTK_RESPONSE_ACCEPT); /* ah, the optimism */
 
-  return FALSE;
-}
+    g_signal_connect(priv->confirmation_dialog, "response",
+                     G_CALLBACK(confirmation_response_cb), manager);
+
+    gtk_widget_realize(priv->confirmation_dialog);
+  }
 
-static void queue_confirmation_by_user(MsdXrandrManager *manager,
-                                       GdkWindow *parent_window,
-                                       guint32 timestamp) {
-  struct confirmation *confirmation;
+  if (parent_window)
+    gdk_window_set_transient_for(
+        gtk_widget_get_window(priv->confirmation_dialog), parent_window);
 
-  confirmation = g_new(struct confirmation, 1);
-  confirmation->manager = manager;
-  confirmation->parent_window = parent_window;
-  confirmation->timestamp = timestamp;
+  print_countdown_text(manager);
+  gtk_widget_show_all(priv->confirmation_dialog);
+  gtk_window_present_with_time(GTK_WINDOW(priv->confirmation_dialog),
+                               timestamp);
 
-  g_idle_add(confirm_with_user_idle_cb, confirmation);
+  /* We don't use g_timeout_add_seconds() since we actually care that the user
+   * sees "real" second ticks in the dialog */
+  priv->confirmation_timeout_id =
+      g_timeout_add(1000, confirmation_timeout_cb, manager);
 }
 
 static gboolean try_to_apply_intended_configuration(MsdXrandrManager *manager,
@@ -560,13 +858,12 @@ static gboolean try_to_apply_intended_configuration(MsdXrandrManager *manager,
                                                   intended_filename);
     goto out;
   } else {
-    /* We need to return as quickly as possible, so instead of
-     * confirming with the user right here, we do it in an idle
-     * handler.  The caller only expects a status for "could you
-     * change the RANDR configuration?", not "is the user OK with it
-     * as well?".
+    /* We need to return as quickly as possible, so the user's answer
+     * is not waited for here.  The caller only expects a status for
+     * "could you change the RANDR configuration?", not "is the user OK
+     * with it as well?".
      */
-    queue_confirmation_by_user(manager, parent_window, timestamp);
+    begin_confirmation(manager, parent_window, timestamp);
   }
 
 out:
@@ -943,9 +1240,62 @@ static MateRRConfig *make_other_setup(MateRRScreen *screen) {
   return result;
 }
 
+static int compare_strings(gconstpointer a, gconstpointer b) {
+  return g_strcmp0(*(const char **)a, *(const char **)b);
+}
+
+/* Exactly what mate_rr_config_equal() compares of each output, in an
+ * order that does not depend on the order of the outputs.  Like it,
+ * this ignores the clone flag, the primary output and display names */
+static char *get_config_key(MateRRConfig *config) {
+  MateRROutputInfo **outputs = mate_rr_config_get_outputs(config);
+  GPtrArray *keys;
+  GString *key;
+  GString *output;
+  int x, y, width, height;
+  gchar vendor[4];
+  int i;
+
+  keys = g_ptr_array_new_with_free_func(g_free);
+
+  for (i = 0; outputs[i] != NULL; i++) {
+    output = g_string_new(mate_rr_output_info_get_name(outputs[i]));
+
+    mate_rr_output_info_get_vendor(outputs[i], vendor);
+    g_string_append_printf(output, ":%.3s:%u:%u:%d", vendor,
+                           mate_rr_output_info_get_product(outputs[i]),
+                           mate_rr_output_info_get_serial(outputs[i]),
+                           mate_rr_output_info_is_connected(outputs[i]));
+
+    if (mate_rr_output_info_is_active(outputs[i])) {
+      mate_rr_output_info_get_geometry(outputs[i], &x, &y, &width, &height);
+      g_string_append_printf(output, ":%dx%d@%d+%d+%d:%d", width, height,
+                             mate_rr_output_info_get_refresh_rate(outputs[i]),
+                             x, y,
+                             mate_rr_output_info_get_rotation(outputs[i]));
+    } else {
+      g_string_append(output, ":off");
+    }
+
+    g_ptr_array_add(keys, g_string_free(output, FALSE));
+  }
+
+  g_ptr_array_sort(keys, compare_strings);
+
+  key = g_string_new(NULL);
+  for (i = 0; i < keys->len; i++) {
+    if (i > 0) g_string_append_c(key, ';');
+    g_string_append(key, g_ptr_array_index(keys, i));
+  }
+  g_ptr_array_unref(keys);
+
+  return g_string_free(key, FALSE);
+}
+
 static GPtrArray *sanitize(MsdXrandrManager *manager, GPtrArray *array) {
   int i;
   GPtrArray *new;
+  GHashTable *seen;
 
   g_debug("before sanitizing");
 
@@ -958,21 +1308,23 @@ static GPtrArray *sanitize(MsdXrandrManager *manager, GPtrArray *array) {
   /* Remove configurations that are duplicates of
    * configurations earlier in the cycle
    */
+  seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
   for (i = 0; i < array->len; i++) {
-    int j;
+    char *key;
 
-    for (j = i + 1; j < array->len; j++) {
-      MateRRConfig *this = array->pdata[j];
-      MateRRConfig *other = array->pdata[i];
+    if (array->pdata[i] == NULL) continue;
 
-      if (this && other && mate_rr_config_equal(this, other)) {
-        g_debug("removing duplicate configuration");
-        g_object_unref(this);
-        array->pdata[j] = NULL;
-        break;
-      }
+    key = get_config_key(array->pdata[i]);
+    if (g_hash_table_contains(seen, key)) {
+      g_debug("removing duplicate configuration");
+      g_object_unref(array->pdata[i]);
+      array->pdata[i] = NULL;
+      g_free(key);
+    } else {
+      g_hash_table_add(seen, key);
     }
   }
+  g_hash_table_destroy(seen);
 
   for (i = 0; i < array->len; ++i) {
     MateRRConfig *config = array->pdata[i];
@@ -1029,13 +1381,7 @@ static GPtrArray *sanitize(MsdXrandrManager *manager, GPtrArray *array) {
   return new;
 }
 
-static void generate_fn_f7_configs(MsdXrandrManager *mgr) {
-  GPtrArray *array = g_ptr_array_new();
-  MateRRScreen *screen = mgr->priv->rw_screen;
-
-  g_debug("Generating configurations");
-
-  /* Free any existing list of configurations */
+static void free_fn_f7_configs(MsdXrandrManager *mgr) {
   if (mgr->priv->fn_f7_configs) {
     int i;
 
@@ -1047,6 +1393,19 @@ static void generate_fn_f7_configs(MsdXrandrManager *mgr) {
     mgr->priv->current_fn_f7_config = -1;
   }
 
+  g_clear_pointer(&mgr->priv->fn_f7_keys, g_strfreev);
+}
+
+static void generate_fn_f7_configs(MsdXrandrManager *mgr) {
+  GPtrArray *array = g_ptr_array_new();
+  MateRRScreen *screen = mgr->priv->rw_screen;
+  int i;
+
+  g_debug("Generating configurations");
+
+  /* Free any existing list of configurations */
+  free_fn_f7_configs(mgr);
+
   g_ptr_array_add(array, mate_rr_config_new_current(screen, NULL));
   g_ptr_array_add(array, make_clone_setup(screen));
   g_ptr_array_add(array, make_xinerama_setup(screen));
@@ -1058,7 +1417,65 @@ static void generate_fn_f7_configs(MsdXrandrManager *mgr) {
   if (array) {
     mgr->priv->fn_f7_configs = (MateRRConfig **)g_ptr_array_free(array, FALSE);
     mgr->priv->current_fn_f7_config = 0;
+
+    for (i = 0; mgr->priv->fn_f7_configs[i] != NULL; i++)
+      ;
+    mgr->priv->fn_f7_keys = g_new0(char *, i + 1);
+    for (i = 0; mgr->priv->fn_f7_configs[i] != NULL; i++)
+      mgr->priv->fn_f7_keys[i] = get_config_key(mgr->priv->fn_f7_configs[i]);
+  }
+}
+
+/* Whether the screen is no longer in the configuration we last cycled
+ * to, so the cycle has to be worked out again */
+static gboolean fn_f7_configs_are_stale(MsdXrandrManager *mgr,
+                                        MateRRConfig *current) {
+  MsdXrandrManagerPrivate *priv = mgr->priv;
+  gboolean stale;
+  char *key;
+
+  if (!priv->fn_f7_configs) return TRUE;
+
+  if (!mate_rr_config_match(current, priv->fn_f7_configs[0])) return TRUE;
+
+  key = get_config_key(current);
+  stale = g_strcmp0(key, priv->fn_f7_keys[priv->current_fn_f7_config]) != 0;
+  g_free(key);
+
+  return stale;
+}
+
+static gboolean update_fn_f7_configs_cb(MsdXrandrManager *mgr) {
+  MateRRConfig *current;
+
+  mgr->priv->fn_f7_timeout_id = 0;
+
+  current = mate_rr_config_new_current(mgr->priv->rw_screen, NULL);
+  if (current == NULL) return G_SOURCE_REMOVE;
+
+  if (fn_f7_configs_are_stale(mgr, current)) {
+    generate_fn_f7_configs(mgr);
+
+    log_msg("Generated stock configurations after the screen changed:\n");
+    log_configurations(mgr->priv->fn_f7_configs);
+    log_flush();
   }
+
+  g_object_unref(current);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Works out the fn-F7 cycle once the screen settles, so the key itself
+ * only has to apply the next configuration */
+static void queue_fn_f7_update(MsdXrandrManager *mgr) {
+  if (!mgr->priv->switch_video_mode_keycode) return;
+
+  if (mgr->priv->fn_f7_timeout_id != 0)
+    g_source_remove(mgr->priv->fn_f7_timeout_id);
+
+  mgr->priv->fn_f7_timeout_id = g_timeout_add(
+      FN_F7_SETTLE_DELAY, (GSourceFunc)update_fn_f7_configs_cb, mgr);
 }
 
 static void error_message(MsdXrandrManager *mgr, const char *primary_text,
@@ -1101,6 +1518,7 @@ static void handle_fn_f7(MsdXrandrManager *mgr, guint32 timestamp) {
   MateRRScreen *screen = priv->rw_screen;
   MateRRConfig *current;
   GError *error;
+  gint64 start_time;
 
   /* Theory of fn-F7 operation
    *
@@ -1109,14 +1527,16 @@ static void handle_fn_f7(MsdXrandrManager *mgr, guint32 timestamp) {
    * mode (or "off") for each connected output.
    *
    * When the user hits fn-F7, we cycle to the next MateRRConfig
-   * in the data structure. If the data structure does not exist, it
-   * is generated. If the configs in the data structure do not match
-   * the current hardware reality, it is regenerated.
+   * in the data structure. The data structure is generated after
+   * each change of the screen has settled; see queue_fn_f7_update().
+   * If it does not exist yet, or the configs in it do not match the
+   * current hardware reality, it is regenerated here.
    *
    */
   g_debug("Handling fn-f7");
 
-  log_open();
+  start_time = g_get_monotonic_time();
+
   log_msg("Handling XF86Display hotkey - timestamp %u\n", timestamp);
 
   error = NULL;
@@ -1133,18 +1553,9 @@ static void handle_fn_f7(MsdXrandrManager *mgr, guint32 timestamp) {
     g_free(str);
   }
 
-  if (!priv->fn_f7_configs) {
-    log_msg("Generating stock configurations:\n");
-    generate_fn_f7_configs(mgr);
-    log_configurations(priv->fn_f7_configs);
-  }
-
   current = mate_rr_config_new_current(screen, NULL);
 
-  if (priv->fn_f7_configs &&
-      (!mate_rr_config_match(current, priv->fn_f7_configs[0]) ||
-       !mate_rr_config_equal(
-           current, priv->fn_f7_configs[mgr->priv->current_fn_f7_config]))) {
+  if (fn_f7_configs_are_stale(mgr, current)) {
     /* Our view of the world is incorrect, so regenerate the
      * configurations
      */
@@ -1195,12 +1606,14 @@ static void handle_fn_f7(MsdXrandrManager *mgr, guint32 timestamp) {
               timestamp);
       log_configuration(priv->fn_f7_configs[mgr->priv->current_fn_f7_config]);
     }
+
+    log_screen_event(screen, "fn-f7", success ? "applied" : "failed",
+                     start_time, 0, timestamp);
   } else {
     g_debug("no configurations generated");
+    log_flush();
   }
 
-  log_close();
-
   g_debug("done handling fn-f7");
 }
 
@@ -1288,8 +1701,7 @@ static void handle_rotate_windows(MsdXrandrManager *mgr, guint32 timestamp) {
 
   /* Which rotation? */
 
-  get_allowed_rotations_for_output(current, priv->rw_screen,
-                                   rotatable_output_info,
+  get_allowed_rotations_for_output(mgr, rotatable_output_info,
                                    &num_allowed_rotations, &allowed_rotations);
   next_rotation = get_next_rotation(
       allowed_rotations,
@@ -1497,12 +1909,17 @@ static void on_randr_event(MateRRScreen *screen, gpointer data) {
   MsdXrandrManager *manager = MSD_XRANDR_MANAGER(data);
   MsdXrandrManagerPrivate *priv = manager->priv;
   guint32 change_timestamp, config_timestamp;
+  gint64 start_time;
+  const char *action;
 
   if (!priv->running) return;
 
+  start_time = g_get_monotonic_time();
+
+  g_hash_table_remove_all(priv->rotation_cache);
+
   mate_rr_screen_get_timestamps(screen, &change_timestamp, &config_timestamp);
 
-  log_open();
   log_msg("Got RANDR event with timestamps change=%u %c config=%u\n",
           change_timestamp,
           timestamp_relationship(change_timestamp, config_timestamp),
@@ -1518,6 +1935,7 @@ static void on_randr_event(MateRRScreen *screen, gpointer data) {
      */
     show_timestamps_dialog(manager, "ignoring since change > config");
     log_msg("  Ignoring event since change >= config\n");
+    action = "ignored";
   } else {
     /* Here, config_timestamp > change_timestamp.  This means that
      * the screen got reconfigured because of hotplug/unplug; the X
@@ -1525,19 +1943,25 @@ static void on_randr_event(MateRRScreen *screen, gpointer data) {
      * outputs in a sane way.
      */
 
-    char *intended_filename;
     GError *error;
     gboolean success;
 
+    if (priv->confirmation_state == CONFIRMATION_PENDING) {
+      /* Configuring the new outputs now would work from the
+       * configuration the user has not decided about yet */
+      priv->randr_event_queued = TRUE;
+      log_msg("  Deferring event until the display configuration is "
+              "confirmed\n");
+      action = "deferred";
+      goto out;
+    }
+
     show_timestamps_dialog(
         manager, "need to deal with reconfiguration, as config > change");
 
-    intended_filename = mate_rr_config_get_intended_filename();
-
     error = NULL;
-    success = apply_configuration_from_filename(manager, intended_filename,
-                                                TRUE, config_timestamp, &error);
-    g_free(intended_filename);
+    success = apply_intended_configuration_from_index(manager, config_timestamp,
+                                                      &error);
 
     if (!success) {
       /* We don't bother checking the error type.
@@ -1561,11 +1985,16 @@ static void on_randr_event(MateRRScreen *screen, gpointer data) {
         priv->last_config_timestamp = config_timestamp;
         auto_configure_outputs(manager, config_timestamp);
         log_msg("  Automatically configured outputs to deal with event\n");
-      } else
+        action = "automatic";
+      } else {
         log_msg(
             "  Ignored event as old and new config timestamps are the same\n");
-    } else
+        action = "unchanged";
+      }
+    } else {
       log_msg("Applied stored configuration to deal with event\n");
+      action = "stored";
+    }
   }
 
   /* poke mate-color-manager */
@@ -1574,7 +2003,11 @@ static void on_randr_event(MateRRScreen *screen, gpointer data) {
   refresh_tray_icon_menu_if_active(manager,
                                    MAX(change_timestamp, config_timestamp));
 
-  log_close();
+  queue_fn_f7_update(manager);
+
+out:
+  log_screen_event(screen, "randr", action, start_time, change_timestamp,
+                   config_timestamp);
 }
 
 static void run_display_capplet(GtkWidget *widget) {
@@ -1827,12 +2260,20 @@ static GtkWidget *make_menu_item_for_output_title(MsdXrandrManager *manager,
   return item;
 }
 
-static void get_allowed_rotations_for_output(MateRRConfig *config,
-                                             MateRRScreen *rr_screen,
+static void get_allowed_rotations_for_output(MsdXrandrManager *manager,
                                              MateRROutputInfo *output,
                                              int *out_num_rotations,
                                              MateRRRotation *out_rotations) {
+  MsdXrandrManagerPrivate *priv = manager->priv;
   MateRRRotation current_rotation;
+  MateRROutput *rr_output;
+  MateRRCrtc *crtc;
+  MateRRMode *mode;
+  int min_width, max_width, min_height, max_height;
+  int x, y, width, height;
+  gpointer cached;
+  char *name;
+  char *key;
   int i;
 
   *out_num_rotations = 0;
@@ -1840,30 +2281,64 @@ static void get_allowed_rotations_for_output(MateRRConfig *config,
 
   current_rotation = mate_rr_output_info_get_rotation(output);
 
-  /* Yay for brute force */
+  name = mate_rr_output_info_get_name(output);
+  rr_output = mate_rr_screen_get_output_by_name(priv->rw_screen, name);
+  crtc = rr_output != NULL ? mate_rr_output_get_crtc(rr_output) : NULL;
+  mode = rr_output != NULL ? mate_rr_output_get_current_mode(rr_output) : NULL;
 
-  for (i = 0; i < G_N_ELEMENTS(possible_rotations); i++) {
-    MateRRRotation rotation_to_test;
+  mate_rr_output_info_get_geometry(output, &x, &y, &width, &height);
 
-    rotation_to_test = possible_rotations[i];
+  key = g_strdup_printf("%s:%u:%d,%d,%dx%d", name,
+                        mode != NULL ? mate_rr_mode_get_id(mode) : 0, x, y,
+                        width, height);
 
-    mate_rr_output_info_set_rotation(output, rotation_to_test);
+  if (g_hash_table_lookup_extended(priv->rotation_cache, key, NULL, &cached)) {
+    *out_rotations = GPOINTER_TO_UINT(cached);
+    g_free(key);
+  } else {
+    /* The size the output has when not rotated */
+    if (current_rotation & (MATE_RR_ROTATION_90 | MATE_RR_ROTATION_270)) {
+      int tmp = width;
+      width = height;
+      height = tmp;
+    }
+
+    mate_rr_screen_get_ranges(priv->rw_screen, &min_width, &max_width,
+                              &min_height, &max_height);
+
+    /* A rotation is possible if the CRTC can do it and the rotated
+     * output still fits on the screen where it is */
+    for (i = 0; crtc != NULL && i < G_N_ELEMENTS(possible_rotations); i++) {
+      MateRRRotation rotation = possible_rotations[i];
+      gboolean sideways =
+          (rotation & (MATE_RR_ROTATION_90 | MATE_RR_ROTATION_270)) != 0;
 
-    if (mate_rr_config_applicable(config, rr_screen, NULL)) { /* NULL-GError */
-      (*out_num_rotations)++;
-      (*out_rotations) |= rotation_to_test;
+      if (!mate_rr_crtc_supports_rotation(crtc, rotation)) continue;
+
+      if (x + (sideways ? height : width) > max_width ||
+          y + (sideways ? width : height) > max_height)
+        continue;
+
+      *out_rotations |= rotation;
     }
+
+    g_hash_table_insert(priv->rotation_cache, key,
+                        GUINT_TO_POINTER(*out_rotations));
   }
 
-  mate_rr_output_info_set_rotation(output, current_rotation);
+  for (i = 0; i < G_N_ELEMENTS(possible_rotations); i++) {
+    if (*out_rotations & possible_rotations[i]) (*out_num_rotations)++;
+  }
 
   if (*out_num_rotations == 0 || *out_rotations == 0) {
-    g_warning(
-        "Huh, output %p says it doesn't support any rotations, and yet it has "
-        "a current rotation?",
-        output);
+    /* Outputs that are off have no CRTC to ask */
+    if (crtc != NULL)
+      g_warning(
+          "Huh, output %p says it doesn't support any rotations, and yet it "
+          "has a current rotation?",
+          output);
     *out_num_rotations = 1;
-    *out_rotations = mate_rr_output_info_get_rotation(output);
+    *out_rotations = current_rotation;
   }
 }
 
@@ -2088,12 +2563,11 @@ static void add_items_for_rotations(MsdXrandrManager *manager,
 
 static void add_rotation_items_for_output(MsdXrandrManager *manager,
                                           MateRROutputInfo *output) {
-  struct MsdXrandrManagerPrivate *priv = manager->priv;
   int num_rotations;
   MateRRRotation rotations;
 
-  get_allowed_rotations_for_output(priv->configuration, priv->rw_screen, output,
-                                   &num_rotations, &rotations);
+  get_allowed_rotations_for_output(manager, output, &num_rotations,
+                                   &rotations);
 
   if (num_rotations == 1)
     add_unsupported_rotation_item(manager);
@@ -2318,6 +2792,8 @@ static void on_config_changed(GSettings *settings, gchar *key,
                               MsdXrandrManager *manager) {
   if (g_strcmp0(key, CONF_KEY_SHOW_NOTIFICATION_ICON) == 0)
     start_or_stop_icon(manager);
+  else if (g_strcmp0(key, CONF_KEY_DEBUG_LOG) == 0)
+    update_event_log(settings);
 }
 
 static gboolean apply_intended_configuration(MsdXrandrManager *manager,
@@ -2451,10 +2927,10 @@ gboolean msd_xrandr_manager_start(MsdXrandrManager *manager, GError **error) {
   g_debug("Starting xrandr manager");
   mate_settings_profile_start(NULL);
 
-  log_open();
-  log_msg(
-      "------------------------------------------------------------\nSTARTING "
-      "XRANDR PLUGIN\n");
+  manager->priv->settings = g_settings_new(CONF_SCHEMA);
+  update_event_log(manager->priv->settings);
+
+  log_event("start", NULL);
 
   manager->priv->rw_screen =
       mate_rr_screen_new(gdk_screen_get_default(), error);
@@ -2463,22 +2939,34 @@ gboolean msd_xrandr_manager_start(MsdXrandrManager *manager, GError **error) {
     log_msg("Could not initialize the RANDR plugin%s%s\n",
             (error && *error) ? ": " : "",
             (error && *error) ? (*error)->message : "");
-    log_close();
+    log_flush();
+    g_clear_pointer(&event_log, msd_xrandr_log_free);
+    if (log_line != NULL) {
+      g_string_free(log_line, TRUE);
+      log_line = NULL;
+    }
+    g_clear_object(&manager->priv->settings);
     return FALSE;
   }
 
   g_signal_connect(manager->priv->rw_screen, "changed",
                    G_CALLBACK(on_randr_event), manager);
 
+  manager->priv->intended_monitor =
+      monitor_config_file(manager, mate_rr_config_get_intended_filename());
+  manager->priv->backup_monitor =
+      monitor_config_file(manager, mate_rr_config_get_backup_filename());
+
   log_msg("State of screen at startup:\n");
   log_screen(manager->priv->rw_screen);
 
   manager->priv->running = TRUE;
-  manager->priv->settings = g_settings_new(CONF_SCHEMA);
 
   g_signal_connect(manager->priv->settings,
                    "changed::" CONF_KEY_SHOW_NOTIFICATION_ICON,
                    G_CALLBACK(on_config_changed), manager);
+  g_signal_connect(manager->priv->settings, "changed::" CONF_KEY_DEBUG_LOG,
+                   G_CALLBACK(on_config_changed), manager);
 
   display = gdk_display_get_default();
 
@@ -2521,9 +3009,11 @@ gboolean msd_xrandr_manager_start(MsdXrandrManager *manager, GError **error) {
   gdk_window_add_filter(gdk_get_default_root_window(),
                         (GdkFilterFunc)event_filter, manager);
 
+  queue_fn_f7_update(manager);
+
   start_or_stop_icon(manager);
 
-  log_close();
+  log_flush();
 
   mate_settings_profile_end(NULL);
 
@@ -2562,11 +3052,27 @@ void msd_xrandr_manager_stop(MsdXrandrManager *manager) {
   gdk_window_remove_filter(gdk_get_default_root_window(),
                            (GdkFilterFunc)event_filter, manager);
 
+  /* Without an answer the backup stays where it is */
+  close_confirmation_dialog(manager);
+  manager->priv->confirmation_state = CONFIRMATION_NONE;
+  manager->priv->randr_event_queued = FALSE;
+
+  if (manager->priv->fn_f7_timeout_id != 0) {
+    g_source_remove(manager->priv->fn_f7_timeout_id);
+    manager->priv->fn_f7_timeout_id = 0;
+  }
+  free_fn_f7_configs(manager);
+
   if (manager->priv->settings != NULL) {
     g_object_unref(manager->priv->settings);
     manager->priv->settings = NULL;
   }
 
+  g_clear_object(&manager->priv->intended_monitor);
+  g_clear_object(&manager->priv->backup_monitor);
+  invalidate_config_index(manager);
+  g_hash_table_remove_all(manager->priv->rotation_cache);
+
   if (manager->priv->rw_screen != NULL) {
     g_object_unref(manager->priv->rw_screen);
     manager->priv->rw_screen = NULL;
@@ -2579,11 +3085,13 @@ void msd_xrandr_manager_stop(MsdXrandrManager *manager) {
 
   status_icon_stop(manager);
 
-  log_open();
-  log_msg(
-      "STOPPING XRANDR "
-      "PLUGIN\n------------------------------------------------------------\n");
-  log_close();
+  log_flush();
+  log_event("stop", NULL);
+  g_clear_pointer(&event_log, msd_xrandr_log_free);
+  if (log_line != NULL) {
+    g_string_free(log_line, TRUE);
+    log_line = NULL;
+  }
 }
 
 static void msd_xrandr_manager_class_init(MsdXrandrManagerClass *klass) {
@@ -2615,6 +3123,11 @@ static void msd_xrandr_manager_init(MsdXrandrManager *manager) {
 
   manager->priv->current_fn_f7_config = -1;
   manager->priv->fn_f7_configs = NULL;
+
+  manager->priv->config_index =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, unref_config);
+  manager->priv->rotation_cache =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 }
 
 static void msd_xrandr_manager_finalize(GObject *object) {
@@ -2627,6 +3140,10 @@ static void msd_xrandr_manager_finalize(GObject *object) {
 
   g_return_if_fail(xrandr_manager->priv != NULL);
 
+  g_hash_table_destroy(xrandr_manager->priv->config_index);
+  g_hash_table_destroy(xrandr_manager->priv->rotation_cache);
+  g_free(xrandr_manager->priv->config_index_stamp);
+
   G_OBJECT_CLASS(msd_xrandr_manager_parent_class)->finalize(object);
 }
 
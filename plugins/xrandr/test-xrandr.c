@@ -0,0 +1,604 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2012-2021 MATE Developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * Runs the xrandr manager against a private Xvfb, or against the X
+ * server in $MSD_TEST_XRANDR_DISPLAY (for instance Xorg with the dummy
+ * driver and several outputs), and goes through a scripted sequence of
+ * hotplugs and fn-F7 presses.  After each step the resulting layout is
+ * checked and the time from the hotplug to the screen settling is
+ * reported.
+ *
+ * Virtual X servers cannot unplug outputs, so a hotplug is played by
+ * adding a mode to or removing one from an output's mode list.  The
+ * server reports that like a new monitor: the config timestamp moves
+ * past the change timestamp, which sends the manager down the same
+ * path as a real hotplug.
+ *
+ * The fn-F7 steps need at least two connected outputs, since with one
+ * every stock configuration is the same layout; they are skipped on
+ * a plain Xvfb.  Each press has to move to a layout other than the one
+ * before it.
+ *
+ * The settings come from the schemas in this tree, compiled next to
+ * the test, so keys that are not installed yet can be used.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <X11/Xlib.h>
+#include <X11/XF86keysym.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xrandr.h>
+#include <gdk/gdkx.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MATE_DESKTOP_USE_UNSTABLE_API
+#include <libmate-desktop/mate-rr-config.h>
+#include <libmate-desktop/mate-rr.h>
+
+#include "msd-xrandr-manager.h"
+
+/* How long the screen has to stay unchanged before a step counts as
+ * handled */
+#define SETTLE_TIMEOUT 250
+
+/* Sizes of the modes the hotplugs add; they have to fit in the Xvfb
+ * screen below */
+#define STORED_WIDTH 1280
+#define STORED_HEIGHT 800
+#define EXTRA_WIDTH 800
+#define EXTRA_HEIGHT 600
+
+typedef struct {
+  const char *name;
+  /* Sets the step off; FALSE skips it */
+  gboolean (*run)(void);
+  /* Checks the layout beyond the invariants, or NULL */
+  gboolean (*check)(MateRRConfig *current);
+} Step;
+
+static Display *xdisplay;
+static MateRRScreen *screen;
+static MsdXrandrManager *manager;
+
+static GMainLoop *loop;
+static guint settle_id;
+static guint n_changes;
+static gint64 trigger_time;
+static gint64 last_change_time;
+
+static RROutput test_output;
+static char *test_output_name;
+static RRMode stored_mode;
+static RRMode extra_mode;
+static char *stored_layout;
+/* The layout after the step before */
+static char *last_layout;
+
+static gboolean on_settled(gpointer user_data) {
+  settle_id = 0;
+  g_main_loop_quit(loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void restart_settle_timeout(void) {
+  if (settle_id != 0) g_source_remove(settle_id);
+  settle_id = g_timeout_add(SETTLE_TIMEOUT, on_settled, NULL);
+}
+
+static void on_screen_changed(MateRRScreen *rr_screen, gpointer user_data) {
+  n_changes++;
+  last_change_time = g_get_monotonic_time();
+  restart_settle_timeout();
+}
+
+static void wait_for_settle(void) {
+  restart_settle_timeout();
+  g_main_loop_run(loop);
+}
+
+static void begin_step(void) {
+  n_changes = 0;
+  last_change_time = 0;
+  trigger_time = g_get_monotonic_time();
+}
+
+static int compare_strings(gconstpointer a, gconstpointer b) {
+  return g_strcmp0(*(const char **)a, *(const char **)b);
+}
+
+/* "NAME WxH+X+Y" for each active output, sorted by name */
+static char *get_layout(MateRRConfig *config) {
+  MateRROutputInfo **outputs = mate_rr_config_get_outputs(config);
+  GPtrArray *parts;
+  int x, y, width, height;
+  char *layout;
+  int i;
+
+  parts = g_ptr_array_new_with_free_func(g_free);
+
+  for (i = 0; outputs[i] != NULL; i++) {
+    if (!mate_rr_output_info_is_active(outputs[i])) continue;
+
+    mate_rr_output_info_get_geometry(outputs[i], &x, &y, &width, &height);
+    g_ptr_array_add(parts,
+                    g_strdup_printf("%s %dx%d+%d+%d",
+                                    mate_rr_output_info_get_name(outputs[i]),
+                                    width, height, x, y));
+  }
+
+  g_ptr_array_sort(parts, compare_strings);
+  g_ptr_array_add(parts, NULL);
+  layout = g_strjoinv(", ", (char **)parts->pdata);
+  g_ptr_array_unref(parts);
+
+  return layout;
+}
+
+/* What every layout the manager leaves behind has to satisfy: something
+ * is on, the outputs start at the origin, fit the screen, and only
+ * overlap when they are clones of each other */
+static gboolean check_invariants(MateRRConfig *config) {
+  MateRROutputInfo **outputs = mate_rr_config_get_outputs(config);
+  int min_w, max_w, min_h, max_h;
+  int x1, y1, w1, h1, x2, y2, w2, h2;
+  int left = G_MAXINT, top = G_MAXINT, right = 0, bottom = 0;
+  int n_active = 0;
+  gboolean ok = TRUE;
+  int i, j;
+
+  mate_rr_screen_get_ranges(screen, &min_w, &max_w, &min_h, &max_h);
+
+  for (i = 0; outputs[i] != NULL; i++) {
+    if (!mate_rr_output_info_is_active(outputs[i])) continue;
+
+    n_active++;
+    mate_rr_output_info_get_geometry(outputs[i], &x1, &y1, &w1, &h1);
+    left = MIN(left, x1);
+    top = MIN(top, y1);
+    right = MAX(right, x1 + w1);
+    bottom = MAX(bottom, y1 + h1);
+
+    for (j = i + 1; outputs[j] != NULL; j++) {
+      if (!mate_rr_output_info_is_active(outputs[j])) continue;
+
+      mate_rr_output_info_get_geometry(outputs[j], &x2, &y2, &w2, &h2);
+      if (x1 == x2 && y1 == y2 && w1 == w2 && h1 == h2) continue;
+
+      if (x1 < x2 + w2 && x2 < x1 + w1 && y1 < y2 + h2 && y2 < y1 + h1) {
+        g_printerr("  %s and %s overlap\n",
+                   mate_rr_output_info_get_name(outputs[i]),
+                   mate_rr_output_info_get_name(outputs[j]));
+        ok = FALSE;
+      }
+    }
+  }
+
+  if (n_active == 0) {
+    g_printerr("  no output is on\n");
+    return FALSE;
+  }
+
+  if (left != 0 || top != 0) {
+    g_printerr("  layout starts at %d,%d\n", left, top);
+    ok = FALSE;
+  }
+
+  if (right > max_w || bottom > max_h) {
+    g_printerr("  layout is %dx%d, larger than the maximum %dx%d\n", right,
+               bottom, max_w, max_h);
+    ok = FALSE;
+  }
+
+  return ok;
+}
+
+static RRMode add_test_mode(int width, int height) {
+  XRRModeInfo info;
+  RRMode mode;
+  char *name;
+
+  name = g_strdup_printf("msd-test-%dx%d", width, height);
+
+  memset(&info, 0, sizeof(info));
+  info.width = width;
+  info.height = height;
+  info.hSyncStart = width + 48;
+  info.hSyncEnd = width + 80;
+  info.hTotal = width + 160;
+  info.vSyncStart = height + 3;
+  info.vSyncEnd = height + 9;
+  info.vTotal = height + 30;
+  info.dotClock = (unsigned long)info.hTotal * info.vTotal * 60;
+  info.name = name;
+  info.nameLength = strlen(name);
+
+  mode = XRRCreateMode(xdisplay, DefaultRootWindow(xdisplay), &info);
+  XRRAddOutputMode(xdisplay, test_output, mode);
+  XSync(xdisplay, False);
+
+  g_free(name);
+
+  return mode;
+}
+
+static void remove_test_mode(RRMode mode) {
+  GdkDisplay *display = gdk_display_get_default();
+
+  /* The server refuses while a CRTC still shows the mode */
+  gdk_x11_display_error_trap_push(display);
+  XRRDeleteOutputMode(xdisplay, test_output, mode);
+  XRRDestroyMode(xdisplay, mode);
+  XSync(xdisplay, False);
+  gdk_x11_display_error_trap_pop_ignored(display);
+}
+
+static gboolean start_manager(void) {
+  GError *error = NULL;
+
+  manager = msd_xrandr_manager_new();
+  if (!msd_xrandr_manager_start(manager, &error)) {
+    g_printerr("Could not start the xrandr manager: %s\n", error->message);
+    g_error_free(error);
+    g_clear_object(&manager);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean plug_new_mode(void) {
+  stored_mode = add_test_mode(STORED_WIDTH, STORED_HEIGHT);
+  return TRUE;
+}
+
+/* Stores a configuration that puts the test output in the mode added
+ * before, then plugs another mode so the manager picks it up */
+static gboolean plug_with_stored_configuration(void) {
+  MateRRConfig *config;
+  MateRROutputInfo **outputs;
+  GError *error = NULL;
+  int x, y, width, height;
+  int i;
+
+  mate_rr_screen_refresh(screen, NULL);
+  config = mate_rr_config_new_current(screen, NULL);
+  outputs = mate_rr_config_get_outputs(config);
+
+  for (i = 0; outputs[i] != NULL; i++) {
+    if (g_strcmp0(mate_rr_output_info_get_name(outputs[i]),
+                  test_output_name) != 0)
+      continue;
+
+    mate_rr_output_info_get_geometry(outputs[i], &x, &y, &width, &height);
+    mate_rr_output_info_set_active(outputs[i], TRUE);
+    mate_rr_output_info_set_geometry(outputs[i], x, y, STORED_WIDTH,
+                                     STORED_HEIGHT);
+    mate_rr_output_info_set_refresh_rate(outputs[i], 60);
+  }
+
+  if (!mate_rr_config_save(config, &error)) {
+    g_printerr("Could not store a configuration: %s\n", error->message);
+    g_error_free(error);
+    g_object_unref(config);
+    return FALSE;
+  }
+
+  g_free(stored_layout);
+  stored_layout = get_layout(config);
+  g_object_unref(config);
+
+  begin_step();
+  extra_mode = add_test_mode(EXTRA_WIDTH, EXTRA_HEIGHT);
+
+  return TRUE;
+}
+
+static gboolean unplug_extra_mode(void) {
+  remove_test_mode(extra_mode);
+  extra_mode = None;
+  return TRUE;
+}
+
+static gboolean press_fn_f7(void) {
+  MateRROutput **outputs;
+  KeyCode keycode;
+  int n_connected = 0;
+  int i;
+
+  mate_rr_screen_refresh(screen, NULL);
+  outputs = mate_rr_screen_list_outputs(screen);
+  for (i = 0; outputs[i] != NULL; i++) {
+    if (mate_rr_output_is_connected(outputs[i])) n_connected++;
+  }
+  if (n_connected < 2) return FALSE;
+
+  keycode = XKeysymToKeycode(xdisplay, XF86XK_Display);
+  if (keycode == 0) return FALSE;
+
+  XTestFakeKeyEvent(xdisplay, keycode, True, CurrentTime);
+  XTestFakeKeyEvent(xdisplay, keycode, False, CurrentTime);
+  XSync(xdisplay, False);
+
+  return TRUE;
+}
+
+static gboolean check_stored_layout(MateRRConfig *current) {
+  char *layout;
+  gboolean ok;
+
+  layout = get_layout(current);
+  ok = g_strcmp0(layout, stored_layout) == 0;
+  if (!ok) g_printerr("  expected the stored layout %s\n", stored_layout);
+  g_free(layout);
+
+  return ok;
+}
+
+static gboolean check_layout_changed(MateRRConfig *current) {
+  char *layout;
+  gboolean ok;
+
+  layout = get_layout(current);
+  ok = g_strcmp0(layout, last_layout) != 0;
+  if (!ok) g_printerr("  expected to leave the layout %s\n", last_layout);
+  g_free(layout);
+
+  return ok;
+}
+
+static const Step steps[] = {
+    {"startup", start_manager, NULL},
+    {"new mode", plug_new_mode, NULL},
+    {"stored configuration", plug_with_stored_configuration,
+     check_stored_layout},
+    {"unplug", unplug_extra_mode, check_stored_layout},
+    {"fn-F7", press_fn_f7, check_layout_changed},
+    {"fn-F7 again", press_fn_f7, check_layout_changed},
+    {"fn-F7 once more", press_fn_f7, check_layout_changed},
+};
+
+static gboolean run_step(const Step *step) {
+  MateRRConfig *current;
+  gboolean ok;
+  char *layout;
+
+  begin_step();
+  if (!step->run()) {
+    g_print("%-22s skipped\n", step->name);
+    return TRUE;
+  }
+
+  wait_for_settle();
+
+  mate_rr_screen_refresh(screen, NULL);
+  current = mate_rr_config_new_current(screen, NULL);
+  layout = get_layout(current);
+
+  if (n_changes > 0)
+    g_print("%-22s %u change(s), configured after %" G_GINT64_FORMAT
+            " us: %s\n",
+            step->name, n_changes, last_change_time - trigger_time, layout);
+  else
+    g_print("%-22s no change: %s\n", step->name, layout);
+
+  ok = check_invariants(current);
+  if (step->check != NULL && !step->check(current)) ok = FALSE;
+
+  g_free(last_layout);
+  last_layout = layout;
+  g_object_unref(current);
+
+  return ok;
+}
+
+/* Starts Xvfb on a free display and points $DISPLAY at it */
+static GPid start_xvfb(void) {
+  GError *error = NULL;
+  char *argv[] = {"Xvfb",      "-displayfd", NULL,  "-screen",
+                  "0",         "1920x1200x24", "-nolisten", "tcp",
+                  "+extension", "RANDR",       NULL};
+  char buffer[32];
+  char *display_name;
+  ssize_t n;
+  int fds[2];
+  GPid pid;
+
+  if (!g_unix_open_pipe(fds, 0, &error)) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return 0;
+  }
+
+  argv[2] = g_strdup_printf("%d", fds[1]);
+  if (!g_spawn_async(NULL, argv, NULL,
+                     G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN |
+                         G_SPAWN_DO_NOT_REAP_CHILD,
+                     NULL, NULL, &pid, &error)) {
+    g_printerr("Could not start Xvfb: %s\n", error->message);
+    g_error_free(error);
+    pid = 0;
+  }
+  g_free(argv[2]);
+  close(fds[1]);
+
+  /* Xvfb writes the display number once it accepts connections */
+  n = pid != 0 ? read(fds[0], buffer, sizeof(buffer) - 1) : 0;
+  close(fds[0]);
+
+  if (n <= 0) {
+    if (pid != 0) {
+      g_printerr("Xvfb did not report a display\n");
+      kill(pid, SIGTERM);
+      g_spawn_close_pid(pid);
+    }
+    return 0;
+  }
+
+  buffer[n] = '\0';
+  display_name = g_strdup_printf(":%s", g_strstrip(buffer));
+  g_setenv("DISPLAY", display_name, TRUE);
+  g_free(display_name);
+
+  return pid;
+}
+
+static gboolean find_test_output(void) {
+  MateRROutput **outputs;
+  int i;
+
+  outputs = mate_rr_screen_list_outputs(screen);
+  for (i = 0; outputs[i] != NULL; i++) {
+    if (mate_rr_output_is_connected(outputs[i])) {
+      test_output = mate_rr_output_get_id(outputs[i]);
+      test_output_name = g_strdup(mate_rr_output_get_name(outputs[i]));
+      return TRUE;
+    }
+  }
+
+  g_printerr("The X server has no connected output\n");
+  return FALSE;
+}
+
+static void remove_tree(const char *path) {
+  GDir *dir;
+  const char *name;
+  char *child;
+
+  if ((dir = g_dir_open(path, 0, NULL)) != NULL) {
+    while ((name = g_dir_read_name(dir)) != NULL) {
+      child = g_build_filename(path, name, NULL);
+      remove_tree(child);
+      g_free(child);
+    }
+    g_dir_close(dir);
+  }
+
+  g_remove(path);
+}
+
+int main(int argc, char **argv) {
+  GTestDBus *bus;
+  GError *error = NULL;
+  const char *display;
+  char *tmpdir, *dir;
+  GPid xvfb = 0;
+  gboolean ok = TRUE;
+  guint i;
+
+  tmpdir = g_dir_make_tmp("test-xrandr-XXXXXX", &error);
+  if (tmpdir == NULL) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  /* Keep the stored configurations, the settings and the bus name away
+   * from the user's session */
+  dir = g_build_filename(tmpdir, "config", NULL);
+  g_setenv("XDG_CONFIG_HOME", dir, TRUE);
+  g_mkdir_with_parents(dir, 0700);
+  g_free(dir);
+  dir = g_build_filename(tmpdir, "cache", NULL);
+  g_setenv("XDG_CACHE_HOME", dir, TRUE);
+  g_free(dir);
+  g_setenv("GSETTINGS_BACKEND", "memory", TRUE);
+  g_setenv("GSETTINGS_SCHEMA_DIR", TEST_SCHEMA_DIR, TRUE);
+
+  bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+  g_test_dbus_up(bus);
+
+  display = g_getenv("MSD_TEST_XRANDR_DISPLAY");
+  if (display != NULL) {
+    g_setenv("DISPLAY", display, TRUE);
+  } else if ((xvfb = start_xvfb()) == 0) {
+    ok = FALSE;
+    goto out;
+  }
+
+  if (!gtk_init_check(&argc, &argv)) {
+    g_printerr("Could not open the display %s\n", g_getenv("DISPLAY"));
+    ok = FALSE;
+    goto out;
+  }
+
+  xdisplay = gdk_x11_get_default_xdisplay();
+  loop = g_main_loop_new(NULL, FALSE);
+
+  screen = mate_rr_screen_new(gdk_screen_get_default(), &error);
+  if (screen == NULL) {
+    g_printerr("Could not get the screen: %s\n", error->message);
+    g_error_free(error);
+    ok = FALSE;
+    goto out;
+  }
+  g_signal_connect(screen, "changed", G_CALLBACK(on_screen_changed), NULL);
+
+  if (!find_test_output()) {
+    ok = FALSE;
+    goto out;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS(steps); i++) {
+    if (!run_step(&steps[i])) {
+      g_printerr("  step \"%s\" failed\n", steps[i].name);
+      ok = FALSE;
+    }
+    /* Everything after the manager failed to start is meaningless */
+    if (manager == NULL) break;
+  }
+
+  if (manager != NULL) {
+    msd_xrandr_manager_stop(manager);
+    g_object_unref(manager);
+  }
+
+  if (extra_mode != None) remove_test_mode(extra_mode);
+  if (stored_mode != None) remove_test_mode(stored_mode);
+
+out:
+  g_clear_object(&screen);
+  if (loop != NULL) g_main_loop_unref(loop);
+
+  if (xvfb != 0) {
+    kill(xvfb, SIGTERM);
+    g_spawn_close_pid(xvfb);
+  }
+
+  g_test_dbus_down(bus);
+  g_object_unref(bus);
+
+  remove_tree(tmpdir);
+  g_free(tmpdir);
+  g_free(test_output_name);
+  g_free(stored_layout);
+  g_free(last_layout);
+
+  return ok ? 0 : 1;
+}
@@ -26,11 +26,15 @@
 
 #include "msd-xrdb-manager.h"
 
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xresource.h>
 #include <errno.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <locale.h>
 #include <stdio.h>
@@ -48,8 +52,26 @@
 #define USER_X_RESOURCES ".Xresources"
 #define USER_X_DEFAULTS ".Xdefaults"
 
+/* A file or directory listing as read on a previous theme change */
+typedef struct {
+  gint64 mtime;
+  goffset size;
+  guint generation;
+  char *contents;
+  gboolean listed;
+  GSList *entries;
+} XrdbCacheEntry;
+
 struct MsdXrdbManagerPrivate {
   GtkWidget *widget;
+
+  /* Path to XrdbCacheEntry, dropped when a theme change no longer
+   * reads the path */
+  GHashTable *cache;
+  guint generation;
+
+  /* Checksum of the resources last merged */
+  char *applied_checksum;
 };
 
 static void msd_xrdb_manager_finalize(GObject *object);
@@ -117,11 +139,52 @@ static void append_theme_colors(GtkStyle *style, GString *string) {
   return;
 }
 
+static void xrdb_cache_entry_free(XrdbCacheEntry *entry) {
+  g_free(entry->contents);
+  g_slist_free_full(entry->entries, g_free);
+  g_free(entry);
+}
+
+/**
+ * Look up the cache entry for a path, discarding it if the path changed
+ * since it was read. Returns NULL and sets @error if the path can't be
+ * looked at.
+ */
+static XrdbCacheEntry *lookup_cache_entry(MsdXrdbManager *manager,
+                                          const char *path, GError **error) {
+  XrdbCacheEntry *entry;
+  GStatBuf buf;
+  int errsv;
+
+  if (g_stat(path, &buf) != 0) {
+    errsv = errno;
+    g_hash_table_remove(manager->priv->cache, path);
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                "Could not stat %s: %s", path, g_strerror(errsv));
+    return NULL;
+  }
+
+  entry = g_hash_table_lookup(manager->priv->cache, path);
+  if (entry == NULL || entry->mtime != (gint64)buf.st_mtime ||
+      entry->size != (goffset)buf.st_size) {
+    entry = g_new0(XrdbCacheEntry, 1);
+    entry->mtime = buf.st_mtime;
+    entry->size = buf.st_size;
+    g_hash_table_replace(manager->priv->cache, g_strdup(path), entry);
+  }
+
+  entry->generation = manager->priv->generation;
+
+  return entry;
+}
+
 /**
  * Scan a single directory for .ad files, and return them all in a
  * GSList*
  */
-static GSList *scan_ad_directory(const char *path, GError **error) {
+static GSList *scan_ad_directory(MsdXrdbManager *manager, const char *path,
+                                 GError **error) {
+  XrdbCacheEntry *cache_entry;
   GSList *list;
   GDir *dir;
   const char *entry;
@@ -132,6 +195,17 @@ static GSList *scan_ad_directory(const char *path, GError **error) {
   g_return_val_if_fail(path != NULL, NULL);
 
   local_error = NULL;
+  cache_entry = lookup_cache_entry(manager, path, &local_error);
+  if (local_error != NULL) {
+    g_propagate_error(error, local_error);
+    return NULL;
+  }
+
+  /* Adding or removing files touches the directory */
+  if (cache_entry->listed) {
+    return g_slist_copy_deep(cache_entry->entries, (GCopyFunc)g_strdup, NULL);
+  }
+
   dir = g_dir_open(path, 0, &local_error);
   if (local_error != NULL) {
     g_propagate_error(error, local_error);
@@ -147,7 +221,11 @@ static GSList *scan_ad_directory(const char *path, GError **error) {
   g_dir_close(dir);
 
   /* TODO: sort still? */
-  return g_slist_sort(list, (GCompareFunc)strcmp);
+  list = g_slist_sort(list, (GCompareFunc)strcmp);
+  cache_entry->entries = g_slist_copy_deep(list, (GCopyFunc)g_strdup, NULL);
+  cache_entry->listed = TRUE;
+
+  return list;
 }
 
 /**
@@ -184,7 +262,7 @@ static GSList *scan_for_files(MsdXrdbManager *manager, GError **error) {
   system_list = NULL;
 
   local_error = NULL;
-  system_list = scan_ad_directory(SYSTEM_AD_DIR, &local_error);
+  system_list = scan_ad_directory(manager, SYSTEM_AD_DIR, &local_error);
   if (local_error != NULL) {
     g_propagate_error(error, local_error);
     return NULL;
@@ -198,7 +276,7 @@ static GSList *scan_for_files(MsdXrdbManager *manager, GError **error) {
 
     if (g_file_test(user_ad, G_FILE_TEST_IS_DIR)) {
       local_error = NULL;
-      user_list = scan_ad_directory(user_ad, &local_error);
+      user_list = scan_ad_directory(manager, user_ad, &local_error);
       if (local_error != NULL) {
         g_propagate_error(error, local_error);
 
@@ -247,24 +325,33 @@ static GSList *scan_for_files(MsdXrdbManager *manager, GError **error) {
 }
 
 /**
- * Append the contents of a file onto the end of a GString
+ * Append the contents of a file onto the end of a GString, reading it
+ * only if it changed since the last time
  */
-static void append_file(const char *file, GString *string, GError **error) {
-  char *contents;
+static void append_file(MsdXrdbManager *manager, const char *file,
+                        GString *string, GError **error) {
+  XrdbCacheEntry *entry;
 
   g_return_if_fail(string != NULL);
   g_return_if_fail(file != NULL);
 
-  if (g_file_get_contents(file, &contents, NULL, error)) {
-    g_string_append(string, contents);
-    g_free(contents);
+  entry = lookup_cache_entry(manager, file, error);
+  if (entry == NULL) return;
+
+  if (entry->contents == NULL &&
+      !g_file_get_contents(file, &entry->contents, NULL, error)) {
+    g_hash_table_remove(manager->priv->cache, file);
+    return;
   }
+
+  g_string_append(string, entry->contents);
 }
 
 /**
  * Append an X resources file, such as .Xresources, or .Xdefaults
  */
-static void append_xresource_file(const char *filename, GString *string,
+static void append_xresource_file(MsdXrdbManager *manager,
+                                  const char *filename, GString *string,
                                   GError **error) {
   const char *home_path;
   char *xresources;
@@ -283,7 +370,7 @@ static void append_xresource_file(const char *filename, GString *string,
 
     local_error = NULL;
 
-    append_file(xresources, string, &local_error);
+    append_file(manager, xresources, string, &local_error);
     if (local_error != NULL) {
       g_warning("%s", local_error->message);
       g_propagate_error(error, local_error);
@@ -306,15 +393,34 @@ static gboolean write_all(int fd, const char *buf, gsize to_write) {
   return TRUE;
 }
 
+typedef struct {
+  MsdXrdbManager *manager;
+  const char *command;
+  /* Checksum of the input, recorded once the command succeeded */
+  char *checksum;
+} XrdbChild;
+
+static void xrdb_child_free(XrdbChild *child) {
+  g_object_unref(child->manager);
+  g_free(child->checksum);
+  g_free(child);
+}
+
 static void child_watch_cb(GPid pid, int status, gpointer user_data) {
-  char *command = user_data;
+  XrdbChild *child = user_data;
 
   if (!WIFEXITED(status) || WEXITSTATUS(status)) {
-    g_warning("Command %s failed", command);
+    g_warning("Command %s failed", child->command);
+    return;
   }
+
+  g_free(child->manager->priv->applied_checksum);
+  child->manager->priv->applied_checksum = g_steal_pointer(&child->checksum);
 }
 
-static void spawn_with_input(const char *command, const char *input) {
+static void spawn_with_input(MsdXrdbManager *manager, const char *command,
+                             const char *input, const char *checksum) {
+  XrdbChild *child;
   char **argv;
   int child_pid;
   int inpipe;
@@ -349,19 +455,310 @@ static void spawn_with_input(const char *command, const char *input) {
     close(inpipe);
   }
 
-  g_child_watch_add(child_pid, (GChildWatchFunc)child_watch_cb,
-                    (gpointer)command);
+  child = g_new0(XrdbChild, 1);
+  child->manager = g_object_ref(manager);
+  child->command = command;
+  child->checksum = g_strdup(checksum);
+
+  g_child_watch_add_full(G_PRIORITY_DEFAULT, child_pid, child_watch_cb, child,
+                         (GDestroyNotify)xrdb_child_free);
+}
+
+static gboolean is_name_char(char c) { return g_ascii_isalnum(c) || c == '_'; }
+
+/* Names xrdb defines for cpp from the display it runs against, and the
+ * ones cpp itself predefines on common systems.  Their values are only
+ * known to xrdb, so a file that uses one has to go through it.
+ */
+static const char *const cpp_predefined_names[] = {
+    "BITS_PER_RGB", "CLASS", "CLIENTHOST", "COLOR", "DISPLAY_NUM", "HEIGHT",
+    "HOST", "NUM_SCREENS", "PLANES", "RELEASE", "REVISION", "SCREEN_NUM",
+    "SERVERHOST", "VENDOR", "VERSION", "WIDTH", "X_RESOLUTION",
+    "Y_RESOLUTION", "linux", "unix",
+};
+
+static const char *const cpp_predefined_prefixes[] = {
+    "CLASS_", "CLNT_", "EXT_", "SRVR_", "VNDR_", "__",
+};
+
+static gboolean is_cpp_predefined(const char *name) {
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(cpp_predefined_names); i++)
+    if (strcmp(name, cpp_predefined_names[i]) == 0) return TRUE;
+
+  for (i = 0; i < G_N_ELEMENTS(cpp_predefined_prefixes); i++)
+    if (g_str_has_prefix(name, cpp_predefined_prefixes[i])) return TRUE;
+
+  return FALSE;
+}
+
+/**
+ * Append a line to a GString with every defined macro name replaced
+ * by its value, the way cpp substitutes object-like macros.  Returns
+ * FALSE when the line uses a name only cpp, as run by xrdb, can expand.
+ */
+static gboolean expand_line(const char *line, gsize len, GHashTable *defines,
+                            GString *string) {
+  const char *end = line + len;
+  const char *start;
+  const char *value;
+  char *name;
+
+  while (line < end) {
+    /* Numbers such as 0x1A are a single token to cpp */
+    if (g_ascii_isdigit(*line)) {
+      start = line;
+      while (line < end && is_name_char(*line)) line++;
+      g_string_append_len(string, start, line - start);
+      continue;
+    }
+
+    if (!g_ascii_isalpha(*line) && *line != '_') {
+      g_string_append_c(string, *line++);
+      continue;
+    }
+
+    start = line;
+    while (line < end && is_name_char(*line)) line++;
+
+    name = g_strndup(start, line - start);
+    value = g_hash_table_lookup(defines, name);
+
+    if (value == NULL && is_cpp_predefined(name)) {
+      g_free(name);
+      return FALSE;
+    }
+    g_free(name);
+
+    if (value != NULL)
+      g_string_append(string, value);
+    else
+      g_string_append_len(string, start, line - start);
+  }
+
+  return TRUE;
+}
+
+/**
+ * Expand the #define lines of a resource file without running cpp.
+ * Returns NULL when the input needs anything else from cpp, such as
+ * conditionals, includes, comments or the names xrdb predefines, and
+ * has to go through xrdb.
+ */
+static GString *expand_defines(const char *input) {
+  GHashTable *defines;
+  GString *string;
+  GString *value;
+  const char *line;
+  const char *eol;
+  const char *p;
+  const char *name;
+  const char *name_end;
+
+  defines = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  string = g_string_sized_new(strlen(input));
+
+  for (line = input; *line != '\0'; line = *eol != '\0' ? eol + 1 : eol) {
+    eol = strchr(line, '\n');
+    if (eol == NULL) eol = line + strlen(line);
+
+    if (g_strstr_len(line, eol - line, "/*") != NULL) goto needs_cpp;
+
+    for (p = line; p < eol && g_ascii_isspace(*p); p++)
+      ;
+
+    if (p == eol || *p != '#') {
+      if (!expand_line(line, eol - line, defines, string)) goto needs_cpp;
+      g_string_append_c(string, '\n');
+      continue;
+    }
+
+    for (p++; p < eol && g_ascii_isspace(*p); p++)
+      ;
+
+    if (eol - p < 7 || strncmp(p, "define", 6) != 0 ||
+        !g_ascii_isspace(p[6]) || eol[-1] == '\\')
+      goto needs_cpp;
+
+    for (p += 6; p < eol && g_ascii_isspace(*p); p++)
+      ;
+
+    name = p;
+    while (p < eol && is_name_char(*p)) p++;
+    name_end = p;
+
+    /* Function-like macros are left to cpp */
+    if (name == name_end || (p < eol && *p == '(')) goto needs_cpp;
+
+    while (p < eol && g_ascii_isspace(*p)) p++;
+
+    value = g_string_new(NULL);
+    if (!expand_line(p, eol - p, defines, value)) {
+      g_string_free(value, TRUE);
+      goto needs_cpp;
+    }
+    g_hash_table_replace(defines, g_strndup(name, name_end - name),
+                         g_strchomp(g_string_free(value, FALSE)));
+  }
+
+  g_hash_table_destroy(defines);
+
+  return string;
+
+needs_cpp:
+  g_hash_table_destroy(defines);
+  g_string_free(string, TRUE);
+
+  return NULL;
+}
+
+static Bool append_resource(XrmDatabase *db, XrmBindingList bindings,
+                            XrmQuarkList quarks, XrmRepresentation *type,
+                            XrmValue *value, XPointer closure) {
+  GPtrArray *lines = (GPtrArray *)closure;
+  GString *line;
+  const char *str;
+  guint i;
+
+  line = g_string_new(NULL);
+
+  for (i = 0; quarks[i] != NULLQUARK; i++) {
+    if (bindings[i] == XrmBindLoosely)
+      g_string_append_c(line, '*');
+    else if (i > 0)
+      g_string_append_c(line, '.');
+    g_string_append(line, XrmQuarkToString(quarks[i]));
+  }
+
+  g_string_append(line, ":\t");
+
+  str = (const char *)value->addr;
+  for (i = 0; i < value->size && str[i] != '\0'; i++) {
+    if (str[i] == '\n')
+      g_string_append(line, "\\n");
+    else if (str[i] == '\\')
+      g_string_append(line, "\\\\");
+    else if (i == 0 && (str[i] == ' ' || str[i] == '\t'))
+      g_string_append_printf(line, "\\%c", str[i]);
+    else
+      g_string_append_c(line, str[i]);
+  }
+
+  g_ptr_array_add(lines, g_string_free(line, FALSE));
+
+  return False;
+}
+
+static gint compare_lines(gconstpointer a, gconstpointer b) {
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static char *get_resource_manager(GdkDisplay *display, Window root) {
+  Atom type;
+  int format;
+  unsigned long nitems;
+  unsigned long bytes_after;
+  unsigned char *data = NULL;
+  char *resources = NULL;
+  int result;
+
+  gdk_x11_display_error_trap_push(display);
+  result = XGetWindowProperty(GDK_DISPLAY_XDISPLAY(display), root,
+                              XA_RESOURCE_MANAGER, 0, G_MAXLONG, False,
+                              XA_STRING, &type, &format, &nitems,
+                              &bytes_after, &data);
+  gdk_x11_display_error_trap_pop_ignored(display);
+
+  if (result == Success && type == XA_STRING && format == 8)
+    resources = g_strndup((const char *)data, nitems);
+
+  if (data != NULL) XFree(data);
+
+  return resources;
+}
+
+/**
+ * Merge resources into the RESOURCE_MANAGER property the way
+ * "xrdb -merge" does, without spawning it.  Returns FALSE if the
+ * property could not be set
+ */
+static gboolean merge_resources(const char *resources) {
+  GdkDisplay *display;
+  Display *dpy;
+  Window root;
+  XrmDatabase database;
+  XrmQuark empty = NULLQUARK;
+  GPtrArray *lines;
+  GString *string;
+  char *current;
+  guint i;
+  gboolean ret = TRUE;
+
+  display = gdk_display_get_default();
+  dpy = GDK_DISPLAY_XDISPLAY(display);
+  /* xrdb works on the first screen unless told otherwise */
+  root = RootWindow(dpy, 0);
+
+  XrmInitialize();
+
+  current = get_resource_manager(display, root);
+  database = XrmGetStringDatabase(current != NULL ? current : "");
+  g_free(current);
+
+  /* Destroys the new database, its entries win */
+  XrmMergeDatabases(XrmGetStringDatabase(resources), &database);
+
+  lines = g_ptr_array_new_with_free_func(g_free);
+  if (database != NULL) {
+    XrmEnumerateDatabase(database, &empty, &empty, XrmEnumAllLevels,
+                         append_resource, (XPointer)lines);
+    XrmDestroyDatabase(database);
+  }
+
+  /* Sorted like xrdb does */
+  g_ptr_array_sort(lines, compare_lines);
+
+  string = g_string_sized_new(strlen(resources));
+  for (i = 0; i < lines->len; i++) {
+    g_string_append(string, g_ptr_array_index(lines, i));
+    g_string_append_c(string, '\n');
+  }
+  g_ptr_array_unref(lines);
+
+  gdk_x11_display_error_trap_push(display);
+  XChangeProperty(dpy, root, XA_RESOURCE_MANAGER, XA_STRING, 8,
+                  PropModeReplace, (unsigned char *)string->str, string->len);
+  if (gdk_x11_display_error_trap_pop(display)) {
+    g_warning("Could not set the RESOURCE_MANAGER property");
+    ret = FALSE;
+  }
+
+  g_string_free(string, TRUE);
+
+  return ret;
+}
+
+static gboolean is_stale_cache_entry(gpointer key, gpointer value,
+                                     gpointer user_data) {
+  MsdXrdbManager *manager = user_data;
+
+  return ((XrdbCacheEntry *)value)->generation != manager->priv->generation;
 }
 
 static void apply_settings(MsdXrdbManager *manager, GtkStyle *style) {
   const char *command;
   GString *string;
+  GString *expanded;
   GSList *list;
   GSList *p;
   GError *error;
+  char *checksum;
 
   mate_settings_profile_start(NULL);
 
+  manager->priv->generation++;
+
   command = "xrdb -merge -quiet";
 
   string = g_string_sized_new(256);
@@ -376,7 +773,7 @@ static void apply_settings(MsdXrdbManager *manager, GtkStyle *style) {
 
   for (p = list; p != NULL; p = p->next) {
     error = NULL;
-    append_file(p->data, string, &error);
+    append_file(manager, p->data, string, &error);
     if (error != NULL) {
       g_warning("%s", error->message);
       g_error_free(error);
@@ -386,20 +783,45 @@ static void apply_settings(MsdXrdbManager *manager, GtkStyle *style) {
   g_slist_free_full(list, g_free);
 
   error = NULL;
-  append_xresource_file(USER_X_RESOURCES, string, &error);
+  append_xresource_file(manager, USER_X_RESOURCES, string, &error);
   if (error != NULL) {
     g_warning("%s", error->message);
     g_error_free(error);
   }
 
   error = NULL;
-  append_xresource_file(USER_X_DEFAULTS, string, &error);
+  append_xresource_file(manager, USER_X_DEFAULTS, string, &error);
   if (error != NULL) {
     g_warning("%s", error->message);
     g_error_free(error);
   }
 
-  spawn_with_input(command, string->str);
+  g_hash_table_foreach_remove(manager->priv->cache, is_stale_cache_entry,
+                              manager);
+
+  checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA256, string->str,
+                                           string->len);
+  if (g_strcmp0(checksum, manager->priv->applied_checksum) == 0) {
+    g_debug("Resources unchanged, not merging them");
+    g_free(checksum);
+    g_string_free(string, TRUE);
+    mate_settings_profile_end(NULL);
+    return;
+  }
+
+  /* Only a successful merge may skip the next identical one */
+  expanded = expand_defines(string->str);
+  if (expanded != NULL) {
+    if (merge_resources(expanded->str)) {
+      g_free(manager->priv->applied_checksum);
+      manager->priv->applied_checksum = g_steal_pointer(&checksum);
+    }
+    g_string_free(expanded, TRUE);
+  } else {
+    g_debug("Resources need cpp, merging them with xrdb");
+    spawn_with_input(manager, command, string->str, checksum);
+  }
+  g_free(checksum);
   g_string_free(string, TRUE);
 
   mate_settings_profile_end(NULL);
@@ -442,6 +864,9 @@ void msd_xrdb_manager_stop(MsdXrdbManager *manager) {
     gtk_widget_destroy(p->widget);
     p->widget = NULL;
   }
+
+  g_hash_table_remove_all(p->cache);
+  g_clear_pointer(&p->applied_checksum, g_free);
 }
 
 static void msd_xrdb_manager_class_init(MsdXrdbManagerClass *klass) {
@@ -452,6 +877,9 @@ static void msd_xrdb_manager_class_init(MsdXrdbManagerClass *klass) {
 
 static void msd_xrdb_manager_init(MsdXrdbManager *manager) {
   manager->priv = msd_xrdb_manager_get_instance_private(manager);
+
+  manager->priv->cache = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)xrdb_cache_entry_free);
 }
 
 static void msd_xrdb_manager_finalize(GObject *object) {
@@ -464,6 +892,9 @@ static void msd_xrdb_manager_finalize(GObject *object) {
 
   g_return_if_fail(xrdb_manager->priv != NULL);
 
+  g_hash_table_destroy(xrdb_manager->priv->cache);
+  g_free(xrdb_manager->priv->applied_checksum);
+
   G_OBJECT_CLASS(msd_xrdb_manager_parent_class)->finalize(object);
 }
 